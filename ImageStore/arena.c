@@ -0,0 +1,165 @@
+/**
+ * @file arena.c
+ * @brief Memory of one request, released all at once.
+ *
+ * Each chunk is a buffer of the pool starting with an arena_chunk; the
+ * allocations follow it, one after the other.
+ *
+ * @author ???
+ */
+
+#include "arena.h"
+#include "buf_pool.h"
+
+#include <stdint.h> // for SIZE_MAX
+#include <string.h> // for strlen, memcpy
+
+/**
+ * In front of the allocations of a chunk, keeping them aligned as malloc would.
+ */
+struct arena_chunk {
+    union {
+        struct {
+            arena_chunk* next;
+            size_t used;     // bytes after the header
+            size_t capacity; // bytes after the header
+            int shared;      // by small allocations, rather than of one large one
+        } h;
+        max_align_t align;
+    } u;
+};
+
+/**
+ * Rounds a size up to the alignment of malloc.
+ */
+static size_t aligned(size_t size)
+{
+    const size_t align = sizeof(max_align_t);
+    return size > SIZE_MAX - align ? SIZE_MAX : (size + align - 1) / align * align;
+}
+
+/**
+ * Borrows a chunk for at least size bytes.
+ */
+static arena_chunk* new_chunk(size_t size, int shared)
+{
+    if (size > SIZE_MAX - sizeof(arena_chunk)) {
+        return NULL;
+    }
+
+    arena_chunk* chunk = pool_alloc(sizeof(arena_chunk) + size);
+
+    if (chunk != NULL) {
+        chunk->u.h.next = NULL;
+        chunk->u.h.used = 0;
+        chunk->u.h.capacity = pool_capacity(chunk) - sizeof(arena_chunk);
+        chunk->u.h.shared = shared;
+    }
+
+    return chunk;
+}
+
+/**
+ * Allocates from an arena.
+ */
+void* arena_alloc(arena* a, size_t size)
+{
+    if (a == NULL) {
+        return NULL;
+    }
+
+    size = aligned(size == 0 ? 1 : size);
+
+    arena_chunk* chunk = a->chunks;
+
+    if (chunk == NULL || chunk->u.h.capacity - chunk->u.h.used < size) {
+        if (size > ARENA_CHUNK_SIZE / 4) {
+            // Its own chunk, behind the current one which may still serve small ones
+            chunk = new_chunk(size, 0);
+
+            if (chunk == NULL) {
+                return NULL;
+            }
+
+            if (a->chunks == NULL) {
+                a->chunks = chunk;
+            } else {
+                chunk->u.h.next = a->chunks->u.h.next;
+                a->chunks->u.h.next = chunk;
+            }
+
+        } else {
+            if (a->spare != NULL) {
+                chunk = a->spare;
+                a->spare = NULL;
+            } else if ((chunk = new_chunk(ARENA_CHUNK_SIZE - sizeof(arena_chunk), 1)) == NULL) {
+                return NULL;
+            }
+
+            chunk->u.h.next = a->chunks;
+            a->chunks = chunk;
+        }
+    }
+
+    void* memory = (char*) (chunk + 1) + chunk->u.h.used;
+    chunk->u.h.used += size;
+
+    return memory;
+}
+
+/**
+ * Copies a string into an arena.
+ */
+char* arena_strdup(arena* a, const char* str)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+
+    const size_t len = strlen(str);
+    char* copy = arena_alloc(a, len + 1);
+
+    if (copy != NULL) {
+        memcpy(copy, str, len + 1);
+    }
+
+    return copy;
+}
+
+/**
+ * Releases all the allocations of an arena, keeping a chunk for the next ones.
+ */
+void arena_reset(arena* a)
+{
+    if (a == NULL) {
+        return;
+    }
+
+    while (a->chunks != NULL) {
+        arena_chunk* chunk = a->chunks;
+        a->chunks = chunk->u.h.next;
+
+        // A shared chunk is kept, the others go back to the pool
+        if (a->spare == NULL && chunk->u.h.shared) {
+            chunk->u.h.used = 0;
+            chunk->u.h.next = NULL;
+            a->spare = chunk;
+        } else {
+            pool_free(chunk);
+        }
+    }
+}
+
+/**
+ * Releases all the allocations of an arena and its chunks.
+ */
+void arena_release(arena* a)
+{
+    if (a == NULL) {
+        return;
+    }
+
+    arena_reset(a);
+    pool_free(a->spare);
+    a->spare = NULL;
+}
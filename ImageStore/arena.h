@@ -0,0 +1,67 @@
+#pragma once
+
+/**
+ * @file arena.h
+ * @brief Memory of one request, released all at once.
+ *
+ * What a request or a command needs until it ends (names, image contents
+ * read or uploaded) is allocated from its arena, and never freed one by
+ * one: the arena is reset when the request ends, whichever way it ends.
+ * Allocations are carved out of chunks borrowed from the buffer pool; those
+ * larger than a quarter of a chunk get a chunk of their own. A reset keeps
+ * one chunk for the next request.
+ *
+ * An arena belongs to one thread at a time.
+ *
+ * @author ???
+ */
+
+#include <stddef.h>
+
+/* bytes of the chunks shared by small allocations */
+#define ARENA_CHUNK_SIZE ((size_t) 64 << 10)
+
+typedef struct arena_chunk arena_chunk;
+typedef struct arena arena;
+
+/**
+ * @brief An arena, empty when zeroed (see ARENA_INIT).
+ */
+struct arena {
+    arena_chunk* chunks; // most recent first
+    arena_chunk* spare;  // kept by the last reset
+};
+
+#define ARENA_INIT { NULL, NULL }
+
+/**
+ * @brief Allocates from an arena, aligned as malloc would.
+ *
+ * @param a The arena.
+ * @param size The bytes needed.
+ * @return The memory, not zeroed, valid until the next reset; NULL if out of memory.
+ */
+void* arena_alloc(arena* a, size_t size);
+
+/**
+ * @brief Copies a string into an arena.
+ *
+ * @param a The arena.
+ * @param str The string.
+ * @return The copy, NULL if out of memory.
+ */
+char* arena_strdup(arena* a, const char* str);
+
+/**
+ * @brief Releases all the allocations of an arena, keeping a chunk for the next ones.
+ *
+ * @param a The arena.
+ */
+void arena_reset(arena* a);
+
+/**
+ * @brief Releases all the allocations of an arena and its chunks.
+ *
+ * @param a The arena, empty afterwards.
+ */
+void arena_release(arena* a);
@@ -0,0 +1,396 @@
+/**
+ * @file blob_cache.c
+ * @brief In-memory cache of image contents, by metadata slot and resolution.
+ *
+ * Each shard chains its entries in hash buckets and keeps them on a circular
+ * list swept by a CLOCK hand: a hit only sets a bit, and eviction skips (and
+ * clears) the entries hit since the hand last passed.
+ *
+ * @author ???
+ */
+
+#include "blob_cache.h"
+
+#include <stdlib.h> // for calloc
+#include <string.h> // for memset
+
+// Fibonacci hashing: spreads consecutive slots over the shards
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/**
+ * Allocates a blob of a given size, with one reference.
+ */
+blob* blob_new(uint32_t size)
+{
+    blob* b = malloc(sizeof(blob) + size);
+
+    if (b != NULL) {
+        atomic_init(&b->refs, 1);
+        b->size = size;
+    }
+
+    return b;
+}
+
+/**
+ * Takes one more reference to a blob.
+ */
+blob* blob_retain(blob* b)
+{
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    return b;
+}
+
+/**
+ * Releases one reference to a blob, freeing it with the last one.
+ */
+void blob_release(blob* b)
+{
+    if (b != NULL && atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+        free(b);
+    }
+}
+
+/**
+ * Hash of a key: its low bits pick the shard, the others the bucket.
+ */
+static uint64_t hash_key(size_t slot, int res)
+{
+    return ((uint64_t) slot * NB_RES + (uint64_t) res) * HASH_MULTIPLIER;
+}
+
+/**
+ * Shard of a hash.
+ */
+static cache_shard* shard_of(blob_cache* cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 32) % CACHE_SHARDS];
+}
+
+/**
+ * Bucket of a hash in its shard.
+ */
+static cache_entry** bucket_of(cache_shard* shard, uint64_t hash)
+{
+    return &shard->buckets[(hash >> 40) & (shard->nb_buckets - 1)];
+}
+
+/**
+ * Takes an entry out of its bucket and the CLOCK, and frees it (shard locked).
+ */
+static void unlink_entry(cache_shard* shard, cache_entry** link)
+{
+    cache_entry* e = *link;
+    *link = e->next;
+
+    if (e->clock_next == e) {
+        shard->hand = NULL;
+
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+
+        if (shard->hand == e) {
+            shard->hand = e->clock_next;
+        }
+    }
+
+    shard->bytes -= e->content->size;
+    --shard->entries;
+
+    blob_release(e->content);
+    free(e);
+}
+
+/**
+ * Finds the link to the entry of a key, or to the end of its bucket (shard locked).
+ */
+static cache_entry** find_link(cache_shard* shard, uint64_t hash, size_t slot, int res)
+{
+    cache_entry** link = bucket_of(shard, hash);
+
+    while (*link != NULL && ((*link)->slot != slot || (*link)->res != res)) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+/**
+ * Evicts entries until size more bytes fit in the shard (shard locked).
+ */
+static void make_room(cache_shard* shard, size_t size)
+{
+    while (shard->hand != NULL && shard->bytes + size > shard->budget) {
+        cache_entry* e = shard->hand;
+
+        // A second chance for what was hit since the last sweep
+        if (e->referenced) {
+            e->referenced = 0;
+            shard->hand = e->clock_next;
+            continue;
+        }
+
+        const uint64_t hash = hash_key(e->slot, e->res);
+        unlink_entry(shard, find_link(shard, hash, e->slot, e->res));
+        ++shard->evictions;
+    }
+}
+
+/**
+ * Gives an imgStore a cache.
+ */
+int cache_init(size_t budget, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    cache_free(imgstfile);
+
+    if (budget == 0) {
+        return ERR_NONE;
+    }
+
+    blob_cache* cache = calloc(1, sizeof(blob_cache));
+    M_EXIT_IF_NULL(cache, sizeof(blob_cache));
+
+    // Enough buckets for the originals of a full imgStore
+    size_t nb_buckets = 1;
+
+    while (nb_buckets * CACHE_SHARDS < imgstfile->header.max_files) {
+        nb_buckets <<= 1;
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        cache_shard* shard = &cache->shards[i];
+
+        shard->buckets = calloc(nb_buckets, sizeof(cache_entry*));
+
+        if (shard->buckets == NULL) {
+            for (size_t j = 0; j < i; ++j) {
+                pthread_mutex_destroy(&cache->shards[j].lock);
+                free(cache->shards[j].buckets);
+            }
+
+            free(cache);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->nb_buckets = nb_buckets;
+        shard->budget = budget / CACHE_SHARDS;
+    }
+
+    imgstfile->cache = cache;
+
+    return ERR_NONE;
+}
+
+/**
+ * Frees the cache of an imgStore, if any.
+ */
+void cache_free(imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->cache == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        cache_shard* shard = &imgstfile->cache->shards[i];
+
+        for (size_t b = 0; b < shard->nb_buckets; ++b) {
+            while (shard->buckets[b] != NULL) {
+                unlink_entry(shard, &shard->buckets[b]);
+            }
+        }
+
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->buckets);
+    }
+
+    FREE_DEREF(imgstfile->cache);
+}
+
+/**
+ * Looks up an image in a cache.
+ */
+blob* cache_get(blob_cache* cache, size_t slot, int res, uint64_t offset)
+{
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    const uint64_t hash = hash_key(slot, res);
+    cache_shard* shard = shard_of(cache, hash);
+    blob* found = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    cache_entry** link = find_link(shard, hash, slot, res);
+
+    if (*link != NULL && (*link)->offset != offset) {
+        // The slot was rewritten since
+        unlink_entry(shard, link);
+
+    } else if (*link != NULL) {
+        (*link)->referenced = 1;
+        found = blob_retain((*link)->content);
+    }
+
+    // Misses are counted by cache_put: a lookup may be tried again before reading
+    if (found != NULL) {
+        ++shard->hits;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+/**
+ * Caches the content of an image.
+ */
+void cache_put(blob_cache* cache, size_t slot, int res, uint64_t offset, blob* content)
+{
+    if (cache == NULL || content == NULL) {
+        return;
+    }
+
+    const uint64_t hash = hash_key(slot, res);
+    cache_shard* shard = shard_of(cache, hash);
+
+    cache_entry* e = content->size > shard->budget ? NULL : calloc(1, sizeof(cache_entry));
+
+    if (e == NULL) {
+        // Too large, or out of memory: only a cache
+        pthread_mutex_lock(&shard->lock);
+        ++shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    e->offset = offset;
+    e->slot = (uint32_t) slot;
+    e->res = (uint16_t) res;
+    e->content = blob_retain(content);
+
+    pthread_mutex_lock(&shard->lock);
+    ++shard->misses;
+
+    // Another reader may have cached it meanwhile: the newest wins
+    cache_entry** link = find_link(shard, hash, slot, res);
+
+    if (*link != NULL) {
+        unlink_entry(shard, link);
+    }
+
+    make_room(shard, content->size);
+
+    // Behind the hand: looked at last
+    e->next = *bucket_of(shard, hash);
+    *bucket_of(shard, hash) = e;
+
+    if (shard->hand == NULL) {
+        e->clock_next = e->clock_prev = e;
+        shard->hand = e;
+
+    } else {
+        e->clock_next = shard->hand;
+        e->clock_prev = shard->hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        shard->hand->clock_prev = e;
+    }
+
+    shard->bytes += content->size;
+    ++shard->entries;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Forgets every resolution of a slot about to change.
+ */
+void cache_forget(size_t slot, imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->cache == NULL) {
+        return;
+    }
+
+    for (int res = 0; res < NB_RES; ++res) {
+        const uint64_t hash = hash_key(slot, res);
+        cache_shard* shard = shard_of(imgstfile->cache, hash);
+
+        pthread_mutex_lock(&shard->lock);
+
+        cache_entry** link = find_link(shard, hash, slot, res);
+
+        if (*link != NULL) {
+            unlink_entry(shard, link);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Sums the counters of a cache.
+ */
+void cache_stats(blob_cache* cache, blob_cache_stats* stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (cache == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        cache_shard* shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->budget += shard->budget;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Lists the images in a cache.
+ */
+size_t cache_keys(blob_cache* cache, cache_key* keys, size_t max)
+{
+    if (cache == NULL || keys == NULL) {
+        return 0;
+    }
+
+    size_t nb = 0;
+
+    for (size_t i = 0; i < CACHE_SHARDS && nb < max; ++i) {
+        cache_shard* shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        cache_entry* e = shard->hand;
+
+        for (size_t j = 0; j < shard->entries && nb < max; ++j) {
+            memset(&keys[nb], 0, sizeof(cache_key));
+            keys[nb].offset = e->offset;
+            keys[nb].slot = e->slot;
+            keys[nb].size = e->content->size;
+            keys[nb].res = e->res;
+            ++nb;
+            e = e->clock_next;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return nb;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+/**
+ * @file blob_cache.h
+ * @brief In-memory cache of image contents, by metadata slot and resolution.
+ *
+ * Optional, like the index: an imgst_file without cache reads every image
+ * from the file. The cache holds reference-counted blobs within a byte
+ * budget, split in shards that each have their own lock and CLOCK hand, so
+ * that lookups from several threads seldom contend and never need the lock
+ * of the imgStore.
+ *
+ * Entries are checked against the offset of the image they were read from:
+ * as images are only appended, an entry whose slot now points elsewhere is
+ * stale and dropped, whoever rewrote the slot.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* number of independently locked shards */
+#define CACHE_SHARDS 16
+
+/* default byte budget of the cache */
+#define CACHE_DEFAULT_BUDGET ((size_t) 64 << 20)
+
+typedef struct blob blob;
+typedef struct cache_entry cache_entry;
+typedef struct cache_shard cache_shard;
+typedef struct blob_cache_stats blob_cache_stats;
+typedef struct cache_key cache_key;
+
+/**
+ * @brief The content of an image, shared between the cache and its readers.
+ *
+ * Read-only once made; released by each holder with blob_release.
+ */
+struct blob {
+    atomic_uint refs;
+    uint32_t size;
+    char data[];
+};
+
+/**
+ * @brief A cached image, in its bucket and around the CLOCK.
+ */
+struct cache_entry {
+    cache_entry* next;       // in its bucket
+    cache_entry* clock_next; // around the clock
+    cache_entry* clock_prev;
+    uint64_t offset;         // of the image in the imgStore file
+    uint32_t slot;
+    uint16_t res;
+    uint16_t referenced;     // hit since the hand last passed
+    blob* content;
+};
+
+/**
+ * @brief One lock's worth of the cache.
+ */
+struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry** buckets;
+    size_t nb_buckets;       // a power of two
+    cache_entry* hand;       // next entry the CLOCK looks at, NULL if empty
+    size_t bytes;            // of the cached blobs
+    size_t budget;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;         // images read from the file, then put
+    uint64_t evictions;
+};
+
+struct blob_cache {
+    cache_shard shards[CACHE_SHARDS];
+};
+
+/**
+ * @brief Counters of a cache, summed over its shards.
+ */
+struct blob_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+};
+
+/**
+ * @brief Where a cached image was read from.
+ */
+struct cache_key {
+    uint64_t offset;
+    uint32_t slot;
+    uint32_t size;
+    uint16_t res;
+    uint16_t reserved[3]; // zero
+};
+
+/**
+ * @brief Allocates a blob of a given size, with one reference.
+ *
+ * @param size The size of its content.
+ * @return The blob, or NULL if out of memory.
+ */
+blob* blob_new(uint32_t size);
+
+/**
+ * @brief Takes one more reference to a blob.
+ *
+ * @param b The blob.
+ * @return The blob.
+ */
+blob* blob_retain(blob* b);
+
+/**
+ * @brief Releases one reference to a blob, freeing it with the last one.
+ *
+ * @param b The blob, NULL for none.
+ */
+void blob_release(blob* b);
+
+/**
+ * @brief Gives an imgStore a cache (replacing any previous one).
+ *
+ * @param budget The most bytes of image contents to keep, 0 for no cache.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int cache_init(size_t budget, imgst_file* imgstfile);
+
+/**
+ * @brief Frees the cache of an imgStore, if any.
+ *
+ * Blobs still held by readers stay valid until they release them.
+ *
+ * @param imgstfile The imgst_file in memory
+ */
+void cache_free(imgst_file* imgstfile);
+
+/**
+ * @brief Looks up an image in a cache.
+ *
+ * Takes no lock of the imgStore: the offset is read from the metadata by the caller.
+ *
+ * @param cache The cache, NULL for none.
+ * @param slot The metadata slot of the image.
+ * @param res The resolution code.
+ * @param offset The offset of the image in the imgStore file.
+ * @return A reference to the content (to release), or NULL if not cached.
+ */
+blob* cache_get(blob_cache* cache, size_t slot, int res, uint64_t offset);
+
+/**
+ * @brief Caches the content of an image, evicting others beyond the budget.
+ *
+ * The cache takes its own reference. No-op without cache, or for a blob
+ * larger than a shard's budget. Counts a miss: the content was just read.
+ *
+ * @param cache The cache, NULL for none.
+ * @param slot The metadata slot of the image.
+ * @param res The resolution code.
+ * @param offset The offset of the image in the imgStore file.
+ * @param content The content of the image.
+ */
+void cache_put(blob_cache* cache, size_t slot, int res, uint64_t offset, blob* content);
+
+/**
+ * @brief Forgets every resolution of a slot about to change. No-op without cache.
+ *
+ * @param slot The metadata slot.
+ * @param imgstfile The imgst_file in memory
+ */
+void cache_forget(size_t slot, imgst_file* imgstfile);
+
+/**
+ * @brief Sums the counters of a cache.
+ *
+ * @param cache The cache, NULL for none (all zero).
+ * @param stats Location receiving the counters.
+ */
+void cache_stats(blob_cache* cache, blob_cache_stats* stats);
+
+/**
+ * @brief Lists the images in a cache.
+ *
+ * @param cache The cache, NULL for none.
+ * @param keys Array receiving the keys, shard by shard, in CLOCK order.
+ * @param max The size of keys.
+ * @return The number of keys listed.
+ */
+size_t cache_keys(blob_cache* cache, cache_key* keys, size_t max);
+
+/**
+ * @brief Reads the content of an image as a blob, through the cache if any.
+ *
+ * As do_read, but the content is shared with the cache rather than copied.
+ *
+ * @param img_id The image ID.
+ * @param resolution The resolution code.
+ * @param image Location receiving a reference to the content (to release).
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int do_read_blob(const char* img_id, const int resolution, blob** image, imgst_file* imgstfile);
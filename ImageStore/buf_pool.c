@@ -0,0 +1,220 @@
+/**
+ * @file buf_pool.c
+ * @brief Pool of the buffers holding image contents, by size class.
+ *
+ * Each buffer follows a pool_header telling its class, so that pool_free
+ * needs no size. Free buffers are chained through their header: in the
+ * lists of the thread that gave them back, without lock, then in the spill,
+ * under its mutex. What neither has room for goes back to the allocator.
+ *
+ * @author ???
+ */
+
+#include "buf_pool.h"
+
+#include <stdlib.h> // for malloc, calloc, free
+#include <stdint.h> // for SIZE_MAX
+#include <pthread.h>
+
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+// Class of the buffers larger than the largest one
+#define POOL_UNPOOLED (-1)
+
+typedef union pool_header pool_header;
+typedef struct pool_cache pool_cache;
+
+/**
+ * In front of each buffer, keeping it aligned as malloc would.
+ */
+union pool_header {
+    struct {
+        pool_header* next; // while free
+        size_t capacity;
+        int class;
+    } h;
+    max_align_t align;
+};
+
+/**
+ * Free buffers of one thread, or of the spill.
+ */
+struct pool_cache {
+    pool_header* free[POOL_CLASSES];
+    size_t count[POOL_CLASSES];
+    size_t bytes; // all classes together
+};
+
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static pthread_key_t s_key;
+static int s_key_ok = 0;
+
+static pthread_mutex_t s_spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_cache s_spill;
+
+/**
+ * Class of a size, POOL_UNPOOLED if too large.
+ */
+static int class_of(size_t size)
+{
+    int class = 0;
+
+    while (class < POOL_CLASSES && ((size_t) 1 << (POOL_MIN_SHIFT + class)) < size) {
+        ++class;
+    }
+
+    return class < POOL_CLASSES ? class : POOL_UNPOOLED;
+}
+
+/**
+ * Gives a buffer to the spill, or to the allocator if the spill is full.
+ */
+static void spill(pool_header* header)
+{
+    pthread_mutex_lock(&s_spill_lock);
+
+    if (s_spill.bytes + header->h.capacity <= POOL_SPILL_BYTES) {
+        header->h.next = s_spill.free[header->h.class];
+        s_spill.free[header->h.class] = header;
+        ++s_spill.count[header->h.class];
+        s_spill.bytes += header->h.capacity;
+        header = NULL;
+    }
+
+    pthread_mutex_unlock(&s_spill_lock);
+
+    free(header);
+}
+
+/**
+ * Spills what an ending thread kept.
+ */
+static void thread_exit(void* arg)
+{
+    pool_cache* cache = arg;
+
+    for (int class = 0; class < POOL_CLASSES; ++class) {
+        while (cache->free[class] != NULL) {
+            pool_header* header = cache->free[class];
+            cache->free[class] = header->h.next;
+            spill(header);
+        }
+    }
+
+    free(cache);
+}
+
+static void make_key(void)
+{
+    s_key_ok = pthread_key_create(&s_key, thread_exit) == 0;
+}
+
+/**
+ * Free buffers of the calling thread, NULL if they cannot be had.
+ */
+static pool_cache* thread_cache(void)
+{
+    pthread_once(&s_once, make_key);
+
+    if (!s_key_ok) {
+        return NULL;
+    }
+
+    pool_cache* cache = pthread_getspecific(s_key);
+
+    if (cache == NULL && (cache = calloc(1, sizeof(pool_cache))) != NULL
+        && pthread_setspecific(s_key, cache) != 0) {
+        free(cache);
+        cache = NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * Borrows a buffer of at least size bytes.
+ */
+void* pool_alloc(size_t size)
+{
+    const int class = class_of(size);
+    pool_header* header = NULL;
+
+    if (class != POOL_UNPOOLED) {
+        pool_cache* cache = thread_cache();
+
+        if (cache != NULL && cache->free[class] != NULL) {
+            header = cache->free[class];
+            cache->free[class] = header->h.next;
+            --cache->count[class];
+            cache->bytes -= header->h.capacity;
+
+        } else {
+            pthread_mutex_lock(&s_spill_lock);
+
+            if (s_spill.free[class] != NULL) {
+                header = s_spill.free[class];
+                s_spill.free[class] = header->h.next;
+                --s_spill.count[class];
+                s_spill.bytes -= header->h.capacity;
+            }
+
+            pthread_mutex_unlock(&s_spill_lock);
+        }
+    }
+
+    if (header == NULL) {
+        const size_t capacity = class == POOL_UNPOOLED ? size : (size_t) 1 << (POOL_MIN_SHIFT + class);
+
+        // Not zeroed: whoever borrows it fills it
+        header = capacity > SIZE_MAX - sizeof(pool_header) ? NULL : malloc(sizeof(pool_header) + capacity);
+
+        if (header == NULL) {
+            return NULL;
+        }
+
+        header->h.capacity = capacity;
+        header->h.class = class;
+    }
+
+    header->h.next = NULL;
+
+    return header + 1;
+}
+
+/**
+ * Gives a buffer back to the pool.
+ */
+void pool_free(void* buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+
+    pool_header* header = (pool_header*) buffer - 1;
+
+    if (header->h.class == POOL_UNPOOLED) {
+        free(header);
+        return;
+    }
+
+    pool_cache* cache = thread_cache();
+
+    if (cache != NULL && cache->count[header->h.class] < POOL_THREAD_KEEP
+        && cache->bytes + header->h.capacity <= POOL_THREAD_BYTES) {
+        header->h.next = cache->free[header->h.class];
+        cache->free[header->h.class] = header;
+        ++cache->count[header->h.class];
+        cache->bytes += header->h.capacity;
+        return;
+    }
+
+    spill(header);
+}
+
+/**
+ * Gives the usable bytes of a borrowed buffer.
+ */
+size_t pool_capacity(const void* buffer)
+{
+    return buffer == NULL ? 0 : ((const pool_header*) buffer - 1)->h.capacity;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+/**
+ * @file buf_pool.h
+ * @brief Pool of the buffers holding image contents, by size class.
+ *
+ * Reading, inserting or resizing an image needs a buffer of its size for
+ * the time of one request. Rather than a fresh zeroed allocation each time,
+ * such buffers are borrowed with pool_alloc and given back with pool_free:
+ * capacities are rounded up to a power of two, and buffers given back are
+ * kept per thread first, then in lists shared by all threads (the spill),
+ * each within a bound. A thread that ends spills what it kept.
+ *
+ * Buffers larger than the largest class are plain allocations, still
+ * released with pool_free. Contents of a borrowed buffer are undefined.
+ *
+ * @author ???
+ */
+
+#include <stddef.h>
+
+/* smallest size class: 4 KiB */
+#define POOL_MIN_SHIFT 12
+
+/* largest size class: 16 MiB */
+#define POOL_MAX_SHIFT 24
+
+/* buffers kept by each thread, per class */
+#define POOL_THREAD_KEEP 4
+
+/* bytes kept by each thread, all classes together: one of the largest class */
+#define POOL_THREAD_BYTES ((size_t) 16 << 20)
+
+/* bytes kept in the spill, all classes together */
+#define POOL_SPILL_BYTES ((size_t) 64 << 20)
+
+/**
+ * @brief Borrows a buffer of at least size bytes.
+ *
+ * @param size The bytes needed, 0 giving the smallest class.
+ * @return The buffer, or NULL if out of memory.
+ */
+void* pool_alloc(size_t size);
+
+/**
+ * @brief Gives a buffer back to the pool.
+ *
+ * @param buffer A buffer from pool_alloc, or NULL.
+ */
+void pool_free(void* buffer);
+
+/**
+ * @brief Gives the usable bytes of a borrowed buffer, at least what was asked for.
+ *
+ * @param buffer A buffer from pool_alloc.
+ * @return Its capacity.
+ */
+size_t pool_capacity(const void* buffer);
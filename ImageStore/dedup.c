@@ -9,6 +9,8 @@
 #include "dedup.h"
 #include "error.h"
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "meta_scan.h"
 #include <string.h>
 
 int do_name_and_content_dedup(imgst_file* imgstfile, const uint32_t index)
@@ -26,30 +28,45 @@ int do_name_and_content_dedup(imgst_file* imgstfile, const uint32_t index)
     const char* id = imgstfile->metadata[index].img_id;
     const unsigned char* sha = imgstfile->metadata[index].SHA;
 
-    // Loop over valid metadata.
-    // If an image has the same name, return an error.
-    // If an image has the same SHA(ie. content) de-duplicate.
+    // With the index, only the candidates are looked at
+    if (imgstfile->index != NULL) {
+        M_EXIT_IF(index_find_id(id, imgstfile) != INDEX_NOT_FOUND,
+                  ERR_DUPLICATE_ID, "image with same imgID exists", );
 
-    int i = 0;
-    int has_content_clone = 0;
+        const size_t clone = index_find_sha(sha, index, imgstfile);
 
-    while(i < imgstfile->header.max_files) {
-        if(i != index && imgstfile->metadata[i].is_valid) {
-            M_EXIT_IF(!strncmp(id, imgstfile->metadata[i].img_id, MAX_IMG_ID),
-                      ERR_DUPLICATE_ID, "image with same imgID exists", );
+        if (clone == INDEX_NOT_FOUND) {
+            imgstfile->metadata[index].offset[RES_ORIG] = 0;
 
-            if(shaCompare(sha, imgstfile->metadata[i].SHA) == 0) {
-                memcpy(imgstfile->metadata[index].offset, imgstfile->metadata[i].offset, NB_RES * sizeof(uint64_t));
-                memcpy(imgstfile->metadata[index].size, imgstfile->metadata[i].size, NB_RES * sizeof(uint32_t));
-                has_content_clone = 1;
-            }
+        } else {
+            memcpy(imgstfile->metadata[index].offset, imgstfile->metadata[clone].offset, NB_RES * sizeof(uint64_t));
+            memcpy(imgstfile->metadata[index].size, imgstfile->metadata[clone].size, NB_RES * sizeof(uint32_t));
         }
 
-        ++i;
+        return ERR_NONE;
+    }
+
+    // Loop over valid metadata.
+    // If an image has the same name, return an error.
+    const size_t max = imgstfile->header.max_files;
+    size_t i = meta_next_state(imgstfile->metadata, 0, max, NON_EMPTY);
+
+    while (i < max) {
+        M_EXIT_IF(i != index && !strncmp(id, imgstfile->metadata[i].img_id, MAX_IMG_ID),
+                  ERR_DUPLICATE_ID, "image with same imgID exists", );
+
+        i = meta_next_state(imgstfile->metadata, i + 1, max, NON_EMPTY);
     }
 
-    // Tells the function caller that metadata[index] is content-unique
-    if(has_content_clone == 0) {
+    // If an image has the same SHA(ie. content) de-duplicate.
+    const size_t clone = meta_find_sha(imgstfile->metadata, max, sha, index);
+
+    if (clone < max) {
+        memcpy(imgstfile->metadata[index].offset, imgstfile->metadata[clone].offset, NB_RES * sizeof(uint64_t));
+        memcpy(imgstfile->metadata[index].size, imgstfile->metadata[clone].size, NB_RES * sizeof(uint32_t));
+
+    } else {
+        // Tells the function caller that metadata[index] is content-unique
         imgstfile->metadata[index].offset[RES_ORIG] = 0;
     }
 
@@ -20,6 +20,8 @@ const char * const ERR_MESSAGES[] = {
     "Existing image ID",
     "Image manipulation library error",
     "Debug",
+    "Busy, retry later",
+    "Read-only imgStore",
 
     "no error (shall not be displayed)" // ERR_LAST
 };
@@ -42,6 +42,8 @@ typedef enum {
     ERR_DUPLICATE_ID,
     ERR_IMGLIB,
     ERR_DEBUG,
+    ERR_BUSY,
+    ERR_READ_ONLY,
 
     NB_ERR // not an actual error but to have the total number of errors
 } error_code;
@@ -0,0 +1,396 @@
+/**
+ * @file hot_set.c
+ * @brief The images worth having in memory when a server starts.
+ *
+ * The hot set is a hotset_file_header followed by cache_key records, hottest
+ * first as far as the saver knew. Warming keeps the records that still match
+ * the metadata within the budget, sorts them by offset and merges neighbours
+ * into ranges: the kernel is advised of every range first, so that it reads
+ * them ahead while the first ones are copied into the cache.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno and posix_fadvise
+
+#include "hot_set.h"
+#include "imgst_heat.h"
+
+#include <stdlib.h> // for calloc, qsort
+#include <string.h> // for memcpy, memcmp
+#include <fcntl.h>  // for posix_fadvise
+
+#define HOTSET_MAGIC "IMGSTHS1"
+#define HOTSET_MAGIC_LEN 8
+
+typedef struct hotset_file_header hotset_file_header;
+typedef struct hotset_range hotset_range;
+
+/**
+ * Header of the hot set.
+ */
+struct hotset_file_header {
+    char magic[HOTSET_MAGIC_LEN];
+    uint32_t max_files;
+    uint32_t nb_keys;
+};
+
+/**
+ * Images read together: keys[first, last) within [start, end).
+ */
+struct hotset_range {
+    uint64_t start;
+    uint64_t end;
+    size_t first;
+    size_t last;
+};
+
+/**
+ * Path of a file next to an imgStore.
+ */
+static char* side_path(const char* imgst_filename, const char* suffix)
+{
+    char* path = malloc(strlen(imgst_filename) + strlen(suffix) + 1);
+
+    if (path != NULL) {
+        strcpy(path, imgst_filename);
+        strcat(path, suffix);
+    }
+
+    return path;
+}
+
+/**
+ * Lists the hottest images by access statistics, within HOTSET_DEFAULT_BYTES.
+ */
+static size_t hottest_keys(cache_key* keys, size_t max, const imgst_file* imgstfile)
+{
+    uint32_t* slots = calloc(imgstfile->header.max_files + 1, sizeof(uint32_t));
+
+    if (slots == NULL) {
+        return 0;
+    }
+
+    const size_t nb_slots = heat_hottest(slots, imgstfile->header.max_files, imgstfile);
+    uint64_t bytes = 0;
+    size_t nb = 0;
+
+    for (size_t i = 0; i < nb_slots && bytes < HOTSET_DEFAULT_BYTES; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[slots[i]];
+
+        // Smallest first: thumbnails are what pages show many of
+        for (int res = 0; res < NB_RES && nb < max; ++res) {
+            if (meta->size[res] == 0 || meta->offset[res] == 0) {
+                continue;
+            }
+
+            memset(&keys[nb], 0, sizeof(cache_key));
+            keys[nb].offset = meta->offset[res];
+            keys[nb].slot = slots[i];
+            keys[nb].size = meta->size[res];
+            keys[nb].res = (uint16_t) res;
+            bytes += meta->size[res];
+            ++nb;
+        }
+    }
+
+    free(slots);
+
+    return nb;
+}
+
+/**
+ * Saves the hot set of an imgStore.
+ */
+int hotset_save(const char* imgst_filename, const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    // Nothing to tell: keep what a previous run saved
+    if (imgstfile->cache == NULL && imgstfile->heat == NULL) {
+        return ERR_NONE;
+    }
+
+    size_t max = (size_t) imgstfile->header.max_files * NB_RES;
+
+    if (imgstfile->cache != NULL) {
+        blob_cache_stats stats;
+        cache_stats(imgstfile->cache, &stats);
+        max = stats.entries;
+    }
+
+    cache_key* keys = calloc(max + 1, sizeof(cache_key));
+    M_EXIT_IF_NULL(keys, (max + 1) * sizeof(cache_key));
+
+    const size_t nb = imgstfile->cache != NULL ? cache_keys(imgstfile->cache, keys, max)
+                      : hottest_keys(keys, max, imgstfile);
+
+    hotset_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HOTSET_MAGIC, HOTSET_MAGIC_LEN);
+    header.max_files = imgstfile->header.max_files;
+    header.nb_keys = (uint32_t) nb;
+
+    char* path = side_path(imgst_filename, HOTSET_SUFFIX);
+    char* tmp_path = side_path(imgst_filename, HOTSET_SUFFIX ".tmp");
+    int ret = path == NULL || tmp_path == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+
+    // Written aside then renamed: a crash leaves the previous hot set
+    if (ret == ERR_NONE) {
+        FILE* file = fopen(tmp_path, "wb");
+
+        if (file == NULL) {
+            ret = ERR_IO;
+
+        } else {
+            if (fwrite(&header, sizeof(header), 1, file) != 1
+                || fwrite(keys, sizeof(cache_key), nb, file) != nb) {
+                ret = ERR_IO;
+            }
+
+            if (fclose(file) != 0) {
+                ret = ERR_IO;
+            }
+        }
+
+        if (ret == ERR_NONE && rename(tmp_path, path) != 0) {
+            ret = ERR_IO;
+        }
+
+        if (ret != ERR_NONE) {
+            remove(tmp_path);
+        }
+    }
+
+    free(path);
+    free(tmp_path);
+    free(keys);
+
+    return ret;
+}
+
+/**
+ * Reads a hot set, if it matches the imgStore.
+ */
+static int read_keys(const char* imgst_filename, cache_key** keys, size_t* nb,
+                     const imgst_file* imgstfile)
+{
+    *keys = NULL;
+    *nb = 0;
+
+    char* path = side_path(imgst_filename, HOTSET_SUFFIX);
+    M_EXIT_IF_NULL(path, strlen(imgst_filename) + strlen(HOTSET_SUFFIX) + 1);
+
+    FILE* file = fopen(path, "rb");
+    free(path);
+
+    if (file == NULL) {
+        return ERR_NONE;
+    }
+
+    hotset_file_header header;
+    int ret = ERR_NONE;
+
+    if (fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, HOTSET_MAGIC, HOTSET_MAGIC_LEN) == 0
+        && header.max_files == imgstfile->header.max_files
+        && header.nb_keys <= (size_t) header.max_files * NB_RES) {
+        *keys = calloc((size_t) header.nb_keys + 1, sizeof(cache_key));
+
+        if (*keys == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+
+        } else if (fread(*keys, sizeof(cache_key), header.nb_keys, file) != header.nb_keys) {
+            FREE_DEREF(*keys);
+
+        } else {
+            *nb = header.nb_keys;
+        }
+    }
+
+    fclose(file);
+
+    return ret;
+}
+
+/**
+ * By offset.
+ */
+static int compare_offsets(const void* a, const void* b)
+{
+    const cache_key* x = a;
+    const cache_key* y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Keeps the keys still matching the metadata, within a budget, in saved order.
+ */
+static size_t keep_current(cache_key* keys, size_t nb, uint64_t budget, const imgst_file* imgstfile)
+{
+    uint64_t bytes = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < nb; ++i) {
+        const cache_key* key = &keys[i];
+
+        if (key->slot >= imgstfile->header.max_files || key->res >= NB_RES || key->size == 0) {
+            continue;
+        }
+
+        const img_metadata* meta = &imgstfile->metadata[key->slot];
+
+        if (meta->is_valid != NON_EMPTY || meta->offset[key->res] != key->offset
+            || meta->size[key->res] != key->size) {
+            continue;
+        }
+
+        if (bytes + key->size > budget) {
+            break;
+        }
+
+        bytes += key->size;
+        keys[kept++] = *key;
+    }
+
+    return kept;
+}
+
+/**
+ * Merges keys sorted by offset into ranges read at once.
+ */
+static size_t merge_ranges(const cache_key* keys, size_t nb, hotset_range* ranges)
+{
+    size_t nb_ranges = 0;
+
+    for (size_t i = 0; i < nb; ) {
+        hotset_range* range = &ranges[nb_ranges++];
+        range->start = keys[i].offset;
+        range->end = keys[i].offset + keys[i].size;
+        range->first = i++;
+
+        while (i < nb && keys[i].offset <= range->end + HOTSET_MERGE_GAP) {
+            const uint64_t end = keys[i].offset + keys[i].size;
+            const uint64_t new_end = end > range->end ? end : range->end;
+
+            if (new_end - range->start > HOTSET_READ_MAX) {
+                break;
+            }
+
+            range->end = new_end;
+            ++i;
+        }
+
+        range->last = i;
+    }
+
+    return nb_ranges;
+}
+
+/**
+ * Reads a range and caches its images.
+ */
+static int cache_range(const hotset_range* range, const cache_key* keys, imgst_file* imgstfile)
+{
+    const size_t len = (size_t) (range->end - range->start);
+    char* buffer = malloc(len);
+    M_EXIT_IF_NULL(buffer, len);
+
+    if (fseek(imgstfile->file, (long) range->start, SEEK_SET) != 0
+        || fread(buffer, len, 1, imgstfile->file) != 1) {
+        free(buffer);
+        return ERR_IO;
+    }
+
+    int ret = ERR_NONE;
+
+    for (size_t k = range->first; k < range->last && ret == ERR_NONE; ++k) {
+        blob* b = blob_new(keys[k].size);
+
+        if (b == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+
+        } else {
+            memcpy(b->data, buffer + (keys[k].offset - range->start), keys[k].size);
+            cache_put(imgstfile->cache, keys[k].slot, keys[k].res, keys[k].offset, b);
+            blob_release(b);
+        }
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+/**
+ * Reads back the saved hot set of an imgStore.
+ */
+int hotset_warm(const char* imgst_filename, hotset_stats* stats, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(*stats));
+
+    cache_key* keys = NULL;
+    size_t nb = 0;
+    M_EXIT_IF_ERR(read_keys(imgst_filename, &keys, &nb, imgstfile));
+
+    // What was saved without a cache is already bounded
+    uint64_t budget = UINT64_MAX;
+
+    if (imgstfile->cache != NULL) {
+        blob_cache_stats cstats;
+        cache_stats(imgstfile->cache, &cstats);
+        budget = cstats.budget;
+    }
+
+    nb = keep_current(keys, nb, budget, imgstfile);
+    qsort(keys, nb, sizeof(cache_key), compare_offsets);
+
+    hotset_range* ranges = calloc(nb + 1, sizeof(hotset_range));
+
+    if (ranges == NULL) {
+        free(keys);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const size_t nb_ranges = merge_ranges(keys, nb, ranges);
+    const int fd = fileno(imgstfile->file);
+
+    // The kernel reads the later ranges while the first ones are copied
+    for (size_t r = 0; r < nb_ranges; ++r) {
+        posix_fadvise(fd, (off_t) ranges[r].start, (off_t) (ranges[r].end - ranges[r].start),
+                      POSIX_FADV_WILLNEED);
+    }
+
+    int ret = ERR_NONE;
+
+    for (size_t r = 0; r < nb_ranges && ret == ERR_NONE; ++r) {
+        if (imgstfile->cache != NULL) {
+            ret = cache_range(&ranges[r], keys, imgstfile);
+        }
+
+        if (ret == ERR_NONE) {
+            for (size_t k = ranges[r].first; k < ranges[r].last; ++k) {
+                stats->bytes += keys[k].size;
+            }
+
+            stats->images += ranges[r].last - ranges[r].first;
+            ++stats->reads;
+        }
+    }
+
+    free(ranges);
+    free(keys);
+
+    return ret;
+}
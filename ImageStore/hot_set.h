@@ -0,0 +1,66 @@
+#pragma once
+
+/**
+ * @file hot_set.h
+ * @brief The images worth having in memory when a server starts.
+ *
+ * Long-lived readers save their hot set to "<imgstore_filename>.hotset" from
+ * time to time and when they stop: where each cached image was read from,
+ * or, without a cache, the images read most according to the access
+ * statistics. When they start again, the hot set is read back in offset
+ * order, in few large reads, before they take requests.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+#include "blob_cache.h"
+
+/* appended to the imgStore filename to name the hot set */
+#define HOTSET_SUFFIX ".hotset"
+
+/* without a cache, the most bytes of hottest images saved */
+#define HOTSET_DEFAULT_BYTES CACHE_DEFAULT_BUDGET
+
+/* images closer than this are read together, gap included */
+#define HOTSET_MERGE_GAP ((uint64_t) 64 << 10)
+
+/* the most bytes read at once */
+#define HOTSET_READ_MAX ((uint64_t) 4 << 20)
+
+typedef struct hotset_stats hotset_stats;
+
+/**
+ * @brief What a warm-up did.
+ */
+struct hotset_stats {
+    size_t images; // still where they were when saved
+    size_t bytes;
+    size_t reads;  // ranges read (or advised, without a cache)
+};
+
+/**
+ * @brief Saves the hot set of an imgStore, replacing the previous one.
+ *
+ * Reads the metadata and access statistics: callers sharing the imgStore
+ * between threads hold its lock.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int hotset_save(const char* imgst_filename, const imgst_file* imgstfile);
+
+/**
+ * @brief Reads back the saved hot set of an imgStore.
+ *
+ * Images that moved or went since are skipped. With a cache, the others are
+ * read into it, within its budget; without, the kernel is only advised to
+ * read them ahead. A missing or mismatched hot set warms nothing.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @param stats Location receiving what was done.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int hotset_warm(const char* imgst_filename, hotset_stats* stats, imgst_file* imgstfile);
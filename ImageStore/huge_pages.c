@@ -0,0 +1,132 @@
+/**
+ * @file huge_pages.c
+ * @brief Large tables probed at random, backed by huge pages where possible.
+ *
+ * Each table follows a huge_header telling how it was allocated, so that
+ * huge_free needs no size. A mapped table starts HUGE_HEADER_SIZE bytes into
+ * its mapping: its elements then still lie on the huge pages of the mapping.
+ *
+ * @author ???
+ */
+
+#define _GNU_SOURCE // for MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE
+
+#include "huge_pages.h"
+
+#include <stdint.h>   // for SIZE_MAX, uintptr_t
+#include <stdlib.h>   // for calloc, free
+#include <sys/mman.h> // for mmap, munmap, madvise
+
+#define HUGE_HEADER_SIZE 64
+
+#define HUGE_FROM_CALLOC 0
+#define HUGE_MAPPED 1
+
+typedef union huge_header huge_header;
+
+/**
+ * In front of each table, keeping it aligned as malloc would.
+ */
+union huge_header {
+    struct {
+        int kind;       // HUGE_FROM_CALLOC or HUGE_MAPPED
+        void* base;     // of the mapping
+        size_t length;  // of the mapping
+    } h;
+    char align[HUGE_HEADER_SIZE];
+};
+
+/**
+ * Maps length bytes aligned to HUGE_PAGE_SIZE, NULL if the system will not.
+ */
+static void* map_aligned(size_t length)
+{
+#ifdef MAP_HUGETLB
+    // Reserved huge pages, if the administrator set some aside
+    void* base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base != MAP_FAILED) {
+        return base;
+    }
+#endif
+
+    // Else ordinary pages, over-mapped to cut an aligned range out of them
+    char* over = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (over == MAP_FAILED) {
+        return NULL;
+    }
+
+    const size_t head = (HUGE_PAGE_SIZE - (uintptr_t) over % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+
+    if (head > 0) {
+        munmap(over, head);
+    }
+
+    munmap(over + head + length, HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+    // Advice only: without transparent huge pages, the table still works
+    madvise(over + head, length, MADV_HUGEPAGE);
+#endif
+
+    return over + head;
+}
+
+/**
+ * Allocates a zeroed table of nmemb elements of size bytes each.
+ */
+void* huge_calloc(size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > (SIZE_MAX - HUGE_PAGE_SIZE - HUGE_HEADER_SIZE) / size) {
+        return NULL;
+    }
+
+    const size_t bytes = nmemb * size + HUGE_HEADER_SIZE;
+    huge_header* header = NULL;
+
+    if (bytes >= HUGE_PAGE_SIZE) {
+        // Whole huge pages, zeroed by the kernel
+        const size_t length = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        void* base = map_aligned(length);
+
+        if (base != NULL) {
+            header = base;
+            header->h.kind = HUGE_MAPPED;
+            header->h.base = base;
+            header->h.length = length;
+        }
+    }
+
+    if (header == NULL) {
+        header = calloc(1, bytes);
+
+        if (header == NULL) {
+            return NULL;
+        }
+
+        header->h.kind = HUGE_FROM_CALLOC;
+    }
+
+    return header + 1;
+}
+
+/**
+ * Releases a table from huge_calloc.
+ */
+void huge_free(void* table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    huge_header* header = (huge_header*) table - 1;
+
+    if (header->h.kind == HUGE_MAPPED) {
+        munmap(header->h.base, header->h.length);
+    } else {
+        free(header);
+    }
+}
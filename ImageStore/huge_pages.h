@@ -0,0 +1,36 @@
+#pragma once
+
+/**
+ * @file huge_pages.h
+ * @brief Large tables probed at random, backed by huge pages where possible.
+ *
+ * The metadata of a big imgStore and its indexes span thousands of 4 KiB
+ * pages, and a lookup lands on any of them: each probe then likely misses
+ * the TLB. Tables of at least HUGE_PAGE_SIZE bytes are mapped on their own,
+ * aligned to HUGE_PAGE_SIZE, from the reserved huge pages if the system has
+ * some (MAP_HUGETLB), else with transparent huge pages asked for
+ * (MADV_HUGEPAGE). Smaller tables, or when mapping fails, come from calloc.
+ *
+ * @author ???
+ */
+
+#include <stddef.h>
+
+/* size of a huge page, and smallest table mapped on its own */
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+/**
+ * @brief Allocates a zeroed table of nmemb elements of size bytes each.
+ *
+ * @param nmemb The number of elements.
+ * @param size The bytes of an element.
+ * @return The table, to release with huge_free; NULL if out of memory.
+ */
+void* huge_calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief Releases a table from huge_calloc.
+ *
+ * @param table The table, or NULL.
+ */
+void huge_free(void* table);
@@ -7,72 +7,119 @@
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "buf_pool.h"
 #include "error.h"
 
 #include <vips/vips.h>
 #include <stdlib.h>
 
 /**
- * Read a vips image from a file. Responsibility of caller to free buffer later.
+ * Helper method to calculate the ratio between the original and resized image
  */
-int read_vips_from_file(void** buffer, const size_t size, VipsImage** image, FILE* file)
+double shrink_value(const VipsImage *image, int max_resized_width, int max_resized_height)
 {
+    const double h_shrink = (double) max_resized_width  / (double) image->Xsize ;
+    const double v_shrink = (double) max_resized_height / (double) image->Ysize ;
+    return h_shrink > v_shrink ? v_shrink : h_shrink ;
+}
 
-    // Null-pointer check
-    M_REQUIRE_NON_NULL(file);
+/**
+ * Resizes a JPEG image held in memory. Responsibility of caller to g_free resized later.
+ */
+int resize_image(const void* image, const size_t size, const uint16_t max_width,
+                 const uint16_t max_height, void** resized, size_t* resized_size)
+{
 
-    // Intermediate buffer to read the file
-    M_EXIT_IF_NULL(*buffer = calloc(1, size), size);
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(resized_size);
 
-    if (fread(*buffer, size, 1, file) != 1) {
-		FREE_DEREF(*buffer);
-        return ERR_IO;
+    // Load the buffer into a single VipsImage as a jpeg
+    VipsImage* original_image = NULL;
+
+    if (vips_jpegload_buffer((void*) image, size, &original_image, NULL)) {
+        return ERR_IMGLIB;
     }
 
-    // Loading the buffer into a VipsImage as a jpeg
-    if(vips_jpegload_buffer(*buffer, size, image, NULL)) {
-		FREE_DEREF(*buffer);
+    // Constant used by shrink_value to determine the resize ration
+    const double ratio = shrink_value(original_image, max_width, max_height);
+
+    // Compute the resized image with the ratio
+    VipsImage* resized_image = NULL;
+    const int failed = vips_resize(original_image, &resized_image, ratio, NULL);
+
+    // The original VipsImage* is no longer needed.
+    g_object_unref(original_image);
+
+    if (failed) {
+        return ERR_IMGLIB;
+    }
+
+    // VipsImage -> Buffer
+    if (vips_jpegsave_buffer(resized_image, resized, resized_size, NULL)) {
+        g_object_unref(resized_image);
         return ERR_IMGLIB;
     }
 
+    g_object_unref(resized_image);
+
     return ERR_NONE;
 }
+
 /**
- * Write a vips image to a file. Requires buffer with enough allocated memory.
+ * Appends a resized image to the imgStore file and records it in memory.
  */
-int write_vips_to_file(void** buffer, size_t* size, VipsImage** image, FILE* file)
+int append_resized(const int res_code, imgst_file* imgstfile, const size_t idx,
+                   const void* buffer, const size_t size)
 {
 
     // Null-pointer checks
-    M_REQUIRE_NON_NULL(image);
-    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(buffer);
 
-    // VipsImage -> Buffer
-    if (vips_jpegsave_buffer(*image, buffer, size, NULL)) {
-		FREE_DEREF(buffer);
-        g_object_unref(*image); *image = NULL;
-        return ERR_IMGLIB;
+    // Check if valid resolution code
+    M_EXIT_IF(res_code != RES_SMALL && res_code != RES_THUMB, ERR_RESOLUTIONS,
+              "invalid resolution code %d", res_code);
+
+    M_EXIT_IF_ERR(validMetadataIndex(idx, imgstfile));
+
+    // Append the content to the end of the imgStore file
+    if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
+        return ERR_IO;
     }
 
-    // Buffer -> File
-    if (fwrite(*buffer, *size, 1, file) != 1) {
-		FREE_DEREF(buffer);
+    const long offset = ftell(imgstfile->file); // This is the new offset.
+
+    if (fwrite(buffer, size, 1, imgstfile->file) != 1) {
         return ERR_IO;
     }
 
-    return ERR_NONE;
-}
+    // Update the metadata in memory
+    imgstfile->metadata[idx].offset[res_code] = offset;
+    imgstfile->metadata[idx].size[res_code] = size;
 
+    // A new derivative is a change of the imgStore as well
+    imgstfile->header.imgst_version += 1;
 
+    return ERR_NONE;
+}
 
 /**
- * Helper method to calculate the ratio between the original and resized image
+ * Appends a resized image to the imgStore file and records it in the metadata.
  */
-double shrink_value(const VipsImage *image, int max_resized_width, int max_resized_height)
+int store_resized(const int res_code, imgst_file* imgstfile, const size_t idx,
+                  const void* buffer, const size_t size)
 {
-    const double h_shrink = (double) max_resized_width  / (double) image->Xsize ;
-    const double v_shrink = (double) max_resized_height / (double) image->Ysize ;
-    return h_shrink > v_shrink ? v_shrink : h_shrink ;
+    M_EXIT_IF_ERR(append_resized(res_code, imgstfile, idx, buffer, size));
+
+    // Write the metadata and header to disk
+    M_EXIT_IF_ERR(updateMetadata(idx, imgstfile));
+    M_EXIT_IF_ERR(updateHeader(imgstfile));
+    M_EXIT_IF_ERR(log_change(CHANGE_RESIZE, idx, res_code, imgstfile));
+
+    return ERR_NONE;
 }
 
 /**
@@ -102,51 +149,34 @@ int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx)
 
     /// Create new variant of image in requested resolution
 
-    // Move to position in file of original image
-    fseek(imgstfile->file, imgstfile->metadata[idx].offset[RES_ORIG], SEEK_SET);
-
-    // Load image file into a single VipsImage using a buffer
-    void* buffer = NULL;
-    VipsImage* original_image = NULL;
+    // Read the original image
     const size_t orig_size = imgstfile->metadata[idx].size[RES_ORIG];
-    M_EXIT_IF_ERR_DO_SOMETHING(read_vips_from_file(&buffer, orig_size, &original_image, imgstfile->file),
-							   FREE_DEREF(buffer);
-                               g_object_unref(original_image); original_image = NULL);
-
-    // Constant used by shrink_value to determine the resize ration
-    const double ratio = shrink_value(original_image,
-                                      imgstfile->header.res_resized[2 * res_code],
-                                      imgstfile->header.res_resized[2 * res_code + 1]);
+    void* original = NULL;
+    M_EXIT_IF_NULL(original = pool_alloc(orig_size), orig_size);
 
-    // Compute the resized image with the ratio
-    VipsImage* resized_image = NULL;
-    vips_resize(original_image, &resized_image, ratio, NULL);
-
-    // The original VipsImage* is no longer needed.
-    g_object_unref(original_image);
-
-    // Append the content to the end of the imgStore file
-    if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
-        FREE_DEREF(buffer);
-        g_object_unref(resized_image); resized_image = NULL;
+    if (fseek(imgstfile->file, imgstfile->metadata[idx].offset[RES_ORIG], SEEK_SET) != 0
+        || fread(original, orig_size, 1, imgstfile->file) != 1) {
+        pool_free(original);
+        return ERR_IO;
     }
 
-    const long offset = ftell(imgstfile->file); // This is the new offset.
-
-    // Write the resized VipsImage to file. Buffer has more than enough allocated memory.
+    // Resize it
+    void* resized = NULL;
     size_t resized_size = 0;
-    M_EXIT_IF_ERR_DO_SOMETHING(write_vips_to_file(&buffer, &resized_size, &resized_image, imgstfile->file),
-                               FREE_DEREF(buffer);
-                               g_object_unref(resized_image); resized_image = NULL);
+    M_EXIT_IF_ERR_DO_SOMETHING(resize_image(original, orig_size,
+                                            imgstfile->header.res_resized[2 * res_code],
+                                            imgstfile->header.res_resized[2 * res_code + 1],
+                                            &resized, &resized_size),
+                               pool_free(original));
 
-    // The resized VipsImage* and its buffer is no longer needed.
-    g_object_unref(resized_image); resized_image = NULL;
-    FREE_DEREF(buffer);
+    // The original is no longer needed.
+    pool_free(original);
 
-    // Update the metadata in memory and on disk
-    imgstfile->metadata[idx].offset[res_code] = offset;
-    imgstfile->metadata[idx].size[res_code] = resized_size;
-    M_EXIT_IF_ERR(updateMetadata(idx, imgstfile));
+    // Append it to the imgStore
+    M_EXIT_IF_ERR_DO_SOMETHING(store_resized(res_code, imgstfile, idx, resized, resized_size),
+                               g_free(resized));
+
+    g_free(resized);
 
     return ERR_NONE;
 }
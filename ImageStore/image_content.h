@@ -21,6 +21,49 @@
  */
 int lazily_resize(const int res_code, imgst_file* imgstfile, const size_t idx);
 
+/**
+ * @brief Resizes a JPEG image held in memory, without touching any imgStore.
+ *
+ * Lets callers decode and resize without holding the imgStore. The result
+ * must be released with g_free.
+ *
+ * @param image pointer to a memory region containing JPEG image
+ * @param size size in bytes of the JPEG image
+ * @param max_width maximal width of the resized image
+ * @param max_height maximal height of the resized image
+ * @param resized will make point to the resized JPEG image
+ * @param resized_size will make point to the size of the resized JPEG image
+ */
+int resize_image(const void* image, const size_t size, const uint16_t max_width,
+                 const uint16_t max_height, void** resized, size_t* resized_size);
+
+/**
+ * @brief Appends a resized image to the imgStore file and records it in memory only.
+ *
+ * For writers that persist several changes at once: the caller writes the
+ * metadata and header, then logs the change.
+ *
+ * @param res_code The image resolution code defined in imgStore.h (RES_THUMB or RES_SMALL).
+ * @param imgstfile The imgStore file.
+ * @param idx The index of the resized image.
+ * @param buffer pointer to the resized JPEG image
+ * @param size size in bytes of the resized JPEG image
+ */
+int append_resized(const int res_code, imgst_file* imgstfile, const size_t idx,
+                   const void* buffer, const size_t size);
+
+/**
+ * @brief Appends a resized image to the imgStore file and records it in the metadata.
+ *
+ * @param res_code The image resolution code defined in imgStore.h (RES_THUMB or RES_SMALL).
+ * @param imgstfile The imgStore file.
+ * @param idx The index of the resized image.
+ * @param buffer pointer to the resized JPEG image
+ * @param size size in bytes of the resized JPEG image
+ */
+int store_resized(const int res_code, imgst_file* imgstfile, const size_t idx,
+                  const void* buffer, const size_t size);
+
 
 /**
  * @brief Gets the resolution of a JPEG image
@@ -62,6 +62,15 @@
 #define MAX_RES_THUMB 128
 #define MAX_RES_SMALL 512
 
+/* kinds of imgst_change */
+#define CHANGE_INSERT 0
+#define CHANGE_DELETE 1
+#define CHANGE_RESIZE 2
+#define CHANGE_MOVE   3 // contents moved by do_reorganize
+
+/* suffix of the change log file, kept next to the imgStore file */
+#define CHANGES_SUFFIX ".changes"
+
 /* initial values for imgst_file fields and subfields*/
 #define INIT_NB_FILES 0
 #define INIT_VER 0
@@ -76,6 +85,11 @@ extern "C" {
 typedef struct imgst_header imgst_header;
 typedef struct img_metadata img_metadata;
 typedef struct imgst_file imgst_file;
+typedef struct imgst_change imgst_change;
+typedef struct imgst_index imgst_index;
+typedef struct blob_cache blob_cache;
+typedef struct imgst_heat imgst_heat;
+typedef struct arena arena;
 
 /// STRUCT DEFINTIIONS
 
@@ -101,9 +115,13 @@ struct imgst_header {
      */
     uint16_t res_resized [2 * (NB_RES - 1)];
 
+    /* The number of times the contents were moved (see do_gbcollect).
+     * Backups and followers only apply to the generation they were made from.
+     */
+    uint32_t generation;
+
     /* Unused
      */
-    uint32_t unused_32;
     uint64_t unused_64;
 };
 
@@ -149,6 +167,44 @@ struct imgst_file {
     /* A dynamic array containing the image metadata.
      */
     img_metadata* metadata;
+
+    /* A pointer to the change log file (NULL if there is none).
+     */
+    FILE* changes;
+
+    /* The in-memory ID and SHA indexes (NULL if not built, see imgst_index.h).
+     */
+    imgst_index* index;
+
+    /* The in-memory cache of image contents (NULL if none, see blob_cache.h).
+     */
+    blob_cache* cache;
+
+    /* The access statistics of the images (NULL if not loaded, see imgst_heat.h).
+     */
+    imgst_heat* heat;
+};
+
+struct imgst_change {
+    /* The imgst_version of the imgStore right after the change.
+     */
+    uint32_t version;
+
+    /* The kind of change: CHANGE_INSERT, CHANGE_DELETE, CHANGE_RESIZE or CHANGE_MOVE.
+     */
+    uint16_t kind;
+
+    /* The resolution code of the new derivative for CHANGE_RESIZE.
+     */
+    int16_t res;
+
+    /* The metadata slot of the image.
+     */
+    uint32_t slot;
+
+    /* The ID of the image.
+     */
+    char img_id[MAX_IMG_ID + 1];
 };
 
 
@@ -183,22 +239,111 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
  */
 void do_close(imgst_file* imgstfile);
 
+/**
+ * @brief Takes an advisory lock on an open imgStore, until it is closed.
+ *
+ * Whoever holds an imgStore open to write it (the daemon, the HTTP server,
+ * local writers) takes it exclusive; whoever must not see writes under way
+ * (snapshot, clone) takes it shared.
+ *
+ * @param imgstfile The imgst_file in memory
+ * @param exclusive Whether others may not even read under the lock.
+ * @return ERR_BUSY if another process holds a conflicting lock. 0 if no error.
+ */
+int do_lock(imgst_file* imgstfile, int exclusive);
+
+/**
+ * @brief Checks that no process holds an imgStore locked (see do_lock).
+ *
+ * @param imgst_filename Path to the imgStore file (which may not exist yet)
+ * @return ERR_BUSY if a process holds it locked. 0 otherwise.
+ */
+int check_unlocked(const char* imgst_filename);
+
 /**
  * @brief List of possible output modes for do_list
+ */
+enum do_list_mode {
+    STDOUT,
+    JSON
+};
+
+/**
+ * @brief Sink receiving successive chunks of do_list output.
  *
- * @param imgst_file Structure for header, metadata and file pointer to be freed/closed.
+ * @param arg Opaque argument given along with the writer.
+ * @param data The bytes to write (not null-terminated).
+ * @param len The number of bytes to write.
+ * @return Some error code. 0 if no error.
+ */
+typedef int (*list_writer)(void* arg, const char* data, size_t len);
+
+/* states of a list_stream */
+#define LIST_IDLE    0
+#define LIST_BEGIN   1
+#define LIST_ENTRIES 2
+#define LIST_DONE    3
+
+/* number of entries emitted by one do_list_step call in do_list */
+#define LIST_STEP_ENTRIES 256
+
+typedef struct list_stream list_stream;
+
+/**
+ * @brief Resumable state of a JSON listing.
+ *
+ * Small enough to be kept per connection by the server, so that a listing
+ * can be produced a few entries at a time as the client drains it.
  */
-/* **********************************************************************
- * TODO WEEK 11: DEFINE do_list_mode TYPE HERE.
- * **********************************************************************
+struct list_stream {
+    uint32_t cursor;   // next metadata slot to visit
+    uint32_t limit;    // maximum number of entries, 0 for no limit
+    uint32_t written;  // number of entries emitted so far
+    uint16_t state;    // LIST_IDLE, LIST_BEGIN, LIST_ENTRIES or LIST_DONE
+};
+
+/**
+ * @brief Prepares a JSON listing starting at a given slot.
+ *
+ * @param stream The listing state to initialize.
+ * @param cursor The first metadata slot to visit (0 to start from the beginning).
+ * @param limit The maximum number of entries to list, 0 for no limit.
  */
+void list_stream_init(list_stream* stream, uint32_t cursor, uint32_t limit);
 
 /**
- * @brief Displays (on stdout) imgStore metadata.
+ * @brief Emits the next part of a JSON listing through writer.
  *
- * @param imgst_file In memory structure with header and metadata.
+ * All the steps of a stream together produce a single JSON document
+ * {"Images":["id", ...],"next":<cursor>}, where "next" is only present
+ * when the limit stopped the listing before the last valid entry.
+ *
+ * @param imgstfile In memory structure with header and metadata.
+ * @param stream The listing state, updated in place.
+ * @param budget The maximum number of entries to emit during this step.
+ * @param writer The sink receiving the output.
+ * @param arg Opaque argument given to writer.
+ * @return Some error code. 0 if no error.
+ */
+int do_list_step(const imgst_file* imgstfile, list_stream* stream, uint32_t budget,
+                 list_writer writer, void* arg);
+
+/**
+ * @brief Lists imgStore metadata, human-readable on stdout or as JSON.
+ *
+ * In JSON mode the output is streamed through writer in bounded chunks,
+ * so memory use does not depend on the number of images.
+ *
+ * @param imgstfile In memory structure with header and metadata.
+ * @param output_mode STDOUT or JSON.
+ * @param cursor The first metadata slot to visit (0 to start from the beginning).
+ * @param limit The maximum number of entries to list, 0 for no limit.
+ * @param writer The sink receiving the JSON output (unused for STDOUT).
+ * @param arg Opaque argument given to writer.
+ * @return Some error code. 0 if no error.
  */
-void do_list(const imgst_file* imgstfile);
+int do_list(const imgst_file* imgstfile, enum do_list_mode output_mode,
+            uint32_t cursor, uint32_t limit, list_writer writer, void* arg);
 
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
@@ -236,6 +381,9 @@ int resolution_atoi(const char* resolution);
 /**
  * @brief Reads the content of an image from a imgStore.
  *
+ * The content is in a buffer borrowed from the pool (see buf_pool.h),
+ * which the caller gives back with pool_free.
+ *
  * @param img_id The ID of the image to be read.
  * @param resolution The desired resolution for the image read.
  * @param image_buffer Location of the location of the image content
@@ -247,6 +395,45 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, const int resolution, char** image_buffer,
             uint32_t* image_size, imgst_file* imgstfile);
 
+/**
+ * @brief Reads the content of an image into a buffer of the caller.
+ *
+ * For callers reusing one buffer across reads. If the image does not fit,
+ * nothing is read, image_size still receives its size and
+ * ERR_INVALID_ARGUMENT is returned.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param buffer Where the content is read.
+ * @param capacity The bytes available in buffer.
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_into(const char* img_id, const int resolution, char* buffer, size_t capacity,
+                 uint32_t* image_size, imgst_file* imgstfile);
+
+/* size of the chunks handed to the writer by do_read_stream */
+#define READ_CHUNK_SIZE 65536
+
+/**
+ * @brief Streams the content of an image from a imgStore through writer.
+ *
+ * Like do_read, but in chunks of at most READ_CHUNK_SIZE bytes, so that
+ * memory use does not depend on the image size.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param writer The sink receiving the content.
+ * @param arg Opaque argument given to writer.
+ * @param imgst_file The main in-memory data structure
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_read_stream(const char* img_id, const int resolution, list_writer writer, void* arg,
+                   imgst_file* imgstfile);
+
 /**
  * @brief Insert image in the imgStore file
  *
@@ -259,6 +446,131 @@ int do_read(const char* img_id, const int resolution, char** image_buffer,
 
 int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile);
 
+/**
+ * @brief Computes what do_insert needs to know about an image: its SHA and resolution.
+ *
+ * Only reads the buffer, so it can run concurrently with anything else.
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param sha Array receiving the SHA-256 of the content
+ * @param res_orig Array receiving the width and height of the image
+ *
+ * @return Some error code. 0 if no error.
+ */
+int prepare_insert(const char* image_buffer, size_t image_size,
+                   unsigned char sha[SHA256_DIGEST_LENGTH], uint32_t res_orig[DIMS]);
+
+/**
+ * @brief Inserts a prepared image in memory, appending its content if new.
+ *
+ * The header and metadata are updated in memory only: the caller writes them
+ * (possibly for several inserts at once) and then logs the change.
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param img_id Image ID
+ * @param sha The SHA-256 of the content, from prepare_insert
+ * @param res_orig The resolution of the image, from prepare_insert
+ * @param idx Location receiving the metadata index of the image
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                    const unsigned char sha[SHA256_DIGEST_LENGTH], const uint32_t res_orig[DIMS],
+                    size_t* idx, imgst_file* imgstfile);
+
+/**
+ * @brief Inserts a prepared image, and writes the header, its metadata and
+ * the change to disk: do_insert once prepare_insert ran.
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param img_id Image ID
+ * @param sha The SHA-256 of the content, from prepare_insert
+ * @param res_orig The resolution of the image, from prepare_insert
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                       const unsigned char sha[SHA256_DIGEST_LENGTH], const uint32_t res_orig[DIMS],
+                       imgst_file* imgstfile);
+
+/**
+ * @brief Progress and outcome of do_import.
+ */
+typedef struct import_stats {
+    size_t imported;  // images and derivatives stored
+    size_t failed;    // entries rejected (unreadable, invalid, duplicate ID, ...)
+    double seconds;   // elapsed time
+} import_stats;
+
+/**
+ * @brief Inserts many images at once: all the files below a directory, those
+ *        listed in a manifest, or those of a tar stream.
+ *
+ * In a directory, the ID of an image is its path relative to the directory.
+ * A manifest has one "<img_id> <path>" line per image; blank lines and lines
+ * starting with # are ignored. A tar stream ("-" for stdin, or a file ending
+ * in ".tar") is read in order; as written by do_export, its entries carry
+ * their ID, resolution and, for originals, SHA and size (which are trusted
+ * rather than recomputed). Entries of other tar streams are originals, with
+ * their path as ID.
+ *
+ * Files are read, hashed and probed by worker threads while a single writer
+ * appends them and writes the metadata in batches. Failures of single
+ * images are reported on stderr and counted, they do not stop the import.
+ *
+ * @param source Path to a directory, a manifest or a tar file, or "-"
+ * @param nb_workers Number of worker threads, 0 for one per online CPU
+ * @param progress Whether to report progress on stderr
+ * @param stats Location receiving the outcome
+ * @param imgstfile The imgst_file in memory, opened in "rb+"
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_import(const char* source, size_t nb_workers, int progress,
+              import_stats* stats, imgst_file* imgstfile);
+
+/**
+ * @brief Progress and outcome of do_export.
+ */
+typedef struct export_stats {
+    size_t files;     // files written
+    size_t failed;    // contents that could not be read, derived or written
+    uint64_t bytes;   // bytes written (without archive overhead)
+    double seconds;   // elapsed time
+} export_stats;
+
+/**
+ * @brief Writes all the images out: to a directory, a tar file or a tar stream on stdout.
+ *
+ * Each stored content of each valid image becomes a file named like by
+ * create_name (<img_id>_<res>.jpg; IDs containing '/' make subdirectories).
+ * IDs that would be written outside the directory (see check_relative_id)
+ * are reported and counted as failed.
+ * In tar streams, pax records also give the ID and resolution of each
+ * file and the SHA and size of originals, for do_import.
+ * Contents are read in file offset order, so the imgStore is read
+ * sequentially, and written out by worker threads. Failures of single
+ * images are reported on stderr and counted, they do not stop the export.
+ * The imgStore is not modified, even when derivatives are made.
+ *
+ * @param target Path to a directory (created if needed), to a file ending in
+ *        ".tar", or "-" for a tar stream on stdout
+ * @param derive Whether to also make the missing thumbnail and small images
+ * @param nb_workers Number of worker threads, 0 for one per online CPU
+ * @param progress Whether to report progress on stderr
+ * @param stats Location receiving the outcome
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_export(const char* target, int derive, size_t nb_workers, int progress,
+              export_stats* stats, imgst_file* imgstfile);
+
 /**
  * @brief Finds index in metadata for a given img_id
  *
@@ -290,6 +602,17 @@ int validMetadataIndex(const size_t idx, const imgst_file* imgstfile);
  */
 int updateMetadata(const size_t idx, imgst_file* imgstfile);
 
+/**
+ * @brief Updates consecutive metadata in the imgStore file with a single write
+ *
+ * @param first The index of the first metadata
+ * @param count The number of metadata
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error
+ */
+int updateMetadataRange(const size_t first, const size_t count, imgst_file* imgstfile);
+
 
 /**
  * @brief Updates the header in the imgStore file
@@ -314,20 +637,270 @@ int shaCompare(const unsigned char* sha1, const unsigned char* sha2);
  *
  * @param img_id The image ID
  * @param resolution The resolution code
+ * @param mem The arena of the request the name is for, or NULL for one to free
  * @param newname The string to store the new name
  */
-int create_name(const char* img_id, const int resolution, char** newname);
+int create_name(const char* img_id, const int resolution, arena* mem, char** newname);
+
+/**
+ * @brief Checks that an image ID names a file below a directory.
+ *
+ * IDs made files or subdirectories (export, and tar streams imported)
+ * must neither be absolute nor contain a ".." component.
+ *
+ * @param img_id The image ID
+ * @return ERR_INVALID_IMGID if it would escape the directory. 0 otherwise.
+ */
+int check_relative_id(const char* img_id);
+
+
+/**
+ * @brief Opens the change log of an imgStore file.
+ *
+ * With "rb" a missing log is not an error (changes is left NULL), with "rb+"
+ * a missing log is created, and with "wb" the log is truncated.
+ *
+ * @param imgst_filename Path to the imgStore file
+ * @param open_mode Mode the imgStore file is opened with: "rb", "rb+" or "wb".
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int open_changes(const char* imgst_filename, const char* open_mode, imgst_file* imgstfile);
+
+/**
+ * @brief Appends a change to the change log, tagged with the current imgst_version.
+ *
+ * Does nothing if the imgStore has no change log.
+ *
+ * @param kind CHANGE_INSERT, CHANGE_DELETE or CHANGE_RESIZE.
+ * @param idx The metadata index of the changed image.
+ * @param res The resolution code for CHANGE_RESIZE (ignored otherwise).
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int log_change(const uint16_t kind, const size_t idx, const int res, imgst_file* imgstfile);
+
+/**
+ * @brief Appends a change made at a given version to the change log.
+ *
+ * For writers that persist several changes at once: each change keeps the
+ * version the imgStore had right after it.
+ *
+ * @param version The imgst_version right after the change.
+ * @param kind CHANGE_INSERT, CHANGE_DELETE or CHANGE_RESIZE.
+ * @param idx The metadata index of the changed image.
+ * @param res The resolution code for CHANGE_RESIZE (ignored otherwise).
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int log_change_at(const uint32_t version, const uint16_t kind, const size_t idx, const int res,
+                  imgst_file* imgstfile);
+
+/**
+ * @brief Reads the changes made after a given version, oldest first.
+ *
+ * @param since Only changes with a greater version are read.
+ * @param changes Array receiving the changes.
+ * @param max The capacity of changes.
+ * @param nb_read Location receiving the number of changes read.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int read_changes(const uint32_t since, imgst_change* changes, const size_t max,
+                 size_t* nb_read, const imgst_file* imgstfile);
+
+/**
+ * @brief Gives the version of the last logged change (0 if none).
+ *
+ * @param version Location receiving the version.
+ * @param oldest Location receiving the version of the first logged change (0 if none), may be NULL.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int changes_bounds(uint32_t* version, uint32_t* oldest, const imgst_file* imgstfile);
+
+/**
+ * @brief Writes the changes made after a given version as a JSON document.
+ *
+ * The document is {"Changes":[...],"version":V,"resync":B,"more":B}, where V is
+ * the version to pass as since for the next call, resync tells that older
+ * changes were not logged (the consumer must reload everything), and more tells
+ * that limit truncated the output.
+ *
+ * @param since Only changes with a greater version are written.
+ * @param limit The maximum number of changes, 0 for no limit.
+ * @param writer The sink receiving the output.
+ * @param arg Opaque argument given to writer.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_changes(const uint32_t since, const uint32_t limit, list_writer writer, void* arg,
+               const imgst_file* imgstfile);
+
+/**
+ * @brief Copies an imgStore, with its change log, as of now.
+ *
+ * The copies share their blocks with the imgStore until either is written,
+ * on filesystems supporting reflinks (FICLONE, or copy_file_range on btrfs
+ * and XFS); elsewhere they are full copies. Buffered writes are flushed
+ * first; the caller must keep the imgStore from changing meanwhile.
+ *
+ * @param target The path of the copy, which must not exist yet.
+ * @param writable 0 for a read-only snapshot, 1 for a clone to work on.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_INVALID_FILENAME if target exists, or some error code. 0 if no error.
+ */
+int do_snapshot(const char* target, int writable, imgst_file* imgstfile);
+
+/**
+ * @brief What a backup holds.
+ */
+typedef struct backup_stats {
+    uint32_t base_version; // imgst_version it applies to, 0 for a full backup
+    uint32_t version;      // imgst_version once applied
+    size_t nb_slots;       // metadata records
+    size_t nb_changes;     // change log records
+    uint64_t bytes;        // image bytes
+} backup_stats;
+
+/**
+ * @brief Backs an imgStore up, fully or since a previous backup.
+ *
+ * Images are only appended (until the imgStore is compacted), so a backup
+ * since a previous one holds the bytes appended since, the metadata records
+ * of the slots named by the change log since (all of them if the log does
+ * not cover every version), and those log records: its size follows the
+ * churn, not the size of the imgStore.
+ *
+ * @param target The path of the backup, which must not exist yet.
+ * @param previous The path of the previous backup, NULL for a full backup.
+ * @param stats Location receiving what the backup holds.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_INVALID_ARGUMENT if the imgStore was rewritten since previous,
+ *         or some error code. 0 if no error.
+ */
+int do_backup(const char* target, const char* previous, backup_stats* stats,
+              imgst_file* imgstfile);
+
+/**
+ * @brief Restores a backup onto an imgStore.
+ *
+ * A full backup creates the imgStore if it does not exist; otherwise the
+ * imgStore must be at the version the backup was taken since. The header is
+ * written last, so that an interrupted restore can be run again.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @param backup Path to the backup file.
+ * @param stats Location receiving what the backup held.
+ *
+ * @return ERR_INVALID_ARGUMENT if the backup does not apply, or some error code. 0 if no error.
+ */
+int do_restore(const char* imgst_filename, const char* backup, backup_stats* stats);
+
+/**
+ * @brief Writes what changed in an open imgStore since a base version to a stream.
+ *
+ * The backup format of do_backup, without a file: what a follower needs to
+ * catch up with its leader (see ipc.h).
+ *
+ * @param out The stream receiving the backup.
+ * @param base_version The imgst_version it applies to, 0 for a full backup.
+ * @param base_end The size of the imgStore file at base_version, 0 for a full backup.
+ * @param stats Location receiving what the backup holds, NULL if not needed.
+ * @param imgstfile The imgst_file in memory
+ *
+ * @return ERR_INVALID_ARGUMENT if the imgStore was rewritten since the base,
+ *         or some error code. 0 if no error.
+ */
+int backup_write(FILE* out, uint32_t base_version, uint64_t base_end, backup_stats* stats,
+                 imgst_file* imgstfile);
+
+/**
+ * @brief Applies a backup read from a stream to an open imgStore.
+ *
+ * As do_restore, onto an imgStore already open for writing; its index, if
+ * any, is kept up to date.
+ *
+ * @param in The stream holding the backup.
+ * @param stats Location receiving what the backup held, NULL if not needed.
+ * @param imgstfile The imgst_file in memory, open for writing.
+ *
+ * @return ERR_INVALID_ARGUMENT if the backup does not apply, or some error code. 0 if no error.
+ */
+int backup_apply(FILE* in, backup_stats* stats, imgst_file* imgstfile);
+
+/* placement orders of do_gbcollect */
+#define PLACE_BY_OFFSET 0 // as they are
+#define PLACE_BY_ID     1 // by image ID
+#define PLACE_BY_HEAT   2 // most read first (see imgst_heat.h)
 
+/**
+ * @brief What a garbage collection did.
+ */
+typedef struct gc_stats {
+    size_t nb_images;      // valid images
+    size_t nb_contents;    // contents kept, once each even if deduplicated
+    uint64_t bytes_before; // size of the imgStore file
+    uint64_t bytes_after;
+} gc_stats;
 
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
+ * The live images are written to a new file in placement order, each with
+ * its resolutions next to each other, thumbnail first; the new file then
+ * replaces the imgStore. Slots, versions and the change log are kept, but
+ * the generation is bumped: backups since, and followers of, the old file
+ * are refused.
+ *
  * @param imgst_path The path to the imgStore file
  * @param imgst_tmp_bkp_path The path to the a (to be created) temporary imgStore backup file
+ * @param placement PLACE_BY_OFFSET, PLACE_BY_ID or PLACE_BY_HEAT.
+ * @param stats Location receiving what was done.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path, int placement,
+                  gc_stats* stats);
+
+/**
+ * @brief What a reorganization did.
+ */
+typedef struct reorganize_stats {
+    size_t nb_groups;  // keys
+    size_t nb_moved;   // groups moved by this run
+    size_t nb_left;    // groups still to move, beyond max_groups
+    size_t nb_images;  // images moved
+    uint64_t bytes;    // bytes appended
+} reorganize_stats;
+
+/**
+ * @brief Clusters the contents of related images, incrementally.
+ *
+ * Images are grouped by the part of their ID before separator (all of it if
+ * there is none), and ordered by group then ID. The groups whose contents do
+ * not follow each other in that order, each image with its resolutions next
+ * to each other, are copied to the end of the file, one logged CHANGE_MOVE
+ * per image. A content that deduplicated images of several groups share is
+ * copied once, and all of them point to the copy. The imgStore only grows:
+ * gc reclaims the old copies.
+ *
+ * @param separator The character ending the key of an image ID.
+ * @param max_groups The most groups moved, 0 for all: a next run resumes.
+ * @param stats Location receiving what was done.
+ * @param imgstfile The imgst_file in memory, open for writing.
  *
  * @return Some error code. 0 if no error.
  */
-int do_gbcollect (const char *imgst_path, const char *imgst_tmp_bkp_path);
+int do_reorganize(char separator, uint32_t max_groups, reorganize_stats* stats, imgst_file* imgstfile);
 
 #ifdef __cplusplus
 }
@@ -7,23 +7,67 @@
  * @author Mia Primorac
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno, dup and ftruncate
+
 #include "util.h" // for _unused
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "blob_cache.h"
+#include "imgst_heat.h"
+#include "hot_set.h"
+#include "imgst_similar.h"
+#include "arena.h"
+#include "ipc.h"
 #include "error.h"
 
 #include <stdlib.h>
 #include <string.h> // for strlen and strcmp
+#include <signal.h> // for signal
+#include <unistd.h> // for close and getcwd
+#include <inttypes.h> // for PRIu32 and PRIu64
 #include <vips/vips.h>
 
 // Constants : commands
-#define NB_COMMANDS 6
+#define NB_COMMANDS 20
 #define MIN_COMMAND_ARGS 2
 
-#define MIN_LIST_ARGS 2
 #define MIN_CREATE_ARGS 2
-#define MIN_DELETE_ARGS 3
-#define MIN_READ_ARGS 3
-#define MIN_INSERT_ARGS 4
+#define MIN_STORE_ARGS 2
+#define MIN_BATCH_ARGS 2
+#define MIN_SERVE_ARGS 2
+#define MIN_FOLLOW_ARGS 3
+#define MIN_RESTORE_ARGS 3
+#define MIN_HOT_ARGS 2
+#define MIN_GC_ARGS 3
+#define MIN_REORGANIZE_ARGS 2
+#define MIN_SIMILAR_ARGS 2
+
+// Constants : commands on an open imgStore (arguments counted from the command name)
+#define NB_STORE_COMMANDS 10
+#define MIN_LIST_ARGS 1
+#define MIN_DELETE_ARGS 2
+#define MIN_READ_ARGS 2
+#define MIN_INSERT_ARGS 3
+#define MIN_CHANGES_ARGS 1
+#define MIN_IMPORT_ARGS 2
+#define MIN_EXPORT_ARGS 2
+#define MIN_SNAPSHOT_ARGS 2
+#define MIN_BACKUP_ARGS 2
+#define MAX_PATH_LEN 4096
+
+// Constants : commands run by a daemon (see ipc.h)
+#define NB_REMOTE_COMMANDS 7
+
+// Constants : stdin or stdout instead of a file
+#define STREAM_ARG "-"
+
+// Constants : suffix of the file a read is written to before taking its name
+#define READ_TMP_SUFFIX ".part"
+
+// Constants : batch command
+#define MAX_BATCH_LINE 1024
+#define MAX_BATCH_WORDS 16
+#define BATCH_SEPARATORS " \t\r\n"
 
 // Constants : create command
 #define NB_CREATE_OPTIONS 3
@@ -36,8 +80,12 @@
 
 // Typedefs
 typedef int (*command)(int args, char* argv[]);	// Commands
+typedef int (*store_command)(imgst_file* imgstfile, int args, char* argv[]); // Commands on an open imgStore
+typedef int (*remote_command)(int fd, int args, char* argv[]); // Commands sent to a daemon
 
 typedef struct command_mapping command_mapping;
+typedef struct store_command_mapping store_command_mapping;
+typedef struct remote_command_mapping remote_command_mapping;
 typedef struct option_mapping option_mapping;
 
 /**
@@ -48,6 +96,22 @@ struct command_mapping {
     command comm;
 };
 
+/**
+ * This maps command names to functions working on an open imgStore
+ */
+struct store_command_mapping {
+    const char* name;
+    store_command comm;
+};
+
+/**
+ * This maps command names to functions sending them to a daemon
+ */
+struct remote_command_mapping {
+    const char* name;
+    remote_command comm;
+};
+
 /**
  * This maps command options to everything it needs
  */
@@ -60,31 +124,826 @@ struct option_mapping {
     void* arguments;     // option arguments
 };
 
+// Set while a batch reads its commands from stdin
+static int stdin_taken = 0;
+
+// Set while a batch writes its result lines to stdout
+static int stdout_taken = 0;
+
+// Memory of the command being run, reset once it has run
+static arena s_request = ARENA_INIT;
+
+// Set by the signal handler to stop serve
+static volatile sig_atomic_t s_stop = 0;
+
 /**
- * Opens imgStore file and calls do_list command.
+ * Writes do_list output to the FILE* given as argument.
  */
-int do_list_cmd (int args, char* argv[])
+static int file_writer(void* arg, const char* data, size_t len)
+{
+    return fwrite(data, 1, len, (FILE*) arg) == len ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Parses the options of list.
+ */
+static int parse_list_args (int args, char* argv[], enum do_list_mode* mode,
+                            uint32_t* cursor, uint32_t* limit)
+{
+    *mode = STDOUT;
+    *cursor = 0;
+    *limit = 0;
+
+    for (int i = MIN_LIST_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-json")) {
+            *mode = JSON;
+
+        } else if (!strcmp(argv[i], "-cursor") && i + 1 < args) {
+            *cursor = atouint32(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else if (!strcmp(argv[i], "-limit") && i + 1 < args) {
+            *limit = atouint32(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Lists the content of an open imgStore.
+ */
+static int list_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    // Parse the options
+    enum do_list_mode mode = STDOUT;
+    uint32_t cursor = 0;
+    uint32_t limit = 0;
+    M_EXIT_IF_ERR(parse_list_args(args, argv, &mode, &cursor, &limit));
+
+    // List the contents
+    M_EXIT_IF_ERR(do_list(imgstfile, mode, cursor, limit, file_writer, stdout));
+
+    if (mode == JSON) {
+        putchar('\n');
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Checks the imgID argument: non-null, non-degenerate and of capped length.
+ */
+static int check_img_id (const char* img_id)
+{
+    M_EXIT_IF((img_id == NULL || strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID),
+              ERR_INVALID_IMGID, "invalid imgID argument", );
+
+    return ERR_NONE;
+}
+
+/**
+ * Deletes an image from an open imgStore.
+ */
+static int delete_store_cmd (imgst_file* imgstfile, int args, char* argv[])
 {
-    // List needs at least filename as argument
-    if (args < MIN_LIST_ARGS) {
+    // Delete needs at least imgID as argument
+    if (args < MIN_DELETE_ARGS) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
-    // Get filename argument
-    const char* filename = argv[1];
+    const char* img_id = argv[1];
+    M_EXIT_IF_ERR(check_img_id(img_id));
+
+    return do_delete(img_id, imgstfile);
+}
+
+/**
+ * Opens the file an image named name is written to first, NULL on error.
+ */
+static FILE* open_aside (const char* name, char** tmp_name)
+{
+    const size_t len = strlen(name) + strlen(READ_TMP_SUFFIX) + 1;
+    *tmp_name = arena_alloc(&s_request, len);
+
+    if (*tmp_name == NULL) {
+        return NULL;
+    }
+
+    snprintf(*tmp_name, len, "%s%s", name, READ_TMP_SUFFIX);
+
+    return fopen(*tmp_name, "wb");
+}
+
+/**
+ * Closes a file from open_aside and, if ret and the close are fine, gives it
+ * its name; else removes it, so that a failed read leaves any file of that
+ * name as it was.
+ */
+static int close_aside (FILE* file, const char* tmp_name, const char* name, int ret)
+{
+    if (fclose(file) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+
+    if (ret == ERR_NONE && rename(tmp_name, name) != 0) {
+        ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE) {
+        remove(tmp_name);
+    }
+
+    return ret;
+}
+
+/**
+ * Parses the arguments of read: <imgID> [orig|thumbnail|...] [-] (to stdout).
+ */
+static int parse_read_args (int args, char* argv[], const char** img_id,
+                            int* resolution, int* to_stdout)
+{
+    // Read needs at least <imgID>
+    if (args < MIN_READ_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    *img_id = argv[1];
+    M_EXIT_IF_ERR(check_img_id(*img_id));
+
+    *resolution = RES_ORIG;
+    *to_stdout = 0;
+
+    for (int i = MIN_READ_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], STREAM_ARG)) {
+            *to_stdout = 1;
+
+        } else {
+            *resolution = resolution_atoi(argv[i]);
+            M_EXIT_IF(*resolution == NOT_RES, ERR_RESOLUTIONS, "invalid resolution code", );
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the content of an image from an open imgStore and saves it to a file, or to stdout.
+ */
+static int read_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    const char* img_id = NULL;
+    int resolution = RES_ORIG;
+    int to_stdout = 0;
+    M_EXIT_IF_ERR(parse_read_args(args, argv, &img_id, &resolution, &to_stdout));
+
+    // A batch writing its results to stdout cannot also write an image to it
+    M_EXIT_IF(to_stdout && stdout_taken, ERR_INVALID_ARGUMENT, "stdout already carries results", );
+
+    if (to_stdout) {
+        M_EXIT_IF_ERR(do_read_stream(img_id, resolution, file_writer, stdout, imgstfile));
+        return fflush(stdout) == 0 ? ERR_NONE : ERR_IO;
+    }
+
+    // Generate a new name
+    char* new_name = NULL;
+    M_EXIT_IF_ERR(create_name(img_id, resolution, &s_request, &new_name));
+
+    // Write to jpg in folder where imgStoreMgr is located
+    char* tmp_name = NULL;
+    FILE* new_file = open_aside(new_name, &tmp_name);
+
+    if (new_file == NULL) {
+        return ERR_IO;
+    }
+
+    const int ret = do_read_stream(img_id, resolution, file_writer, new_file, imgstfile);
+
+    return close_aside(new_file, tmp_name, new_name, ret);
+}
+
+/**
+ * Reads a whole stream, of unknown length (no seeking), into the memory of the command.
+ */
+static int read_all (FILE* input, char** buffer, size_t* size)
+{
+    size_t capacity = READ_CHUNK_SIZE;
+    char* data = arena_alloc(&s_request, capacity);
+    M_EXIT_IF_NULL(data, capacity);
+
+    *size = 0;
+
+    while (1) {
+        *size += fread(data + *size, 1, capacity - *size, input);
+
+        if (*size < capacity) {
+            break; // end of stream, or error
+        }
+
+        // Images must fit the 32 bits sizes of the metadata
+        if (capacity > UINT32_MAX / 2) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        // The smaller ones stay until the command ends: at most as much again
+        char* bigger = arena_alloc(&s_request, 2 * capacity);
+        M_EXIT_IF_NULL(bigger, 2 * capacity);
+
+        memcpy(bigger, data, *size);
+        data = bigger;
+        capacity *= 2;
+    }
+
+    if (ferror(input)) {
+        return ERR_IO;
+    }
+
+    *buffer = data;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the image to insert, named by argv[2] ("-" for stdin), into the memory of the command.
+ */
+static int load_insert_image (int args, char* argv[], char** buffer, size_t* size)
+{
+    // Insert needs at least <imgID> <filename>
+    if (args < MIN_INSERT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    M_EXIT_IF_ERR(check_img_id(argv[1]));
+
+    // Get non-null image filename
+    const char* filename = argv[2];
     M_REQUIRE_NON_NULL(filename);
 
-    // Declare an imgst_file
+    const int from_stdin = !strcmp(filename, STREAM_ARG);
+
+    // A batch reading its commands from stdin cannot also read an image from it
+    M_EXIT_IF(from_stdin && stdin_taken, ERR_INVALID_ARGUMENT, "stdin already carries commands", );
+
+    // Read the image to a buffer, without relying on its size being known
+    FILE* image_file = from_stdin ? stdin : fopen(filename, "rb");
+
+    if (image_file == NULL) {
+        return ERR_IO;
+    }
+
+    const int ret = read_all(image_file, buffer, size);
+
+    if (!from_stdin) {
+        fclose(image_file);
+    }
+
+    return ret;
+}
+
+/**
+ * Inserts an image read from a file, or from stdin, into an open imgStore.
+ */
+static int insert_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    // Make sure there is enough space
+    if (args >= MIN_INSERT_ARGS && imgstfile->header.num_files >= imgstfile->header.max_files) {
+        return ERR_FULL_IMGSTORE;
+    }
+
+    const char* img_id = argv[1];
+    char* image_buffer = NULL;
+    size_t image_size = 0;
+    M_EXIT_IF_ERR(load_insert_image(args, argv, &image_buffer, &image_size));
+
+    // Insert
+    return do_insert(image_buffer, image_size, img_id, imgstfile);
+}
+
+/**
+ * Parses the optional version and limit of changes.
+ */
+static int parse_changes_args (int args, char* argv[], uint32_t* since, uint32_t* limit)
+{
+    *since = 0;
+    *limit = 0;
+
+    for (int i = MIN_CHANGES_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-limit") && i + 1 < args) {
+            *limit = atouint32(argv[++i]);
+        } else {
+            *since = atouint32(argv[i]);
+        }
+
+        M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Prints the changes made to an open imgStore after a given version.
+ */
+static int changes_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    uint32_t since = 0;
+    uint32_t limit = 0;
+    M_EXIT_IF_ERR(parse_changes_args(args, argv, &since, &limit));
+
+    M_EXIT_IF_ERR(do_changes(since, limit, file_writer, stdout, imgstfile));
+    putchar('\n');
+
+    return ERR_NONE;
+}
+
+/**
+ * Imports many images into an open imgStore.
+ */
+static int import_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    // Import needs at least a directory, manifest or tar stream
+    if (args < MIN_IMPORT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* source = argv[1];
+    M_REQUIRE_NON_NULL(source);
+    M_EXIT_IF(!strcmp(source, STREAM_ARG) && stdin_taken, ERR_INVALID_ARGUMENT,
+              "stdin already carries commands", );
+
+    // Parse the options
+    size_t nb_workers = 0;
+
+    for (int i = MIN_IMPORT_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-workers") && i + 1 < args) {
+            nb_workers = atouint16(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    import_stats stats;
+    M_EXIT_IF_ERR(do_import(source, nb_workers, 1, &stats, imgstfile));
+
+    printf("Imported %zu images (%zu failed) in %.2f s, %.0f images/s\n",
+           stats.imported, stats.failed, stats.seconds,
+           stats.seconds > 0 ? (double) stats.imported / stats.seconds : 0.0);
+
+    return ERR_NONE;
+}
+
+/**
+ * Exports all the images of an open imgStore.
+ */
+static int export_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    // Export needs at least a target
+    if (args < MIN_EXPORT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* target = argv[1];
+    M_REQUIRE_NON_NULL(target);
+    M_EXIT_IF(!strcmp(target, STREAM_ARG) && stdout_taken, ERR_INVALID_ARGUMENT,
+              "stdout already carries results", );
+
+    // Parse the options
+    int derive = 0;
+    size_t nb_workers = 0;
+
+    for (int i = MIN_EXPORT_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-derive")) {
+            derive = 1;
+
+        } else if (!strcmp(argv[i], "-workers") && i + 1 < args) {
+            nb_workers = atouint16(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    export_stats stats;
+    M_EXIT_IF_ERR(do_export(target, derive, nb_workers, 1, &stats, imgstfile));
+
+    // stdout may be carrying the tar stream
+    fprintf(strcmp(target, STREAM_ARG) ? stdout : stderr,
+            "Exported %zu files (%zu failed) in %.2f s, %.1f MB/s\n",
+            stats.files, stats.failed, stats.seconds,
+            stats.seconds > 0 ? (double) stats.bytes / 1e6 / stats.seconds : 0.0);
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies an open imgStore, read-only or writable.
+ */
+static int copy_store (imgst_file* imgstfile, int writable, int args, char* argv[])
+{
+    // Snapshot and clone need a target
+    if (args < MIN_SNAPSHOT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* target = argv[1];
+    M_EXIT_IF(target == NULL || strlen(target) == 0 || strlen(target) > MAX_IMGST_NAME,
+              ERR_INVALID_FILENAME, "invalid target filename", );
+
+    return do_snapshot(target, writable, imgstfile);
+}
+
+/**
+ * Makes a read-only point-in-time copy of an open imgStore.
+ */
+static int snapshot_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    return copy_store(imgstfile, 0, args, argv);
+}
+
+/**
+ * Makes a writable point-in-time copy of an open imgStore.
+ */
+static int clone_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    return copy_store(imgstfile, 1, args, argv);
+}
+
+/**
+ * Prints what a backup holds.
+ */
+static void print_backup_stats (const char* action, const backup_stats* stats)
+{
+    printf("%s versions %" PRIu32 " to %" PRIu32 ": %zu metadata, %zu changes, %" PRIu64 " bytes\n",
+           action, stats->base_version, stats->version, stats->nb_slots, stats->nb_changes,
+           stats->bytes);
+}
+
+/**
+ * Backs an open imgStore up, fully or since a previous backup.
+ */
+static int backup_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    // Backup needs at least a target
+    if (args < MIN_BACKUP_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* target = argv[1];
+    M_REQUIRE_NON_NULL(target);
+
+    const char* previous = args > MIN_BACKUP_ARGS ? argv[MIN_BACKUP_ARGS] : NULL;
+
+    backup_stats stats;
+    M_EXIT_IF_ERR(do_backup(target, previous, &stats, imgstfile));
+    print_backup_stats("Backed up", &stats);
+
+    return ERR_NONE;
+}
+
+/**
+ * Commands that can run against an open imgStore, alone or in a batch.
+ */
+static const store_command_mapping store_commands[NB_STORE_COMMANDS] = {
+    {"list", list_store_cmd},
+    {"delete", delete_store_cmd},
+    {"read", read_store_cmd},
+    {"insert", insert_store_cmd},
+    {"changes", changes_store_cmd},
+    {"import", import_store_cmd},
+    {"export", export_store_cmd},
+    {"snapshot", snapshot_store_cmd},
+    {"clone", clone_store_cmd},
+    {"backup", backup_store_cmd}
+};
+
+/**
+ * Runs a command, named by argv[0], against an open imgStore.
+ */
+static int run_store_cmd (imgst_file* imgstfile, int args, char* argv[])
+{
+    int ret = ERR_INVALID_COMMAND;
+
+    for (size_t i = 0; i < NB_STORE_COMMANDS; ++i) {
+        if (!strcmp(store_commands[i].name, argv[0])) {
+            ret = store_commands[i].comm(imgstfile, args, argv);
+            break;
+        }
+    }
+
+    // What the command allocated goes at once, however it ended
+    arena_reset(&s_request);
+
+    return ret;
+}
+
+/**
+ * Lists the content of an imgStore held by a daemon.
+ */
+static int list_remote_cmd (int fd, int args, char* argv[])
+{
+    enum do_list_mode mode = STDOUT;
+    ipc_request request = { .op = IPC_LIST };
+    M_EXIT_IF_ERR(parse_list_args(args, argv, &mode, &request.arg, &request.limit));
+
+    request.flags = mode == JSON ? IPC_LIST_JSON : 0;
+
+    char* reply = NULL;
+    size_t reply_len = 0;
+    M_EXIT_IF_ERR(ipc_call(fd, &request, NULL, NULL, 0, &reply, &reply_len));
+
+    if (mode == JSON) {
+        fwrite(reply, 1, reply_len, stdout);
+        putchar('\n');
+        free(reply);
+        return ERR_NONE;
+    }
+
+    // The header, then the listed metadata, printed as do_list would
+    if (reply_len < sizeof(imgst_header)
+        || (reply_len - sizeof(imgst_header)) % sizeof(img_metadata) != 0) {
+        free(reply);
+        return ERR_IO;
+    }
+
+    imgst_header header;
+    memcpy(&header, reply, sizeof(header));
+    print_header(&header);
+
+    if (header.num_files == 0) {
+        printf("<< empty imgStore >>\n");
+    }
+
+    for (size_t pos = sizeof(imgst_header); pos < reply_len; pos += sizeof(img_metadata)) {
+        img_metadata metadata;
+        memcpy(&metadata, reply + pos, sizeof(metadata));
+        print_metadata(&metadata);
+    }
+
+    free(reply);
+
+    return ERR_NONE;
+}
+
+/**
+ * Deletes an image from an imgStore held by a daemon.
+ */
+static int delete_remote_cmd (int fd, int args, char* argv[])
+{
+    if (args < MIN_DELETE_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    M_EXIT_IF_ERR(check_img_id(argv[1]));
+
+    ipc_request request = { .op = IPC_DELETE };
+    char* reply = NULL;
+    size_t reply_len = 0;
+    const int ret = ipc_call(fd, &request, argv[1], NULL, 0, &reply, &reply_len);
+    free(reply);
+
+    return ret;
+}
+
+/**
+ * Reads an image from an imgStore held by a daemon and saves it to a file, or to stdout.
+ */
+static int read_remote_cmd (int fd, int args, char* argv[])
+{
+    const char* img_id = NULL;
+    int resolution = RES_ORIG;
+    int to_stdout = 0;
+    M_EXIT_IF_ERR(parse_read_args(args, argv, &img_id, &resolution, &to_stdout));
+
+    ipc_request request = { .op = IPC_READ, .res = (uint8_t) resolution };
+    char* image = NULL;
+    size_t size = 0;
+    M_EXIT_IF_ERR(ipc_call(fd, &request, img_id, NULL, 0, &image, &size));
+
+    if (to_stdout) {
+        const int ret = file_writer(stdout, image, size);
+        free(image);
+        M_EXIT_IF_ERR(ret);
+        return fflush(stdout) == 0 ? ERR_NONE : ERR_IO;
+    }
+
+    // Same name as a local read
+    char* new_name = NULL;
+    M_EXIT_IF_ERR_DO_SOMETHING(create_name(img_id, resolution, &s_request, &new_name), free(image));
+
+    char* tmp_name = NULL;
+    FILE* new_file = open_aside(new_name, &tmp_name);
+    int ret = ERR_IO;
+
+    if (new_file != NULL) {
+        ret = close_aside(new_file, tmp_name, new_name, file_writer(new_file, image, size));
+    }
+
+    free(image);
+
+    return ret;
+}
+
+/**
+ * Inserts an image, read from a file or from stdin, into an imgStore held by a daemon.
+ */
+static int insert_remote_cmd (int fd, int args, char* argv[])
+{
+    char* image = NULL;
+    size_t size = 0;
+    M_EXIT_IF_ERR(load_insert_image(args, argv, &image, &size));
+
+    ipc_request request = { .op = IPC_INSERT };
+    char* reply = NULL;
+    size_t reply_len = 0;
+    const int ret = ipc_call(fd, &request, argv[1], image, size, &reply, &reply_len);
+    free(reply);
+
+    return ret;
+}
+
+/**
+ * Prints the changes made to an imgStore held by a daemon after a given version.
+ */
+static int changes_remote_cmd (int fd, int args, char* argv[])
+{
+    ipc_request request = { .op = IPC_CHANGES };
+    M_EXIT_IF_ERR(parse_changes_args(args, argv, &request.arg, &request.limit));
+
+    char* reply = NULL;
+    size_t reply_len = 0;
+    M_EXIT_IF_ERR(ipc_call(fd, &request, NULL, NULL, 0, &reply, &reply_len));
+
+    fwrite(reply, 1, reply_len, stdout);
+    putchar('\n');
+    free(reply);
+
+    return ERR_NONE;
+}
+
+/**
+ * Has a daemon copy the imgStore it holds, read-only or writable.
+ */
+static int copy_remote (int fd, int writable, int args, char* argv[])
+{
+    if (args < MIN_SNAPSHOT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* target = argv[1];
+    M_EXIT_IF(target == NULL || strlen(target) == 0 || strlen(target) > MAX_IMGST_NAME,
+              ERR_INVALID_FILENAME, "invalid target filename", );
+
+    // The daemon may run elsewhere in the filesystem
+    char path[MAX_PATH_LEN];
+
+    if (target[0] == '/') {
+        strncpy(path, target, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+
+    } else if (getcwd(path, sizeof(path)) == NULL
+               || strlen(path) + 1 + strlen(target) >= sizeof(path)) {
+        return ERR_INVALID_FILENAME;
+
+    } else {
+        strcat(path, "/");
+        strcat(path, target);
+    }
+
+    ipc_request request = { .op = IPC_SNAPSHOT, .flags = writable ? IPC_SNAPSHOT_WRITABLE : 0 };
+    char* reply = NULL;
+    size_t reply_len = 0;
+    const int ret = ipc_call(fd, &request, NULL, path, strlen(path), &reply, &reply_len);
+    free(reply);
+
+    return ret;
+}
+
+/**
+ * Has a daemon make a read-only copy of the imgStore it holds.
+ */
+static int snapshot_remote_cmd (int fd, int args, char* argv[])
+{
+    return copy_remote(fd, 0, args, argv);
+}
+
+/**
+ * Has a daemon make a writable copy of the imgStore it holds.
+ */
+static int clone_remote_cmd (int fd, int args, char* argv[])
+{
+    return copy_remote(fd, 1, args, argv);
+}
+
+/**
+ * Commands that a daemon holding the imgStore open can run.
+ */
+static const remote_command_mapping remote_commands[NB_REMOTE_COMMANDS] = {
+    {"list", list_remote_cmd},
+    {"delete", delete_remote_cmd},
+    {"read", read_remote_cmd},
+    {"insert", insert_remote_cmd},
+    {"changes", changes_remote_cmd},
+    {"snapshot", snapshot_remote_cmd},
+    {"clone", clone_remote_cmd}
+};
+
+/**
+ * Finds the function sending the command name to a daemon, NULL if there is none.
+ */
+static remote_command find_remote_cmd (const char* name)
+{
+    for (size_t i = 0; i < NB_REMOTE_COMMANDS; ++i) {
+        if (!strcmp(remote_commands[i].name, name)) {
+            return remote_commands[i].comm;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Fails with ERR_BUSY if a daemon or the HTTP server, or anything else, holds
+ * the imgStore open to write it.
+ */
+static int check_not_served (const char* imgstore_filename)
+{
+    int fd = -1;
+
+    if (ipc_connect(imgstore_filename, &fd) == ERR_NONE) {
+        close(fd);
+        return ERR_BUSY;
+    }
+
+    return check_unlocked(imgstore_filename);
+}
+
+/**
+ * Opens the imgStore named by argv[1], runs the command argv[0] on it and closes it.
+ *
+ * If a daemon holds the imgStore open, it runs the command instead; commands
+ * it cannot run may only read the imgStore meanwhile. Otherwise, writers lock
+ * the imgStore, as do the commands that must not see writes under way.
+ */
+static int run_on_store (const char* open_mode, int quiesce, int args, char* argv[])
+{
+    // Every such command needs at least <imgstore_filename>
+    if (args < MIN_STORE_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    // Get non-null imgstore filename
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    // Drop <imgstore_filename>, keeping the command name in front
+    argv[1] = argv[0];
+
+    // One socket round trip if a daemon serves the imgStore
+    int fd = -1;
+
+    if (ipc_connect(imgstore_filename, &fd) == ERR_NONE) {
+        const remote_command remote = find_remote_cmd(argv[0]);
+        const int ret = remote != NULL ? remote(fd, args - 1, argv + 1)
+                        : strcmp(open_mode, "rb") ? ERR_BUSY : ERR_NONE;
+        close(fd);
+        arena_reset(&s_request);
+
+        if (remote != NULL || ret != ERR_NONE) {
+            return ret;
+        }
+    }
+
+    // Open the imgStore file
     imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, open_mode, &imgstfile));
+
+    // Not behind the back of another writer, such as the HTTP server
+    const int writer = strcmp(open_mode, "rb") != 0;
 
-    // Open the file with the given filename in binary read mode
-    M_EXIT_IF_ERR(do_open(filename, "rb", &imgstfile));
+    if (writer || quiesce) {
+        M_EXIT_IF_ERR_DO_SOMETHING(do_lock(&imgstfile, writer), do_close(&imgstfile));
+    }
+
+    const int ret = run_store_cmd(&imgstfile, args - 1, argv + 1);
 
-    // List the contents and then close the file.
-    do_list(&imgstfile);
+    // Clean up the file
     do_close(&imgstfile);
 
-    return ERR_NONE;
+    return ret;
+}
+
+/**
+ * Opens imgStore file and calls do_list command.
+ */
+int do_list_cmd (int args, char* argv[])
+{
+    return run_on_store("rb", 0, args, argv);
 }
 
 /**
@@ -102,6 +961,9 @@ int do_create_cmd (int args, char* argv[])
     M_EXIT_IF((filename == NULL) || (strlen(filename) > MAX_IMGST_NAME),
               ERR_INVALID_ARGUMENT, "invalid filename argument", );
 
+    // Do not overwrite an imgStore held open by a daemon
+    M_EXIT_IF_ERR(check_not_served(filename));
+
     // Skips "create" and "<imgstore_filename>"
     args -= MIN_CREATE_ARGS; argv += MIN_CREATE_ARGS;
 
@@ -222,7 +1084,10 @@ int help (int args, char* argv[])
 {
     printf("imgStoreMgr [COMMAND] [ARGUMENTS]\n"
            "  help: displays this help.\n"
-           "  list <imgstore_filename>: list imgStore content.\n"
+           "  list <imgstore_filename> [-json] [-cursor <N>] [-limit <N>]: list imgStore content.\n"
+           "      -json prints the image IDs as a JSON document.\n"
+           "      -cursor starts listing at metadata slot N (see \"next\" in JSON output).\n"
+           "      -limit lists at most N images.\n"
            "  create <imgstore_filename> [options]: create a new imgStore.\n"
            "      options are:\n"
            "          -max_files <MAX_FILES>: maximum number of files.\n"
@@ -234,14 +1099,74 @@ int help (int args, char* argv[])
            "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
            "                                  default value is %dx%d\n"
            "                                  maximum value is %dx%d\n"
-           "  read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
-           "      read an image from the imgStore and save it to a file.\n"
+           "  read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small] [-]:\n"
+           "      read an image from the imgStore and save it to a file,\n"
+           "      or write it to stdout with -.\n"
            "      default resolution is \"original\".\n"
-           "  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n"
-           "  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n",
+           "  insert <imgstore_filename> <imgID> <filename|->: insert a new image in the imgStore.\n"
+           "      - reads the image from stdin.\n"
+           "  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n"
+           "  changes <imgstore_filename> [<since>] [-limit <N>]:\n"
+           "      print as JSON the changes made after version <since> (default 0).\n"
+           "  batch <imgstore_filename> [<command_filename>|-]: run many commands at once.\n"
+           "      reads list, read, insert, delete, changes, import, export, snapshot, clone\n"
+           "      and backup commands, one per line and without <imgstore_filename>,\n"
+           "      from the file or stdin (default).\n"
+           "      prints per command \"OK <N>\" followed by the N bytes it printed\n"
+           "      (list, changes, import, export, backup), or \"ERROR: <message>\";\n"
+           "      images are thus read to files, not to stdout (-).\n"
+           "  import <imgstore_filename> <directory|manifest|tar_filename.tar|-> [-workers <N>]:\n"
+           "      insert all the files below a directory, with their relative path as imgID,\n"
+           "      those of a manifest, one \"<imgID> <filename>\" per line,\n"
+           "      or those of a .tar file or a tar stream on stdin (-), with their path as imgID.\n"
+           "      tar streams made by export also restore the derivatives.\n"
+           "      files are read and hashed by N threads (default: one per CPU).\n"
+           "      reports progress and failed images on stderr.\n"
+           "  export <imgstore_filename> <directory|tar_filename.tar|-> [-derive] [-workers <N>]:\n"
+           "      write every stored image as <imgID>_<resolution>.jpg, in a directory,\n"
+           "      a .tar file or a tar stream on stdout (-).\n"
+           "      -derive also makes the missing thumbnail and small images.\n"
+           "      files are written by N threads (default: one per CPU).\n"
+           "  snapshot <imgstore_filename> <target_filename>: make a read-only copy of the imgStore.\n"
+           "  clone <imgstore_filename> <target_filename>: make a writable copy of the imgStore.\n"
+           "      the copies share their blocks with the imgStore until either changes,\n"
+           "      where the filesystem supports it (btrfs, XFS); they are full copies elsewhere.\n"
+           "  backup <imgstore_filename> <backup_filename> [<previous_backup_filename>]:\n"
+           "      back the imgStore up, fully or only what changed since the previous backup.\n"
+           "  restore <imgstore_filename> <backup_filename>...: apply backups in order.\n"
+           "      a full backup creates the imgStore; the next ones each follow the previous.\n",
            DEF_MAX_FILES, MAX_MAX_FILES,
            DEF_RES_THUMB, DEF_RES_THUMB, MAX_RES_THUMB, MAX_RES_THUMB,
            DEF_RES_SMALL, DEF_RES_SMALL, MAX_RES_SMALL, MAX_RES_SMALL);
+    printf("  hot <imgstore_filename> [-limit <N>]: print as JSON the most read images,\n"
+           "      as counted by serve, follow and the server in <imgstore_filename>.heat.\n"
+           "      counts halve every %d minutes without reads.\n"
+           "  gc <imgstore_filename> <tmp_imgstore_filename> [-place offset|id|heat]:\n"
+           "      remove the deleted images, rewriting the others through the temporary file\n"
+           "      with the resolutions of each image next to each other, in their current\n"
+           "      order (default), by imgID, or most read first.\n"
+           "      backups taken before can no longer be followed by incremental ones.\n"
+           "  reorganize <imgstore_filename> [-sep <char>] [-limit <N>]: cluster the images\n"
+           "      by the part of their imgID before <char> (default /), then by imgID,\n"
+           "      appending a copy of each scattered group; a later gc reclaims the old ones.\n"
+           "      -limit moves at most N groups: run again to resume.\n"
+           "  similar <imgstore_filename> [<imgID>] [-distance <N>]: print as JSON the images\n"
+           "      that look like <imgID>, closest first, or all groups of look-alikes,\n"
+           "      such as re-encoded or resized copies: their perceptual hashes differ\n"
+           "      by at most N of 64 bits (default %d). the hashes are kept in\n"
+           "      <imgstore_filename>.phash, and made for the images new since.\n"
+           "  serve <imgstore_filename>: keep the imgStore open and serve the other commands.\n"
+           "      listens on <imgstore_filename>.sock until interrupted.\n"
+           "      list, read, insert, delete, changes, snapshot and clone on the imgStore\n"
+           "      are then sent to it;\n"
+           "      export and backup still read the file, while import, batch, create\n"
+           "      and restore are refused.\n"
+           "  follow <imgstore_filename> <leader_imgstore_filename>: serve a copy of an imgStore\n"
+           "      (a clone, or a restored backup), applying what changes on the served\n"
+           "      leader as it changes. insert and delete on the copy are refused.\n"
+           "      to fail over, stop following and serve the copy.\n"
+           "  while imgStore_server runs, it serves the commands as serve does.\n",
+           HEAT_EPOCH_SECONDS / 60, DEF_SIMILAR_DISTANCE);
 
     // We'll assume that calling help never fails.
     return ERR_NONE;
@@ -252,100 +1177,359 @@ int help (int args, char* argv[])
  */
 int do_delete_cmd (int args, char* argv[])
 {
-    // Delete needs at least filename and imgID as argument
-    if (args < MIN_DELETE_ARGS) {
+    return run_on_store("rb+", 0, args, argv);
+}
+
+/**
+ * Reads the content of an image from a imgStore
+ */
+int do_read_cmd (int args, char* argv[])
+{
+    return run_on_store("rb+", 0, args, argv);
+}
+
+/**
+ * Inserts an image in a imgStore
+ */
+int do_insert_cmd (int args, char* argv[])
+{
+    return run_on_store("rb+", 0, args, argv);
+}
+
+/**
+ * Prints the changes made to an imgStore after a given version.
+ */
+int do_changes_cmd (int args, char* argv[])
+{
+    return run_on_store("rb", 0, args, argv);
+}
+
+/**
+ * Imports many images in a imgStore
+ */
+int do_import_cmd (int args, char* argv[])
+{
+    return run_on_store("rb+", 0, args, argv);
+}
+
+/**
+ * Exports all the images of a imgStore
+ */
+int do_export_cmd (int args, char* argv[])
+{
+    return run_on_store("rb", 0, args, argv);
+}
+
+/**
+ * Backs a imgStore up
+ */
+int do_backup_cmd (int args, char* argv[])
+{
+    return run_on_store("rb", 0, args, argv);
+}
+
+/**
+ * Restores backups, in order, onto a imgStore
+ */
+int do_restore_cmd (int args, char* argv[])
+{
+    // Restore needs at least <imgstore_filename> <backup_filename>
+    if (args < MIN_RESTORE_ARGS) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
-    // Get non-null filename argument
-    const char* filename = argv[1];
-    M_REQUIRE_NON_NULL(filename);
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
 
-    // Get non-null non-degenerate capped-length imgID argument
-    const char* img_id = argv[2];
-    M_EXIT_IF((img_id == NULL || strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID),
-              ERR_INVALID_IMGID, "invalid imgID argument", );
+    // Do not write behind the back of a daemon
+    M_EXIT_IF_ERR(check_not_served(imgstore_filename));
 
-    // Open the file
-    imgst_file imgstfile;
-    M_EXIT_IF_ERR(do_open(filename, "rb+", &imgstfile));
+    for (int i = MIN_RESTORE_ARGS - 1; i < args; ++i) {
+        backup_stats stats;
+        M_EXIT_IF_ERR(do_restore(imgstore_filename, argv[i], &stats));
+        print_backup_stats("Restored", &stats);
+    }
 
-    // If correctly opened, then delete.
-    M_EXIT_IF_ERR_DO_SOMETHING(do_delete(img_id, &imgstfile),
-                               do_close(&imgstfile));
+    return ERR_NONE;
+}
 
-    // Clean up the file
-    do_close(&imgstfile);
+/**
+ * Removes the deleted images from an imgStore, placing the others in some order
+ */
+int do_gc_cmd (int args, char* argv[])
+{
+    // GC needs at least <imgstore_filename> <tmp_imgstore_filename>
+    if (args < MIN_GC_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    const char* tmp_filename = argv[2];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+    M_REQUIRE_NON_NULL(tmp_filename);
+
+    int placement = PLACE_BY_OFFSET;
+
+    for (int i = MIN_GC_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-place") && i + 1 < args) {
+            ++i;
+
+            if (!strcmp(argv[i], "offset")) {
+                placement = PLACE_BY_OFFSET;
+            } else if (!strcmp(argv[i], "id")) {
+                placement = PLACE_BY_ID;
+            } else if (!strcmp(argv[i], "heat")) {
+                placement = PLACE_BY_HEAT;
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    // Do not move contents behind the back of a daemon
+    M_EXIT_IF_ERR(check_not_served(imgstore_filename));
+
+    gc_stats stats;
+    M_EXIT_IF_ERR(do_gbcollect(imgstore_filename, tmp_filename, placement, &stats));
+
+    printf("Collected %zu images (%zu contents): %" PRIu64 " to %" PRIu64 " bytes\n",
+           stats.nb_images, stats.nb_contents, stats.bytes_before, stats.bytes_after);
 
     return ERR_NONE;
 }
 
 /**
- * Reads the content of an image from a imgStore
+ * Clusters the contents of the images of an imgStore by key
  */
-int do_read_cmd (int args, char* argv[])
+int do_reorganize_cmd (int args, char* argv[])
 {
-
-    // Read needs at least <imgstore_filename>, <imgID>
-    if (args < MIN_READ_ARGS) {
+    // Reorganize needs at least <imgstore_filename>
+    if (args < MIN_REORGANIZE_ARGS) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
-    // Get non-null filename argument
     const char* imgstore_filename = argv[1];
     M_REQUIRE_NON_NULL(imgstore_filename);
 
-    // Get non-null non-degenerate capped-length imgID argument
-    const char* img_id = argv[2];
-    M_EXIT_IF((img_id == NULL || strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID),
-              ERR_INVALID_IMGID, "invalid imgID argument", );
+    char separator = '/';
+    uint32_t limit = 0;
+
+    for (int i = MIN_REORGANIZE_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-sep") && i + 1 < args && strlen(argv[i + 1]) == 1) {
+            separator = argv[++i][0];
+
+        } else if (!strcmp(argv[i], "-limit") && i + 1 < args) {
+            limit = atouint32(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
 
-    // Optional argument is [orig|thumbnail|...]
-    const int resolution = (args >= MIN_READ_ARGS + 1) ? resolution_atoi(argv[3]) : RES_ORIG;
-    M_EXIT_IF(resolution == NOT_RES, ERR_RESOLUTIONS, "invalid resolution code", );
+    // Do not append behind the back of a daemon
+    M_EXIT_IF_ERR(check_not_served(imgstore_filename));
 
-    // Open the file
     imgst_file imgstfile;
     M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &imgstfile));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_lock(&imgstfile, 1), do_close(&imgstfile));
 
-    // Read into image_buffer and image_size
-    char* image_buffer = NULL;
-    uint32_t image_size = 0;
-    M_EXIT_IF_ERR_DO_SOMETHING(do_read(img_id, resolution, &image_buffer, &image_size, &imgstfile),
-                               do_close(&imgstfile);
-                               FREE_DEREF(image_buffer));
+    reorganize_stats stats;
+    const int ret = do_reorganize(separator, limit, &stats, &imgstfile);
+    do_close(&imgstfile);
+    M_EXIT_IF_ERR(ret);
 
-    // Generate a new name
-    char* new_name;
-    M_EXIT_IF_ERR_DO_SOMETHING(create_name(img_id, resolution, &new_name),
-                               do_close(&imgstfile);
-                               FREE_DEREF(image_buffer);
-                               FREE_DEREF(new_name));
+    printf("Reorganized %zu of %zu groups (%zu images, %" PRIu64 " bytes appended), %zu left\n",
+           stats.nb_moved, stats.nb_groups, stats.nb_images, stats.bytes, stats.nb_left);
 
-    // Write to jpg in folder where imgStoreMgr is located
-    FILE* new_file = fopen(new_name, "wb");
-    fwrite(image_buffer, (size_t) image_size, 1, new_file);
+    return ERR_NONE;
+}
+
+/**
+ * Lists the most read images of a imgStore, as counted by serve and the server
+ */
+int do_hot_cmd (int args, char* argv[])
+{
+    // Hot needs at least <imgstore_filename>
+    if (args < MIN_HOT_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    uint32_t limit = 0;
+
+    for (int i = MIN_HOT_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-limit") && i + 1 < args) {
+            limit = atouint32(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
 
-    // Free pointers
-    FREE_DEREF(new_name);
-    FREE_DEREF(image_buffer);
+    // As last written back: a daemon flushes its counters every HEAT_FLUSH_SECONDS
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb", &imgstfile));
+
+    int ret = heat_open(imgstore_filename, "rb", &imgstfile);
+
+    if (ret == ERR_NONE) {
+        ret = do_hot(limit, file_writer, stdout, &imgstfile);
+        putchar('\n');
+    }
 
-    // Close the files
-    fclose(new_file);
     do_close(&imgstfile);
 
-    return ERR_NONE;
+    return ret;
+}
+
+/**
+ * Lists the near-duplicates of an image, or all groups of near-duplicates
+ */
+int do_similar_cmd (int args, char* argv[])
+{
+    // Similar needs at least <imgstore_filename>
+    if (args < MIN_SIMILAR_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    const char* img_id = NULL;
+    uint32_t max_distance = DEF_SIMILAR_DISTANCE;
+
+    for (int i = MIN_SIMILAR_ARGS; i < args; ++i) {
+        if (!strcmp(argv[i], "-distance") && i + 1 < args) {
+            max_distance = atouint32(argv[++i]);
+            M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+        } else if (img_id == NULL && argv[i][0] != '-') {
+            img_id = argv[i];
+            M_EXIT_IF_TOO_LONG(img_id, MAX_IMG_ID);
+
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    // As last written: the hashes of images a daemon inserts since are computed next time
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb", &imgstfile));
+
+    const int ret = do_similar(imgstore_filename, img_id, max_distance, file_writer, stdout, &imgstfile);
+    do_close(&imgstfile);
+
+    if (ret == ERR_NONE) {
+        putchar('\n');
+    }
+
+    return ret;
 }
 
+/**
+ * Makes a read-only copy of a imgStore
+ */
+int do_snapshot_cmd (int args, char* argv[])
+{
+    return run_on_store("rb", 1, args, argv);
+}
 
 /**
- * Reads the content of an image from a imgStore
+ * Makes a writable copy of a imgStore
  */
-int do_insert_cmd (int args, char* argv[])
+int do_clone_cmd (int args, char* argv[])
 {
+    return run_on_store("rb", 1, args, argv);
+}
 
-    // Insert needs at least <imgstore_filename> <imgID> <filename>
-    if (args < MIN_INSERT_ARGS) {
+/**
+ * Splits a batch line into whitespace-separated words. Returns the number of
+ * words, or -1 if there are more than max_words.
+ */
+static int split_words (char* line, char* words[], int max_words)
+{
+    int nb = 0;
+
+    for (char* word = strtok(line, BATCH_SEPARATORS);
+         word != NULL;
+         word = strtok(NULL, BATCH_SEPARATORS)) {
+        if (nb == max_words) {
+            return -1;
+        }
+
+        words[nb++] = word;
+    }
+
+    return nb;
+}
+
+/**
+ * Runs a command of a batch with its output set aside in capture, so that
+ * it does not mix with the result lines. Returns the command's error code.
+ */
+static int run_captured (FILE* capture, imgst_file* imgstfile, int args, char* argv[])
+{
+    // What the previous command wrote is gone
+    fflush(stdout);
+    rewind(capture);
+    M_EXIT_IF(ftruncate(fileno(capture), 0) != 0, ERR_IO, "cannot reset batch output", );
+
+    const int saved = dup(STDOUT_FILENO);
+    M_EXIT_IF(saved < 0, ERR_IO, "cannot redirect batch output", );
+
+    if (dup2(fileno(capture), STDOUT_FILENO) < 0) {
+        close(saved);
+        return ERR_IO;
+    }
+
+    const int ret = run_store_cmd(imgstfile, args, argv);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    return ret;
+}
+
+/**
+ * Prints the result of a batch command: OK and the number of bytes of its
+ * output, then that output, or ERROR and the message alone.
+ */
+static void print_result (FILE* capture, int ret)
+{
+    if (ret != ERR_NONE) {
+        printf("ERROR: %s\n", ERR_MESSAGES[ret]);
+        return;
+    }
+
+    fseek(capture, 0, SEEK_END);
+    const long size = ftell(capture);
+    rewind(capture);
+
+    printf("OK %ld\n", size > 0 ? size : 0L);
+
+    char buf[BUFSIZ];
+    size_t n = 0;
+
+    while ((n = fread(buf, 1, sizeof(buf), capture)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+}
+
+/**
+ * Runs many commands, one per line, against a single open imgStore.
+ */
+int do_batch_cmd (int args, char* argv[])
+{
+    // Batch needs at least <imgstore_filename>
+    if (args < MIN_BATCH_ARGS) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
@@ -353,54 +1537,184 @@ int do_insert_cmd (int args, char* argv[])
     const char* imgstore_filename = argv[1];
     M_REQUIRE_NON_NULL(imgstore_filename);
 
-    // Get non-null non-degenerate capped-length imgID argument
-    const char* img_id = argv[2];
-    M_EXIT_IF((img_id == NULL || strlen(img_id) == 0 || strlen(img_id) > MAX_IMG_ID),
-              ERR_INVALID_IMGID, "invalid imgID argument", );
+    // A daemon already keeps the imgStore open for many commands
+    M_EXIT_IF_ERR(check_not_served(imgstore_filename));
 
-    // Get non-null image filename
-    const char* filename = argv[3];
-    M_REQUIRE_NON_NULL(filename);
+    // Commands come from a file, or from stdin by default
+    FILE* input = stdin;
 
-    // Open the imgStore file
-    imgst_file imgstfile;
-    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &imgstfile));
+    if (args > MIN_BATCH_ARGS && strcmp(argv[MIN_BATCH_ARGS], STREAM_ARG) != 0) {
+        input = fopen(argv[MIN_BATCH_ARGS], "r");
 
-    // Make sure there is enough space
-    if (imgstfile.header.num_files >= imgstfile.header.max_files) {
-        do_close(&imgstfile);
-        return ERR_FULL_IMGSTORE;
+        if (input == NULL) {
+            return ERR_IO;
+        }
     }
 
-    // Read disk image, read size and load to buffer
-    FILE* image_file = fopen(filename, "rb");
+    // Open the imgStore file, once for all the commands
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR_DO_SOMETHING(do_open(imgstore_filename, "rb+", &imgstfile),
+                               if (input != stdin) fclose(input));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_lock(&imgstfile, 1),
+                               do_close(&imgstfile); if (input != stdin) fclose(input));
+
+    // Many commands: look images up by index rather than by scanning
+    M_EXIT_IF_ERR_DO_SOMETHING(index_build(&imgstfile),
+                               do_close(&imgstfile); if (input != stdin) fclose(input));
 
-    if (image_file == NULL) {
+    // Where the output of each command waits for its result line
+    FILE* capture = tmpfile();
+
+    if (capture == NULL) {
         do_close(&imgstfile);
+
+        if (input != stdin) {
+            fclose(input);
+        }
+
         return ERR_IO;
     }
 
-    fseek(image_file, 0, SEEK_END);
-    const size_t image_size = ftell(image_file);
-    rewind(image_file);
+    stdin_taken = input == stdin;
+    stdout_taken = 1;
 
-    void* image_buffer = calloc(1, image_size);
-    fread(image_buffer, image_size, 1, image_file);
+    char line[MAX_BATCH_LINE + 2]; // with '\n' and '\0'
+    char* words[MAX_BATCH_WORDS];
 
-    // Insert
-    M_EXIT_IF_ERR_DO_SOMETHING(do_insert(image_buffer, image_size, img_id, &imgstfile),
-                               FREE_DEREF(image_buffer);
-                               fclose(image_file);
-                               do_close(&imgstfile));
-
-    // Free buffer and clean up the file
-    FREE_DEREF(image_buffer);
-    fclose(image_file);
+    while (fgets(line, sizeof(line), input) != NULL) {
+        int ret = ERR_NONE;
+
+        if (strchr(line, '\n') == NULL && !feof(input)) {
+            // Line too long: skip the rest of it
+            int c = 0;
+            while ((c = getc(input)) != '\n' && c != EOF);
+            ret = ERR_INVALID_ARGUMENT;
+
+        } else {
+            const int nb_words = split_words(line, words, MAX_BATCH_WORDS);
+
+            // Skip blank lines and comments
+            if (nb_words == 0 || words[0][0] == '#') {
+                continue;
+            }
+
+            // Too many words: refuse rather than run with some dropped
+            ret = nb_words < 0 ? ERR_INVALID_ARGUMENT : run_captured(capture, &imgstfile, nb_words, words);
+        }
+
+        // Exactly one result per command, framed, visible right away to a pipe
+        print_result(capture, ret);
+        fflush(stdout);
+    }
+
+    // Clean up the files
+    fclose(capture);
     do_close(&imgstfile);
+    stdin_taken = 0;
+    stdout_taken = 0;
+
+    if (input != stdin) {
+        fclose(input);
+    }
 
     return ERR_NONE;
 }
 
+/**
+ * Records the signal so that serve stops.
+ */
+static void stop_handler (int signo)
+{
+    s_stop = signo;
+}
+
+/**
+ * Keeps an imgStore open, with its index, and serves it until interrupted,
+ * following a leader if any.
+ */
+static int serve_store (const char* imgstore_filename, const char* leader_filename)
+{
+    // One daemon per imgStore
+    M_EXIT_IF_ERR(check_not_served(imgstore_filename));
+
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(imgstore_filename, "rb+", &imgstfile));
+    M_EXIT_IF_ERR_DO_SOMETHING(do_lock(&imgstfile, 1), do_close(&imgstfile));
+    M_EXIT_IF_ERR_DO_SOMETHING(index_build(&imgstfile), do_close(&imgstfile));
+    M_EXIT_IF_ERR_DO_SOMETHING(cache_init(CACHE_DEFAULT_BUDGET, &imgstfile), do_close(&imgstfile));
+    M_EXIT_IF_ERR_DO_SOMETHING(heat_open(imgstore_filename, "rb+", &imgstfile), do_close(&imgstfile));
+
+    // What was hot before the restart, read back before the first command
+    hotset_stats warmed;
+    int ret = hotset_warm(imgstore_filename, &warmed, &imgstfile);
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "cannot warm up: %s\n", ERR_MESSAGES[ret]);
+    } else if (warmed.images > 0) {
+        printf("Warmed up %zu images (%zu bytes) in %zu reads\n",
+               warmed.images, warmed.bytes, warmed.reads);
+    }
+
+    // Stop cleanly on Ctrl-C
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    if (leader_filename != NULL) {
+        printf("Following %s: ", leader_filename);
+    }
+
+    printf("Serving %s on %s%s\n", imgstore_filename, imgstore_filename, IPC_SOCKET_SUFFIX);
+    fflush(stdout);
+
+    ret = leader_filename == NULL ? ipc_serve(imgstore_filename, &s_stop, &imgstfile)
+          : ipc_follow(imgstore_filename, leader_filename, &s_stop, &imgstfile);
+
+    hotset_save(imgstore_filename, &imgstfile);
+    do_close(&imgstfile);
+
+    return ret;
+}
+
+/**
+ * Keeps an imgStore open, with its index, and runs the commands sent by
+ * other imgStoreMgr processes until interrupted.
+ */
+int do_serve_cmd (int args, char* argv[])
+{
+    // Serve needs at least <imgstore_filename>
+    if (args < MIN_SERVE_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    // Get non-null imgstore filename
+    const char* imgstore_filename = argv[1];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+
+    return serve_store(imgstore_filename, NULL);
+}
+
+/**
+ * Keeps a copy of an imgStore in step with the imgStore served by another
+ * imgStoreMgr process, and runs the read-only commands sent to the copy.
+ */
+int do_follow_cmd (int args, char* argv[])
+{
+    // Follow needs at least <imgstore_filename> and <leader_imgstore_filename>
+    if (args < MIN_FOLLOW_ARGS) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    // Get non-null filenames
+    const char* imgstore_filename = argv[1];
+    const char* leader_filename = argv[2];
+    M_REQUIRE_NON_NULL(imgstore_filename);
+    M_REQUIRE_NON_NULL(leader_filename);
+    M_EXIT_IF(!strcmp(imgstore_filename, leader_filename), ERR_INVALID_ARGUMENT,
+              "an imgStore cannot follow itself", );
+
+    return serve_store(imgstore_filename, leader_filename);
+}
+
 /**
  * MAIN
  */
@@ -418,7 +1732,21 @@ int main (int argc, char* argv[])
         {"help", help},
         {"delete", do_delete_cmd},
         {"read", do_read_cmd},
-        {"insert", do_insert_cmd}
+        {"insert", do_insert_cmd},
+        {"changes", do_changes_cmd},
+        {"batch", do_batch_cmd},
+        {"import", do_import_cmd},
+        {"export", do_export_cmd},
+        {"serve", do_serve_cmd},
+        {"follow", do_follow_cmd},
+        {"snapshot", do_snapshot_cmd},
+        {"clone", do_clone_cmd},
+        {"backup", do_backup_cmd},
+        {"restore", do_restore_cmd},
+        {"hot", do_hot_cmd},
+        {"gc", do_gc_cmd},
+        {"reorganize", do_reorganize_cmd},
+        {"similar", do_similar_cmd}
     };
 
 
@@ -453,6 +1781,7 @@ int main (int argc, char* argv[])
         help(argc, argv);
     }
 
+    arena_release(&s_request);
     vips_shutdown();
 
     return ret;
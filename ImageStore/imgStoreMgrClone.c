@@ -46,7 +46,7 @@ int do_list_cmd (const char* filename)
 
     // We cannot list the contents of a file that wasn't correctly opened
     if (err == ERR_NONE) {
-        do_list(&imgstfile);
+        do_list(&imgstfile, STDOUT, 0, 0, NULL, NULL);
     }
 
     // Clean up the file
@@ -0,0 +1,1065 @@
+/**
+ * @file imgStore_server.c
+ * @brief imgStore server: serves an imgStore over HTTP.
+ *
+ * Image Database Server
+ *
+ * @author ???
+ */
+
+#include "util.h" // for atouint32
+#include "imgStore.h"
+#include "imgst_index.h"
+#include "blob_cache.h"
+#include "imgst_heat.h"
+#include "hot_set.h"
+#include "arena.h"
+#include "image_content.h"
+#include "job_queue.h"
+#include "ipc.h"
+#include "error.h"
+#include "mongoose.h"
+
+#include <stdlib.h>
+#include <string.h> // for memcpy and strcmp
+#include <inttypes.h> // for PRIu64
+#include <signal.h> // for signal
+#include <pthread.h>
+#include <vips/vips.h>
+
+// Constants : server
+#define MIN_SERVER_ARGS 2
+#define CACHE_OPTION_ARGS 2 // -cache <MiB>
+#define LISTENING_ADDRESS "http://localhost:8000"
+#define POLL_TIMEOUT_MS 100 // also the latency of change notifications
+
+// Constants : list call
+#define QUERY_VAR_SIZE 16
+#define LIST_SEND_HIGH_WATER (64 * 1024) // stop producing while more is queued
+
+// Constants : changes call
+#define CHANGES_MAX_PER_REPLY 1024
+#define CHANGES_MAX_WAIT_MS 60000
+
+// Constants : admission control
+#define WAKEUP_ADDRESS "udp://127.0.0.1:0"
+#define RETRY_AFTER_HEADER_SIZE 32
+
+// Classes of requests, each with its own limits
+#define OP_META   0 // list, changes and delete: served on the event loop
+#define OP_READ   1 // reads of existing images, whatever their resolution
+#define OP_RESIZE 2 // reads creating a derivative first
+#define OP_INSERT 3
+#define NB_OPS    4
+
+// What a connection is busy with, between two events
+#define CONN_IDLE    0
+#define CONN_LISTING 1
+#define CONN_WAITING 2
+#define CONN_BUSY    3 // waiting for a job
+
+typedef struct conn_state conn_state;
+typedef struct op_limits op_limits;
+typedef struct job job;
+
+/**
+ * Admission limits of a class of requests.
+ */
+struct op_limits {
+    size_t capacity;      // maximum number of waiting requests (OP_META: of streaming replies)
+    size_t workers;       // maximum number of requests served at once (unused for OP_META)
+    unsigned retry_after; // seconds suggested to rejected clients
+};
+
+static const op_limits OP_LIMITS[NB_OPS] = {
+    [OP_META]   = { .capacity = 64, .workers = 0, .retry_after = 1 },
+    [OP_READ]   = { .capacity = 64, .workers = 4, .retry_after = 1 },
+    [OP_RESIZE] = { .capacity = 16, .workers = 2, .retry_after = 2 },
+    [OP_INSERT] = { .capacity = 16, .workers = 1, .retry_after = 2 }
+};
+
+/**
+ * A request served by a worker thread.
+ */
+struct job {
+    job* next;               // linkage in the list of finished jobs
+    int op;                  // OP_READ, OP_RESIZE or OP_INSERT
+    unsigned long conn_id;   // connection to reply to, if still open
+    imgst_file* imgstfile;
+    char img_id[MAX_IMG_ID + 1];
+    int resolution;
+    char* buffer;            // insert: the uploaded image, resize: the image made
+    blob* content;           // read: the image read, shared with the cache
+    size_t size;
+    int vips_owned;          // buffer must be released with g_free, else it is in mem
+    int error;
+    arena mem;               // what the request needs until it is answered
+};
+
+/**
+ * Per-connection state, kept in the connection label.
+ */
+struct conn_state {
+    uint16_t kind;      // CONN_IDLE, CONN_LISTING, CONN_WAITING or CONN_BUSY
+    uint16_t pipelined; // whether requests came meanwhile, refused once the reply ends
+    union {
+        list_stream list; // for CONN_LISTING
+        struct {
+            uint32_t since;         // version the client already knows
+            uint32_t limit;         // maximum number of changes in the reply
+            unsigned long deadline; // mg_millis() value at which to reply anyway
+        } wait; // for CONN_WAITING
+    } u;
+};
+
+// Set by the signal handler to stop the server
+static volatile sig_atomic_t s_signo = 0;
+
+// Serializes the accesses to the imgStore between the event loop and the workers
+static pthread_mutex_t s_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One queue per class of requests served by workers (OP_META is unused)
+static job_queue s_queues[NB_OPS];
+
+// Number of streaming OP_META replies in progress (event loop only)
+static size_t s_meta_inflight = 0;
+
+// Jobs run by the workers, waiting for the event loop to reply
+static pthread_mutex_t s_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static job* s_done = NULL;
+
+// Datagram socket used by the workers to wake up the event loop
+static int s_wakeup_fd = -1;
+static struct sockaddr_in s_wakeup_addr;
+
+// What the thread serving the CLI on the socket of the imgStore needs
+typedef struct {
+    const char* filename;
+    imgst_file* imgstfile;
+} ipc_args;
+
+/**
+ * Records the signal so that the polling loop stops.
+ */
+static void signal_handler(int signo)
+{
+    s_signo = signo;
+}
+
+/**
+ * Replies with the message of an imgStore error code.
+ */
+static void mg_error_msg(struct mg_connection* c, int error)
+{
+    mg_http_reply(c, 500, "", "Error: %s\n", ERR_MESSAGES[error]);
+}
+
+/**
+ * Rejects a request of the given class because its queue is full.
+ */
+static void reply_busy(struct mg_connection* c, int op)
+{
+    char headers[RETRY_AFTER_HEADER_SIZE];
+    snprintf(headers, sizeof(headers), "Retry-After: %u\r\n", OP_LIMITS[op].retry_after);
+    mg_http_reply(c, 503, headers, "Error: %s\n", ERR_MESSAGES[ERR_BUSY]);
+}
+
+/**
+ * Replies with the content of an image.
+ */
+static void reply_image(struct mg_connection* c, const blob* image)
+{
+    mg_printf(c, "HTTP/1.1 200 OK\r\n"
+              "Content-Type: image/jpeg\r\n"
+              "Content-Length: %zu\r\n\r\n", image->size);
+    mg_send(c, image->data, image->size);
+}
+
+/**
+ * Writes do_list output as one HTTP chunk on the connection given as argument.
+ */
+static int chunk_writer(void* arg, const char* data, size_t len)
+{
+    mg_http_write_chunk((struct mg_connection*) arg, data, len);
+    return ERR_NONE;
+}
+
+/**
+ * Parses an optional unsigned query variable. Leaves value untouched if absent.
+ */
+static int get_uint32_var(const struct mg_http_message* hm, const char* name, uint32_t* value)
+{
+    char buf[QUERY_VAR_SIZE];
+
+    if (mg_http_get_var(&hm->query, name, buf, sizeof(buf)) <= 0) {
+        return ERR_NONE;
+    }
+
+    *value = atouint32(buf);
+    M_REQUIRE_NO_ERRNO(ERR_INVALID_ARGUMENT);
+
+    return ERR_NONE;
+}
+
+/**
+ * Loads the state of the connection from its label.
+ */
+static void load_state(const struct mg_connection* c, conn_state* state)
+{
+    memcpy(state, c->label, sizeof(*state));
+}
+
+/**
+ * Stores the state of the connection into its label.
+ */
+static void store_state(struct mg_connection* c, const conn_state* state)
+{
+    memcpy(c->label, state, sizeof(*state));
+}
+
+/**
+ * Changes what the connection is busy with, keeping count of streaming replies.
+ */
+static void set_kind(conn_state* state, uint16_t kind)
+{
+    const int was_streaming = state->kind == CONN_LISTING || state->kind == CONN_WAITING;
+    const int is_streaming = kind == CONN_LISTING || kind == CONN_WAITING;
+
+    if (is_streaming && !was_streaming) {
+        ++s_meta_inflight;
+    } else if (was_streaming && !is_streaming) {
+        --s_meta_inflight;
+    }
+
+    state->kind = kind;
+}
+
+/**
+ * Ends the reply in progress on the connection. Requests pipelined behind it
+ * were not served: the client is told so, and to retry on a new connection,
+ * replies on a connection coming in the order of its requests.
+ */
+static void end_reply(struct mg_connection* c, conn_state* state)
+{
+    set_kind(state, CONN_IDLE);
+
+    if (state->pipelined) {
+        state->pipelined = 0;
+        reply_busy(c, OP_META);
+        c->is_draining = 1;
+    }
+}
+
+/**
+ * Continues a listing in progress on the connection, as long as the client keeps up.
+ *
+ * The listing state lives in the connection label, so a listing never holds
+ * more than LIST_SEND_HIGH_WATER bytes in memory, whatever the store size.
+ */
+static void list_pump(struct mg_connection* c, conn_state* state, const imgst_file* imgstfile)
+{
+    list_stream* stream = &state->u.list;
+
+    while (stream->state != LIST_DONE && c->send.len < LIST_SEND_HIGH_WATER) {
+
+        pthread_mutex_lock(&s_store_lock);
+        const int ret = do_list_step(imgstfile, stream, LIST_STEP_ENTRIES, chunk_writer, c);
+        pthread_mutex_unlock(&s_store_lock);
+
+        // The status line is already sent: all we can do on error is to abort
+        if (ret != ERR_NONE) {
+            c->is_closing = 1;
+            stream->state = LIST_DONE;
+        }
+    }
+
+    // Terminating chunk, and the connection can serve its next request
+    if (stream->state == LIST_DONE) {
+        mg_http_write_chunk(c, "", 0);
+        end_reply(c, state);
+    }
+}
+
+/**
+ * Starts a JSON listing: /imgStore/list[?cursor=<slot>][&limit=<N>]
+ */
+static void handle_list_call(struct mg_connection* c, const struct mg_http_message* hm,
+                             const imgst_file* imgstfile)
+{
+    uint32_t cursor = 0;
+    uint32_t limit = 0;
+
+    if (get_uint32_var(hm, "cursor", &cursor) != ERR_NONE
+        || get_uint32_var(hm, "limit", &limit) != ERR_NONE) {
+        mg_error_msg(c, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    if (s_meta_inflight >= OP_LIMITS[OP_META].capacity) {
+        reply_busy(c, OP_META);
+        return;
+    }
+
+    mg_printf(c, "%s",
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: application/json\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n");
+
+    conn_state state;
+    load_state(c, &state);
+    set_kind(&state, CONN_LISTING);
+    list_stream_init(&state.u.list, cursor, limit);
+
+    // Produce the first bytes right away, the rest as the socket drains
+    list_pump(c, &state, imgstfile);
+    store_state(c, &state);
+}
+
+/**
+ * Sends the changes made after since as a JSON document.
+ */
+static void reply_changes(struct mg_connection* c, uint32_t since, uint32_t limit,
+                          const imgst_file* imgstfile)
+{
+    mg_printf(c, "%s",
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: application/json\r\n"
+              "Cache-Control: no-store\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n");
+
+    pthread_mutex_lock(&s_store_lock);
+    const int ret = do_changes(since, limit, chunk_writer, c, imgstfile);
+    pthread_mutex_unlock(&s_store_lock);
+
+    // The status line is already sent: all we can do on error is to abort
+    if (ret != ERR_NONE) {
+        c->is_closing = 1;
+        return;
+    }
+
+    mg_http_write_chunk(c, "", 0);
+}
+
+/**
+ * Tells whether changes were logged after since.
+ */
+static int has_changes_after(uint32_t since, const imgst_file* imgstfile)
+{
+    uint32_t latest = 0;
+
+    pthread_mutex_lock(&s_store_lock);
+    const int ret = changes_bounds(&latest, NULL, imgstfile);
+    pthread_mutex_unlock(&s_store_lock);
+
+    return ret == ERR_NONE && latest > since;
+}
+
+/**
+ * Sends or waits for changes: /imgStore/changes[?since=<version>][&limit=<N>][&wait=<ms>]
+ *
+ * With wait, the reply is held back until a change is logged (by this process
+ * or any other one writing the imgStore) or the delay expires.
+ */
+static void handle_changes_call(struct mg_connection* c, const struct mg_http_message* hm,
+                                const imgst_file* imgstfile)
+{
+    uint32_t since = 0;
+    uint32_t limit = 0;
+    uint32_t wait = 0;
+
+    if (get_uint32_var(hm, "since", &since) != ERR_NONE
+        || get_uint32_var(hm, "limit", &limit) != ERR_NONE
+        || get_uint32_var(hm, "wait", &wait) != ERR_NONE) {
+        mg_error_msg(c, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    // Keep replies bounded: the client continues from the returned version
+    if (limit == 0 || limit > CHANGES_MAX_PER_REPLY) {
+        limit = CHANGES_MAX_PER_REPLY;
+    }
+
+    if (wait == 0 || has_changes_after(since, imgstfile)) {
+        reply_changes(c, since, limit, imgstfile);
+        return;
+    }
+
+    if (wait > CHANGES_MAX_WAIT_MS) {
+        wait = CHANGES_MAX_WAIT_MS;
+    }
+
+    if (s_meta_inflight >= OP_LIMITS[OP_META].capacity) {
+        reply_busy(c, OP_META);
+        return;
+    }
+
+    conn_state state;
+    load_state(c, &state);
+    set_kind(&state, CONN_WAITING);
+    state.u.wait.since = since;
+    state.u.wait.limit = limit;
+    state.u.wait.deadline = mg_millis() + wait;
+    store_state(c, &state);
+}
+
+/**
+ * Replies to a waiting client once there are changes or its delay expired.
+ */
+static void changes_poll(struct mg_connection* c, conn_state* state, const imgst_file* imgstfile)
+{
+    if (has_changes_after(state->u.wait.since, imgstfile)
+        || mg_millis() >= state->u.wait.deadline) {
+        reply_changes(c, state->u.wait.since, state->u.wait.limit, imgstfile);
+        end_reply(c, state);
+    }
+}
+
+/**
+ * Frees a job and everything it holds.
+ */
+static void free_job(job* j)
+{
+    if (j->vips_owned) {
+        g_free(j->buffer);
+    }
+
+    blob_release(j->content);
+    arena_release(&j->mem);
+    free(j);
+}
+
+/**
+ * Reads an image whose resolution already exists (worker thread).
+ */
+static void run_read(job* j)
+{
+    pthread_mutex_lock(&s_store_lock);
+    j->error = do_read_blob(j->img_id, j->resolution, &j->content, j->imgstfile);
+    pthread_mutex_unlock(&s_store_lock);
+
+    j->size = j->content == NULL ? 0 : j->content->size;
+}
+
+/**
+ * Creates and reads a derivative (worker thread).
+ *
+ * Only reading the original and appending the result hold the imgStore:
+ * decoding and resizing, the expensive part, run concurrently with other requests.
+ */
+static void run_resize(job* j)
+{
+    imgst_file* imgstfile = j->imgstfile;
+    char* original = NULL;
+    uint32_t orig_size = 0;
+    uint16_t max_width = 0;
+    uint16_t max_height = 0;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    size_t idx = 0;
+
+    pthread_mutex_lock(&s_store_lock);
+
+    int ret = findMetadataIndex(&idx, j->img_id, imgstfile);
+
+    if (ret == ERR_NONE && imgstfile->metadata[idx].offset[j->resolution] != INIT_OFFSET) {
+        // Another request created it in the meantime
+        pthread_mutex_unlock(&s_store_lock);
+        run_read(j);
+        return;
+    }
+
+    if (ret == ERR_NONE) {
+        // The original, in the memory of the request
+        const uint32_t size = imgstfile->metadata[idx].size[RES_ORIG];
+        original = arena_alloc(&j->mem, size);
+        ret = original == NULL ? ERR_OUT_OF_MEMORY
+              : do_read_into(j->img_id, RES_ORIG, original, size, &orig_size, imgstfile);
+        max_width = imgstfile->header.res_resized[2 * j->resolution];
+        max_height = imgstfile->header.res_resized[2 * j->resolution + 1];
+        memcpy(sha, imgstfile->metadata[idx].SHA, SHA256_DIGEST_LENGTH);
+    }
+
+    pthread_mutex_unlock(&s_store_lock);
+
+    if (ret != ERR_NONE) {
+        j->error = ret;
+        return;
+    }
+
+    void* resized = NULL;
+    size_t resized_size = 0;
+    ret = resize_image(original, orig_size, max_width, max_height, &resized, &resized_size);
+
+    if (ret != ERR_NONE) {
+        j->error = ret;
+        return;
+    }
+
+    // Store it, unless the image changed or the derivative was stored meanwhile
+    pthread_mutex_lock(&s_store_lock);
+
+    if (findMetadataIndex(&idx, j->img_id, imgstfile) == ERR_NONE
+        && shaCompare(sha, imgstfile->metadata[idx].SHA) == 0
+        && imgstfile->metadata[idx].offset[j->resolution] == INIT_OFFSET) {
+        ret = store_resized(j->resolution, imgstfile, idx, resized, resized_size);
+    }
+
+    pthread_mutex_unlock(&s_store_lock);
+
+    j->buffer = resized;
+    j->size = resized_size;
+    j->vips_owned = 1;
+    j->error = ret;
+}
+
+/**
+ * Inserts an uploaded image (worker thread).
+ */
+static void run_insert(job* j)
+{
+    // Hashing and decoding only read the upload: the store waits for none of it
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[DIMS];
+    j->error = prepare_insert(j->buffer, j->size, sha, res_orig);
+
+    if (j->error == ERR_NONE) {
+        pthread_mutex_lock(&s_store_lock);
+        j->error = do_insert_prepared(j->buffer, j->size, j->img_id, sha, res_orig, j->imgstfile);
+        pthread_mutex_unlock(&s_store_lock);
+    }
+
+    // The upload is no longer needed
+    arena_reset(&j->mem);
+    j->buffer = NULL;
+    j->size = 0;
+}
+
+/**
+ * Runs a job of any class (worker thread).
+ */
+static void run_job(void* arg)
+{
+    job* j = arg;
+
+    if (j->op == OP_READ) {
+        run_read(j);
+    } else if (j->op == OP_RESIZE) {
+        run_resize(j);
+    } else if (j->op == OP_INSERT) {
+        run_insert(j);
+    } else {
+        j->error = ERR_INVALID_COMMAND;
+    }
+}
+
+/**
+ * Hands a run job over to the event loop, and wakes it up (worker thread).
+ */
+static void job_done(void* arg)
+{
+    job* j = arg;
+
+    pthread_mutex_lock(&s_done_lock);
+    j->next = s_done;
+    s_done = j;
+    pthread_mutex_unlock(&s_done_lock);
+
+    const char wakeup = 0;
+    sendto(s_wakeup_fd, &wakeup, sizeof(wakeup), 0,
+           (const struct sockaddr*) &s_wakeup_addr, sizeof(s_wakeup_addr));
+}
+
+/**
+ * Finds an open connection by its ID.
+ */
+static struct mg_connection* find_connection(struct mg_mgr* mgr, unsigned long id)
+{
+    for (struct mg_connection* c = mgr->conns; c != NULL; c = c->next) {
+        if (c->id == id) {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Replies to the requests whose jobs were run (event loop).
+ */
+static void finish_jobs(struct mg_mgr* mgr)
+{
+    pthread_mutex_lock(&s_done_lock);
+    job* j = s_done;
+    s_done = NULL;
+    pthread_mutex_unlock(&s_done_lock);
+
+    while (j != NULL) {
+        job* next = j->next;
+        struct mg_connection* c = find_connection(mgr, j->conn_id);
+
+        // The client may have gone away in the meantime
+        if (c != NULL) {
+            if (j->error != ERR_NONE) {
+                mg_error_msg(c, j->error);
+
+            } else if (j->op == OP_INSERT) {
+                mg_http_reply(c, 200, "", "%s", "");
+
+            } else if (j->content != NULL) {
+                reply_image(c, j->content);
+
+            } else {
+                mg_printf(c, "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: image/jpeg\r\n"
+                          "Content-Length: %zu\r\n\r\n", j->size);
+                mg_send(c, j->buffer, j->size);
+            }
+
+            conn_state state;
+            load_state(c, &state);
+            end_reply(c, &state);
+            store_state(c, &state);
+        }
+
+        free_job(j);
+        j = next;
+    }
+}
+
+/**
+ * Queues a job for its class, or rejects the request if the queue is full.
+ */
+static void submit_job(struct mg_connection* c, job* j)
+{
+    j->conn_id = c->id;
+
+    if (job_queue_submit(&s_queues[j->op], j) != ERR_NONE) {
+        reply_busy(c, j->op);
+        free_job(j);
+        return;
+    }
+
+    conn_state state;
+    load_state(c, &state);
+    set_kind(&state, CONN_BUSY);
+    store_state(c, &state);
+}
+
+/**
+ * Allocates a job for an image of the request.
+ */
+static job* new_job(int op, const char* img_id, int resolution, imgst_file* imgstfile)
+{
+    job* j = calloc(1, sizeof(job));
+
+    if (j != NULL) {
+        j->op = op;
+        j->imgstfile = imgstfile;
+        j->resolution = resolution;
+        strncpy(j->img_id, img_id, MAX_IMG_ID);
+    }
+
+    return j;
+}
+
+/**
+ * Reads an image: /imgStore/read?res=<resolution>&img_id=<imgID>
+ *
+ * Cached images are sent right away, from the event loop. Otherwise, reads
+ * needing a new derivative are admitted as OP_RESIZE, the others as OP_READ.
+ */
+static void handle_read_call(struct mg_connection* c, const struct mg_http_message* hm,
+                             imgst_file* imgstfile)
+{
+    char img_id[MAX_IMG_ID + 1];
+    char res[QUERY_VAR_SIZE];
+
+    if (mg_http_get_var(&hm->query, "img_id", img_id, sizeof(img_id)) <= 0
+        || mg_http_get_var(&hm->query, "res", res, sizeof(res)) <= 0) {
+        mg_error_msg(c, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    const int resolution = resolution_atoi(res);
+
+    if (resolution == NOT_RES) {
+        mg_error_msg(c, ERR_RESOLUTIONS);
+        return;
+    }
+
+    // Classify the request: a lookup in memory only
+    size_t idx = 0;
+
+    pthread_mutex_lock(&s_store_lock);
+    const int ret = findMetadataIndex(&idx, img_id, imgstfile);
+    const uint64_t offset = ret == ERR_NONE ? imgstfile->metadata[idx].offset[resolution] : INIT_OFFSET;
+    const int op = (ret == ERR_NONE && offset == INIT_OFFSET) ? OP_RESIZE : OP_READ;
+
+    if (ret == ERR_NONE) {
+        heat_touch(idx, imgstfile);
+    }
+
+    pthread_mutex_unlock(&s_store_lock);
+
+    if (ret != ERR_NONE) {
+        mg_error_msg(c, ret);
+        return;
+    }
+
+    // A hot image needs neither a worker nor the imgStore
+    blob* cached = op == OP_READ ? cache_get(imgstfile->cache, idx, resolution, offset) : NULL;
+
+    if (cached != NULL) {
+        reply_image(c, cached);
+        blob_release(cached);
+        return;
+    }
+
+    job* j = new_job(op, img_id, resolution, imgstfile);
+
+    if (j == NULL) {
+        mg_error_msg(c, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    submit_job(c, j);
+}
+
+/**
+ * Inserts the image sent as body: POST /imgStore/insert?name=<imgID>
+ */
+static void handle_insert_call(struct mg_connection* c, const struct mg_http_message* hm,
+                               imgst_file* imgstfile)
+{
+    char img_id[MAX_IMG_ID + 1];
+
+    if (mg_http_get_var(&hm->query, "name", img_id, sizeof(img_id)) <= 0 || hm->body.len == 0) {
+        mg_error_msg(c, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    job* j = new_job(OP_INSERT, img_id, RES_ORIG, imgstfile);
+
+    if (j == NULL || (j->buffer = arena_alloc(&j->mem, hm->body.len)) == NULL) {
+        free(j);
+        mg_error_msg(c, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    // The request is gone once the event returns: keep a copy of the body
+    memcpy(j->buffer, hm->body.ptr, hm->body.len);
+    j->size = hm->body.len;
+
+    submit_job(c, j);
+}
+
+/**
+ * Deletes an image: /imgStore/delete?img_id=<imgID>
+ */
+static void handle_delete_call(struct mg_connection* c, const struct mg_http_message* hm,
+                               imgst_file* imgstfile)
+{
+    char img_id[MAX_IMG_ID + 1];
+
+    if (mg_http_get_var(&hm->query, "img_id", img_id, sizeof(img_id)) <= 0) {
+        mg_error_msg(c, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    // Only rewrites one metadata record and the header: cheap enough for the event loop
+    pthread_mutex_lock(&s_store_lock);
+    const int ret = do_delete(img_id, imgstfile);
+    pthread_mutex_unlock(&s_store_lock);
+
+    if (ret != ERR_NONE) {
+        mg_error_msg(c, ret);
+        return;
+    }
+
+    mg_http_reply(c, 200, "", "%s", "");
+}
+
+/**
+ * Reports the counters of the cache: /imgStore/stats
+ */
+static void handle_stats_call(struct mg_connection* c, imgst_file* imgstfile)
+{
+    blob_cache_stats stats;
+    cache_stats(imgstfile->cache, &stats);
+
+    const uint64_t lookups = stats.hits + stats.misses;
+
+    mg_http_reply(c, 200, "Content-Type: application/json\r\nCache-Control: no-store\r\n",
+                  "{\"cache\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+                  ",\"hit_rate\":%.4f,\"evictions\":%" PRIu64
+                  ",\"entries\":%zu,\"bytes\":%zu,\"budget\":%zu}}\n",
+                  stats.hits, stats.misses, lookups == 0 ? 0.0 : (double) stats.hits / (double) lookups,
+                  stats.evictions, stats.entries, stats.bytes, stats.budget);
+}
+
+/**
+ * Drains the wake-up datagrams sent by the workers.
+ */
+static void wakeup_handler(struct mg_connection* c, int ev, void* ev_data _unused, void* fn_data _unused)
+{
+    if (ev == MG_EV_READ) {
+        c->recv.len = 0;
+    }
+}
+
+/**
+ * Starts the wake-up socket and the worker threads.
+ */
+static int start_workers(struct mg_mgr* mgr)
+{
+    struct mg_connection* wakeup = mg_listen(mgr, WAKEUP_ADDRESS, wakeup_handler, NULL);
+    M_EXIT_IF(wakeup == NULL, ERR_IO, "cannot listen on %s", WAKEUP_ADDRESS);
+
+    // The workers send to the port the system picked
+    socklen_t len = sizeof(s_wakeup_addr);
+
+    if (getsockname((int) (size_t) wakeup->fd, (struct sockaddr*) &s_wakeup_addr, &len) != 0
+        || (s_wakeup_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return ERR_IO;
+    }
+
+    for (int op = OP_META + 1; op < NB_OPS; ++op) {
+        M_EXIT_IF_ERR(job_queue_init(&s_queues[op], OP_LIMITS[op].capacity,
+                                     OP_LIMITS[op].workers, run_job, job_done));
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Stops the worker threads, once they ran the jobs still queued.
+ */
+static void stop_workers(struct mg_mgr* mgr)
+{
+    for (int op = OP_META + 1; op < NB_OPS; ++op) {
+        job_queue_free(&s_queues[op]);
+    }
+
+    finish_jobs(mgr);
+
+    if (s_wakeup_fd >= 0) {
+        close(s_wakeup_fd);
+        s_wakeup_fd = -1;
+    }
+}
+
+/**
+ * Serves the CLI on the socket of the imgStore until the server stops. Its
+ * requests take the store lock in turn with the workers: a snapshot or a
+ * clone thus sees no write under way.
+ */
+static void* ipc_main(void* arg)
+{
+    const ipc_args* args = arg;
+
+    const int ret = ipc_serve_shared(args->filename, &s_signo, &s_store_lock, args->imgstfile);
+
+    // The CLI then finds the imgStore locked, and only reads it
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "cannot serve %s.sock: %s\n", args->filename, ERR_MESSAGES[ret]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Dispatches HTTP requests and drives listings in progress.
+ */
+static void imgst_event_handler(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    imgst_file* imgstfile = fn_data;
+
+    if (ev == MG_EV_HTTP_MSG) {
+        struct mg_http_message* hm = (struct mg_http_message*) ev_data;
+        conn_state state;
+        load_state(c, &state);
+
+        // A reply is still in progress: this one would be mixed with it
+        if (state.kind != CONN_IDLE) {
+            state.pipelined = 1;
+            store_state(c, &state);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/list")) {
+            handle_list_call(c, hm, imgstfile);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/changes")) {
+            handle_changes_call(c, hm, imgstfile);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/read")) {
+            handle_read_call(c, hm, imgstfile);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/insert")) {
+            handle_insert_call(c, hm, imgstfile);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/delete")) {
+            handle_delete_call(c, hm, imgstfile);
+
+        } else if (mg_http_match_uri(hm, "/imgStore/stats")) {
+            handle_stats_call(c, imgstfile);
+
+        } else {
+            mg_http_reply(c, 404, "", "%s", "Not found\n");
+        }
+
+    } else if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+        conn_state state;
+        load_state(c, &state);
+
+        if (state.kind == CONN_LISTING) {
+            list_pump(c, &state, imgstfile);
+            store_state(c, &state);
+
+        } else if (state.kind == CONN_WAITING && ev == MG_EV_POLL) {
+            changes_poll(c, &state, imgstfile);
+            store_state(c, &state);
+        }
+
+    } else if (ev == MG_EV_CLOSE) {
+        conn_state state;
+        load_state(c, &state);
+        set_kind(&state, CONN_IDLE);
+    }
+}
+
+/**
+ * MAIN
+ */
+int main (int argc, char* argv[])
+{
+    // The server needs the imgStore filename
+    if (argc < MIN_SERVER_ARGS) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ERR_NOT_ENOUGH_ARGUMENTS]);
+        fprintf(stderr, "usage: imgStore_server <imgstore_filename> [-cache <MiB>]\n");
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    // Hot images are served from memory, within a budget (0 for none)
+    size_t cache_budget = CACHE_DEFAULT_BUDGET;
+
+    if (argc >= MIN_SERVER_ARGS + CACHE_OPTION_ARGS && !strcmp(argv[MIN_SERVER_ARGS], "-cache")) {
+        cache_budget = (size_t) atouint32(argv[MIN_SERVER_ARGS + 1]) << 20;
+    }
+
+    // The connection label must be able to hold the connection state
+    _Static_assert(sizeof(conn_state) <= sizeof(((struct mg_connection*) NULL)->label),
+                   "conn_state does not fit in a connection label");
+
+    // VIPS_INIT
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+    }
+
+    // Open the imgStore once, for the whole life of the server
+    imgst_file imgstfile;
+    int ret = do_open(argv[1], "rb+", &imgstfile);
+
+    // Held until the end: the CLI does not copy, collect or write it meanwhile
+    if (ret == ERR_NONE) {
+        ret = do_lock(&imgstfile, 1);
+
+        if (ret != ERR_NONE) {
+            do_close(&imgstfile);
+        }
+    }
+
+    // Look images up by index rather than by scanning, for every request
+    if (ret == ERR_NONE) {
+        ret = index_build(&imgstfile);
+
+        if (ret == ERR_NONE) {
+            ret = cache_init(cache_budget, &imgstfile);
+        }
+
+        // Count the reads, on top of those counted by the previous runs
+        if (ret == ERR_NONE) {
+            ret = heat_open(argv[1], "rb+", &imgstfile);
+        }
+
+        if (ret != ERR_NONE) {
+            do_close(&imgstfile);
+        }
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ret]);
+        vips_shutdown();
+        return ret;
+    }
+
+    print_header(&imgstfile.header);
+
+    // What was hot before the restart, read back before the first request
+    hotset_stats warmed;
+    ret = hotset_warm(argv[1], &warmed, &imgstfile);
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "cannot warm up: %s\n", ERR_MESSAGES[ret]);
+    } else if (warmed.images > 0) {
+        printf("Warmed up %zu images (%zu bytes) in %zu reads\n",
+               warmed.images, warmed.bytes, warmed.reads);
+    }
+
+    // Stop cleanly on Ctrl-C
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
+
+    ret = start_workers(&mgr);
+
+    if (ret == ERR_NONE
+        && mg_http_listen(&mgr, LISTENING_ADDRESS, imgst_event_handler, &imgstfile) == NULL) {
+        ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: cannot listen on %s\n", LISTENING_ADDRESS);
+        stop_workers(&mgr);
+        mg_mgr_free(&mgr);
+        do_close(&imgstfile);
+        vips_shutdown();
+        return ret;
+    }
+
+    printf("Starting imgStore server on %s\n", LISTENING_ADDRESS);
+
+    // The CLI commands run through the server rather than around it
+    ipc_args ipc = { argv[1], &imgstfile };
+    pthread_t ipc_thread;
+    const int ipc_started = pthread_create(&ipc_thread, NULL, ipc_main, &ipc) == 0;
+
+    unsigned long last_flush = mg_millis();
+
+    while (s_signo == 0) {
+        mg_mgr_poll(&mgr, POLL_TIMEOUT_MS);
+
+        // Reply to the requests served by the workers meanwhile
+        finish_jobs(&mgr);
+
+        // A crash loses at most this much of the access statistics and hot set
+        if (mg_millis() - last_flush >= HEAT_FLUSH_SECONDS * 1000) {
+            pthread_mutex_lock(&s_store_lock);
+            heat_flush(&imgstfile);
+            hotset_save(argv[1], &imgstfile);
+            pthread_mutex_unlock(&s_store_lock);
+            last_flush = mg_millis();
+        }
+    }
+
+    if (ipc_started) {
+        pthread_join(ipc_thread, NULL);
+    }
+
+    stop_workers(&mgr);
+    mg_mgr_free(&mgr);
+    hotset_save(argv[1], &imgstfile);
+    do_close(&imgstfile);
+    vips_shutdown();
+
+    return ERR_NONE;
+}
@@ -0,0 +1,528 @@
+/**
+ * @file imgst_backup.c
+ * @brief imgStore library: incremental backup and restore.
+ *
+ * Images are only ever appended to an imgStore file, so what changed since
+ * a backup is its tail, the metadata records of the slots in the change log,
+ * and the change log itself. A backup file holds:
+ *
+ *   backup_header | nb_slots slot numbers | nb_slots img_metadata |
+ *   nb_changes imgst_change | bytes [base_end, end) of the imgStore file
+ *
+ * A full backup is a backup since the empty imgStore of the same geometry.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno, ftruncate, posix_fadvise
+
+#include "imgStore.h"
+#include "imgst_index.h"
+#include "blob_cache.h"
+
+#include <stdlib.h>
+#include <string.h>    // for memcmp, memcpy
+#include <unistd.h>    // for ftruncate
+#include <fcntl.h>     // for posix_fadvise
+#include <sys/stat.h>  // for fstat
+
+#define BACKUP_MAGIC "IMGSTBK1"
+#define BACKUP_MAGIC_LEN 8
+#define BACKUP_CHUNK_SIZE (1 << 20)
+#define BACKUP_CHANGES_BATCH 256
+#define MAX_BACKUP_CHANGES (1u << 26) // change records a streamed backup may announce
+
+typedef struct backup_header backup_header;
+
+/**
+ * Header of a backup file.
+ */
+struct backup_header {
+    char magic[BACKUP_MAGIC_LEN];
+    uint32_t base_version;   // imgst_version the backup applies to, 0 for a full backup
+    uint32_t version;        // imgst_version once applied
+    uint64_t base_end;       // size of the imgStore file it applies to
+    uint64_t end;            // size of the imgStore file once applied
+    uint32_t nb_slots;       // metadata records in the backup
+    uint32_t nb_changes;     // change log records in the backup
+    imgst_header header;     // imgStore header once applied
+};
+
+/**
+ * Offset of the first image of an imgStore, right after its metadata.
+ */
+static uint64_t data_start(const imgst_header* header)
+{
+    return sizeof(imgst_header) + (uint64_t) header->max_files * sizeof(img_metadata);
+}
+
+/**
+ * Gives the size of an open file, buffered writes included.
+ */
+static int file_size(FILE* file, uint64_t* size)
+{
+    // Seeking flushes what is buffered
+    if (fseek(file, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+
+    const long end = ftell(file);
+    M_EXIT_IF(end < 0, ERR_IO, "cannot get the imgStore size", );
+
+    *size = (uint64_t) end;
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies len bytes from a stream to another.
+ */
+static int copy_bytes(FILE* from, FILE* to, uint64_t len)
+{
+    char* buffer = malloc(BACKUP_CHUNK_SIZE);
+    M_EXIT_IF_NULL(buffer, (size_t) BACKUP_CHUNK_SIZE);
+
+    int ret = ERR_NONE;
+
+    while (len > 0 && ret == ERR_NONE) {
+        const size_t chunk = len < BACKUP_CHUNK_SIZE ? (size_t) len : BACKUP_CHUNK_SIZE;
+
+        if (fread(buffer, 1, chunk, from) != chunk || fwrite(buffer, 1, chunk, to) != chunk) {
+            ret = ERR_IO;
+        }
+
+        len -= chunk;
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+/**
+ * Reads all the logged changes made after since.
+ */
+static int read_all_changes(uint32_t since, imgst_change** changes, size_t* count,
+                            const imgst_file* imgstfile)
+{
+    size_t capacity = BACKUP_CHANGES_BATCH;
+    imgst_change* all = malloc(capacity * sizeof(imgst_change));
+    M_EXIT_IF_NULL(all, capacity * sizeof(imgst_change));
+
+    *count = 0;
+
+    while (1) {
+        if (capacity - *count < BACKUP_CHANGES_BATCH) {
+            imgst_change* bigger = realloc(all, 2 * capacity * sizeof(imgst_change));
+
+            if (bigger == NULL) {
+                free(all);
+                return ERR_OUT_OF_MEMORY;
+            }
+
+            all = bigger;
+            capacity *= 2;
+        }
+
+        size_t nb_read = 0;
+        M_EXIT_IF_ERR_DO_SOMETHING(read_changes(since, all + *count, BACKUP_CHANGES_BATCH,
+                                                &nb_read, imgstfile), free(all));
+
+        if (nb_read == 0) {
+            break;
+        }
+
+        *count += nb_read;
+        since = all[*count - 1].version;
+    }
+
+    *changes = all;
+
+    return ERR_NONE;
+}
+
+/**
+ * Picks the slots whose metadata goes in a backup. Returns their number.
+ */
+static uint32_t pick_slots(const backup_header* bh, const imgst_change* changes,
+                           size_t nb_changes, uint32_t* slots, const imgst_file* imgstfile)
+{
+    const uint32_t max_files = imgstfile->header.max_files;
+
+    // Every version since the base is in the log, one change each, none
+    // missing (log_change may fail once the metadata is written): the slots
+    // it names are enough
+    int logged = nb_changes == (size_t) (bh->version - bh->base_version);
+
+    for (size_t i = 0; logged && i < nb_changes; ++i) {
+        logged = changes[i].version == bh->base_version + 1 + i;
+    }
+
+    uint32_t nb_slots = 0;
+
+    if (!logged) {
+        // Otherwise all of them, but the empty ones of a full backup
+        for (uint32_t i = 0; i < max_files; ++i) {
+            if (bh->base_version > 0 || imgstfile->metadata[i].is_valid == NON_EMPTY) {
+                slots[nb_slots++] = i;
+            }
+        }
+
+        return nb_slots;
+    }
+
+    // Each slot once, in order (slots is used as a bitmap first)
+    memset(slots, 0, max_files * sizeof(uint32_t));
+
+    for (size_t i = 0; i < nb_changes; ++i) {
+        if (changes[i].slot < max_files) {
+            slots[changes[i].slot] = 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (slots[i]) {
+            slots[nb_slots++] = i;
+        }
+    }
+
+    return nb_slots;
+}
+
+/**
+ * Writes the backup file, all but the images.
+ */
+static int write_backup_head(FILE* out, const backup_header* bh, const uint32_t* slots,
+                             const imgst_change* changes, const imgst_file* imgstfile)
+{
+    M_EXIT_IF(fwrite(bh, sizeof(*bh), 1, out) != 1
+              || fwrite(slots, sizeof(uint32_t), bh->nb_slots, out) != bh->nb_slots,
+              ERR_IO, "cannot write backup", );
+
+    for (uint32_t i = 0; i < bh->nb_slots; ++i) {
+        M_EXIT_IF(fwrite(&imgstfile->metadata[slots[i]], sizeof(img_metadata), 1, out) != 1,
+                  ERR_IO, "cannot write backup", );
+    }
+
+    M_EXIT_IF(fwrite(changes, sizeof(imgst_change), bh->nb_changes, out) != bh->nb_changes,
+              ERR_IO, "cannot write backup", );
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads and checks the header of a backup file.
+ */
+static int read_backup_header(FILE* in, backup_header* bh)
+{
+    M_EXIT_IF(fread(bh, sizeof(*bh), 1, in) != 1, ERR_IO, "cannot read backup", );
+    M_EXIT_IF(memcmp(bh->magic, BACKUP_MAGIC, BACKUP_MAGIC_LEN) != 0
+              || bh->version < bh->base_version || bh->end < bh->base_end
+              || bh->base_end < data_start(&bh->header)
+              || bh->nb_slots > bh->header.max_files
+              || bh->nb_changes > MAX_BACKUP_CHANGES,
+              ERR_INVALID_ARGUMENT, "not an imgStore backup", );
+
+    // A backup file must hold all that its header announces (a stream tells on reading)
+    struct stat st;
+    const long at = ftell(in);
+
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && at >= 0) {
+        const uint64_t announced = (uint64_t) bh->nb_slots * (sizeof(uint32_t) + sizeof(img_metadata))
+                                   + (uint64_t) bh->nb_changes * sizeof(imgst_change)
+                                   + (bh->end - bh->base_end);
+
+        M_EXIT_IF(announced > (uint64_t) st.st_size - (uint64_t) at,
+                  ERR_INVALID_ARGUMENT, "backup shorter than its header", );
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Fills what a backup holds from its header.
+ */
+static void fill_stats(const backup_header* bh, backup_stats* stats)
+{
+    if (stats != NULL) {
+        stats->base_version = bh->base_version;
+        stats->version = bh->version;
+        stats->nb_slots = bh->nb_slots;
+        stats->nb_changes = bh->nb_changes;
+        stats->bytes = bh->end - bh->base_end;
+    }
+}
+
+/**
+ * Writes what changed in an open imgStore since a base version to a stream.
+ */
+int backup_write(FILE* out, uint32_t base_version, uint64_t base_end, backup_stats* stats,
+                 imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    backup_header bh;
+    memset(&bh, 0, sizeof(bh));
+    memcpy(bh.magic, BACKUP_MAGIC, BACKUP_MAGIC_LEN);
+    bh.header = imgstfile->header;
+    bh.version = imgstfile->header.imgst_version;
+    bh.base_version = base_version;
+    bh.base_end = base_end == 0 ? data_start(&imgstfile->header) : base_end;
+    M_EXIT_IF_ERR(file_size(imgstfile->file, &bh.end));
+
+    // Only appends since: otherwise, a full backup is needed
+    M_EXIT_IF(base_version > bh.version || bh.base_end > bh.end
+              || bh.base_end < data_start(&imgstfile->header),
+              ERR_INVALID_ARGUMENT, "imgStore rewritten since the base", );
+
+    imgst_change* changes = NULL;
+    size_t nb_changes = 0;
+    M_EXIT_IF_ERR(read_all_changes(bh.base_version, &changes, &nb_changes, imgstfile));
+
+    uint32_t* slots = calloc(imgstfile->header.max_files + 1, sizeof(uint32_t));
+
+    if (slots == NULL) {
+        free(changes);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    bh.nb_slots = pick_slots(&bh, changes, nb_changes, slots, imgstfile);
+    bh.nb_changes = (uint32_t) nb_changes;
+
+    int ret = write_backup_head(out, &bh, slots, changes, imgstfile);
+
+    free(slots);
+    free(changes);
+
+    // The images appended since, in one sweep the kernel may read well ahead of
+    if (ret == ERR_NONE) {
+        posix_fadvise(fileno(imgstfile->file), (off_t) bh.base_end, (off_t) (bh.end - bh.base_end),
+                      POSIX_FADV_SEQUENTIAL);
+        ret = fseek(imgstfile->file, (long) bh.base_end, SEEK_SET) != 0 ? ERR_IO
+              : copy_bytes(imgstfile->file, out, bh.end - bh.base_end);
+    }
+
+    if (ret == ERR_NONE) {
+        fill_stats(&bh, stats);
+    }
+
+    return ret;
+}
+
+/**
+ * Backs an imgStore up, fully or since a previous backup.
+ */
+int do_backup(const char* target, const char* previous, backup_stats* stats,
+              imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(target);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    uint32_t base_version = 0;
+    uint64_t base_end = 0;
+
+    // An incremental backup starts where the previous one ended
+    if (previous != NULL) {
+        FILE* in = fopen(previous, "rb");
+        M_EXIT_IF(in == NULL, ERR_IO, "cannot open previous backup", );
+
+        backup_header prev;
+        const int ret = read_backup_header(in, &prev);
+        fclose(in);
+        M_EXIT_IF_ERR(ret);
+
+        M_EXIT_IF(prev.header.max_files != imgstfile->header.max_files
+                  || prev.header.generation != imgstfile->header.generation,
+                  ERR_INVALID_ARGUMENT, "imgStore rewritten since the previous backup", );
+
+        base_version = prev.version;
+        base_end = prev.end;
+    }
+
+    // Never overwrite a backup
+    FILE* out = fopen(target, "wbx");
+    M_EXIT_IF(out == NULL, ERR_IO, "cannot create backup", );
+
+    int ret = backup_write(out, base_version, base_end, stats, imgstfile);
+
+    if (fclose(out) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE) {
+        remove(target);
+    }
+
+    return ret;
+}
+
+/**
+ * Applies an opened backup to an open imgStore at its base version.
+ */
+static int apply_backup(FILE* in, const backup_header* bh, imgst_file* imgstfile)
+{
+    M_EXIT_IF(imgstfile->header.max_files != bh->header.max_files
+              || imgstfile->header.imgst_version != bh->base_version,
+              ERR_INVALID_ARGUMENT, "backup does not follow the imgStore version", );
+
+    // Contents moved since the base: its offsets no longer apply
+    M_EXIT_IF(bh->base_version != 0 && imgstfile->header.generation != bh->header.generation,
+              ERR_INVALID_ARGUMENT, "imgStore garbage collected since the backup base", );
+
+    // What an interrupted restore (or a failed insert) left after the base goes
+    uint64_t size = 0;
+    M_EXIT_IF_ERR(file_size(imgstfile->file, &size));
+    M_EXIT_IF(size < bh->base_end, ERR_INVALID_ARGUMENT, "imgStore shorter than the backup base", );
+
+    if (size > bh->base_end) {
+        M_EXIT_IF(ftruncate(fileno(imgstfile->file), (off_t) bh->base_end) != 0,
+                  ERR_IO, "cannot truncate imgStore", );
+    }
+
+    uint32_t* slots = malloc(((size_t) bh->nb_slots + 1) * sizeof(uint32_t));
+    imgst_change* changes = malloc(((size_t) bh->nb_changes + 1) * sizeof(imgst_change));
+
+    int ret = slots == NULL || changes == NULL ? ERR_OUT_OF_MEMORY
+              : fread(slots, sizeof(uint32_t), bh->nb_slots, in) == bh->nb_slots ? ERR_NONE : ERR_IO;
+
+    for (uint32_t i = 0; i < bh->nb_slots && ret == ERR_NONE; ++i) {
+        if (slots[i] >= bh->header.max_files) {
+            ret = ERR_IO;
+            break;
+        }
+
+        // A served imgStore keeps its index and cache in step with the records
+        if (imgstfile->metadata[slots[i]].is_valid == NON_EMPTY) {
+            index_remove(slots[i], imgstfile);
+        }
+
+        cache_forget(slots[i], imgstfile);
+
+        if (fread(&imgstfile->metadata[slots[i]], sizeof(img_metadata), 1, in) != 1) {
+            imgstfile->metadata[slots[i]].is_valid = EMPTY;
+            ret = ERR_IO;
+
+        } else if (imgstfile->metadata[slots[i]].is_valid == NON_EMPTY) {
+            ret = index_add(slots[i], imgstfile);
+        }
+    }
+
+    if (ret == ERR_NONE
+        && fread(changes, sizeof(imgst_change), bh->nb_changes, in) != bh->nb_changes) {
+        ret = ERR_IO;
+    }
+
+    // Images, metadata and log, then the header last: until then, the base version stays
+    if (ret == ERR_NONE) {
+        ret = fseek(imgstfile->file, (long) bh->base_end, SEEK_SET) != 0 ? ERR_IO
+              : copy_bytes(in, imgstfile->file, bh->end - bh->base_end);
+    }
+
+    for (uint32_t i = 0; i < bh->nb_slots && ret == ERR_NONE; ++i) {
+        ret = updateMetadata(slots[i], imgstfile);
+    }
+
+    // Without the changes an interrupted restore already logged
+    uint32_t logged = 0;
+
+    if (ret == ERR_NONE) {
+        ret = changes_bounds(&logged, NULL, imgstfile);
+    }
+
+    for (uint32_t i = 0; i < bh->nb_changes && ret == ERR_NONE && imgstfile->changes != NULL; ++i) {
+        if (changes[i].version > logged
+            && fwrite(&changes[i], sizeof(imgst_change), 1, imgstfile->changes) != 1) {
+            ret = ERR_IO;
+        }
+    }
+
+    if (ret == ERR_NONE && imgstfile->changes != NULL && fflush(imgstfile->changes) != 0) {
+        ret = ERR_IO;
+    }
+
+    free(slots);
+    free(changes);
+
+    if (ret == ERR_NONE) {
+        imgstfile->header = bh->header;
+        ret = updateHeader(imgstfile);
+    }
+
+    return ret;
+}
+
+/**
+ * Applies a backup read from a stream to an open imgStore.
+ */
+int backup_apply(FILE* in, backup_stats* stats, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    backup_header bh;
+    M_EXIT_IF_ERR(read_backup_header(in, &bh));
+    M_EXIT_IF_ERR(apply_backup(in, &bh, imgstfile));
+
+    fill_stats(&bh, stats);
+
+    return ERR_NONE;
+}
+
+/**
+ * Restores a backup onto an imgStore.
+ */
+int do_restore(const char* imgst_filename, const char* backup, backup_stats* stats)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(backup);
+    M_REQUIRE_NON_NULL(stats);
+
+    FILE* in = fopen(backup, "rb");
+    M_EXIT_IF(in == NULL, ERR_IO, "cannot open backup", );
+
+    backup_header bh;
+    M_EXIT_IF_ERR_DO_SOMETHING(read_backup_header(in, &bh), fclose(in));
+
+    // A full backup may start from nothing: the empty imgStore of its geometry
+    imgst_file imgstfile;
+    FILE* existing = fopen(imgst_filename, "rb");
+    int ret = ERR_NONE;
+
+    if (existing != NULL) {
+        fclose(existing);
+        ret = do_open(imgst_filename, "rb+", &imgstfile);
+
+    } else if (bh.base_version == 0) {
+        memset(&imgstfile, 0, sizeof(imgstfile));
+        imgstfile.header = bh.header;
+        ret = do_create(imgst_filename, &imgstfile);
+
+        if (ret != ERR_NONE) {
+            do_close(&imgstfile);
+        }
+
+    } else {
+        ret = ERR_FILE_NOT_FOUND;
+    }
+
+    if (ret == ERR_NONE) {
+        ret = apply_backup(in, &bh, &imgstfile);
+        do_close(&imgstfile);
+    }
+
+    fclose(in);
+
+    if (ret == ERR_NONE) {
+        fill_stats(&bh, stats);
+    }
+
+    return ret;
+}
@@ -0,0 +1,315 @@
+/**
+ * @file imgst_changes.c
+ * @brief imgStore library: change log of the mutations of an imgStore.
+ *
+ * Every insert, delete and new derivative appends a fixed-size imgst_change
+ * record to a side file, tagged with the imgst_version it produced. Versions
+ * only grow, so the changes after a given version are found by binary search.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+#include "json_writer.h"
+
+#include "util.h" // for zero_init_var
+
+#include <stdlib.h> // for malloc
+#include <inttypes.h> // for PRIu32
+
+// Number of records read at once by do_changes
+#define CHANGES_BATCH 64
+
+/**
+ * Opens the change log of an imgStore file.
+ */
+int open_changes(const char* imgst_filename, const char* open_mode, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(open_mode);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    imgstfile->changes = NULL;
+
+    // Log mode corresponding to the imgStore mode
+    const char* log_mode = NULL;
+
+    if (!strcmp(open_mode, "rb")) {
+        log_mode = "rb";
+
+    } else if (!strcmp(open_mode, "rb+")) {
+        log_mode = "ab+";
+
+    } else if (!strcmp(open_mode, "wb")) {
+        log_mode = "wb+";
+
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // Log filename
+    const size_t len = strlen(imgst_filename) + strlen(CHANGES_SUFFIX);
+    char* log_filename = NULL;
+    M_EXIT_IF_NULL(log_filename = malloc(len + 1), len + 1);
+
+    strcpy(log_filename, imgst_filename);
+    strcat(log_filename, CHANGES_SUFFIX);
+
+    imgstfile->changes = fopen(log_filename, log_mode);
+    FREE_DEREF(log_filename);
+
+    // A read-only imgStore may have no log at all
+    if (imgstfile->changes == NULL && strcmp(log_mode, "rb") != 0) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Appends a change to the change log.
+ */
+int log_change(const uint16_t kind, const size_t idx, const int res, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    return log_change_at(imgstfile->header.imgst_version, kind, idx, res, imgstfile);
+}
+
+/**
+ * Appends a change made at a given version to the change log.
+ */
+int log_change_at(const uint32_t version, const uint16_t kind, const size_t idx, const int res,
+                  imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF(imgstfile->header.max_files <= idx, ERR_INVALID_ARGUMENT,
+              "change index out of range", );
+
+    if (imgstfile->changes == NULL) {
+        return ERR_NONE;
+    }
+
+    imgst_change change;
+    zero_init_var(change);
+
+    change.version = version;
+    change.kind = kind;
+    change.res = (int16_t) (kind == CHANGE_RESIZE ? res : NOT_RES);
+    change.slot = (uint32_t) idx;
+    strncpy(change.img_id, imgstfile->metadata[idx].img_id, MAX_IMG_ID);
+
+    // The log is opened in append mode: writes always go to its end
+    if (fwrite(&change, sizeof(imgst_change), 1, imgstfile->changes) != 1
+        || fflush(imgstfile->changes) != 0) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the i-th record of the log.
+ */
+static int read_record(FILE* log, const size_t i, imgst_change* change)
+{
+    if (fseek(log, (long) (i * sizeof(imgst_change)), SEEK_SET) != 0
+        || fread(change, sizeof(imgst_change), 1, log) != 1) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Gives the number of records of the log.
+ */
+static int count_records(FILE* log, size_t* count)
+{
+    if (fseek(log, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+
+    const long size = ftell(log);
+    M_EXIT_IF(size < 0, ERR_IO, "cannot get the change log size", );
+
+    // A partially written last record is ignored
+    *count = (size_t) size / sizeof(imgst_change);
+
+    return ERR_NONE;
+}
+
+/**
+ * Finds the index of the first record with a version greater than since.
+ */
+static int first_after(FILE* log, const uint32_t since, const size_t count, size_t* first)
+{
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        imgst_change change;
+        M_EXIT_IF_ERR(read_record(log, mid, &change));
+
+        if (change.version <= since) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *first = lo;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the changes made after a given version, oldest first.
+ */
+int read_changes(const uint32_t since, imgst_change* changes, const size_t max,
+                 size_t* nb_read, const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(changes);
+    M_REQUIRE_NON_NULL(nb_read);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    *nb_read = 0;
+
+    if (imgstfile->changes == NULL) {
+        return ERR_NONE;
+    }
+
+    size_t count = 0;
+    size_t first = 0;
+    M_EXIT_IF_ERR(count_records(imgstfile->changes, &count));
+    M_EXIT_IF_ERR(first_after(imgstfile->changes, since, count, &first));
+
+    const size_t nb = (count - first < max) ? count - first : max;
+
+    if (nb > 0) {
+        if (fseek(imgstfile->changes, (long) (first * sizeof(imgst_change)), SEEK_SET) != 0
+            || fread(changes, sizeof(imgst_change), nb, imgstfile->changes) != nb) {
+            return ERR_IO;
+        }
+    }
+
+    *nb_read = nb;
+
+    return ERR_NONE;
+}
+
+/**
+ * Gives the versions of the last and first logged changes.
+ */
+int changes_bounds(uint32_t* version, uint32_t* oldest, const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(version);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    *version = 0;
+
+    if (oldest != NULL) {
+        *oldest = 0;
+    }
+
+    size_t count = 0;
+
+    if (imgstfile->changes == NULL) {
+        return ERR_NONE;
+    }
+
+    M_EXIT_IF_ERR(count_records(imgstfile->changes, &count));
+
+    if (count == 0) {
+        return ERR_NONE;
+    }
+
+    imgst_change change;
+    M_EXIT_IF_ERR(read_record(imgstfile->changes, count - 1, &change));
+    *version = change.version;
+
+    if (oldest != NULL) {
+        M_EXIT_IF_ERR(read_record(imgstfile->changes, 0, &change));
+        *oldest = change.version;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Human-readable names of changes and resolutions
+ */
+static const char* const CHANGE_NAMES[] = { "insert", "delete", "resize", "move" };
+static const char* const RES_NAMES[NB_RES] = { "thumb", "small", "orig" };
+
+/**
+ * Writes one change as a JSON object.
+ */
+static int append_change(json_buffer* out, const imgst_change* change, const int first)
+{
+    const char* kind = change->kind <= CHANGE_MOVE ? CHANGE_NAMES[change->kind] : "unknown";
+
+    M_EXIT_IF_ERR(json_appendf(out, "%s{\"version\":%" PRIu32 ",\"op\":\"%s\",\"slot\":%" PRIu32 ",\"id\":",
+                               first ? "" : ",", change->version, kind, change->slot));
+    M_EXIT_IF_ERR(json_append_id(out, change->img_id));
+
+    if (change->kind == CHANGE_RESIZE && change->res >= 0 && change->res < NB_RES) {
+        M_EXIT_IF_ERR(json_appendf(out, ",\"res\":\"%s\"", RES_NAMES[change->res]));
+    }
+
+    return json_append(out, "}", 1);
+}
+
+/**
+ * Writes the changes made after a given version as a JSON document.
+ */
+int do_changes(const uint32_t since, const uint32_t limit, list_writer writer, void* arg,
+               const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    // Changes older than the log cannot be told apart: the consumer must resync
+    uint32_t latest = 0;
+    uint32_t oldest = 0;
+    M_EXIT_IF_ERR(changes_bounds(&latest, &oldest, imgstfile));
+
+    const int resync = (oldest == 0) ? since < imgstfile->header.imgst_version
+                                     : since + 1 < oldest;
+
+    json_buffer out = { .len = 0, .writer = writer, .arg = arg };
+    M_EXIT_IF_ERR(json_append(&out, "{\"Changes\":[", 12));
+
+    uint32_t version = since;
+    uint32_t written = 0;
+    int more = 0;
+    imgst_change batch[CHANGES_BATCH];
+    size_t nb = 0;
+
+    do {
+        M_EXIT_IF_ERR(read_changes(version, batch, CHANGES_BATCH, &nb, imgstfile));
+
+        for (size_t i = 0; i < nb && !more; ++i) {
+            if (limit != 0 && written >= limit) {
+                more = 1;
+            } else {
+                M_EXIT_IF_ERR(append_change(&out, &batch[i], written == 0));
+                version = batch[i].version;
+                ++written;
+            }
+        }
+    } while (nb == CHANGES_BATCH && !more);
+
+    M_EXIT_IF_ERR(json_appendf(&out, "],\"version\":%" PRIu32 ",\"resync\":%s,\"more\":%s}",
+                               version, resync ? "true" : "false", more ? "true" : "false"));
+
+    return json_flush(&out);
+}
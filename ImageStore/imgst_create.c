@@ -7,9 +7,9 @@
 
 #include "imgStore.h"
 #include "error.h" // for errors
+#include "huge_pages.h"
 
 #include <string.h> // for strncpy
-#include <stdlib.h> // for calloc
 #include <stdio.h> // for fopen
 
 /**
@@ -31,14 +31,18 @@ int do_create(const char* imgst_filename, imgst_file* imgstfile)
     imgstfile->header.imgst_version = INIT_VER;
     imgstfile->header.num_files = INIT_NB_FILES;
 
-    /// Explicitly initialize the metadata member
-    M_EXIT_IF_NULL(imgstfile->metadata = calloc(imgstfile->header.max_files, sizeof(img_metadata)),
+    /// Explicitly initialize the metadata member (probed at random: on huge pages if large)
+    M_EXIT_IF_NULL(imgstfile->metadata = huge_calloc(imgstfile->header.max_files, sizeof(img_metadata)),
                    sizeof(img_metadata));
 
     /// Explicitly initialize the file member
 
     // The pointer to the file we write to
     imgstfile->file = ((FILE*) NULL);
+    imgstfile->changes = ((FILE*) NULL);
+    imgstfile->index = NULL;
+    imgstfile->cache = NULL;
+    imgstfile->heat = NULL;
 
     // Write to binary file
     size_t num_files_written = 0;
@@ -46,24 +50,28 @@ int do_create(const char* imgst_filename, imgst_file* imgstfile)
     imgstfile->file = fopen(imgst_filename, "wb");
 
     if (imgstfile->file == NULL) {
-        FREE_DEREF(imgstfile->metadata);
+        huge_free(imgstfile->metadata);
+        imgstfile->metadata = NULL;
         return ERR_IO;
     }
 
     // Write the header and metadata to the file.
     M_EXIT_IF_ERR_DO_SOMETHING(updateHeader(imgstfile),
-                               FREE_DEREF(imgstfile->metadata));
+                               huge_free(imgstfile->metadata); imgstfile->metadata = NULL);
     num_files_written += 1;
 
     for(size_t i = 0; i < imgstfile->header.max_files; ++i) {
         M_EXIT_IF_ERR_DO_SOMETHING(updateMetadata(i, imgstfile),
-                                   FREE_DEREF(imgstfile->metadata));
+                                   huge_free(imgstfile->metadata); imgstfile->metadata = NULL);
         num_files_written += 1;
     }
 
     M_EXIT_IF(num_files_written != imgstfile->header.max_files + 1,
               ERR_IO, "incorrect number of files written", );
 
+    // Start a new (empty) change log
+    M_EXIT_IF_ERR(open_changes(imgst_filename, "wb", imgstfile));
+
     // Print the number of successfully written items.
     fprintf(stdout, "%zu item(s) written\n", num_files_written);
 
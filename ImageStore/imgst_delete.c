@@ -6,6 +6,8 @@
  */
 
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "blob_cache.h"
 
 #include <string.h>
 
@@ -27,6 +29,8 @@ int do_delete(const char* img_id, imgst_file* imgstfile)
     /// Deletion
 
     // "Delete" the file
+    index_remove(idx, imgstfile);
+    cache_forget(idx, imgstfile);
     imgstfile->metadata[idx].is_valid = EMPTY;
 
     // Update the file's copy of the metadata
@@ -37,6 +41,9 @@ int do_delete(const char* img_id, imgst_file* imgstfile)
     imgstfile->header.imgst_version += 1;	// The version of the imgStore increments
     M_EXIT_IF_ERR(updateHeader(imgstfile));
 
+    // Record the change for change feed consumers
+    M_EXIT_IF_ERR(log_change(CHANGE_DELETE, idx, NOT_RES, imgstfile));
+
     return ERR_NONE;
 }
 
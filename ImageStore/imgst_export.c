@@ -0,0 +1,518 @@
+/**
+ * @file imgst_export.c
+ * @brief imgStore library: do_export implementation
+ *
+ * The calling thread reads the contents in file offset order, so that the
+ * imgStore is read sequentially, and a pool of worker threads writes them
+ * out (and makes the missing derivatives, if asked to).
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for mkdir and clock_gettime
+
+#include "imgStore.h"
+#include "image_content.h"
+#include "job_queue.h"
+#include "buf_pool.h"
+#include "tar.h"
+#include "scan_ahead.h"
+
+#include <stdlib.h> // for calloc, qsort
+#include <inttypes.h> // for PRIu32
+#include <string.h> // for strlen, strcmp
+#include <time.h>   // for clock_gettime
+#include <errno.h>  // for EEXIST
+#include <sys/stat.h> // for mkdir
+#include <unistd.h> // for sysconf
+
+#define EXPORT_MAX_PATH 4096
+#define EXPORT_MAX_WORKERS 64
+#define EXPORT_JOBS_PER_WORKER 4 // contents read ahead, bounds memory use
+#define EXPORT_MAX_PAX_VALUE 80
+
+/* resolution names of the tar streams, by resolution code (see resolution_atoi) */
+static const char* const RES_NAMES[NB_RES] = { "thumb", "small", "orig" };
+
+typedef struct export_item export_item;
+typedef struct export_job export_job;
+typedef struct export_target export_target;
+
+/**
+ * One stored content of one image.
+ */
+struct export_item {
+    uint64_t offset;
+    uint64_t order;   // offset, but never before that of the image's original
+    uint32_t slot;
+    int res;
+};
+
+/**
+ * Where and how to write, shared by all the jobs.
+ */
+struct export_target {
+    const char* dir;     // NULL when writing a tar stream
+    FILE* tar;           // the tar stream, written by the calling thread only
+    uint16_t res_resized[2 * (NB_RES - 1)];
+};
+
+/**
+ * One stored content, and the derivatives to make from it.
+ */
+struct export_job {
+    job_list* finished;            // where to hand the job once written
+    const export_target* target;
+    size_t seq;                    // rank of the job, the order of the tar stream
+    char img_id[MAX_IMG_ID + 1];
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[DIMS];
+    int res;                       // resolution of buffer
+    char* buffer;
+    size_t size;
+    int derive[NB_RES];            // derivatives to make from buffer, an original
+    void* derived[NB_RES];         // the derivatives made (g_free'd)
+    size_t derived_size[NB_RES];
+    size_t files;                  // number of files written or to write
+    int error;
+};
+
+/**
+ * Seconds elapsed since some fixed point.
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Orders items by offset, then by slot, originals first: a derivative
+ * written before its original (as gc and reorganize write them) comes
+ * right after it, where do_import can apply it.
+ */
+static int compare_items(const void* a, const void* b)
+{
+    const export_item* x = a;
+    const export_item* y = b;
+
+    if (x->order != y->order) {
+        return (x->order > y->order) - (x->order < y->order);
+    }
+
+    if (x->slot != y->slot) {
+        return (x->slot > y->slot) - (x->slot < y->slot);
+    }
+
+    return (x->res < y->res) - (x->res > y->res);
+}
+
+/**
+ * Creates the missing directories leading to path.
+ */
+static int make_parents(char* path)
+{
+    for (char* sep = strchr(path + 1, '/'); sep != NULL; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        const int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+        *sep = '/';
+
+        if (failed) {
+            return ERR_IO;
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes one content as <dir>/<img_id>_<res>.jpg.
+ */
+static int write_file(const char* dir, const char* img_id, int res, const void* data, size_t size)
+{
+    // Below dir only, whatever the ID
+    M_EXIT_IF_ERR(check_relative_id(img_id));
+
+    char* name = NULL;
+    M_EXIT_IF_ERR(create_name(img_id, res, NULL, &name));
+
+    char path[EXPORT_MAX_PATH];
+    const int n = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    free(name);
+
+    M_EXIT_IF(n < 0 || (size_t) n >= sizeof(path), ERR_INVALID_FILENAME, "export path too long", );
+    M_EXIT_IF_ERR(make_parents(path));
+
+    FILE* file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return ERR_IO;
+    }
+
+    const int ok = fwrite(data, size, 1, file) == 1;
+
+    if (fclose(file) != 0 || !ok) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes one content to the tar stream as <img_id>_<res>.jpg, with what
+ * do_import needs to know about it in pax records.
+ */
+static int write_tar(FILE* tar, const export_job* job, int res, const void* data, size_t size)
+{
+    char pax[TAR_MAX_PAX];
+    size_t pax_len = 0;
+    char value[EXPORT_MAX_PAX_VALUE];
+
+    M_EXIT_IF_ERR(tar_pax_add(pax, sizeof(pax), &pax_len, "IMGSTORE.id", job->img_id));
+    M_EXIT_IF_ERR(tar_pax_add(pax, sizeof(pax), &pax_len, "IMGSTORE.res", RES_NAMES[res]));
+
+    if (res == RES_ORIG) {
+        for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+            snprintf(value + 2 * i, 3, "%02x", job->sha[i]);
+        }
+
+        M_EXIT_IF_ERR(tar_pax_add(pax, sizeof(pax), &pax_len, "IMGSTORE.sha", value));
+
+        snprintf(value, sizeof(value), "%" PRIu32, job->res_orig[0]);
+        M_EXIT_IF_ERR(tar_pax_add(pax, sizeof(pax), &pax_len, "IMGSTORE.width", value));
+
+        snprintf(value, sizeof(value), "%" PRIu32, job->res_orig[1]);
+        M_EXIT_IF_ERR(tar_pax_add(pax, sizeof(pax), &pax_len, "IMGSTORE.height", value));
+    }
+
+    char* name = NULL;
+    M_EXIT_IF_ERR(create_name(job->img_id, res, NULL, &name));
+
+    const int ret = tar_write_file(tar, name, pax, pax_len, data, size);
+    free(name);
+
+    return ret;
+}
+
+/**
+ * Worker: makes the derivatives, and writes everything when exporting to a directory.
+ */
+static void write_job(void* arg)
+{
+    export_job* job = arg;
+    const export_target* target = job->target;
+
+    for (int res = 0; res < NB_RES && job->error == ERR_NONE; ++res) {
+        if (job->derive[res]) {
+            job->error = resize_image(job->buffer, job->size,
+                                      target->res_resized[2 * res], target->res_resized[2 * res + 1],
+                                      &job->derived[res], &job->derived_size[res]);
+            ++job->files;
+        }
+    }
+
+    ++job->files;
+
+    // The tar stream is written by the calling thread
+    if (target->dir == NULL) {
+        return;
+    }
+
+    if (job->error == ERR_NONE) {
+        job->error = write_file(target->dir, job->img_id, job->res, job->buffer, job->size);
+    }
+
+    for (int res = 0; res < NB_RES && job->error == ERR_NONE; ++res) {
+        if (job->derived[res] != NULL) {
+            job->error = write_file(target->dir, job->img_id, res, job->derived[res], job->derived_size[res]);
+        }
+    }
+}
+
+/**
+ * Worker: hands a written job back.
+ */
+static void hand_job(void* arg)
+{
+    export_job* job = arg;
+    job_list_push(job->finished, job);
+}
+
+/**
+ * Calling thread: writes finished jobs to the tar stream (if any), accounts for them and frees them.
+ */
+static void finish_jobs(export_job** jobs, size_t nb_jobs, int* error, export_stats* stats)
+{
+    for (size_t j = 0; j < nb_jobs; ++j) {
+        export_job* job = jobs[j];
+        FILE* tar = job->target->tar;
+
+        if (tar != NULL && job->error == ERR_NONE && *error == ERR_NONE) {
+            *error = write_tar(tar, job, job->res, job->buffer, job->size);
+
+            for (int res = 0; res < NB_RES && *error == ERR_NONE; ++res) {
+                if (job->derived[res] != NULL) {
+                    *error = write_tar(tar, job, res, job->derived[res], job->derived_size[res]);
+                }
+            }
+        }
+
+        if (job->error != ERR_NONE) {
+            fprintf(stderr, "%s: %s\n", job->img_id, ERR_MESSAGES[job->error]);
+            ++stats->failed;
+
+        } else if (*error == ERR_NONE) {
+            stats->files += job->files;
+            stats->bytes += job->size;
+
+            for (int res = 0; res < NB_RES; ++res) {
+                stats->bytes += job->derived_size[res];
+            }
+        }
+
+        for (int res = 0; res < NB_RES; ++res) {
+            g_free(job->derived[res]);
+        }
+
+        pool_free(job->buffer);
+        free(job);
+    }
+}
+
+/**
+ * Lists the stored contents of the valid images, in file offset order but
+ * for the derivatives stored before their original.
+ */
+static int list_items(const imgst_file* imgstfile, export_item** items, size_t* nb_items)
+{
+    const size_t max = (size_t) imgstfile->header.num_files * NB_RES;
+
+    *nb_items = 0;
+    *items = calloc(max > 0 ? max : 1, sizeof(export_item));
+    M_EXIT_IF_NULL(*items, max * sizeof(export_item));
+
+    for (uint32_t slot = 0; slot < imgstfile->header.max_files; ++slot) {
+        const img_metadata* meta = &imgstfile->metadata[slot];
+
+        if (meta->is_valid != NON_EMPTY) {
+            continue;
+        }
+
+        for (int res = 0; res < NB_RES && *nb_items < max; ++res) {
+            if (meta->offset[res] != 0 && meta->size[res] != 0) {
+                const uint64_t orig = meta->offset[RES_ORIG];
+
+                (*items)[(*nb_items)++] = (export_item) {
+                    .offset = meta->offset[res], .slot = slot, .res = res,
+                    .order = meta->offset[res] > orig ? meta->offset[res] : orig
+                };
+            }
+        }
+    }
+
+    qsort(*items, *nb_items, sizeof(export_item), compare_items);
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads one stored content.
+ */
+static int read_item(const export_item* item, export_job* job, imgst_file* imgstfile)
+{
+    const img_metadata* meta = &imgstfile->metadata[item->slot];
+
+    job->size = meta->size[item->res];
+    job->buffer = pool_alloc(job->size);
+    M_EXIT_IF_NULL(job->buffer, job->size);
+
+    if (fseek(imgstfile->file, (long) item->offset, SEEK_SET) != 0
+        || fread(job->buffer, job->size, 1, imgstfile->file) != 1) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reports the progress of an export on stderr.
+ */
+static void report_progress(const export_stats* stats, double seconds)
+{
+    fprintf(stderr, "%zu files exported, %zu failed, %.1f MB/s\n",
+            stats->files, stats->failed,
+            seconds > 0 ? (double) stats->bytes / 1e6 / seconds : 0.0);
+}
+
+/**
+ * Writes all the images out.
+ */
+int do_export(const char* target, int derive, size_t nb_workers, int progress,
+              export_stats* stats, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(target);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(export_stats));
+
+    if (nb_workers == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_workers = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    if (nb_workers > EXPORT_MAX_WORKERS) {
+        nb_workers = EXPORT_MAX_WORKERS;
+    }
+
+    // "-" and *.tar make a tar stream, anything else is a directory
+    export_target out = { .dir = NULL, .tar = NULL };
+    memcpy(out.res_resized, imgstfile->header.res_resized, sizeof(out.res_resized));
+
+    const size_t target_len = strlen(target);
+
+    if (!strcmp(target, "-")) {
+        out.tar = stdout;
+
+    } else if (target_len > 4 && !strcmp(target + target_len - 4, ".tar")) {
+        out.tar = fopen(target, "wb");
+        M_EXIT_IF(out.tar == NULL, ERR_IO, "cannot create tar file", );
+
+    } else {
+        M_EXIT_IF(mkdir(target, 0755) != 0 && errno != EEXIST, ERR_IO,
+                  "cannot create export directory", );
+        out.dir = target;
+    }
+
+    const size_t max_in_flight = nb_workers * EXPORT_JOBS_PER_WORKER;
+
+    export_item* items = NULL;
+    size_t nb_items = 0;
+    export_job** taken = calloc(max_in_flight, sizeof(export_job*));
+    export_job** window = calloc(max_in_flight, sizeof(export_job*)); // finished, by seq
+    job_list finished;
+    job_queue queue;
+
+    int error = taken == NULL || window == NULL ? ERR_OUT_OF_MEMORY
+                : list_items(imgstfile, &items, &nb_items);
+
+    if (error == ERR_NONE && (error = job_list_init(&finished, max_in_flight)) == ERR_NONE
+        && (error = job_queue_init(&queue, max_in_flight, nb_workers, write_job, hand_job)) != ERR_NONE) {
+        job_list_free(&finished);
+    }
+
+    if (error != ERR_NONE) {
+        if (out.tar != NULL && out.tar != stdout) {
+            fclose(out.tar);
+        }
+
+        free(items);
+        free(taken);
+        free(window);
+        return error;
+    }
+
+    // In offset order mostly, but with the gaps of deleted images and
+    // reads far smaller than what the kernel would read ahead of them
+    scan_extent* extents = calloc(nb_items + 1, sizeof(scan_extent));
+    scan_ahead ahead;
+
+    for (size_t i = 0; extents != NULL && i < nb_items; ++i) {
+        extents[i].offset = items[i].offset;
+        extents[i].size = imgstfile->metadata[items[i].slot].size[items[i].res];
+    }
+
+    scan_ahead_init(&ahead, imgstfile->file, extents, nb_items, SCAN_AHEAD_WINDOW);
+
+    const double start = now_seconds();
+    double last_report = start;
+    size_t in_flight = 0;
+    size_t next = 0;     // next item to read
+    size_t done = 0;     // number of jobs finished, in order
+
+    while (next < nb_items || in_flight > 0) {
+        // Keep the workers busy, within the memory bound
+        while (next < nb_items && in_flight < max_in_flight && error == ERR_NONE) {
+            const export_item* item = &items[next++];
+            const img_metadata* meta = &imgstfile->metadata[item->slot];
+
+            export_job* job = calloc(1, sizeof(export_job));
+
+            if (job == NULL) {
+                error = ERR_OUT_OF_MEMORY;
+                break;
+            }
+
+            job->finished = &finished;
+            job->target = &out;
+            job->seq = next - 1;
+            job->res = item->res;
+            strncpy(job->img_id, meta->img_id, MAX_IMG_ID);
+            memcpy(job->sha, meta->SHA, SHA256_DIGEST_LENGTH);
+            memcpy(job->res_orig, meta->res_orig, sizeof(job->res_orig));
+
+            // Missing derivatives are made from the original
+            for (int res = 0; derive && item->res == RES_ORIG && res < RES_ORIG; ++res) {
+                job->derive[res] = meta->offset[res] == 0 || meta->size[res] == 0;
+            }
+
+            scan_ahead_next(&ahead);
+            job->error = read_item(item, job, imgstfile);
+
+            // Cannot be busy: at most max_in_flight jobs are queued
+            job_queue_submit(&queue, job);
+            ++in_flight;
+        }
+
+        if (in_flight == 0) {
+            break;
+        }
+
+        const size_t nb_taken = job_list_take(&finished, (void**) taken, max_in_flight);
+
+        // Finish in item order: a derivative never precedes its original in a tar stream
+        for (size_t j = 0; j < nb_taken; ++j) {
+            window[taken[j]->seq % max_in_flight] = taken[j];
+        }
+
+        while (window[done % max_in_flight] != NULL) {
+            finish_jobs(&window[done % max_in_flight], 1, &error, stats);
+            window[done % max_in_flight] = NULL;
+            ++done;
+            --in_flight;
+        }
+
+        if (progress && now_seconds() - last_report >= 1.0) {
+            last_report = now_seconds();
+            report_progress(stats, last_report - start);
+        }
+    }
+
+    job_queue_free(&queue);
+    job_list_free(&finished);
+    free(extents);
+    free(items);
+    free(taken);
+    free(window);
+
+    if (out.tar != NULL) {
+        if (error == ERR_NONE) {
+            error = tar_finish(out.tar);
+        }
+
+        if (out.tar != stdout && fclose(out.tar) != 0 && error == ERR_NONE) {
+            error = ERR_IO;
+        }
+    }
+
+    stats->seconds = now_seconds() - start;
+
+    if (progress) {
+        report_progress(stats, stats->seconds);
+    }
+
+    return error;
+}
@@ -0,0 +1,369 @@
+/**
+ * @file imgst_gc.c
+ * @brief imgStore library: garbage collection, with a placement policy.
+ *
+ * The live images are copied into a new file, which then replaces the
+ * imgStore. Whatever order they were appended in (originals at insert time,
+ * derivatives whenever first asked for), each image is written with its
+ * resolutions next to each other, thumbnail first, so that a page showing
+ * its thumbnail and small image reads one extent. Images come in the order
+ * of the placement policy. Contents shared by deduplicated images are copied
+ * once.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno and fsync
+
+#include "imgStore.h"
+#include "imgst_heat.h"
+#include "scan_ahead.h"
+#include "meta_scan.h"
+
+#include <stdlib.h> // for calloc, qsort
+#include <string.h> // for memset, strcmp
+#include <unistd.h> // for fsync
+
+#define GC_CHUNK_SIZE (1 << 20)
+
+typedef struct gc_move gc_move;
+
+/**
+ * Where a content was, and where it goes.
+ */
+struct gc_move {
+    uint64_t from;
+    uint64_t to;   // INIT_OFFSET until copied
+};
+
+/**
+ * The imgStore whose slots are sorted: qsort passes no context.
+ */
+static const imgst_file* s_sorted = NULL;
+
+/**
+ * By first stored content: the order they are in.
+ */
+static int compare_by_offset(const void* a, const void* b)
+{
+    const img_metadata* x = &s_sorted->metadata[*(const uint32_t*) a];
+    const img_metadata* y = &s_sorted->metadata[*(const uint32_t*) b];
+
+    return x->offset[RES_ORIG] < y->offset[RES_ORIG] ? -1 : x->offset[RES_ORIG] > y->offset[RES_ORIG];
+}
+
+/**
+ * By image ID.
+ */
+static int compare_by_id(const void* a, const void* b)
+{
+    return strcmp(s_sorted->metadata[*(const uint32_t*) a].img_id,
+                  s_sorted->metadata[*(const uint32_t*) b].img_id);
+}
+
+/**
+ * Hottest first, then by image ID.
+ */
+static int compare_by_heat(const void* a, const void* b)
+{
+    const uint16_t x = heat_count(*(const uint32_t*) a, s_sorted);
+    const uint16_t y = heat_count(*(const uint32_t*) b, s_sorted);
+
+    return x != y ? (x > y ? -1 : 1) : compare_by_id(a, b);
+}
+
+/**
+ * By content offset.
+ */
+static int compare_moves(const void* a, const void* b)
+{
+    const gc_move* x = a;
+    const gc_move* y = b;
+
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/**
+ * Whether a resolution of an image is stored.
+ */
+static int is_stored(const img_metadata* meta, int res)
+{
+    return meta->offset[res] != INIT_OFFSET && meta->size[res] > 0;
+}
+
+/**
+ * Lists the valid slots in placement order.
+ */
+static int place_images(int placement, uint32_t* slots, size_t* nb, const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(slots);
+    M_REQUIRE_NON_NULL(nb);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    int (*compare)(const void*, const void*) = NULL;
+
+    switch (placement) {
+    case PLACE_BY_OFFSET:
+        compare = compare_by_offset;
+        break;
+    case PLACE_BY_ID:
+        compare = compare_by_id;
+        break;
+    case PLACE_BY_HEAT:
+        compare = compare_by_heat;
+        break;
+    default:
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    *nb = meta_valid_slots(imgstfile->metadata, imgstfile->header.max_files, slots);
+
+    s_sorted = imgstfile;
+    qsort(slots, *nb, sizeof(uint32_t), compare);
+    s_sorted = NULL;
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies len bytes at an offset of one file to the end of another.
+ */
+static int copy_content(FILE* from, uint64_t offset, uint64_t len, FILE* to, char* buffer)
+{
+    M_EXIT_IF(fseek(from, (long) offset, SEEK_SET) != 0, ERR_IO, "cannot seek imgStore", );
+
+    while (len > 0) {
+        const size_t chunk = len < GC_CHUNK_SIZE ? (size_t) len : GC_CHUNK_SIZE;
+
+        M_EXIT_IF(fread(buffer, 1, chunk, from) != chunk || fwrite(buffer, 1, chunk, to) != chunk,
+                  ERR_IO, "cannot copy image", );
+
+        len -= chunk;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Lists the stored contents once each, sorted by offset.
+ */
+static int list_moves(gc_move** moves, size_t* nb, const imgst_file* imgstfile)
+{
+    const size_t max = (size_t) imgstfile->header.max_files * NB_RES;
+    *moves = calloc(max + 1, sizeof(gc_move));
+    M_EXIT_IF_NULL(*moves, (max + 1) * sizeof(gc_move));
+
+    size_t count = 0;
+
+    for (uint32_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[i];
+
+        for (int res = 0; res < NB_RES && meta->is_valid == NON_EMPTY; ++res) {
+            if (is_stored(meta, res)) {
+                (*moves)[count++].from = meta->offset[res];
+            }
+        }
+    }
+
+    qsort(*moves, count, sizeof(gc_move), compare_moves);
+
+    // Deduplicated images share their contents
+    size_t unique = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (unique == 0 || (*moves)[unique - 1].from != (*moves)[i].from) {
+            (*moves)[unique++] = (*moves)[i];
+        }
+    }
+
+    *nb = unique;
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies the live contents in placement order, updating the offsets in metadata.
+ */
+static int copy_images(const uint32_t* slots, size_t nb_slots, gc_move* moves, size_t nb_moves,
+                       img_metadata* metadata, FILE* to, const imgst_file* imgstfile)
+{
+    char* buffer = malloc(GC_CHUNK_SIZE);
+    scan_extent* extents = calloc(nb_moves + 1, sizeof(scan_extent));
+
+    if (buffer == NULL || extents == NULL) {
+        free(buffer);
+        free(extents);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const uint64_t start = sizeof(imgst_header) + (uint64_t) imgstfile->header.max_files * sizeof(img_metadata);
+    uint64_t end = start;
+    size_t nb_extents = 0;
+
+    // Where each content goes: one after the other, in placement order
+    for (size_t i = 0; i < nb_slots; ++i) {
+        img_metadata* meta = &metadata[slots[i]];
+
+        // Smallest first: the derivatives of an image, then its original
+        // (export puts the original back in front, as do_import needs it)
+        for (int res = 0; res < NB_RES; ++res) {
+            if (!is_stored(meta, res)) {
+                continue;
+            }
+
+            const gc_move key = { .from = meta->offset[res], .to = INIT_OFFSET };
+            gc_move* move = bsearch(&key, moves, nb_moves, sizeof(gc_move), compare_moves);
+
+            if (move->to == INIT_OFFSET) {
+                move->to = end;
+                end += meta->size[res];
+                extents[nb_extents++] = (scan_extent) { .offset = move->from, .size = meta->size[res] };
+            }
+
+            meta->offset[res] = move->to;
+        }
+    }
+
+    // Then copied in that order, the next ones read ahead meanwhile
+    scan_ahead ahead;
+    scan_ahead_init(&ahead, imgstfile->file, extents, nb_extents, SCAN_AHEAD_WINDOW);
+
+    int ret = fseek(to, (long) start, SEEK_SET) == 0 ? ERR_NONE : ERR_IO;
+
+    for (size_t i = 0; i < nb_extents && ret == ERR_NONE; ++i) {
+        scan_ahead_next(&ahead);
+        ret = copy_content(imgstfile->file, extents[i].offset, extents[i].size, to, buffer);
+    }
+
+    free(buffer);
+    free(extents);
+
+    return ret;
+}
+
+/**
+ * Writes the compacted imgStore to a new file.
+ */
+static int write_compacted(const char* path, int placement, gc_stats* stats,
+                           const imgst_file* imgstfile)
+{
+    const size_t max_files = imgstfile->header.max_files;
+
+    uint32_t* slots = calloc(max_files + 1, sizeof(uint32_t));
+    img_metadata* metadata = calloc(max_files + 1, sizeof(img_metadata));
+    gc_move* moves = NULL;
+    size_t nb_slots = 0;
+    size_t nb_moves = 0;
+
+    int ret = slots == NULL || metadata == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+
+    if (ret == ERR_NONE) {
+        ret = place_images(placement, slots, &nb_slots, imgstfile);
+    }
+
+    if (ret == ERR_NONE) {
+        ret = list_moves(&moves, &nb_moves, imgstfile);
+    }
+
+    // What was deleted leaves no trace
+    for (size_t i = 0; i < max_files && ret == ERR_NONE; ++i) {
+        if (imgstfile->metadata[i].is_valid == NON_EMPTY) {
+            metadata[i] = imgstfile->metadata[i];
+        }
+    }
+
+    FILE* to = ret == ERR_NONE ? fopen(path, "wb") : NULL;
+
+    if (ret == ERR_NONE && to == NULL) {
+        ret = ERR_IO;
+    }
+
+    if (ret == ERR_NONE) {
+        ret = copy_images(slots, nb_slots, moves, nb_moves, metadata, to, imgstfile);
+    }
+
+    // Contents moved: backups and followers of the old layout no longer apply
+    imgst_header header = imgstfile->header;
+    ++header.generation;
+
+    if (ret == ERR_NONE) {
+        stats->nb_images = nb_slots;
+        stats->nb_contents = nb_moves;
+
+        if (fseek(to, 0, SEEK_END) != 0 || ftell(to) < 0) {
+            ret = ERR_IO;
+        } else {
+            stats->bytes_after = (uint64_t) ftell(to);
+        }
+    }
+
+    if (ret == ERR_NONE
+        && (fseek(to, 0, SEEK_SET) != 0
+            || fwrite(&header, sizeof(imgst_header), 1, to) != 1
+            || fwrite(metadata, sizeof(img_metadata), max_files, to) != max_files
+            || fflush(to) != 0 || fsync(fileno(to)) != 0)) {
+        ret = ERR_IO;
+    }
+
+    if (to != NULL && fclose(to) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE && to != NULL) {
+        remove(path);
+    }
+
+    free(slots);
+    free(metadata);
+    free(moves);
+
+    return ret;
+}
+
+/**
+ * Removes the deleted images by moving the existing ones, in placement order.
+ */
+int do_gbcollect(const char* imgst_path, const char* imgst_tmp_bkp_path, int placement,
+                 gc_stats* stats)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_path);
+    M_REQUIRE_NON_NULL(imgst_tmp_bkp_path);
+    M_REQUIRE_NON_NULL(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    imgst_file imgstfile;
+    M_EXIT_IF_ERR(do_open(imgst_path, "rb", &imgstfile));
+
+    int ret = ERR_NONE;
+
+    // Read-only: the counts order the images, and stay valid (slots do not move)
+    if (placement == PLACE_BY_HEAT) {
+        ret = heat_open(imgst_path, "rb", &imgstfile);
+    }
+
+    if (ret == ERR_NONE) {
+        if (fseek(imgstfile.file, 0, SEEK_END) != 0 || ftell(imgstfile.file) < 0) {
+            ret = ERR_IO;
+        } else {
+            stats->bytes_before = (uint64_t) ftell(imgstfile.file);
+        }
+    }
+
+    if (ret == ERR_NONE) {
+        ret = write_compacted(imgst_tmp_bkp_path, placement, stats, &imgstfile);
+    }
+
+    do_close(&imgstfile);
+
+    // The change log still applies: slots and versions are unchanged
+    if (ret == ERR_NONE && rename(imgst_tmp_bkp_path, imgst_path) != 0) {
+        remove(imgst_tmp_bkp_path);
+        ret = ERR_IO;
+    }
+
+    return ret;
+}
@@ -0,0 +1,412 @@
+/**
+ * @file imgst_heat.c
+ * @brief Access frequency of the images, kept in a side table.
+ *
+ * The table is a heat_file_header followed by one heat_record per metadata
+ * slot. Counters decay lazily: a record holds its count as of its last
+ * epoch, and is halved by the number of epochs since whenever it is read.
+ *
+ * @author ???
+ */
+
+#include "imgst_heat.h"
+#include "json_writer.h"
+#include "sha_hash.h"
+
+#include <stdlib.h>   // for calloc, qsort
+#include <string.h>   // for memcpy, memcmp, memset
+#include <inttypes.h> // for PRIu32
+
+#define HEAT_MAGIC "IMGSTHT1"
+#define HEAT_MAGIC_LEN 8
+
+// Beyond this many epochs, any 16 bits counter is down to zero
+#define HEAT_MAX_HALVINGS 16
+
+typedef struct heat_file_header heat_file_header;
+
+/**
+ * Header of the table.
+ */
+struct heat_file_header {
+    char magic[HEAT_MAGIC_LEN];
+    uint32_t max_files;
+    uint32_t reserved;
+    int64_t epoch_start;
+};
+
+/**
+ * A slot and its counter, to sort.
+ */
+typedef struct heat_rank {
+    uint32_t slot;
+    uint16_t count;
+} heat_rank;
+
+/**
+ * Gives the current epoch.
+ */
+uint32_t heat_epoch(const imgst_heat* heat)
+{
+    const time_t now = time(NULL);
+    return now <= heat->epoch_start ? 0 : (uint32_t) ((now - heat->epoch_start) / HEAT_EPOCH_SECONDS);
+}
+
+/**
+ * Counter of a record as of an epoch.
+ */
+static uint16_t decayed(const heat_record* record, uint32_t epoch)
+{
+    const uint32_t halvings = epoch > record->last_epoch ? epoch - record->last_epoch : 0;
+    return halvings >= HEAT_MAX_HALVINGS ? 0 : (uint16_t) (record->count >> halvings);
+}
+
+/**
+ * Path of the table of an imgStore.
+ */
+static char* heat_path(const char* imgst_filename)
+{
+    char* path = malloc(strlen(imgst_filename) + strlen(HEAT_SUFFIX) + 1);
+
+    if (path != NULL) {
+        strcpy(path, imgst_filename);
+        strcat(path, HEAT_SUFFIX);
+    }
+
+    return path;
+}
+
+/**
+ * Reads a table, if it matches the imgStore.
+ */
+static int read_table(FILE* file, imgst_heat* heat, uint32_t max_files)
+{
+    heat_file_header header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, HEAT_MAGIC, HEAT_MAGIC_LEN) != 0
+        || header.max_files != max_files
+        || fread(heat->records, sizeof(heat_record), max_files, file) != max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    heat->epoch_start = (time_t) header.epoch_start;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes a whole table.
+ */
+static int write_table(FILE* file, const imgst_heat* heat, uint32_t max_files)
+{
+    heat_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEAT_MAGIC, HEAT_MAGIC_LEN);
+    header.max_files = max_files;
+    header.epoch_start = (int64_t) heat->epoch_start;
+
+    M_EXIT_IF(fseek(file, 0, SEEK_SET) != 0
+              || fwrite(&header, sizeof(header), 1, file) != 1
+              || fwrite(heat->records, sizeof(heat_record), max_files, file) != max_files
+              || fflush(file) != 0, ERR_IO, "cannot write access statistics", );
+
+    return ERR_NONE;
+}
+
+/**
+ * Loads the access statistics of an imgStore.
+ */
+int heat_open(const char* imgst_filename, const char* open_mode, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(open_mode);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    heat_close(imgstfile);
+
+    const uint32_t max_files = imgstfile->header.max_files;
+    imgst_heat* heat = calloc(1, sizeof(imgst_heat));
+    M_EXIT_IF_NULL(heat, sizeof(imgst_heat));
+
+    heat->records = calloc(max_files, sizeof(heat_record));
+    heat->dirty = calloc(max_files, sizeof(unsigned char));
+    char* path = heat_path(imgst_filename);
+
+    if (heat->records == NULL || heat->dirty == NULL || path == NULL) {
+        free(heat->records);
+        free(heat->dirty);
+        free(heat);
+        free(path);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const int writable = !strcmp(open_mode, "rb+");
+    FILE* file = fopen(path, writable ? "rb+" : "rb");
+
+    // Missing or mismatched: start afresh
+    if (file == NULL || read_table(file, heat, max_files) != ERR_NONE) {
+        memset(heat->records, 0, max_files * sizeof(heat_record));
+        heat->epoch_start = time(NULL);
+
+        if (file == NULL && writable) {
+            file = fopen(path, "wb+");
+        }
+
+        if (file != NULL && writable && write_table(file, heat, max_files) != ERR_NONE) {
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+    free(path);
+
+    if (file != NULL && !writable) {
+        fclose(file);
+        file = NULL;
+    }
+
+    if (file == NULL && writable) {
+        free(heat->records);
+        free(heat->dirty);
+        free(heat);
+        return ERR_IO;
+    }
+
+    heat->file = file;
+    imgstfile->heat = heat;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes the changed access statistics back.
+ */
+int heat_flush(imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->heat == NULL) {
+        return ERR_NONE;
+    }
+
+    imgst_heat* heat = imgstfile->heat;
+
+    if (heat->file == NULL || heat->nb_dirty == 0) {
+        return ERR_NONE;
+    }
+
+    const size_t max_files = imgstfile->header.max_files;
+    int ret = ERR_NONE;
+
+    // One write per run of dirty records
+    for (size_t i = 0; i < max_files && ret == ERR_NONE; ++i) {
+        if (!heat->dirty[i]) {
+            continue;
+        }
+
+        size_t end = i;
+
+        while (end < max_files && heat->dirty[end]) {
+            ++end;
+        }
+
+        const long offset = (long) (sizeof(heat_file_header) + i * sizeof(heat_record));
+
+        if (fseek(heat->file, offset, SEEK_SET) != 0
+            || fwrite(&heat->records[i], sizeof(heat_record), end - i, heat->file) != end - i) {
+            ret = ERR_IO;
+        }
+
+        i = end;
+    }
+
+    if (ret == ERR_NONE && fflush(heat->file) != 0) {
+        ret = ERR_IO;
+    }
+
+    // Written back only once flushed: otherwise, the next flush writes them again
+    if (ret == ERR_NONE) {
+        memset(heat->dirty, 0, max_files);
+        heat->nb_dirty = 0;
+    }
+
+    return ret;
+}
+
+/**
+ * Writes the access statistics back, and frees them.
+ */
+void heat_close(imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->heat == NULL) {
+        return;
+    }
+
+    heat_flush(imgstfile);
+
+    if (imgstfile->heat->file != NULL) {
+        fclose(imgstfile->heat->file);
+    }
+
+    free(imgstfile->heat->records);
+    free(imgstfile->heat->dirty);
+    FREE_DEREF(imgstfile->heat);
+}
+
+/**
+ * Counts one read of a valid slot, in memory.
+ */
+void heat_touch(size_t slot, imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->heat == NULL || slot >= imgstfile->header.max_files
+        || imgstfile->metadata[slot].is_valid != NON_EMPTY) {
+        return;
+    }
+
+    imgst_heat* heat = imgstfile->heat;
+    heat_record* record = &heat->records[slot];
+    const uint32_t tag = sha_tag(imgstfile->metadata[slot].SHA);
+    const uint32_t epoch = heat_epoch(heat);
+
+    // Another image since: it starts cold
+    const uint16_t count = record->tag == tag ? decayed(record, epoch) : 0;
+
+    record->tag = tag;
+    record->count = count == UINT16_MAX ? count : (uint16_t) (count + 1);
+    record->last_epoch = epoch;
+
+    if (!heat->dirty[slot]) {
+        heat->dirty[slot] = 1;
+        ++heat->nb_dirty;
+    }
+}
+
+/**
+ * Counter of a slot as of an epoch, 0 if its record is about another image.
+ */
+static uint16_t slot_count(size_t slot, uint32_t epoch, const imgst_file* imgstfile)
+{
+    const img_metadata* meta = &imgstfile->metadata[slot];
+    const heat_record* record = &imgstfile->heat->records[slot];
+
+    if (meta->is_valid != NON_EMPTY || record->tag != sha_tag(meta->SHA)) {
+        return 0;
+    }
+
+    return decayed(record, epoch);
+}
+
+/**
+ * Gives the access counter of a slot, decayed up to now.
+ */
+uint16_t heat_count(size_t slot, const imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->heat == NULL || slot >= imgstfile->header.max_files) {
+        return 0;
+    }
+
+    return slot_count(slot, heat_epoch(imgstfile->heat), imgstfile);
+}
+
+/**
+ * Hottest first, then by slot.
+ */
+static int compare_ranks(const void* a, const void* b)
+{
+    const heat_rank* x = a;
+    const heat_rank* y = b;
+
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/**
+ * Lists the hottest valid slots, hottest first.
+ */
+size_t heat_hottest(uint32_t* slots, size_t max, const imgst_file* imgstfile)
+{
+    if (slots == NULL || imgstfile == NULL || imgstfile->heat == NULL) {
+        return 0;
+    }
+
+    heat_rank* ranks = calloc(imgstfile->header.max_files + 1, sizeof(heat_rank));
+
+    if (ranks == NULL) {
+        return 0;
+    }
+
+    const uint32_t epoch = heat_epoch(imgstfile->heat);
+    size_t nb = 0;
+
+    for (uint32_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const uint16_t count = slot_count(i, epoch, imgstfile);
+
+        if (count > 0) {
+            ranks[nb].slot = i;
+            ranks[nb].count = count;
+            ++nb;
+        }
+    }
+
+    qsort(ranks, nb, sizeof(heat_rank), compare_ranks);
+
+    if (nb > max) {
+        nb = max;
+    }
+
+    for (size_t i = 0; i < nb; ++i) {
+        slots[i] = ranks[i].slot;
+    }
+
+    free(ranks);
+
+    return nb;
+}
+
+/**
+ * Lists the hottest images as a JSON document.
+ */
+int do_hot(uint32_t limit, list_writer writer, void* arg, const imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->heat);
+
+    const size_t max = limit == 0 ? imgstfile->header.max_files : limit;
+    uint32_t* slots = calloc(max + 1, sizeof(uint32_t));
+    M_EXIT_IF_NULL(slots, (max + 1) * sizeof(uint32_t));
+
+    const size_t nb = heat_hottest(slots, max, imgstfile);
+    const uint32_t epoch = heat_epoch(imgstfile->heat);
+
+    json_buffer out = { .len = 0, .writer = writer, .arg = arg };
+    int ret = json_appendf(&out, "{\"epoch\":%" PRIu32 ",\"Images\":[", epoch);
+
+    for (size_t i = 0; i < nb && ret == ERR_NONE; ++i) {
+        const uint32_t slot = slots[i];
+
+        ret = json_appendf(&out, "%s{\"id\":", i == 0 ? "" : ",");
+
+        if (ret == ERR_NONE) {
+            ret = json_append_id(&out, imgstfile->metadata[slot].img_id);
+        }
+
+        if (ret == ERR_NONE) {
+            ret = json_appendf(&out, ",\"heat\":%u,\"last_epoch\":%" PRIu32 "}",
+                               (unsigned) slot_count(slot, epoch, imgstfile),
+                               imgstfile->heat->records[slot].last_epoch);
+        }
+    }
+
+    free(slots);
+
+    if (ret == ERR_NONE) {
+        ret = json_append(&out, "]}", 2);
+    }
+
+    return ret == ERR_NONE ? json_flush(&out) : ret;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+/**
+ * @file imgst_heat.h
+ * @brief Access frequency of the images, kept in a side table.
+ *
+ * Optional, like the index: only long-lived readers (server, daemon) load
+ * it and count the reads they serve. Each metadata slot has a counter that
+ * halves every HEAT_EPOCH_SECONDS without reads, and the epoch of its last
+ * read. Counters are updated in memory and written back to
+ * "<imgstore_filename>.heat" by heat_flush, in the dirty records only.
+ *
+ * The 16 unused bits of a metadata record cannot hold both, and the
+ * metadata is what backups and followers copy: access statistics of one
+ * process stay out of it. Each record is tagged with the SHA of its image
+ * instead, so that a slot reused behind the table's back starts cold.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+#include <time.h> // for time_t
+
+/* appended to the imgStore filename to name the table */
+#define HEAT_SUFFIX ".heat"
+
+/* counters halve every epoch */
+#define HEAT_EPOCH_SECONDS 600
+
+/* how often long-lived readers write the counters back */
+#define HEAT_FLUSH_SECONDS 60
+
+typedef struct heat_record heat_record;
+typedef struct imgst_heat imgst_heat;
+
+/**
+ * @brief Access statistics of a metadata slot, as stored in the table.
+ */
+struct heat_record {
+    uint32_t tag;        // first bytes of the SHA of the image counted
+    uint16_t count;      // reads, halved at every epoch since last_epoch
+    uint16_t reserved;   // zero
+    uint32_t last_epoch; // epoch of the last read
+};
+
+struct imgst_heat {
+    FILE* file;          // the table, NULL if not written back
+    time_t epoch_start;  // start of epoch 0
+    heat_record* records;
+    unsigned char* dirty; // records changed since the last flush
+    size_t nb_dirty;
+};
+
+/**
+ * @brief Loads the access statistics of an imgStore (replacing any previous ones).
+ *
+ * A missing or mismatched table starts empty. With "rb", the table is only
+ * read, and never written back.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @param open_mode "rb" or "rb+", as the imgStore was opened.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int heat_open(const char* imgst_filename, const char* open_mode, imgst_file* imgstfile);
+
+/**
+ * @brief Writes the access statistics back, and frees them. No-op without them.
+ *
+ * @param imgstfile The imgst_file in memory
+ */
+void heat_close(imgst_file* imgstfile);
+
+/**
+ * @brief Writes the changed access statistics back. No-op without them.
+ *
+ * On failure, they stay to be written back by the next call.
+ *
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int heat_flush(imgst_file* imgstfile);
+
+/**
+ * @brief Counts one read of a valid slot, in memory. No-op without statistics.
+ *
+ * @param slot The metadata slot.
+ * @param imgstfile The imgst_file in memory
+ */
+void heat_touch(size_t slot, imgst_file* imgstfile);
+
+/**
+ * @brief Gives the access counter of a slot, decayed up to now.
+ *
+ * @param slot The metadata slot.
+ * @param imgstfile The imgst_file in memory
+ * @return The counter, 0 for an invalid slot, a slot reused since, or without statistics.
+ */
+uint16_t heat_count(size_t slot, const imgst_file* imgstfile);
+
+/**
+ * @brief Gives the current epoch.
+ *
+ * @param heat The access statistics.
+ * @return The number of epochs since epoch_start.
+ */
+uint32_t heat_epoch(const imgst_heat* heat);
+
+/**
+ * @brief Lists the hottest valid slots, hottest first.
+ *
+ * @param slots Array receiving the slots.
+ * @param max The size of slots.
+ * @param imgstfile The imgst_file in memory
+ * @return The number of slots listed: those read at least once, within max.
+ */
+size_t heat_hottest(uint32_t* slots, size_t max, const imgst_file* imgstfile);
+
+/**
+ * @brief Lists the hottest images as a JSON document.
+ *
+ * {"epoch":E,"Images":[{"id":..,"heat":..,"last_epoch":..},...]}
+ *
+ * @param limit The maximal number of images listed, 0 for all.
+ * @param writer Function receiving the document, in pieces.
+ * @param arg Argument of writer.
+ * @param imgstfile The imgst_file in memory, with access statistics.
+ * @return Some error code. 0 if no error.
+ */
+int do_hot(uint32_t limit, list_writer writer, void* arg, const imgst_file* imgstfile);
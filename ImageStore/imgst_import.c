@@ -0,0 +1,731 @@
+/**
+ * @file imgst_import.c
+ * @brief imgStore library: do_import implementation
+ *
+ * Reading, hashing and probing the images is spread over a pool of worker
+ * threads, while the calling thread is the only one touching the imgStore:
+ * it appends the contents and writes the metadata in batches. Derivatives
+ * need no worker at all; originals of a tar stream that carry their SHA and
+ * resolution are only hashed, to check that these are the content's.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for opendir, stat and clock_gettime
+
+#include "imgStore.h"
+#include "image_content.h"
+#include "imgst_index.h"
+#include "job_queue.h"
+#include "buf_pool.h"
+#include "sha_hash.h"
+#include "tar.h"
+
+#include <stdlib.h> // for calloc, qsort
+#include <string.h> // for strcmp, strncpy
+#include <time.h>   // for clock_gettime
+#include <dirent.h> // for opendir, readdir
+#include <sys/stat.h> // for stat
+#include <unistd.h> // for sysconf
+
+#define IMPORT_MAX_PATH 4096
+#define IMPORT_MAX_DEPTH 32
+#define IMPORT_MAX_WORKERS 64
+#define IMPORT_JOBS_PER_WORKER 4 // images read ahead, bounds memory use
+#define IMPORT_MANIFEST_SEPARATORS " \t\r\n"
+#define IMPORT_MAX_PAX_VALUE 80 // long enough for any IMGSTORE.* value but the ID
+
+typedef struct import_job import_job;
+typedef struct import_source import_source;
+typedef struct import_commit import_commit;
+
+/**
+ * One image, from its path to its prepared content.
+ */
+struct import_job {
+    job_list* ready;           // where to hand the job once prepared
+    char img_id[MAX_IMG_ID + 1];
+    char path[IMPORT_MAX_PATH];
+    int res;                   // RES_ORIG, or the resolution of a derivative
+    char* buffer;              // content, read by a worker (or from the tar stream)
+    size_t size;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[DIMS];
+    int prepared;              // whether sha and res_orig came with the content (checked)
+    int error;                 // set when the image cannot be inserted
+};
+
+/**
+ * One change made in memory by the writer, to persist and log.
+ */
+struct import_commit {
+    size_t slot;
+    uint32_t version;
+    uint16_t kind;             // CHANGE_INSERT or CHANGE_RESIZE
+    int res;                   // resolution of a CHANGE_RESIZE
+};
+
+/**
+ * Where the images to import come from: a manifest or a directory tree.
+ */
+struct import_source {
+    FILE* tar;                        // NULL unless reading a tar stream
+    FILE* manifest;                   // NULL unless reading a manifest
+    int error;                        // set when the source itself is broken
+    DIR* dirs[IMPORT_MAX_DEPTH];      // directories being walked, outermost first
+    size_t lens[IMPORT_MAX_DEPTH];    // length of the path of each of them
+    int depth;                        // number of directories being walked
+    size_t root_len;                  // length of the path of the top directory
+    char path[IMPORT_MAX_PATH];       // path of the current entry
+};
+
+/**
+ * Seconds elapsed since some fixed point.
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Opens a directory or a manifest.
+ */
+static int source_open(const char* path, import_source* src)
+{
+    memset(src, 0, sizeof(import_source));
+
+    // "-" and *.tar are tar streams
+    const size_t path_len = strlen(path);
+
+    if (!strcmp(path, "-")) {
+        src->tar = stdin;
+        return ERR_NONE;
+    }
+
+    if (path_len > 4 && !strcmp(path + path_len - 4, ".tar")) {
+        src->tar = fopen(path, "rb");
+        return src->tar == NULL ? ERR_IO : ERR_NONE;
+    }
+
+    struct stat st;
+    M_EXIT_IF(stat(path, &st) != 0, ERR_IO, "cannot stat import source", );
+
+    if (!S_ISDIR(st.st_mode)) {
+        src->manifest = fopen(path, "r");
+        return src->manifest == NULL ? ERR_IO : ERR_NONE;
+    }
+
+    src->root_len = strlen(path);
+    M_EXIT_IF(src->root_len >= IMPORT_MAX_PATH, ERR_INVALID_FILENAME, "import path too long", );
+
+    // IDs are relative to the directory, without leading separator
+    while (src->root_len > 1 && path[src->root_len - 1] == '/') {
+        --src->root_len;
+    }
+
+    memcpy(src->path, path, src->root_len);
+    src->path[src->root_len] = '\0';
+
+    src->dirs[0] = opendir(src->path);
+    M_EXIT_IF(src->dirs[0] == NULL, ERR_IO, "cannot open import directory", );
+
+    src->lens[0] = src->root_len;
+    src->depth = 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Closes what is left open of a source.
+ */
+static void source_close(import_source* src)
+{
+    if (src->tar != NULL && src->tar != stdin) {
+        fclose(src->tar);
+    }
+
+    src->tar = NULL;
+
+    if (src->manifest != NULL) {
+        fclose(src->manifest);
+        src->manifest = NULL;
+    }
+
+    while (src->depth > 0) {
+        closedir(src->dirs[--src->depth]);
+    }
+}
+
+/**
+ * Fills job with the next image of a manifest. Returns 0 once exhausted.
+ */
+static int manifest_next(import_source* src, import_job* job)
+{
+    while (fgets(src->path, sizeof(src->path), src->manifest) != NULL) {
+        if (strchr(src->path, '\n') == NULL && !feof(src->manifest)) {
+            // Line too long: skip the rest of it
+            int c = 0;
+            while ((c = getc(src->manifest)) != '\n' && c != EOF);
+            strncpy(job->img_id, src->path, MAX_IMG_ID);
+            job->error = ERR_INVALID_FILENAME;
+            return 1;
+        }
+
+        const char* img_id = strtok(src->path, IMPORT_MANIFEST_SEPARATORS);
+
+        // Skip blank lines and comments
+        if (img_id == NULL || img_id[0] == '#') {
+            continue;
+        }
+
+        const char* path = strtok(NULL, "\r\n");
+
+        // The path is the rest of the line, without leading blanks
+        while (path != NULL && (*path == ' ' || *path == '\t')) {
+            ++path;
+        }
+
+        strncpy(job->img_id, img_id, MAX_IMG_ID);
+
+        if (strlen(img_id) > MAX_IMG_ID) {
+            job->error = ERR_INVALID_IMGID;
+        } else if (path == NULL || *path == '\0') {
+            job->error = ERR_NOT_ENOUGH_ARGUMENTS;
+        } else {
+            strncpy(job->path, path, IMPORT_MAX_PATH - 1);
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Fills job with the next regular file below the directory. Returns 0 once exhausted.
+ */
+static int directory_next(import_source* src, import_job* job)
+{
+    while (src->depth > 0) {
+        const size_t len = src->lens[src->depth - 1];
+        const struct dirent* entry = readdir(src->dirs[src->depth - 1]);
+
+        if (entry == NULL) {
+            closedir(src->dirs[--src->depth]);
+            continue;
+        }
+
+        // Skip ".", ".." and hidden files
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        const int n = snprintf(src->path + len, sizeof(src->path) - len, "/%s", entry->d_name);
+
+        if (n < 0 || (size_t) n >= sizeof(src->path) - len) {
+            continue;
+        }
+
+        struct stat st;
+
+        if (stat(src->path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (src->depth < IMPORT_MAX_DEPTH) {
+                DIR* sub = opendir(src->path);
+
+                if (sub != NULL) {
+                    src->dirs[src->depth] = sub;
+                    src->lens[src->depth] = len + (size_t) n;
+                    ++src->depth;
+                }
+            }
+
+        } else if (S_ISREG(st.st_mode)) {
+            const char* img_id = src->path + src->root_len + 1;
+
+            strncpy(job->img_id, img_id, MAX_IMG_ID);
+            strncpy(job->path, src->path, IMPORT_MAX_PATH - 1);
+
+            if (strlen(img_id) > MAX_IMG_ID) {
+                job->error = ERR_INVALID_IMGID;
+            }
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a SHA written in hexadecimal. Returns 1 on success.
+ */
+static int sha_from_hex(const char* hex, unsigned char* sha)
+{
+    if (strlen(hex) != 2 * SHA256_DIGEST_LENGTH) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        unsigned int byte = 0;
+
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return 0;
+        }
+
+        sha[i] = (unsigned char) byte;
+    }
+
+    return 1;
+}
+
+/**
+ * Fills job with the next entry of a tar stream, content included. Returns 0 once exhausted.
+ *
+ * Without IMGSTORE.* pax records (any tar), the path is the ID of an original.
+ */
+static int tar_next(import_source* src, import_job* job)
+{
+    tar_entry entry;
+    int end = 0;
+
+    // A broken stream ends the import, as the following entries cannot be found
+    src->error = tar_read_entry(src->tar, &entry, &end);
+
+    if (src->error != ERR_NONE || end) {
+        return 0;
+    }
+
+    char value[IMPORT_MAX_PAX_VALUE];
+
+    if (!tar_pax_get(&entry, "IMGSTORE.id", job->img_id, sizeof(job->img_id))) {
+        strncpy(job->img_id, entry.name, MAX_IMG_ID);
+        job->error = strlen(entry.name) > MAX_IMG_ID ? ERR_INVALID_IMGID : ERR_NONE;
+    }
+
+    // Would be exported outside the target directory
+    if (job->error == ERR_NONE) {
+        job->error = check_relative_id(job->img_id);
+    }
+
+    job->res = RES_ORIG;
+
+    if (tar_pax_get(&entry, "IMGSTORE.res", value, sizeof(value))
+        && (job->res = resolution_atoi(value)) == NOT_RES) {
+        job->error = ERR_RESOLUTIONS;
+    }
+
+    // The SHA and resolution of the archive, if given, checked by a worker
+    char width[IMPORT_MAX_PAX_VALUE], height[IMPORT_MAX_PAX_VALUE];
+
+    job->prepared = tar_pax_get(&entry, "IMGSTORE.sha", value, sizeof(value))
+                    && sha_from_hex(value, job->sha)
+                    && tar_pax_get(&entry, "IMGSTORE.width", width, sizeof(width))
+                    && tar_pax_get(&entry, "IMGSTORE.height", height, sizeof(height));
+
+    if (job->prepared) {
+        job->res_orig[0] = (uint32_t) strtoul(width, NULL, 10);
+        job->res_orig[1] = (uint32_t) strtoul(height, NULL, 10);
+    }
+
+    // The content is read here, in stream order
+    if (entry.size == 0 || entry.size > UINT32_MAX) {
+        job->error = ERR_IO;
+    } else if ((job->buffer = pool_alloc(entry.size)) == NULL) {
+        job->error = ERR_OUT_OF_MEMORY;
+    } else {
+        job->size = entry.size;
+    }
+
+    const int ret = job->buffer != NULL ? tar_read_data(src->tar, job->buffer, entry.size)
+                    : tar_skip_data(src->tar, entry.size);
+
+    if (ret != ERR_NONE) {
+        src->error = ret;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Fills job with the next image of a source. Returns 0 once exhausted.
+ */
+static int source_next(import_source* src, import_job* job)
+{
+    job->res = RES_ORIG;
+
+    if (src->tar != NULL) {
+        return tar_next(src, job);
+    }
+
+    return src->manifest != NULL ? manifest_next(src, job) : directory_next(src, job);
+}
+
+/**
+ * Whether a job needs a worker: only originals, to hash and probe, do.
+ */
+static int needs_worker(const import_job* job)
+{
+    return job->error == ERR_NONE && job->res == RES_ORIG;
+}
+
+/**
+ * Worker: reads, hashes and probes an image.
+ */
+static void prepare_job(void* arg)
+{
+    import_job* job = arg;
+
+    if (!needs_worker(job)) {
+        return;
+    }
+
+    // Contents of tar streams are already read
+    if (job->buffer != NULL) {
+        // The SHA drives dedup: that of a stale or edited archive is not taken
+        // on trust, and the content is then prepared as any other one
+        if (job->prepared) {
+            unsigned char sha[SHA256_DIGEST_LENGTH];
+            sha_digest(job->buffer, job->size, sha);
+
+            if (memcmp(sha, job->sha, SHA256_DIGEST_LENGTH) == 0) {
+                return;
+            }
+        }
+
+        job->error = prepare_insert(job->buffer, job->size, job->sha, job->res_orig);
+        return;
+    }
+
+    FILE* file = fopen(job->path, "rb");
+
+    if (file == NULL) {
+        job->error = ERR_IO;
+        return;
+    }
+
+    long size = -1;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+        rewind(file);
+    }
+
+    if (size <= 0) {
+        job->error = ERR_IO;
+    } else if ((job->buffer = pool_alloc((size_t) size)) == NULL) {
+        job->error = ERR_OUT_OF_MEMORY;
+    } else if (fread(job->buffer, (size_t) size, 1, file) != 1) {
+        job->error = ERR_IO;
+    } else {
+        job->size = (size_t) size;
+        job->error = prepare_insert(job->buffer, job->size, job->sha, job->res_orig);
+    }
+
+    fclose(file);
+}
+
+/**
+ * Worker: hands a prepared image to the writer.
+ */
+static void hand_job(void* arg)
+{
+    import_job* job = arg;
+    job_list_push(job->ready, job);
+}
+
+/**
+ * Frees an image.
+ */
+static void free_job(import_job* job)
+{
+    pool_free(job->buffer);
+    free(job);
+}
+
+/**
+ * Orders metadata slots.
+ */
+static int compare_slots(const void* a, const void* b)
+{
+    const size_t x = *(const size_t*) a;
+    const size_t y = *(const size_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writer: applies one job in memory, setting applied unless there was nothing to do.
+ * Returns some error code.
+ */
+static int apply_job(const import_job* job, import_commit* commit, int* applied,
+                     imgst_file* imgstfile)
+{
+    *applied = 0;
+
+    if (job->res == RES_ORIG) {
+        M_EXIT_IF_ERR(insert_prepared(job->buffer, job->size, job->img_id, job->sha,
+                                      job->res_orig, &commit->slot, imgstfile));
+        commit->kind = CHANGE_INSERT;
+        commit->res = NOT_RES;
+
+    } else {
+        // A derivative goes with its original, inserted before
+        M_EXIT_IF_ERR(findMetadataIndex(&commit->slot, job->img_id, imgstfile));
+
+        // A deduplicated original shares the derivatives of its twin
+        if (imgstfile->metadata[commit->slot].offset[job->res] != 0) {
+            return ERR_NONE;
+        }
+
+        M_EXIT_IF_ERR(append_resized(job->res, imgstfile, commit->slot, job->buffer, job->size));
+        commit->kind = CHANGE_RESIZE;
+        commit->res = job->res;
+    }
+
+    commit->version = imgstfile->header.imgst_version;
+    *applied = 1;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writer: applies jobs in memory, then writes their metadata, the header and
+ * the change log once for all of them.
+ */
+static void commit_batch(import_job** jobs, size_t nb_jobs, import_commit* commits, size_t* slots,
+                         int* error, import_stats* stats, imgst_file* imgstfile)
+{
+    size_t nb_commits = 0;
+
+    for (size_t j = 0; j < nb_jobs; ++j) {
+        import_job* job = jobs[j];
+
+        int ret = job->error;
+
+        if (ret == ERR_NONE && *error == ERR_NONE) {
+            int applied = 0;
+            ret = apply_job(job, &commits[nb_commits], &applied, imgstfile);
+
+            if (ret == ERR_NONE && applied) {
+                slots[nb_commits] = commits[nb_commits].slot;
+                ++nb_commits;
+
+            } else if (ret == ERR_IO || ret == ERR_OUT_OF_MEMORY) {
+                // The imgStore itself failed: stop everything
+                *error = ret;
+            }
+        }
+
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "%s: %s\n", job->img_id, ERR_MESSAGES[ret]);
+            ++stats->failed;
+        }
+
+        free_job(job);
+    }
+
+    if (nb_commits == 0) {
+        return;
+    }
+
+    // Consecutive slots are written at once (new images mostly fill consecutive free slots)
+    qsort(slots, nb_commits, sizeof(size_t), compare_slots);
+
+    for (size_t first = 0; first < nb_commits && *error == ERR_NONE;) {
+        size_t last = first;
+
+        while (last + 1 < nb_commits && slots[last + 1] <= slots[last] + 1) {
+            ++last;
+        }
+
+        *error = updateMetadataRange(slots[first], slots[last] - slots[first] + 1, imgstfile);
+        first = last + 1;
+    }
+
+    if (*error == ERR_NONE) {
+        *error = updateHeader(imgstfile);
+    }
+
+    // In order, each change with its own version, so that the feed stays resumable
+    for (size_t i = 0; i < nb_commits && *error == ERR_NONE; ++i) {
+        *error = log_change_at(commits[i].version, commits[i].kind, commits[i].slot,
+                               commits[i].res, imgstfile);
+    }
+
+    if (*error == ERR_NONE) {
+        stats->imported += nb_commits;
+    }
+}
+
+/**
+ * Reports the progress of an import on stderr.
+ */
+static void report_progress(const import_stats* stats, double seconds)
+{
+    fprintf(stderr, "%zu imported, %zu failed, %.0f images/s\n",
+            stats->imported, stats->failed,
+            seconds > 0 ? (double) stats->imported / seconds : 0.0);
+}
+
+/**
+ * Inserts many images at once.
+ */
+int do_import(const char* source, size_t nb_workers, int progress,
+              import_stats* stats, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(source);
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(import_stats));
+
+    if (nb_workers == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_workers = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    if (nb_workers > IMPORT_MAX_WORKERS) {
+        nb_workers = IMPORT_MAX_WORKERS;
+    }
+
+    // Dedup and free slot searches must not scan the whole imgStore per image
+    if (imgstfile->index == NULL) {
+        M_EXIT_IF_ERR(index_build(imgstfile));
+    }
+
+    const size_t max_in_flight = nb_workers * IMPORT_JOBS_PER_WORKER;
+
+    import_commit* commits = calloc(max_in_flight, sizeof(import_commit));
+    size_t* slots = calloc(max_in_flight, sizeof(size_t));
+    import_job** taken = calloc(max_in_flight, sizeof(import_job*));
+    import_job** pending = calloc(max_in_flight, sizeof(import_job*));
+
+    if (commits == NULL || slots == NULL || taken == NULL || pending == NULL) {
+        free(commits);
+        free(slots);
+        free(taken);
+        free(pending);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    import_source src;
+    job_list ready;
+    job_queue queue;
+    int error = source_open(source, &src);
+
+    if (error == ERR_NONE && (error = job_list_init(&ready, max_in_flight)) != ERR_NONE) {
+        source_close(&src);
+    }
+
+    if (error == ERR_NONE
+        && (error = job_queue_init(&queue, max_in_flight, nb_workers, prepare_job, hand_job)) != ERR_NONE) {
+        job_list_free(&ready);
+        source_close(&src);
+    }
+
+    if (error != ERR_NONE) {
+        free(commits);
+        free(slots);
+        free(taken);
+        free(pending);
+        return error;
+    }
+
+    const double start = now_seconds();
+    double last_report = start;
+    size_t in_flight = 0;    // jobs handed to the workers
+    size_t nb_pending = 0;   // jobs for the writer only
+    import_job* held = NULL; // derivative waiting for the originals in flight
+    int exhausted = 0;
+
+    while (!exhausted || in_flight > 0 || nb_pending > 0 || held != NULL) {
+        // Keep the workers busy, within the memory bound
+        while (held == NULL && !exhausted && in_flight < max_in_flight && nb_pending < max_in_flight) {
+            // Nothing more can go in a full imgStore (but derivatives), nor after a failure
+            if (error != ERR_NONE
+                || (src.tar == NULL && imgstfile->header.num_files >= imgstfile->header.max_files)) {
+                exhausted = 1;
+                break;
+            }
+
+            import_job* job = calloc(1, sizeof(import_job));
+
+            if (job == NULL) {
+                error = ERR_OUT_OF_MEMORY;
+                exhausted = 1;
+                break;
+            }
+
+            job->ready = &ready;
+
+            if (!source_next(&src, job)) {
+                free_job(job);
+                exhausted = 1;
+                break;
+            }
+
+            if (needs_worker(job)) {
+                // Cannot be busy: at most max_in_flight jobs are queued
+                job_queue_submit(&queue, job);
+                ++in_flight;
+
+            } else if (job->res != RES_ORIG && in_flight > 0) {
+                // Its original may still be in flight
+                held = job;
+
+            } else {
+                pending[nb_pending++] = job;
+            }
+        }
+
+        // What needs no worker first: it came before what follows in the source
+        if (nb_pending > 0) {
+            commit_batch(pending, nb_pending, commits, slots, &error, stats, imgstfile);
+            nb_pending = 0;
+        }
+
+        if (in_flight > 0) {
+            const size_t nb_taken = job_list_take(&ready, (void**) taken, max_in_flight);
+            commit_batch(taken, nb_taken, commits, slots, &error, stats, imgstfile);
+            in_flight -= nb_taken;
+
+        } else if (held != NULL) {
+            pending[nb_pending++] = held;
+            held = NULL;
+        }
+
+        if (progress && now_seconds() - last_report >= 1.0) {
+            last_report = now_seconds();
+            report_progress(stats, last_report - start);
+        }
+    }
+
+    job_queue_free(&queue);
+    job_list_free(&ready);
+    source_close(&src);
+
+    if (error == ERR_NONE) {
+        error = src.error;
+    }
+
+    free(commits);
+    free(slots);
+    free(taken);
+    free(pending);
+
+    stats->seconds = now_seconds() - start;
+
+    if (progress) {
+        report_progress(stats, stats->seconds);
+    }
+
+    return error;
+}
@@ -0,0 +1,254 @@
+/**
+ * @file imgst_index.c
+ * @brief In-memory hash indexes of the metadata, by image ID and by SHA.
+ *
+ * Both tables use open addressing with linear probing and hold slot + 1, so
+ * that a zeroed table is empty. Entries are checked against the metadata
+ * itself, which stays the only source of truth.
+ *
+ * @author ???
+ */
+
+#include "imgst_index.h"
+#include "huge_pages.h"
+#include "sha_hash.h"
+#include "meta_scan.h"
+
+#include <stdlib.h> // for calloc
+#include <string.h> // for strncmp
+
+// FNV-1a 64 bits
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+/**
+ * Hash of an image ID.
+ */
+static uint64_t hash_id(const char* img_id)
+{
+    uint64_t h = FNV_OFFSET;
+
+    for (size_t i = 0; i <= MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        h ^= (unsigned char) img_id[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+/**
+ * Hash of a SHA: its first bytes are already uniformly distributed.
+ */
+static uint64_t hash_sha(const unsigned char* sha)
+{
+    return sha_fingerprint(sha);
+}
+
+/**
+ * Inserts slot + 1 in the first empty or removed bucket from hash.
+ */
+static void table_insert(uint32_t* table, size_t capacity, uint64_t hash, size_t idx)
+{
+    size_t b = (size_t) hash & (capacity - 1);
+
+    while (table[b] != INDEX_EMPTY && table[b] != INDEX_TOMBSTONE) {
+        b = (b + 1) & (capacity - 1);
+    }
+
+    table[b] = (uint32_t) (idx + 1);
+}
+
+/**
+ * Replaces the bucket of slot by a tombstone. Returns 1 if it was found.
+ */
+static int table_remove(uint32_t* table, size_t capacity, uint64_t hash, size_t idx)
+{
+    size_t b = (size_t) hash & (capacity - 1);
+
+    while (table[b] != INDEX_EMPTY) {
+        if (table[b] == idx + 1) {
+            table[b] = INDEX_TOMBSTONE;
+            return 1;
+        }
+
+        b = (b + 1) & (capacity - 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Builds the indexes of an open imgStore.
+ */
+int index_build(imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    index_free(imgstfile);
+
+    imgst_index* index = calloc(1, sizeof(imgst_index));
+    M_EXIT_IF_NULL(index, sizeof(imgst_index));
+
+    // At most half full
+    index->capacity = 1;
+
+    while (index->capacity < 2 * (size_t) imgstfile->header.max_files) {
+        index->capacity <<= 1;
+    }
+
+    // Probed at random: on huge pages if large
+    index->by_id = huge_calloc(index->capacity, sizeof(uint32_t));
+    index->by_sha = huge_calloc(index->capacity, sizeof(uint32_t));
+
+    if (index->by_id == NULL || index->by_sha == NULL) {
+        huge_free(index->by_id);
+        huge_free(index->by_sha);
+        free(index);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    index->next_free = imgstfile->header.max_files;
+
+    for (size_t i = 0; i < imgstfile->header.max_files; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[i];
+
+        if (meta->is_valid == NON_EMPTY) {
+            table_insert(index->by_id, index->capacity, hash_id(meta->img_id), i);
+            table_insert(index->by_sha, index->capacity, hash_sha(meta->SHA), i);
+
+        } else if (index->next_free == imgstfile->header.max_files) {
+            index->next_free = i;
+        }
+    }
+
+    imgstfile->index = index;
+
+    return ERR_NONE;
+}
+
+/**
+ * Frees the indexes of an imgStore, if any.
+ */
+void index_free(imgst_file* imgstfile)
+{
+    if (imgstfile != NULL && imgstfile->index != NULL) {
+        huge_free(imgstfile->index->by_id);
+        huge_free(imgstfile->index->by_sha);
+        FREE_DEREF(imgstfile->index);
+    }
+}
+
+/**
+ * Records a newly valid metadata slot.
+ */
+int index_add(const size_t idx, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    imgst_index* index = imgstfile->index;
+
+    if (index == NULL) {
+        return ERR_NONE;
+    }
+
+    // Too many tombstones make probes long: start afresh
+    if (index->tombstones > index->capacity / 4) {
+        return index_build(imgstfile);
+    }
+
+    const img_metadata* meta = &imgstfile->metadata[idx];
+    table_insert(index->by_id, index->capacity, hash_id(meta->img_id), idx);
+    table_insert(index->by_sha, index->capacity, hash_sha(meta->SHA), idx);
+
+    if (index->next_free == idx) {
+        ++index->next_free;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Forgets a metadata slot about to become invalid.
+ */
+void index_remove(const size_t idx, imgst_file* imgstfile)
+{
+    if (imgstfile == NULL || imgstfile->index == NULL) {
+        return;
+    }
+
+    imgst_index* index = imgstfile->index;
+    const img_metadata* meta = &imgstfile->metadata[idx];
+
+    index->tombstones += (size_t) table_remove(index->by_id, index->capacity, hash_id(meta->img_id), idx);
+    index->tombstones += (size_t) table_remove(index->by_sha, index->capacity, hash_sha(meta->SHA), idx);
+
+    if (idx < index->next_free) {
+        index->next_free = idx;
+    }
+}
+
+/**
+ * Finds the valid slot with a given ID.
+ */
+size_t index_find_id(const char* img_id, const imgst_file* imgstfile)
+{
+    const imgst_index* index = imgstfile->index;
+    size_t b = (size_t) hash_id(img_id) & (index->capacity - 1);
+
+    while (index->by_id[b] != INDEX_EMPTY) {
+        if (index->by_id[b] != INDEX_TOMBSTONE) {
+            const size_t idx = index->by_id[b] - 1;
+            const img_metadata* meta = &imgstfile->metadata[idx];
+
+            if (meta->is_valid == NON_EMPTY && !strncmp(meta->img_id, img_id, MAX_IMG_ID)) {
+                return idx;
+            }
+        }
+
+        b = (b + 1) & (index->capacity - 1);
+    }
+
+    return INDEX_NOT_FOUND;
+}
+
+/**
+ * Finds a valid slot, other than exclude, with a given SHA.
+ */
+size_t index_find_sha(const unsigned char* sha, const size_t exclude, const imgst_file* imgstfile)
+{
+    const imgst_index* index = imgstfile->index;
+    size_t b = (size_t) hash_sha(sha) & (index->capacity - 1);
+
+    while (index->by_sha[b] != INDEX_EMPTY) {
+        if (index->by_sha[b] != INDEX_TOMBSTONE) {
+            const size_t idx = index->by_sha[b] - 1;
+            const img_metadata* meta = &imgstfile->metadata[idx];
+
+            if (idx != exclude && meta->is_valid == NON_EMPTY && shaCompare(meta->SHA, sha) == 0) {
+                return idx;
+            }
+        }
+
+        b = (b + 1) & (index->capacity - 1);
+    }
+
+    return INDEX_NOT_FOUND;
+}
+
+/**
+ * Finds the first free metadata slot.
+ */
+size_t find_free_slot(imgst_file* imgstfile)
+{
+    // Without index, or when the hint is stale, scan from the start (or the hint)
+    const size_t from = (imgstfile->index != NULL) ? imgstfile->index->next_free : 0;
+    const size_t idx = meta_next_state(imgstfile->metadata, from, imgstfile->header.max_files, EMPTY);
+
+    if (imgstfile->index != NULL) {
+        imgstfile->index->next_free = idx;
+    }
+
+    return idx;
+}
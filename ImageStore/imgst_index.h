@@ -0,0 +1,88 @@
+#pragma once
+
+/**
+ * @file imgst_index.h
+ * @brief In-memory hash indexes of the metadata, by image ID and by SHA.
+ *
+ * Optional: an imgst_file without index falls back to linear scans of the
+ * metadata. Long-lived users (server, batch, import) build one so that
+ * lookups, dedup and free slot searches do not grow with the store size.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+/* empty bucket marker (buckets hold slot + 1) */
+#define INDEX_EMPTY 0
+/* removed entry marker */
+#define INDEX_TOMBSTONE UINT32_MAX
+/* not found result of the lookups */
+#define INDEX_NOT_FOUND SIZE_MAX
+
+struct imgst_index {
+    size_t capacity;     // number of buckets of each table, a power of two
+    size_t tombstones;   // number of removed entries, over both tables
+    size_t next_free;    // no free metadata slot below this one
+    uint32_t* by_id;     // slot + 1 of each valid image, hashed by ID
+    uint32_t* by_sha;    // slot + 1 of each valid image, hashed by SHA (duplicates allowed)
+};
+
+/**
+ * @brief Builds the indexes of an open imgStore (replacing any previous ones).
+ *
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int index_build(imgst_file* imgstfile);
+
+/**
+ * @brief Frees the indexes of an imgStore, if any.
+ *
+ * @param imgstfile The imgst_file in memory
+ */
+void index_free(imgst_file* imgstfile);
+
+/**
+ * @brief Records a newly valid metadata slot. No-op without index.
+ *
+ * @param idx The slot, whose ID and SHA are set.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int index_add(const size_t idx, imgst_file* imgstfile);
+
+/**
+ * @brief Forgets a metadata slot about to become invalid. No-op without index.
+ *
+ * @param idx The slot, whose ID and SHA are still set.
+ * @param imgstfile The imgst_file in memory
+ */
+void index_remove(const size_t idx, imgst_file* imgstfile);
+
+/**
+ * @brief Finds the valid slot with a given ID.
+ *
+ * @param img_id The image ID.
+ * @param imgstfile The imgst_file in memory, with index.
+ * @return The slot, or INDEX_NOT_FOUND.
+ */
+size_t index_find_id(const char* img_id, const imgst_file* imgstfile);
+
+/**
+ * @brief Finds a valid slot, other than exclude, with a given SHA.
+ *
+ * @param sha The SHA of the content.
+ * @param exclude A slot to ignore (typically the one being inserted).
+ * @param imgstfile The imgst_file in memory, with index.
+ * @return The slot, or INDEX_NOT_FOUND.
+ */
+size_t index_find_sha(const unsigned char* sha, const size_t exclude, const imgst_file* imgstfile);
+
+/**
+ * @brief Finds the first free metadata slot.
+ *
+ * @param imgstfile The imgst_file in memory (with or without index).
+ * @return The slot, or max_files if the imgStore is full.
+ */
+size_t find_free_slot(imgst_file* imgstfile);
@@ -8,15 +8,47 @@
 #include "dedup.h"
 #include "error.h"
 #include "image_content.h"
+#include "imgst_index.h"
+#include "sha_hash.h"
 #include <stdlib.h> // for realloc
-#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH and SHA256()
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
-int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile)
+/**
+ * Computes the SHA and resolution of an image.
+ */
+int prepare_insert(const char* image_buffer, size_t image_size,
+                   unsigned char sha[SHA256_DIGEST_LENGTH], uint32_t res_orig[DIMS])
 {
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(res_orig);
+
+    sha_digest(image_buffer, image_size, sha);
+
+    // Get resolution of the image (which also checks that it is one)
+    uint32_t height = 0, width = 0;
+    M_EXIT_IF_ERR(get_resolution(&height, &width, image_buffer, image_size));
 
+    res_orig[0] = width;
+    res_orig[1] = height;
+
+    return ERR_NONE;
+}
+
+/**
+ * Inserts a prepared image in memory, appending its content if new.
+ */
+int insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                    const unsigned char sha[SHA256_DIGEST_LENGTH], const uint32_t res_orig[DIMS],
+                    size_t* idx, imgst_file* imgstfile)
+{
     // Null-pointer checks
     M_REQUIRE_NON_NULL(image_buffer);
     M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(res_orig);
+    M_REQUIRE_NON_NULL(idx);
     M_REQUIRE_NON_NULL(imgstfile);
     M_REQUIRE_NON_NULL(imgstfile->metadata);
 
@@ -25,27 +57,21 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, i
               ERR_FULL_IMGSTORE, "insert with full imgstore", );
 
     // Find index of empty slot (ie. isValid == 0) which is guarenteed to exist!
-    int index = 0;
-
-    while(index < imgstfile->header.max_files
-          && imgstfile->metadata[index].is_valid != 0) {
-
-        ++index;
-    }
+    const size_t index = find_free_slot(imgstfile);
+    img_metadata* meta = &imgstfile->metadata[index];
 
     /// Initialize the metadata for the image to insert.
 
-    // Get SHA and ID and check against all other images for duplicates
-    unsigned char sha[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char *)image_buffer, image_size, sha);
-    memcpy(imgstfile->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
-    memcpy(imgstfile->metadata[index].img_id, img_id, (MAX_IMG_ID + 1) * sizeof(char));
+    // Set SHA and ID and check against all other images for duplicates
+    memset(meta, 0, sizeof(img_metadata));
+    memcpy(meta->SHA, sha, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+    strncpy(meta->img_id, img_id, MAX_IMG_ID);
 
     // De-dup if content-duplicate, or exit if name-duplicate
-    M_EXIT_IF_ERR(do_name_and_content_dedup(imgstfile, index));
+    M_EXIT_IF_ERR(do_name_and_content_dedup(imgstfile, (uint32_t) index));
 
     // If content-original then the previous function sets offset[RES_ORIG] to 0
-    if(imgstfile->metadata[index].offset[RES_ORIG] == 0) {
+    if(meta->offset[RES_ORIG] == 0) {
 
         // If the image content is new, add it to end of file
         if (fseek(imgstfile->file, 0, SEEK_END) != 0) {
@@ -55,7 +81,7 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, i
         const long offset_endfile = ftell(imgstfile->file);
 
         // Update offset metadata field with the location in file of the newly inserted image
-        imgstfile->metadata[index].offset[RES_ORIG] = offset_endfile;
+        meta->offset[RES_ORIG] = offset_endfile;
 
         // Append the original image to the store
         size_t num_image_written = 0;
@@ -66,25 +92,69 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, i
         }
     }
 
-    // Get resolution of the image and update the metadatum accordingly
-    uint32_t height = 0, width = 0;
-    M_EXIT_IF_ERR(get_resolution(&height, &width, image_buffer, image_size));
-
-    imgstfile->metadata[index].res_orig[0] = width;
-    imgstfile->metadata[index].res_orig[1] = height;
+    meta->res_orig[0] = res_orig[0];
+    meta->res_orig[1] = res_orig[1];
 
     // Rest: metadata fields that don't depend on being a duplicate (or overlap)
-    imgstfile->metadata[index].is_valid = NON_EMPTY;
-    imgstfile->metadata[index].size[RES_ORIG] = (uint32_t)image_size;
+    meta->is_valid = NON_EMPTY;
+    meta->size[RES_ORIG] = (uint32_t)image_size;
+
+    // Valid first, as a rebuild of the index takes the valid slots; not valid if it failed
+    M_EXIT_IF_ERR_DO_SOMETHING(index_add(index, imgstfile), meta->is_valid = EMPTY);
 
     // Update header
     imgstfile->header.imgst_version += 1;
     imgstfile->header.num_files += 1;
 
+    *idx = index;
+
+    return ERR_NONE;
+}
+
+int do_insert(const char* image_buffer, size_t image_size, const char* img_id, imgst_file* imgstfile)
+{
+
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    // Check if database is full before doing any work
+    M_EXIT_IF(imgstfile->header.num_files >= imgstfile->header.max_files,
+              ERR_FULL_IMGSTORE, "insert with full imgstore", );
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[DIMS];
+    M_EXIT_IF_ERR(prepare_insert(image_buffer, image_size, sha, res_orig));
+
+    return do_insert_prepared(image_buffer, image_size, img_id, sha, res_orig, imgstfile);
+}
+
+/**
+ * Inserts a prepared image and writes it through.
+ */
+int do_insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                       const unsigned char sha[SHA256_DIGEST_LENGTH], const uint32_t res_orig[DIMS],
+                       imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(res_orig);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    size_t index = 0;
+    M_EXIT_IF_ERR(insert_prepared(image_buffer, image_size, img_id, sha, res_orig, &index, imgstfile));
+
     // Write change of header and metadata to disk
     M_EXIT_IF_ERR(updateHeader(imgstfile));
     M_EXIT_IF_ERR(updateMetadata(index, imgstfile));
 
+    // Record the change for change feed consumers
+    M_EXIT_IF_ERR(log_change(CHANGE_INSERT, index, NOT_RES, imgstfile));
+
     return ERR_NONE;
 }
-
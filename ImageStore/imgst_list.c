@@ -6,14 +6,112 @@
  */
 
 #include "imgStore.h"
+#include "json_writer.h"
+#include "meta_scan.h"
 
-void do_list(const imgst_file* imgstfile)
+#include <inttypes.h> // for PRIu32
+
+/**
+ * Finds the first valid metadata slot at or after from (max_files if none).
+ */
+static uint32_t next_valid_slot(const imgst_file* imgstfile, uint32_t from)
+{
+    return (uint32_t) meta_next_state(imgstfile->metadata, from, imgstfile->header.max_files, NON_EMPTY);
+}
+
+/**
+ * Prepares a JSON listing starting at a given slot.
+ */
+void list_stream_init(list_stream* stream, uint32_t cursor, uint32_t limit)
+{
+    if (stream != NULL) {
+        stream->cursor = cursor;
+        stream->limit = limit;
+        stream->written = 0;
+        stream->state = LIST_BEGIN;
+    }
+}
+
+/**
+ * Emits the next part of a JSON listing through writer.
+ */
+int do_list_step(const imgst_file* imgstfile, list_stream* stream, uint32_t budget,
+                 list_writer writer, void* arg)
 {
-    // Null-pointer check (no macro because void return type)
-    if (imgstfile == NULL || imgstfile->metadata == NULL) {
-        return;
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(writer);
+
+    M_EXIT_IF(stream->state == LIST_IDLE, ERR_INVALID_ARGUMENT,
+              "listing was not initialized", );
+
+    if (stream->state == LIST_DONE) {
+        return ERR_NONE;
     }
 
+    json_buffer out = { .len = 0, .writer = writer, .arg = arg };
+
+    if (stream->state == LIST_BEGIN) {
+        const char begin[] = "{\"Images\":[";
+        M_EXIT_IF_ERR(json_append(&out, begin, sizeof(begin) - 1));
+        stream->state = LIST_ENTRIES;
+    }
+
+    // Emit at most budget entries, stopping at the limit
+    stream->cursor = next_valid_slot(imgstfile, stream->cursor);
+
+    while (budget > 0 && stream->cursor < imgstfile->header.max_files
+           && (stream->limit == 0 || stream->written < stream->limit)) {
+
+        if (stream->written > 0) {
+            M_EXIT_IF_ERR(json_append(&out, ",", 1));
+        }
+
+        M_EXIT_IF_ERR(json_append_id(&out, imgstfile->metadata[stream->cursor].img_id));
+        ++stream->written;
+        --budget;
+
+        stream->cursor = next_valid_slot(imgstfile, stream->cursor + 1);
+    }
+
+    // Close the document once there is nothing left or the limit is reached
+    if (stream->cursor >= imgstfile->header.max_files) {
+        M_EXIT_IF_ERR(json_append(&out, "]}", 2));
+        stream->state = LIST_DONE;
+
+    } else if (stream->limit != 0 && stream->written >= stream->limit) {
+        M_EXIT_IF_ERR(json_appendf(&out, "],\"next\":%" PRIu32 "}", stream->cursor));
+        stream->state = LIST_DONE;
+    }
+
+    return json_flush(&out);
+}
+
+/**
+ * Lists imgStore metadata, human-readable on stdout or as JSON.
+ */
+int do_list(const imgst_file* imgstfile, enum do_list_mode output_mode,
+            uint32_t cursor, uint32_t limit, list_writer writer, void* arg)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    if (output_mode == JSON) {
+        list_stream stream;
+        list_stream_init(&stream, cursor, limit);
+
+        while (stream.state != LIST_DONE) {
+            M_EXIT_IF_ERR(do_list_step(imgstfile, &stream, LIST_STEP_ENTRIES, writer, arg));
+        }
+
+        return ERR_NONE;
+    }
+
+    M_EXIT_IF(output_mode != STDOUT, ERR_INVALID_ARGUMENT, "unknown list mode", );
+
     /// PRINT
 
     print_header(&(imgstfile->header));
@@ -22,12 +120,16 @@ void do_list(const imgst_file* imgstfile)
         printf("<< empty imgStore >>\n");
 
     } else {
-        // Loop through all metadata, printing when valid
-        for (size_t idx = 0; idx < imgstfile->header.max_files; ++idx) {
+        // Loop through metadata from the cursor, printing when valid
+        uint32_t printed = 0;
 
-            if(imgstfile->metadata[idx].is_valid == NON_EMPTY) {
-                print_metadata(&(imgstfile->metadata[idx]));
-            }
+        for (uint32_t idx = next_valid_slot(imgstfile, cursor); idx < imgstfile->header.max_files
+             && (limit == 0 || printed < limit); idx = next_valid_slot(imgstfile, idx + 1)) {
+
+            print_metadata(&(imgstfile->metadata[idx]));
+            ++printed;
         }
     }
+
+    return ERR_NONE;
 }
@@ -7,11 +7,75 @@
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "blob_cache.h"
+#include "buf_pool.h"
 #include "error.h"
 
-#include <stdlib.h> // for calloc
+#include <string.h> // for memcpy
 #include <stdint.h> // for uint8_t
 
+/**
+ * Finds an image and makes sure it exists in the requested resolution.
+ */
+static int locate(const char* img_id, const int resolution, size_t* idx, imgst_file* imgstfile)
+{
+    // Check if valid resolution code
+    M_EXIT_IF(resolution != RES_SMALL && resolution != RES_THUMB && resolution != RES_ORIG,
+              ERR_RESOLUTIONS, "called do_read with an invalid error code", );
+
+    // Find the metadata index for the img_id.
+    M_EXIT_IF_ERR(findMetadataIndex(idx, img_id, imgstfile));
+
+    // Resize if the image doesn't exist in the requested resolution
+    if (imgstfile->metadata[*idx].offset[resolution] == INIT_OFFSET) {
+        M_EXIT_IF_ERR(lazily_resize(resolution, imgstfile, *idx));
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the content of an image into a buffer of the caller.
+ */
+int do_read_into(const char* img_id, const int resolution, char* buffer, size_t capacity,
+                 uint32_t* image_size, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    // From the cache if there: no file access
+    if (imgstfile->cache != NULL) {
+        blob* image = NULL;
+        M_EXIT_IF_ERR(do_read_blob(img_id, resolution, &image, imgstfile));
+
+        *image_size = image->size;
+        const int ret = image->size > capacity || buffer == NULL ? ERR_INVALID_ARGUMENT : ERR_NONE;
+
+        if (ret == ERR_NONE) {
+            memcpy(buffer, image->data, image->size);
+        }
+
+        blob_release(image);
+
+        return ret;
+    }
+
+    size_t idx = 0;
+    M_EXIT_IF_ERR(locate(img_id, resolution, &idx, imgstfile));
+
+    *image_size = imgstfile->metadata[idx].size[resolution];
+
+    // Too small: the caller learns the size to retry with
+    M_EXIT_IF(*image_size > capacity || buffer == NULL, ERR_INVALID_ARGUMENT,
+              "buffer too small for image", );
+
+    M_EXIT_IF(fseek(imgstfile->file, (long) imgstfile->metadata[idx].offset[resolution], SEEK_SET) != 0
+              || fread(buffer, *image_size, 1, imgstfile->file) != 1, ERR_IO, "cannot read image", );
+
+    return ERR_NONE;
+}
+
 /**
  * Reads the content of an image from a imgStore
  */
@@ -24,32 +88,91 @@ int do_read(const char* img_id, const int resolution, char** image_buffer,
     M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgstfile);
 
-    // Check if valid resolution code
-    M_EXIT_IF(resolution != RES_SMALL && resolution != RES_THUMB && resolution != RES_ORIG,
-              ERR_RESOLUTIONS, "called do_read with an invalid error code", );
+    size_t idx = 0;
+    M_EXIT_IF_ERR(locate(img_id, resolution, &idx, imgstfile));
+
+    // Borrowed from the pool, not zeroed: filled whole right after
+    const uint32_t size = imgstfile->metadata[idx].size[resolution];
+    char* buffer = pool_alloc(size);
+    M_EXIT_IF_NULL(buffer, (size_t) size);
+
+    M_EXIT_IF_ERR_DO_SOMETHING(do_read_into(img_id, resolution, buffer, pool_capacity(buffer),
+                                            image_size, imgstfile),
+                               pool_free(buffer));
+
+    *image_buffer = buffer;
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the content of an image as a blob, through the cache if any.
+ */
+int do_read_blob(const char* img_id, const int resolution, blob** image, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(imgstfile);
 
-    // Find the metadata index for the img_id.
     size_t idx = 0;
-    M_EXIT_IF_ERR(findMetadataIndex(&idx, img_id, imgstfile));
+    M_EXIT_IF_ERR(locate(img_id, resolution, &idx, imgstfile));
 
-    // Resize if the image doesn't exist in the requested resolution
-    if (imgstfile->metadata[idx].offset[resolution] == INIT_OFFSET) {
-        M_EXIT_IF_ERR(lazily_resize(resolution, imgstfile, idx));
-    }
+    const img_metadata* meta = &imgstfile->metadata[idx];
 
-    // Let image_size point to the location of the size value
-    *image_size = imgstfile->metadata[idx].size[resolution];
+    *image = cache_get(imgstfile->cache, idx, resolution, meta->offset[resolution]);
 
-    // Let image_buffer point to the image data
-    void* buffer = NULL;
-    M_EXIT_IF_NULL(buffer = calloc(1, *image_size), *image_size);
+    if (*image != NULL) {
+        return ERR_NONE;
+    }
 
-    // Read the 1 image from the file
-    fseek(imgstfile->file, imgstfile->metadata[idx].offset[resolution], SEEK_SET);
-    M_EXIT_IF_ERR_DO_SOMETHING((fread(buffer, *image_size, 1, imgstfile->file) == 1) ? ERR_NONE : ERR_IO,
-							    FREE_DEREF(buffer));
+    blob* b = blob_new(meta->size[resolution]);
+    M_EXIT_IF_NULL(b, meta->size[resolution]);
 
-    *image_buffer = buffer;
+    if (fseek(imgstfile->file, (long) meta->offset[resolution], SEEK_SET) != 0
+        || fread(b->data, b->size, 1, imgstfile->file) != 1) {
+        blob_release(b);
+        return ERR_IO;
+    }
+
+    cache_put(imgstfile->cache, idx, resolution, meta->offset[resolution], b);
+    *image = b;
 
     return ERR_NONE;
 }
+
+/**
+ * Streams the content of an image from a imgStore through writer
+ */
+int do_read_stream(const char* img_id, const int resolution, list_writer writer, void* arg,
+                   imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(imgstfile);
+
+    size_t idx = 0;
+    M_EXIT_IF_ERR(locate(img_id, resolution, &idx, imgstfile));
+
+    char* chunk = NULL;
+    M_EXIT_IF_NULL(chunk = pool_alloc(READ_CHUNK_SIZE), READ_CHUNK_SIZE);
+
+    size_t left = imgstfile->metadata[idx].size[resolution];
+    int ret = fseek(imgstfile->file, (long) imgstfile->metadata[idx].offset[resolution], SEEK_SET) == 0
+              ? ERR_NONE : ERR_IO;
+
+    // Constant memory, whatever the size of the image
+    while (left > 0 && ret == ERR_NONE) {
+        const size_t len = left < READ_CHUNK_SIZE ? left : READ_CHUNK_SIZE;
+
+        if (fread(chunk, len, 1, imgstfile->file) != 1) {
+            ret = ERR_IO;
+        } else {
+            ret = writer(arg, chunk, len);
+            left -= len;
+        }
+    }
+
+    pool_free(chunk);
+
+    return ret;
+}
@@ -0,0 +1,435 @@
+/**
+ * @file imgst_reorganize.c
+ * @brief imgStore library: clustering the contents of related images.
+ *
+ * Images are grouped by key, the part of their ID before a separator
+ * ("user123" in "user123/2024/cat.jpg"), and ordered by key then ID. A group
+ * whose contents do not follow each other in that order is copied to the
+ * end of the file, each image with its resolutions next to each other, and
+ * its metadata then points to the copies.
+ *
+ * Unlike do_gbcollect, nothing is overwritten: the imgStore only grows, each
+ * move is a logged change, and backups and followers carry on. A group moved
+ * is done, so a run may stop after some groups and the next one resumes;
+ * the old copies are reclaimed by a later gc (in offset order, which keeps
+ * the clusters).
+ *
+ * A content that deduplicated images of several groups share is copied
+ * once, with the first group moved, and all these images then point to
+ * the copy; it cannot follow both groups, so neither needs it to.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+#include "blob_cache.h"
+#include "scan_ahead.h"
+#include "meta_scan.h"
+
+#include <stdlib.h> // for calloc, qsort, bsearch
+#include <string.h> // for memset, strcmp, strchr
+
+#define REORGANIZE_CHUNK_SIZE (1 << 20)
+
+typedef struct reorg_move reorg_move;
+typedef struct reorg_ref reorg_ref;
+
+/**
+ * Where a content was, and where it goes.
+ */
+struct reorg_move {
+    uint64_t from;
+    uint64_t to;      // INIT_OFFSET until copied
+    size_t first_ref; // its images, in the references sorted by offset
+    size_t nb_refs;
+    int shared;       // whether images of several groups have it
+};
+
+/**
+ * An image having a content, and the group of that image.
+ */
+struct reorg_ref {
+    uint64_t from;
+    uint32_t slot;
+    uint32_t group;
+};
+
+/**
+ * The imgStore whose slots are sorted and its separator: qsort passes no context.
+ */
+static const imgst_file* s_sorted = NULL;
+static char s_separator = '/';
+
+/**
+ * Length of the key of an image ID.
+ */
+static size_t key_length(const char* img_id, char separator)
+{
+    const char* end = strchr(img_id, separator);
+    return end == NULL ? strlen(img_id) : (size_t) (end - img_id);
+}
+
+/**
+ * Whether two image IDs have the same key.
+ */
+static int same_key(const char* a, const char* b, char separator)
+{
+    const size_t len = key_length(a, separator);
+    return len == key_length(b, separator) && strncmp(a, b, len) == 0;
+}
+
+/**
+ * By key, then by image ID.
+ */
+static int compare_by_key(const void* a, const void* b)
+{
+    const char* x = s_sorted->metadata[*(const uint32_t*) a].img_id;
+    const char* y = s_sorted->metadata[*(const uint32_t*) b].img_id;
+    const size_t x_len = key_length(x, s_separator);
+    const size_t y_len = key_length(y, s_separator);
+    const int cmp = strncmp(x, y, x_len < y_len ? x_len : y_len);
+
+    if (cmp != 0 || x_len == y_len) {
+        return cmp != 0 ? cmp : strcmp(x, y);
+    }
+
+    return x_len < y_len ? -1 : 1;
+}
+
+/**
+ * By content offset.
+ */
+static int compare_moves(const void* a, const void* b)
+{
+    const reorg_move* x = a;
+    const reorg_move* y = b;
+
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/**
+ * By content offset.
+ */
+static int compare_refs(const void* a, const void* b)
+{
+    const reorg_ref* x = a;
+    const reorg_ref* y = b;
+
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/**
+ * Whether a resolution of an image is stored.
+ */
+static int is_stored(const img_metadata* meta, int res)
+{
+    return meta->offset[res] != INIT_OFFSET && meta->size[res] > 0;
+}
+
+/**
+ * End of the group starting at first in the sorted slots.
+ */
+static size_t group_end(const uint32_t* slots, size_t first, size_t nb, char separator,
+                        const imgst_file* imgstfile)
+{
+    size_t last = first + 1;
+
+    while (last < nb && same_key(imgstfile->metadata[slots[first]].img_id,
+                                 imgstfile->metadata[slots[last]].img_id, separator)) {
+        ++last;
+    }
+
+    return last;
+}
+
+/**
+ * The content at an offset, NULL if moved by this run already.
+ */
+static reorg_move* find_move(uint64_t offset, reorg_move* moves, size_t nb_moves)
+{
+    const reorg_move key = { .from = offset, .to = INIT_OFFSET };
+    return bsearch(&key, moves, nb_moves, sizeof(reorg_move), compare_moves);
+}
+
+/**
+ * Whether the contents of a group already follow each other in order,
+ * except those shared with other groups.
+ */
+static int is_clustered(const uint32_t* slots, size_t nb, reorg_move* moves, size_t nb_moves,
+                        const imgst_file* imgstfile)
+{
+    uint64_t start = INIT_OFFSET;
+    uint64_t next = INIT_OFFSET;
+
+    for (size_t i = 0; i < nb; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[slots[i]];
+
+        for (int res = 0; res < NB_RES; ++res) {
+            if (!is_stored(meta, res)) {
+                continue;
+            }
+
+            const uint64_t offset = meta->offset[res];
+            const reorg_move* move = find_move(offset, moves, nb_moves);
+
+            // One shared with other groups may sit in the cluster, or elsewhere
+            if ((move == NULL || move->shared) && (next == INIT_OFFSET || offset != next)) {
+                continue;
+            }
+
+            if (next == INIT_OFFSET) {
+                start = offset;
+                next = offset + meta->size[res];
+
+            } else if (offset == next) {
+                next += meta->size[res];
+
+            } else if (offset < start || offset + meta->size[res] > next) {
+                // Not even shared with an image placed before it in the group
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Lists the contents of the sorted slots once each, sorted by offset, with
+ * the images having them in refs.
+ */
+static size_t list_moves(const uint32_t* slots, size_t nb, char separator, reorg_ref* refs,
+                         reorg_move* moves, const imgst_file* imgstfile)
+{
+    size_t nb_refs = 0;
+    uint32_t group = 0;
+
+    for (size_t first = 0; first < nb; ++group) {
+        const size_t last = group_end(slots, first, nb, separator, imgstfile);
+
+        for (; first < last; ++first) {
+            const img_metadata* meta = &imgstfile->metadata[slots[first]];
+
+            for (int res = 0; res < NB_RES; ++res) {
+                if (is_stored(meta, res)) {
+                    refs[nb_refs++] = (reorg_ref) { .from = meta->offset[res], .slot = slots[first],
+                                                    .group = group };
+                }
+            }
+        }
+    }
+
+    qsort(refs, nb_refs, sizeof(reorg_ref), compare_refs);
+
+    // Deduplicated images share their contents
+    size_t unique = 0;
+
+    for (size_t i = 0; i < nb_refs; ++i) {
+        if (unique == 0 || moves[unique - 1].from != refs[i].from) {
+            moves[unique++] = (reorg_move) { .from = refs[i].from, .to = INIT_OFFSET, .first_ref = i };
+        }
+
+        reorg_move* move = &moves[unique - 1];
+        move->shared |= refs[move->first_ref].group != refs[i].group;
+        ++move->nb_refs;
+    }
+
+    return unique;
+}
+
+/**
+ * Points the contents of an image to their copies, logging the change if any.
+ */
+static int repoint(uint32_t slot, reorg_move* moves, size_t nb_moves, reorganize_stats* stats,
+                   imgst_file* imgstfile)
+{
+    img_metadata* meta = &imgstfile->metadata[slot];
+    int changed = 0;
+
+    for (int res = 0; res < NB_RES; ++res) {
+        const reorg_move* move = is_stored(meta, res) ? find_move(meta->offset[res], moves, nb_moves)
+                                 : NULL;
+
+        if (move != NULL && move->to != INIT_OFFSET) {
+            meta->offset[res] = move->to;
+            changed = 1;
+        }
+    }
+
+    if (!changed) {
+        return ERR_NONE;
+    }
+
+    cache_forget(slot, imgstfile);
+    imgstfile->header.imgst_version += 1;
+
+    M_EXIT_IF_ERR(updateMetadata(slot, imgstfile));
+    M_EXIT_IF_ERR(updateHeader(imgstfile));
+    M_EXIT_IF_ERR(log_change(CHANGE_MOVE, slot, NOT_RES, imgstfile));
+
+    ++stats->nb_images;
+
+    return ERR_NONE;
+}
+
+/**
+ * Appends a copy of a content at the end of the imgStore file.
+ */
+static int append_copy(uint64_t from, uint32_t size, uint64_t to, char* buffer, imgst_file* imgstfile)
+{
+    uint64_t done = 0;
+
+    while (done < size) {
+        const size_t chunk = size - done < REORGANIZE_CHUNK_SIZE ? (size_t) (size - done)
+                             : REORGANIZE_CHUNK_SIZE;
+
+        M_EXIT_IF(fseek(imgstfile->file, (long) (from + done), SEEK_SET) != 0
+                  || fread(buffer, 1, chunk, imgstfile->file) != chunk
+                  || fseek(imgstfile->file, (long) (to + done), SEEK_SET) != 0
+                  || fwrite(buffer, 1, chunk, imgstfile->file) != chunk,
+                  ERR_IO, "cannot copy image", );
+
+        done += chunk;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies the contents of a group to the end of the file, then points its
+ * metadata there, and that of the images of other groups sharing them.
+ */
+static int move_group(const uint32_t* slots, size_t nb, uint32_t group, reorg_move* moves,
+                      size_t nb_moves, const reorg_ref* refs, scan_extent* extents,
+                      char* buffer, reorganize_stats* stats, imgst_file* imgstfile)
+{
+    M_EXIT_IF(fseek(imgstfile->file, 0, SEEK_END) != 0 || ftell(imgstfile->file) < 0,
+              ERR_IO, "cannot seek imgStore", );
+    const uint64_t start = (uint64_t) ftell(imgstfile->file);
+    uint64_t end = start;
+    size_t nb_extents = 0;
+
+    // Where each content goes: one after the other, in group order
+    for (size_t i = 0; i < nb; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[slots[i]];
+
+        // Smallest first: the derivatives of an image, then its original
+        // (export puts the original back in front, as do_import needs it)
+        for (int res = 0; res < NB_RES; ++res) {
+            if (!is_stored(meta, res)) {
+                continue;
+            }
+
+            // Copied already with this group, or with another group sharing it
+            reorg_move* move = find_move(meta->offset[res], moves, nb_moves);
+
+            if (move != NULL && move->to == INIT_OFFSET) {
+                move->to = end;
+                end += meta->size[res];
+                extents[nb_extents++] = (scan_extent) { .offset = move->from, .size = meta->size[res] };
+            }
+        }
+    }
+
+    // All the copies first, the next ones read ahead meanwhile:
+    // an interrupted move leaves the old contents in use
+    scan_ahead ahead;
+    scan_ahead_init(&ahead, imgstfile->file, extents, nb_extents, SCAN_AHEAD_WINDOW);
+    uint64_t to = start;
+
+    for (size_t i = 0; i < nb_extents; ++i) {
+        scan_ahead_next(&ahead);
+        M_EXIT_IF_ERR(append_copy(extents[i].offset, (uint32_t) extents[i].size, to, buffer, imgstfile));
+        to += extents[i].size;
+        stats->bytes += extents[i].size;
+    }
+
+    M_EXIT_IF(fflush(imgstfile->file) != 0, ERR_IO, "cannot write imgStore", );
+
+    // Then one logged change per image, as backups and followers expect
+    for (size_t i = 0; i < nb; ++i) {
+        M_EXIT_IF_ERR(repoint(slots[i], moves, nb_moves, stats, imgstfile));
+    }
+
+    // The images of other groups sharing a copied content follow it now, not
+    // to copy it again when their group moves
+    for (size_t i = 0; i < nb_extents; ++i) {
+        const reorg_move* move = find_move(extents[i].offset, moves, nb_moves);
+
+        for (size_t r = move->first_ref; move->shared && r < move->first_ref + move->nb_refs; ++r) {
+            if (refs[r].group != group) {
+                M_EXIT_IF_ERR(repoint(refs[r].slot, moves, nb_moves, stats, imgstfile));
+            }
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Clusters the contents of the images by key.
+ */
+int do_reorganize(char separator, uint32_t max_groups, reorganize_stats* stats, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    memset(stats, 0, sizeof(*stats));
+
+    const size_t max_files = imgstfile->header.max_files;
+    uint32_t* slots = calloc(max_files + 1, sizeof(uint32_t));
+    reorg_ref* refs = calloc(max_files * NB_RES + 1, sizeof(reorg_ref));
+    reorg_move* moves = calloc(max_files * NB_RES + 1, sizeof(reorg_move));
+    scan_extent* extents = calloc(max_files * NB_RES + 1, sizeof(scan_extent));
+    char* buffer = malloc(REORGANIZE_CHUNK_SIZE);
+
+    if (slots == NULL || refs == NULL || moves == NULL || extents == NULL || buffer == NULL) {
+        free(slots);
+        free(refs);
+        free(moves);
+        free(extents);
+        free(buffer);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const size_t nb = meta_valid_slots(imgstfile->metadata, max_files, slots);
+
+    s_sorted = imgstfile;
+    s_separator = separator;
+    qsort(slots, nb, sizeof(uint32_t), compare_by_key);
+    s_sorted = NULL;
+
+    // Every content once, for the whole run: those shared are moved once
+    const size_t nb_moves = list_moves(slots, nb, separator, refs, moves, imgstfile);
+
+    int ret = ERR_NONE;
+
+    for (size_t first = 0; first < nb && ret == ERR_NONE; ) {
+        const size_t last = group_end(slots, first, nb, separator, imgstfile);
+        const uint32_t group = (uint32_t) stats->nb_groups;
+
+        ++stats->nb_groups;
+
+        if (is_clustered(&slots[first], last - first, moves, nb_moves, imgstfile)) {
+            // Done by a previous run, or never scattered
+        } else if (max_groups != 0 && stats->nb_moved >= max_groups) {
+            ++stats->nb_left;
+        } else {
+            ret = move_group(&slots[first], last - first, group, moves, nb_moves, refs, extents,
+                             buffer, stats, imgstfile);
+            ++stats->nb_moved;
+        }
+
+        first = last;
+    }
+
+    free(slots);
+    free(refs);
+    free(moves);
+    free(extents);
+    free(buffer);
+
+    return ret;
+}
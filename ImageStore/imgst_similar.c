@@ -0,0 +1,573 @@
+/**
+ * @file imgst_similar.c
+ * @brief Near-duplicate images, found by their perceptual hashes.
+ *
+ * The table is a phash_file_header followed by one phash_record per
+ * metadata slot. Searches gather the hashes of the valid images in one
+ * array, so that the Hamming distances to a hash are computed four at a
+ * time with AVX2: XOR, then a nibble lookup table counts the bits of each
+ * byte and a sum of absolute differences adds them up per hash.
+ *
+ * @author ???
+ */
+
+#include "imgst_similar.h"
+#include "json_writer.h"
+#include "buf_pool.h"
+#include "sha_hash.h"
+
+#include <stdlib.h>   // for calloc, qsort
+#include <string.h>   // for memcpy, memcmp
+#include <vips/vips.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#endif
+
+#define PHASH_MAGIC "IMGSTPH1"
+#define PHASH_MAGIC_LEN 8
+
+typedef struct phash_file_header phash_file_header;
+typedef struct phash_record phash_record;
+
+/**
+ * Header of the table.
+ */
+struct phash_file_header {
+    char magic[PHASH_MAGIC_LEN];
+    uint32_t max_files;
+    uint32_t reserved;
+};
+
+/**
+ * Hash of a metadata slot, as stored in the table.
+ */
+struct phash_record {
+    uint64_t hash;
+    uint32_t tag;   // first bytes of the SHA of the image hashed
+    uint32_t known; // 1 once hash is computed, else 0
+};
+
+/**
+ * A near-duplicate of the image looked for, to sort.
+ */
+typedef struct similar_match {
+    uint32_t slot;
+    uint32_t distance;
+} similar_match;
+
+/**
+ * Number of differing bits of two hashes.
+ */
+static uint32_t distance(uint64_t a, uint64_t b)
+{
+    return (uint32_t) __builtin_popcountll(a ^ b);
+}
+
+/**
+ * Computes the difference hash of a JPEG image.
+ */
+int image_dhash(const void* image, size_t size, uint64_t* hash)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(hash);
+
+    VipsImage* small = NULL;
+    VipsImage* grey = NULL;
+    VipsImage* band = NULL;
+    VipsImage* bytes = NULL;
+
+    // Shrinks while decoding, as thumbnails are made: JPEG decodes at 1/8 for free
+    int ret = vips_thumbnail_buffer((void*) image, size, &small, DHASH_WIDTH,
+                                    "height", DHASH_HEIGHT, "size", VIPS_SIZE_FORCE, NULL)
+              || vips_colourspace(small, &grey, VIPS_INTERPRETATION_B_W, NULL)
+              || vips_extract_band(grey, &band, 0, NULL)
+              || vips_cast_uchar(band, &bytes, NULL) ? ERR_IMGLIB : ERR_NONE;
+
+    size_t len = 0;
+    unsigned char* pixels = ret == ERR_NONE ? vips_image_write_to_memory(bytes, &len) : NULL;
+
+    if (ret == ERR_NONE && (pixels == NULL || len != DHASH_WIDTH * DHASH_HEIGHT)) {
+        ret = ERR_IMGLIB;
+    }
+
+    if (ret == ERR_NONE) {
+        uint64_t h = 0;
+
+        for (size_t y = 0; y < DHASH_HEIGHT; ++y) {
+            for (size_t x = 0; x + 1 < DHASH_WIDTH; ++x) {
+                const unsigned char* p = &pixels[y * DHASH_WIDTH + x];
+                h = (h << 1) | (p[0] < p[1]);
+            }
+        }
+
+        *hash = h;
+    }
+
+    g_free(pixels);
+
+    VipsImage* images[] = { bytes, band, grey, small };
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+        if (images[i] != NULL) {
+            g_object_unref(images[i]);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Finds the hashes close to a given one, one popcount per hash.
+ */
+static size_t hamming_scan_scalar(const uint64_t* hashes, size_t nb, uint64_t query,
+                                  uint32_t max_distance, uint32_t* matches)
+{
+    size_t nb_matches = 0;
+
+    for (size_t i = 0; i < nb; ++i) {
+        if (distance(hashes[i], query) <= max_distance) {
+            matches[nb_matches++] = (uint32_t) i;
+        }
+    }
+
+    return nb_matches;
+}
+
+#ifdef HAVE_AVX2_SCAN
+/**
+ * Finds the hashes close to a given one, four at a time.
+ */
+__attribute__((target("avx2")))
+static size_t hamming_scan_avx2(const uint64_t* hashes, size_t nb, uint64_t query,
+                                uint32_t max_distance, uint32_t* matches)
+{
+    // Bits set in each nibble value, once per 128 bits lane
+    const __m256i nibble_bits = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    const __m256i q = _mm256_set1_epi64x((long long) query);
+    const __m256i max = _mm256_set1_epi64x((long long) max_distance);
+
+    size_t nb_matches = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= nb; i += 4) {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) &hashes[i]), q);
+        const __m256i lo = _mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(x, low_nibbles));
+        const __m256i hi = _mm256_shuffle_epi8(nibble_bits,
+                                               _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibbles));
+        // Sums the 8 byte counts of each hash into its 64 bits
+        const __m256i dist = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+        const __m256i far = _mm256_cmpgt_epi64(dist, max);
+        int close = ~_mm256_movemask_pd(_mm256_castsi256_pd(far)) & 0xf;
+
+        while (close != 0) {
+            matches[nb_matches++] = (uint32_t) (i + (size_t) __builtin_ctz((unsigned) close));
+            close &= close - 1;
+        }
+    }
+
+    const size_t nb_tail = hamming_scan_scalar(&hashes[i], nb - i, query, max_distance, &matches[nb_matches]);
+
+    for (size_t j = 0; j < nb_tail; ++j) {
+        matches[nb_matches + j] += (uint32_t) i;
+    }
+
+    return nb_matches + nb_tail;
+}
+#endif
+
+/**
+ * Finds the hashes close to a given one.
+ */
+size_t hamming_scan(const uint64_t* hashes, size_t nb, uint64_t query,
+                    uint32_t max_distance, uint32_t* matches)
+{
+    if (hashes == NULL || matches == NULL) {
+        return 0;
+    }
+
+#ifdef HAVE_AVX2_SCAN
+    if (__builtin_cpu_supports("avx2")) {
+        return hamming_scan_avx2(hashes, nb, query, max_distance, matches);
+    }
+#endif
+
+    return hamming_scan_scalar(hashes, nb, query, max_distance, matches);
+}
+
+/**
+ * Path of the table of an imgStore.
+ */
+static char* phash_path(const char* imgst_filename)
+{
+    char* path = malloc(strlen(imgst_filename) + strlen(PHASH_SUFFIX) + 1);
+
+    if (path != NULL) {
+        strcpy(path, imgst_filename);
+        strcat(path, PHASH_SUFFIX);
+    }
+
+    return path;
+}
+
+/**
+ * Reads the table, leaving the records zeroed if it is missing or mismatched.
+ */
+static void read_table(const char* path, phash_record* records, uint32_t max_files)
+{
+    FILE* file = fopen(path, "rb");
+    phash_file_header header;
+
+    if (file == NULL) {
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, PHASH_MAGIC, PHASH_MAGIC_LEN) != 0
+        || header.max_files != max_files
+        || fread(records, sizeof(phash_record), max_files, file) != max_files) {
+        memset(records, 0, max_files * sizeof(phash_record));
+    }
+
+    fclose(file);
+}
+
+/**
+ * Writes the whole table.
+ */
+static int write_table(const char* path, const phash_record* records, uint32_t max_files)
+{
+    FILE* file = fopen(path, "wb");
+    M_EXIT_IF(file == NULL, ERR_IO, "cannot open %s", path);
+
+    phash_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PHASH_MAGIC, PHASH_MAGIC_LEN);
+    header.max_files = max_files;
+
+    const int failed = fwrite(&header, sizeof(header), 1, file) != 1
+                       || fwrite(records, sizeof(phash_record), max_files, file) != max_files;
+
+    M_EXIT_IF(fclose(file) != 0 || failed, ERR_IO, "cannot write %s", path);
+
+    return ERR_NONE;
+}
+
+/**
+ * Computes the hash of a slot, from its smallest stored version.
+ */
+static int hash_slot(size_t slot, uint64_t* hash, imgst_file* imgstfile)
+{
+    const img_metadata* meta = &imgstfile->metadata[slot];
+    const int res = meta->offset[RES_THUMB] != 0 ? RES_THUMB : RES_ORIG;
+    const size_t size = meta->size[res];
+
+    char* buffer = pool_alloc(size);
+    M_EXIT_IF_NULL(buffer, size);
+
+    int ret = ERR_NONE;
+
+    if (fseek(imgstfile->file, (long) meta->offset[res], SEEK_SET) != 0
+        || fread(buffer, size, 1, imgstfile->file) != 1) {
+        ret = ERR_IO;
+    } else {
+        ret = image_dhash(buffer, size, hash);
+    }
+
+    pool_free(buffer);
+
+    return ret;
+}
+
+/**
+ * Brings the table up to date with the valid images, writing it back if it changed.
+ */
+static int update_table(const char* imgst_filename, phash_record* records, imgst_file* imgstfile)
+{
+    const uint32_t max_files = imgstfile->header.max_files;
+    char* path = phash_path(imgst_filename);
+    M_EXIT_IF_NULL(path, strlen(imgst_filename) + strlen(PHASH_SUFFIX) + 1);
+
+    read_table(path, records, max_files);
+
+    size_t nb_computed = 0;
+
+    for (size_t i = 0; i < max_files; ++i) {
+        const img_metadata* meta = &imgstfile->metadata[i];
+        phash_record* record = &records[i];
+
+        if (meta->is_valid != NON_EMPTY || (record->known && record->tag == sha_tag(meta->SHA))) {
+            continue;
+        }
+
+        // An image the library cannot decode is left out of the search
+        memset(record, 0, sizeof(phash_record));
+
+        if (hash_slot(i, &record->hash, imgstfile) == ERR_NONE) {
+            record->tag = sha_tag(meta->SHA);
+            record->known = 1;
+            ++nb_computed;
+        }
+    }
+
+    // Best effort: a read-only directory only costs computing them again
+    if (nb_computed > 0) {
+        write_table(path, records, max_files);
+    }
+
+    free(path);
+
+    return ERR_NONE;
+}
+
+/**
+ * Closest first, then by slot.
+ */
+static int compare_matches(const void* a, const void* b)
+{
+    const similar_match* x = a;
+    const similar_match* y = b;
+
+    if (x->distance != y->distance) {
+        return x->distance < y->distance ? -1 : 1;
+    }
+
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/**
+ * Lists the images close to one.
+ */
+static int list_similar(size_t slot, const uint64_t* hashes, const uint32_t* slots, size_t nb,
+                        uint32_t max_distance, json_buffer* out, const imgst_file* imgstfile)
+{
+    uint64_t hash = 0;
+    int hashed = 0;
+
+    for (size_t i = 0; i < nb && !hashed; ++i) {
+        if (slots[i] == slot) {
+            hash = hashes[i];
+            hashed = 1;
+        }
+    }
+
+    M_EXIT_IF(!hashed, ERR_IMGLIB, "cannot hash image %s", imgstfile->metadata[slot].img_id);
+
+    uint32_t* positions = calloc(nb + 1, sizeof(uint32_t));
+    similar_match* matches = calloc(nb + 1, sizeof(similar_match));
+
+    if (positions == NULL || matches == NULL) {
+        free(positions);
+        free(matches);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const size_t nb_positions = hamming_scan(hashes, nb, hash, max_distance, positions);
+    size_t nb_matches = 0;
+
+    for (size_t i = 0; i < nb_positions; ++i) {
+        const uint32_t p = positions[i];
+
+        if (slots[p] != slot) {
+            matches[nb_matches].slot = slots[p];
+            matches[nb_matches].distance = distance(hashes[p], hash);
+            ++nb_matches;
+        }
+    }
+
+    free(positions);
+    qsort(matches, nb_matches, sizeof(similar_match), compare_matches);
+
+    int ret = json_append(out, "{\"id\":", 6);
+
+    if (ret == ERR_NONE) {
+        ret = json_append_id(out, imgstfile->metadata[slot].img_id);
+    }
+
+    if (ret == ERR_NONE) {
+        ret = json_append(out, ",\"Images\":[", 11);
+    }
+
+    for (size_t i = 0; i < nb_matches && ret == ERR_NONE; ++i) {
+        ret = json_appendf(out, "%s{\"id\":", i == 0 ? "" : ",");
+
+        if (ret == ERR_NONE) {
+            ret = json_append_id(out, imgstfile->metadata[matches[i].slot].img_id);
+        }
+
+        if (ret == ERR_NONE) {
+            ret = json_appendf(out, ",\"distance\":%u}", (unsigned) matches[i].distance);
+        }
+    }
+
+    free(matches);
+
+    return ret == ERR_NONE ? json_append(out, "]}", 2) : ret;
+}
+
+/**
+ * Representative of the group of a position, halving the paths on the way.
+ */
+static uint32_t find_group(uint32_t* parent, uint32_t p)
+{
+    while (parent[p] != p) {
+        parent[p] = parent[parent[p]];
+        p = parent[p];
+    }
+
+    return p;
+}
+
+/**
+ * Lists the groups of near-duplicates.
+ */
+static int list_groups(const uint64_t* hashes, const uint32_t* slots, size_t nb,
+                       uint32_t max_distance, json_buffer* out, const imgst_file* imgstfile)
+{
+    uint32_t* parent = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t* positions = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t* group_size = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t* next = calloc(nb + 1, sizeof(uint32_t));
+
+    if (parent == NULL || positions == NULL || group_size == NULL || next == NULL) {
+        free(parent);
+        free(positions);
+        free(group_size);
+        free(next);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < nb; ++i) {
+        parent[i] = (uint32_t) i;
+    }
+
+    // Each pair once: against the hashes after it
+    for (size_t i = 0; i + 1 < nb; ++i) {
+        const size_t nb_positions = hamming_scan(&hashes[i + 1], nb - i - 1, hashes[i],
+                                                 max_distance, positions);
+
+        for (size_t j = 0; j < nb_positions; ++j) {
+            const uint32_t a = find_group(parent, (uint32_t) i);
+            const uint32_t b = find_group(parent, (uint32_t) (i + 1 + positions[j]));
+
+            if (a != b) {
+                parent[a < b ? b : a] = a < b ? a : b;
+            }
+        }
+    }
+
+    // Chains the members of each group from its first one, in slot order
+    uint32_t* last = positions;
+
+    for (size_t i = 0; i < nb; ++i) {
+        const uint32_t g = find_group(parent, (uint32_t) i);
+
+        if (group_size[g]++ > 0) {
+            next[last[g]] = (uint32_t) i;
+        }
+
+        last[g] = (uint32_t) i;
+    }
+
+    int ret = json_append(out, "{\"Groups\":[", 11);
+    size_t nb_groups = 0;
+
+    for (size_t g = 0; g < nb && ret == ERR_NONE; ++g) {
+        if (parent[g] != g || group_size[g] < 2) {
+            continue;
+        }
+
+        ret = json_appendf(out, "%s[", nb_groups++ == 0 ? "" : ",");
+
+        uint32_t p = (uint32_t) g;
+
+        for (uint32_t k = 0; k < group_size[g] && ret == ERR_NONE; ++k) {
+            if (k > 0) {
+                ret = json_append(out, ",", 1);
+            }
+
+            if (ret == ERR_NONE) {
+                ret = json_append_id(out, imgstfile->metadata[slots[p]].img_id);
+            }
+
+            p = next[p];
+        }
+
+        if (ret == ERR_NONE) {
+            ret = json_append(out, "]", 1);
+        }
+    }
+
+    free(parent);
+    free(positions);
+    free(group_size);
+    free(next);
+
+    return ret == ERR_NONE ? json_append(out, "]}", 2) : ret;
+}
+
+/**
+ * Lists near-duplicate images as a JSON document.
+ */
+int do_similar(const char* imgst_filename, const char* img_id, uint32_t max_distance,
+               list_writer writer, void* arg, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(imgst_filename);
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    M_EXIT_IF(max_distance > PHASH_BITS, ERR_INVALID_ARGUMENT,
+              "distance above %d bits", PHASH_BITS);
+
+    size_t slot = 0;
+
+    if (img_id != NULL) {
+        M_EXIT_IF_ERR(findMetadataIndex(&slot, img_id, imgstfile));
+    }
+
+    const uint32_t max_files = imgstfile->header.max_files;
+    phash_record* records = calloc(max_files + 1, sizeof(phash_record));
+    uint64_t* hashes = calloc(max_files + 1, sizeof(uint64_t));
+    uint32_t* slots = calloc(max_files + 1, sizeof(uint32_t));
+
+    if (records == NULL || hashes == NULL || slots == NULL) {
+        free(records);
+        free(hashes);
+        free(slots);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = update_table(imgst_filename, records, imgstfile);
+
+    // The hashes of the valid images, next to each other for the scans
+    size_t nb = 0;
+
+    for (uint32_t i = 0; i < max_files && ret == ERR_NONE; ++i) {
+        if (imgstfile->metadata[i].is_valid == NON_EMPTY && records[i].known) {
+            hashes[nb] = records[i].hash;
+            slots[nb] = i;
+            ++nb;
+        }
+    }
+
+    free(records);
+
+    json_buffer out = { .len = 0, .writer = writer, .arg = arg };
+
+    if (ret == ERR_NONE) {
+        ret = img_id != NULL
+              ? list_similar(slot, hashes, slots, nb, max_distance, &out, imgstfile)
+              : list_groups(hashes, slots, nb, max_distance, &out, imgstfile);
+    }
+
+    free(hashes);
+    free(slots);
+
+    return ret == ERR_NONE ? json_flush(&out) : ret;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+/**
+ * @file imgst_similar.h
+ * @brief Near-duplicate images, found by their perceptual hashes.
+ *
+ * Dedup only shares identical contents: a re-encoded or resized copy of an
+ * image has another SHA. Its difference hash (dHash) barely changes though:
+ * the image is shrunk to DHASH_WIDTH x DHASH_HEIGHT grey pixels, and each
+ * of the 64 bits tells whether a pixel is darker than its right neighbour.
+ * Two images are near-duplicates when their hashes differ by few bits.
+ *
+ * The hashes are kept in "<imgstore_filename>.phash", one record per
+ * metadata slot tagged with the SHA of its image, as the access statistics
+ * are (see imgst_heat.h): the metadata, which backups and followers copy,
+ * stays as it is. Missing hashes are computed when looked for, from the
+ * thumbnail when the image has one, else from the original.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+/* appended to the imgStore filename to name the table */
+#define PHASH_SUFFIX ".phash"
+
+/* size of the grey image the hash is made of: one bit per horizontal pair */
+#define DHASH_WIDTH 9
+#define DHASH_HEIGHT 8
+
+/* number of bits of a hash, and largest distance between two */
+#define PHASH_BITS 64
+
+/* default largest distance between near-duplicates */
+#define DEF_SIMILAR_DISTANCE 10
+
+/**
+ * @brief Computes the difference hash of a JPEG image.
+ *
+ * @param image The JPEG image.
+ * @param size Its size in bytes.
+ * @param hash Location receiving the hash.
+ * @return Some error code. 0 if no error.
+ */
+int image_dhash(const void* image, size_t size, uint64_t* hash);
+
+/**
+ * @brief Finds the hashes close to a given one.
+ *
+ * Uses AVX2 where the CPU has it, else one popcount per hash.
+ *
+ * @param hashes The hashes looked through.
+ * @param nb Their number.
+ * @param query The hash looked for.
+ * @param max_distance The largest number of differing bits of a match.
+ * @param matches Array of nb positions, receiving those of the matches in increasing order.
+ * @return The number of matches.
+ */
+size_t hamming_scan(const uint64_t* hashes, size_t nb, uint64_t query,
+                    uint32_t max_distance, uint32_t* matches);
+
+/**
+ * @brief Lists near-duplicate images as a JSON document.
+ *
+ * With an image ID, the images within max_distance of it, closest first:
+ * {"id":..,"Images":[{"id":..,"distance":..},...]}
+ * Without, the groups of images each within max_distance of another one:
+ * {"Groups":[[id,id,...],...]}
+ *
+ * The hashes computed are written back to the table when it can be
+ * written; when it cannot, the next search computes them again.
+ *
+ * @param imgst_filename Path to the imgStore file, naming the table.
+ * @param img_id The image ID, or NULL for all the groups.
+ * @param max_distance The largest number of differing bits of near-duplicates.
+ * @param writer Function receiving the document, in pieces.
+ * @param arg Argument of writer.
+ * @param imgstfile The imgst_file in memory
+ * @return Some error code. 0 if no error.
+ */
+int do_similar(const char* imgst_filename, const char* img_id, uint32_t max_distance,
+               list_writer writer, void* arg, imgst_file* imgstfile);
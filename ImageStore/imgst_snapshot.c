@@ -0,0 +1,147 @@
+/**
+ * @file imgst_snapshot.c
+ * @brief imgStore library: do_snapshot implementation.
+ *
+ * The copies share their blocks with the imgStore where the filesystem
+ * can (reflinks on btrfs or XFS), and are full copies elsewhere.
+ *
+ * @author ???
+ */
+
+#define _GNU_SOURCE // for copy_file_range
+
+#include "imgStore.h"
+
+#include <stdlib.h>
+#include <string.h>    // for strlen, strcat
+#include <unistd.h>    // for copy_file_range, unlink
+#include <fcntl.h>     // for open
+#include <errno.h>
+#include <sys/stat.h>  // for fstat, fchmod
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>  // for FICLONE
+#endif
+
+#define SNAPSHOT_MODE 0444 // snapshots are read-only
+#define CLONE_MODE 0644
+#define COPY_CHUNK_SIZE (1 << 20)
+
+/**
+ * Copies the size bytes of src to dst, sharing their blocks if the filesystem can.
+ */
+static int copy_fd(int src, int dst, off_t size)
+{
+#ifdef FICLONE
+    // Whole-file reflink: instant, and no extra space until the copies diverge
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return ERR_NONE;
+    }
+#endif
+
+    // In-kernel copy, itself a reflink on some filesystems
+    off_t in = 0, out = 0;
+
+    while (in < size) {
+        const ssize_t copied = copy_file_range(src, &in, dst, &out, (size_t) (size - in), 0);
+
+        if (copied <= 0) {
+            break;
+        }
+    }
+
+    if (in == size) {
+        return ERR_NONE;
+    }
+
+    // Across filesystems, or without copy_file_range: read and write what is left
+    char* buffer = malloc(COPY_CHUNK_SIZE);
+    M_EXIT_IF_NULL(buffer, (size_t) COPY_CHUNK_SIZE);
+
+    while (in < size) {
+        const ssize_t nb_read = pread(src, buffer, COPY_CHUNK_SIZE, in);
+
+        if (nb_read <= 0 || pwrite(dst, buffer, (size_t) nb_read, out) != nb_read) {
+            free(buffer);
+            return ERR_IO;
+        }
+
+        in += nb_read;
+        out += nb_read;
+    }
+
+    free(buffer);
+
+    return ERR_NONE;
+}
+
+/**
+ * Copies an open FILE to a new file, which must not exist yet.
+ */
+static int copy_file(FILE* from, const char* to, mode_t mode)
+{
+    // What is buffered belongs in the copy
+    M_EXIT_IF(fflush(from) != 0, ERR_IO, "cannot flush", );
+
+    const int src = fileno(from);
+    struct stat st;
+    M_EXIT_IF(fstat(src, &st) != 0, ERR_IO, "cannot stat", );
+
+    const int dst = open(to, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    M_EXIT_IF(dst < 0, errno == EEXIST ? ERR_INVALID_FILENAME : ERR_IO, "cannot create copy", );
+
+    int ret = copy_fd(src, dst, st.st_size);
+
+    // The mode is set last, as a snapshot cannot be written once read-only
+    if (ret == ERR_NONE && (fchmod(dst, mode) != 0 || fsync(dst) != 0)) {
+        ret = ERR_IO;
+    }
+
+    if (close(dst) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+
+    if (ret != ERR_NONE) {
+        unlink(to);
+    }
+
+    return ret;
+}
+
+/**
+ * Copies an imgStore, with its change log, as of now.
+ */
+int do_snapshot(const char* target, int writable, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(target);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    const mode_t mode = writable ? CLONE_MODE : SNAPSHOT_MODE;
+
+    char* log_target = NULL;
+
+    if (imgstfile->changes != NULL) {
+        log_target = malloc(strlen(target) + strlen(CHANGES_SUFFIX) + 1);
+        M_EXIT_IF_NULL(log_target, strlen(target) + strlen(CHANGES_SUFFIX) + 1);
+
+        strcpy(log_target, target);
+        strcat(log_target, CHANGES_SUFFIX);
+    }
+
+    // The log first: a failure never leaves a copied imgStore without its log
+    int ret = log_target == NULL ? ERR_NONE : copy_file(imgstfile->changes, log_target, mode);
+
+    if (ret == ERR_NONE) {
+        ret = copy_file(imgstfile->file, target, mode);
+
+        if (ret != ERR_NONE && log_target != NULL) {
+            unlink(log_target);
+        }
+    }
+
+    free(log_target);
+
+    return ret;
+}
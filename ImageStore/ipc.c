@@ -0,0 +1,718 @@
+/**
+ * @file ipc.c
+ * @brief Local daemon holding an imgStore open, and its binary protocol.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for poll, sockets, fmemopen and open_memstream
+
+#include "ipc.h"
+#include "image_content.h" // for resize_image
+#include "imgst_heat.h"
+#include "hot_set.h"
+#include "buf_pool.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>   // for memcpy, strlen
+#include <stdio.h>    // for snprintf
+#include <unistd.h>   // for close, unlink
+#include <pthread.h>  // for pthread_mutex_lock
+#include <poll.h>
+#include <time.h>     // for clock_gettime
+#include <sys/time.h> // for struct timeval
+#include <sys/socket.h>
+#include <sys/un.h>   // for sockaddr_un
+
+#define IPC_POLL_TIMEOUT_MS 100 // latency of stopping the daemon
+#define IPC_CLIENT_TIMEOUT_S 5  // a stuck or idle client is dropped after this long
+#define IPC_BACKLOG 16
+#define IPC_MAX_CLIENTS 32      // connections open at once, served in turn
+
+/**
+ * Where a follower stands with its leader.
+ */
+typedef struct ipc_follower {
+    const char* leader_filename;
+    uint64_t end;        // size of the imgStore file at its version
+    int last_error;      // of the last sync, reported once
+    struct timespec last_sync;
+} ipc_follower;
+
+/**
+ * Growing buffer receiving a reply payload, from the pool.
+ */
+typedef struct ipc_buffer {
+    char* data;
+    size_t len;
+    size_t capacity;
+} ipc_buffer;
+
+/**
+ * Appends to an ipc_buffer (a list_writer).
+ */
+static int buffer_writer(void* arg, const char* data, size_t len)
+{
+    ipc_buffer* buf = arg;
+
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity == 0 ? READ_CHUNK_SIZE : buf->capacity;
+
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+
+        char* bigger = pool_alloc(capacity);
+        M_EXIT_IF_NULL(bigger, capacity);
+
+        if (buf->len > 0) {
+            memcpy(bigger, buf->data, buf->len);
+        }
+
+        pool_free(buf->data);
+        buf->data = bigger;
+        buf->capacity = pool_capacity(bigger);
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return ERR_NONE;
+}
+
+/**
+ * Fills a Unix socket address with the socket path of an imgStore.
+ */
+static int socket_address(const char* imgst_filename, struct sockaddr_un* addr)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    const int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s",
+                             imgst_filename, IPC_SOCKET_SUFFIX);
+
+    M_EXIT_IF(len < 0 || (size_t) len >= sizeof(addr->sun_path), ERR_INVALID_FILENAME,
+              "socket path too long", );
+
+    return ERR_NONE;
+}
+
+/**
+ * Sends exactly len bytes.
+ */
+static int send_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+
+    while (len > 0) {
+        const ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (sent <= 0) {
+            return ERR_IO;
+        }
+
+        p += sent;
+        len -= (size_t) sent;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Receives exactly len bytes. Sets closed if the peer closed before the first byte.
+ */
+static int recv_all(int fd, void* data, size_t len, int* closed)
+{
+    char* p = data;
+    const size_t expected = len;
+
+    while (len > 0) {
+        const ssize_t received = recv(fd, p, len, 0);
+
+        if (received == 0 && len == expected && closed != NULL) {
+            *closed = 1;
+        }
+
+        if (received <= 0) {
+            return ERR_IO;
+        }
+
+        p += received;
+        len -= (size_t) received;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Connects to the daemon serving an imgStore, if any.
+ */
+int ipc_connect(const char* imgst_filename, int* fd)
+{
+    M_REQUIRE_NON_NULL(fd);
+
+    struct sockaddr_un addr;
+    M_EXIT_IF_ERR(socket_address(imgst_filename, &addr));
+
+    const int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        return ERR_IO;
+    }
+
+    if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(s);
+        return ERR_IO;
+    }
+
+    *fd = s;
+
+    return ERR_NONE;
+}
+
+/**
+ * Sends a request to the daemon and waits for its reply.
+ */
+int ipc_call(int fd, ipc_request* request, const char* img_id,
+             const void* payload, size_t payload_len,
+             char** reply, size_t* reply_len)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(request);
+    M_REQUIRE_NON_NULL(reply);
+    M_REQUIRE_NON_NULL(reply_len);
+
+    const size_t id_len = img_id == NULL ? 0 : strlen(img_id);
+    M_EXIT_IF(id_len > MAX_IMG_ID, ERR_INVALID_IMGID, "image ID too long", );
+    M_EXIT_IF(payload_len > IPC_MAX_PAYLOAD, ERR_INVALID_ARGUMENT, "payload too large", );
+
+    request->version = IPC_VERSION;
+    request->reserved = 0;
+    request->id_len = (uint16_t) id_len;
+    request->payload_len = (uint32_t) payload_len;
+
+    *reply = NULL;
+    *reply_len = 0;
+
+    M_EXIT_IF_ERR(send_all(fd, request, sizeof(*request)));
+    M_EXIT_IF_ERR(send_all(fd, img_id, id_len));
+    M_EXIT_IF_ERR(send_all(fd, payload, payload_len));
+
+    ipc_reply header;
+    M_EXIT_IF_ERR(recv_all(fd, &header, sizeof(header), NULL));
+    M_EXIT_IF(header.status < ERR_NONE || header.status >= NB_ERR, ERR_IO,
+              "bad reply status", );
+
+    if (header.payload_len > 0) {
+        *reply = malloc(header.payload_len);
+        M_EXIT_IF_NULL(*reply, header.payload_len);
+
+        if (recv_all(fd, *reply, header.payload_len, NULL) != ERR_NONE) {
+            FREE_DEREF(*reply);
+            return ERR_IO;
+        }
+
+        *reply_len = header.payload_len;
+    }
+
+    return header.status;
+}
+
+/**
+ * Lists the valid metadata from a cursor as raw records, after the header.
+ */
+static int list_raw(const ipc_request* request, ipc_buffer* out, const imgst_file* imgstfile)
+{
+    M_EXIT_IF_ERR(buffer_writer(out, (const char*) &imgstfile->header, sizeof(imgst_header)));
+
+    uint32_t listed = 0;
+
+    for (size_t idx = request->arg; idx < imgstfile->header.max_files
+         && (request->limit == 0 || listed < request->limit); ++idx) {
+
+        if (imgstfile->metadata[idx].is_valid == NON_EMPTY) {
+            M_EXIT_IF_ERR(buffer_writer(out, (const char*) &imgstfile->metadata[idx],
+                                        sizeof(img_metadata)));
+            ++listed;
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads an image without writing to the imgStore: a missing derivative is
+ * resized for this reply only (the leader's one arrives once made).
+ */
+static int read_only(const ipc_request* request, const char* img_id, ipc_buffer* out,
+                     imgst_file* imgstfile)
+{
+    const int res = request->res;
+    size_t idx = 0;
+
+    M_EXIT_IF(res != RES_SMALL && res != RES_THUMB && res != RES_ORIG,
+              ERR_RESOLUTIONS, "invalid resolution", );
+    M_EXIT_IF_ERR(findMetadataIndex(&idx, img_id, imgstfile));
+    heat_touch(idx, imgstfile);
+
+    const int missing = imgstfile->metadata[idx].offset[res] == INIT_OFFSET;
+
+    char* image = NULL;
+    uint32_t size = 0;
+    M_EXIT_IF_ERR(do_read(img_id, missing ? RES_ORIG : res, &image, &size, imgstfile));
+
+    if (missing) {
+        void* resized = NULL;
+        size_t resized_size = 0;
+        const int ret = resize_image(image, size, imgstfile->header.res_resized[2 * res],
+                                     imgstfile->header.res_resized[2 * res + 1],
+                                     &resized, &resized_size);
+        pool_free(image);
+        M_EXIT_IF_ERR(ret);
+
+        // Released with g_free: copied into what the reply gives back
+        image = pool_alloc(resized_size);
+
+        if (image != NULL) {
+            memcpy(image, resized, resized_size);
+        }
+
+        g_free(resized);
+        M_EXIT_IF_NULL(image, resized_size);
+        size = (uint32_t) resized_size;
+    }
+
+    out->data = image;
+    out->len = out->capacity = size;
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes what changed since the version of a follower as the reply payload.
+ */
+static int sync_reply(const ipc_request* request, const char* payload, ipc_buffer* out,
+                      imgst_file* imgstfile)
+{
+    uint64_t base_end = 0;
+    M_EXIT_IF(payload == NULL || request->payload_len != sizeof(base_end),
+              ERR_INVALID_ARGUMENT, "bad sync request", );
+    memcpy(&base_end, payload, sizeof(base_end));
+
+    // Garbage collected on either side: the follower is to be seeded again
+    M_EXIT_IF(request->limit != imgstfile->header.generation, ERR_INVALID_ARGUMENT,
+              "follower of another generation", );
+
+    // Up to date: an empty reply
+    if (request->arg == imgstfile->header.imgst_version) {
+        return ERR_NONE;
+    }
+
+    char* delta = NULL;
+    size_t len = 0;
+    FILE* stream = open_memstream(&delta, &len);
+    M_EXIT_IF(stream == NULL, ERR_OUT_OF_MEMORY, "cannot open memory stream", );
+
+    int ret = backup_write(stream, request->arg, base_end, NULL, imgstfile);
+
+    if (fclose(stream) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+
+    // Too far behind for one reply: the follower is to be seeded again
+    if (ret == ERR_NONE && len > IPC_MAX_PAYLOAD) {
+        ret = ERR_INVALID_ARGUMENT;
+    }
+
+    // Into what the reply gives back to the pool
+    if (ret == ERR_NONE) {
+        ret = buffer_writer(out, delta, len);
+    }
+
+    free(delta);
+
+    return ret;
+}
+
+/**
+ * Runs one request, filling the reply payload. Returns its status.
+ */
+static int run_request(const ipc_request* request, const char* img_id, const char* payload,
+                       int follower, ipc_buffer* out, imgst_file* imgstfile)
+{
+    // A follower only changes through its leader
+    if (follower && (request->op == IPC_INSERT || request->op == IPC_DELETE)) {
+        return ERR_READ_ONLY;
+    }
+
+    switch (request->op) {
+    case IPC_LIST:
+        if (request->flags & IPC_LIST_JSON) {
+            return do_list(imgstfile, JSON, request->arg, request->limit, buffer_writer, out);
+        }
+        return list_raw(request, out, imgstfile);
+
+    case IPC_READ: {
+        if (follower) {
+            return read_only(request, img_id, out, imgstfile);
+        }
+
+        char* image = NULL;
+        uint32_t size = 0;
+        size_t idx = 0;
+
+        M_EXIT_IF_ERR(findMetadataIndex(&idx, img_id, imgstfile));
+        heat_touch(idx, imgstfile);
+        M_EXIT_IF_ERR(do_read(img_id, request->res, &image, &size, imgstfile));
+
+        // The image becomes the payload as is
+        out->data = image;
+        out->len = out->capacity = size;
+        return ERR_NONE;
+    }
+
+    case IPC_INSERT:
+        if (imgstfile->header.num_files >= imgstfile->header.max_files) {
+            return ERR_FULL_IMGSTORE;
+        }
+        return do_insert(payload, request->payload_len, img_id, imgstfile);
+
+    case IPC_DELETE:
+        return do_delete(img_id, imgstfile);
+
+    case IPC_CHANGES:
+        return do_changes(request->arg, request->limit, buffer_writer, out, imgstfile);
+
+    case IPC_SNAPSHOT:
+        // Requests are served one at a time: no writer runs meanwhile
+        M_EXIT_IF(payload == NULL || payload[0] != '/', ERR_INVALID_FILENAME,
+                  "snapshot path must be absolute", );
+        return do_snapshot(payload, request->flags & IPC_SNAPSHOT_WRITABLE, imgstfile);
+
+    case IPC_SYNC:
+        // A follower may lead followers of its own
+        return sync_reply(request, payload, out, imgstfile);
+
+    default:
+        return ERR_INVALID_COMMAND;
+    }
+}
+
+/**
+ * Serves the next request of a connection, in mem reset afterwards, under lock
+ * if any. Returns ERR_IO if the connection closed (then with *closed set) or broke.
+ */
+static int serve_request(int fd, int follower, pthread_mutex_t* lock, arena* mem, int* closed,
+                         imgst_file* imgstfile)
+{
+    ipc_request request;
+
+    M_EXIT_IF_ERR(recv_all(fd, &request, sizeof(request), closed));
+
+    // A request that cannot be read through ends the connection
+    M_EXIT_IF(request.version != IPC_VERSION || request.id_len > MAX_IMG_ID
+              || request.payload_len > IPC_MAX_PAYLOAD, ERR_IO, "bad request", );
+
+    char img_id[MAX_IMG_ID + 1];
+    M_EXIT_IF_ERR(recv_all(fd, img_id, request.id_len, NULL));
+    img_id[request.id_len] = '\0';
+
+    char* payload = NULL;
+
+    if (request.payload_len > 0) {
+        // Null-terminated, for the paths
+        payload = arena_alloc(mem, (size_t) request.payload_len + 1);
+        M_EXIT_IF_NULL(payload, (size_t) request.payload_len + 1);
+        M_EXIT_IF_ERR(recv_all(fd, payload, request.payload_len, NULL));
+        payload[request.payload_len] = '\0';
+    }
+
+    ipc_buffer out = { NULL, 0, 0 };
+
+    // Only the imgStore is shared: requests are read and replied to without it
+    if (lock != NULL) {
+        pthread_mutex_lock(lock);
+    }
+
+    const int status = run_request(&request, img_id, payload, follower, &out, imgstfile);
+
+    if (lock != NULL) {
+        pthread_mutex_unlock(lock);
+    }
+
+    arena_reset(mem);
+
+    // Nothing but the status on failure
+    ipc_reply reply = { status, status == ERR_NONE ? (uint32_t) out.len : 0 };
+
+    int ret = send_all(fd, &reply, sizeof(reply));
+
+    if (ret == ERR_NONE) {
+        ret = send_all(fd, out.data, reply.payload_len);
+    }
+
+    pool_free(out.data);
+
+    return ret;
+}
+
+/**
+ * Milliseconds elapsed since a time of the monotonic clock.
+ */
+static long elapsed_ms(const struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long) (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Gives the size of an open imgStore file.
+ */
+static int file_end(FILE* file, uint64_t* end)
+{
+    M_EXIT_IF(fseek(file, 0, SEEK_END) != 0, ERR_IO, "cannot seek", );
+
+    const long size = ftell(file);
+    M_EXIT_IF(size < 0, ERR_IO, "cannot get the imgStore size", );
+
+    *end = (uint64_t) size;
+
+    return ERR_NONE;
+}
+
+/**
+ * Applies what changed on the leader since the version of the follower.
+ */
+static int sync_follower(ipc_follower* follower, imgst_file* imgstfile)
+{
+    // One connection per sync: the leader drops the idle ones
+    int fd = -1;
+    M_EXIT_IF_ERR(ipc_connect(follower->leader_filename, &fd));
+
+    ipc_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = IPC_SYNC;
+    request.arg = imgstfile->header.imgst_version;
+    request.limit = imgstfile->header.generation;
+
+    char* delta = NULL;
+    size_t len = 0;
+    int ret = ipc_call(fd, &request, NULL, &follower->end, sizeof(follower->end), &delta, &len);
+    close(fd);
+
+    if (ret == ERR_NONE && len > 0) {
+        FILE* in = fmemopen(delta, len, "rb");
+        ret = in == NULL ? ERR_OUT_OF_MEMORY : backup_apply(in, NULL, imgstfile);
+
+        if (in != NULL) {
+            fclose(in);
+        }
+
+        // Applied: the file now ends where the leader's did
+        if (ret == ERR_NONE) {
+            ret = file_end(imgstfile->file, &follower->end);
+        }
+    }
+
+    free(delta);
+
+    return ret;
+}
+
+/**
+ * Binds the socket of an imgStore. Fails with ERR_BUSY if a daemon serves it.
+ */
+static int listen_on(const char* imgst_filename, struct sockaddr_un* addr, int* listener)
+{
+    M_EXIT_IF_ERR(socket_address(imgst_filename, addr));
+
+    // One daemon per imgStore; a socket nobody listens to is left over
+    int other = -1;
+
+    if (ipc_connect(imgst_filename, &other) == ERR_NONE) {
+        close(other);
+        return ERR_BUSY;
+    }
+
+    unlink(addr->sun_path);
+
+    const int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        return ERR_IO;
+    }
+
+    if (bind(s, (struct sockaddr*) addr, sizeof(*addr)) != 0 || listen(s, IPC_BACKLOG) != 0) {
+        close(s);
+        return ERR_IO;
+    }
+
+    *listener = s;
+
+    return ERR_NONE;
+}
+
+/**
+ * Serves an imgStore on its socket until stop is set, following a leader if any.
+ * With a lock, the imgStore is shared with the other threads of the process,
+ * which also keep its access statistics and hot set.
+ */
+static int serve(const char* imgst_filename, volatile sig_atomic_t* stop,
+                 ipc_follower* follower, pthread_mutex_t* lock, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(stop);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->metadata);
+
+    struct sockaddr_un addr;
+    int listener = -1;
+    M_EXIT_IF_ERR(listen_on(imgst_filename, &addr, &listener));
+
+    // Requests are served one at a time, in turn from each client that
+    // sent one: the imgStore needs no lock, and no client holds the others
+    const struct timeval timeout = { .tv_sec = IPC_CLIENT_TIMEOUT_S, .tv_usec = 0 };
+    struct pollfd pfds[1 + IPC_MAX_CLIENTS];
+    struct timespec last_seen[1 + IPC_MAX_CLIENTS];
+    size_t nb_fds = 1;
+
+    pfds[0] = (struct pollfd) { .fd = listener, .events = POLLIN, .revents = 0 };
+
+    struct timespec last_flush;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+
+    // Memory of the request being served, kept from one to the next
+    arena mem = ARENA_INIT;
+
+    while (!*stop) {
+        // A crash loses at most this much of the access statistics and hot set
+        if (lock == NULL && elapsed_ms(&last_flush) >= HEAT_FLUSH_SECONDS * 1000L) {
+            heat_flush(imgstfile);
+            hotset_save(imgst_filename, imgstfile);
+            clock_gettime(CLOCK_MONOTONIC, &last_flush);
+        }
+
+        // Between clients, so that a busy follower still keeps up
+        if (follower != NULL && elapsed_ms(&follower->last_sync) >= IPC_SYNC_INTERVAL_MS) {
+            const int ret = sync_follower(follower, imgstfile);
+
+            // Reported once, not at every retry
+            if (ret != follower->last_error && ret != ERR_NONE) {
+                fprintf(stderr, "cannot sync with %s: %s\n", follower->leader_filename,
+                        ERR_MESSAGES[ret]);
+            } else if (ret != follower->last_error) {
+                fprintf(stderr, "in sync with %s again\n", follower->leader_filename);
+            }
+
+            follower->last_error = ret;
+            clock_gettime(CLOCK_MONOTONIC, &follower->last_sync);
+        }
+
+        // New clients wait in the backlog while all the slots are taken
+        pfds[0].events = nb_fds < 1 + IPC_MAX_CLIENTS ? POLLIN : 0;
+
+        if (poll(pfds, (nfds_t) nb_fds, IPC_POLL_TIMEOUT_MS) < 0) {
+            continue; // interrupted by a signal
+        }
+
+        // Backwards, so that a client closed is replaced by one already seen
+        for (size_t i = nb_fds - 1; i > 0; --i) {
+            int drop = 0;
+
+            if (pfds[i].revents != 0) {
+                int closed = 0;
+                const int ret = serve_request(pfds[i].fd, follower != NULL, lock, &mem, &closed,
+                                                imgstfile);
+
+                // Also what a broken one left
+                arena_reset(&mem);
+
+                if (ret != ERR_NONE && !closed) {
+                    fprintf(stderr, "dropped a broken connection\n");
+                }
+
+                drop = ret != ERR_NONE;
+                clock_gettime(CLOCK_MONOTONIC, &last_seen[i]);
+
+            } else {
+                drop = elapsed_ms(&last_seen[i]) >= IPC_CLIENT_TIMEOUT_S * 1000L;
+            }
+
+            if (drop) {
+                close(pfds[i].fd);
+                --nb_fds;
+                pfds[i] = pfds[nb_fds];
+                last_seen[i] = last_seen[nb_fds];
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            const int client = accept(listener, NULL, NULL);
+
+            if (client >= 0) {
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+                pfds[nb_fds] = (struct pollfd) { .fd = client, .events = POLLIN, .revents = 0 };
+                clock_gettime(CLOCK_MONOTONIC, &last_seen[nb_fds]);
+                ++nb_fds;
+            }
+        }
+    }
+
+    for (size_t i = 1; i < nb_fds; ++i) {
+        close(pfds[i].fd);
+    }
+
+    arena_release(&mem);
+    close(listener);
+    unlink(addr.sun_path);
+
+    return ERR_NONE;
+}
+
+/**
+ * Serves an open imgStore on its socket until stop is set.
+ */
+int ipc_serve(const char* imgst_filename, volatile sig_atomic_t* stop, imgst_file* imgstfile)
+{
+    return serve(imgst_filename, stop, NULL, NULL, imgstfile);
+}
+
+/**
+ * Serves an imgStore open in another thread on its socket until stop is set.
+ */
+int ipc_serve_shared(const char* imgst_filename, volatile sig_atomic_t* stop,
+                     pthread_mutex_t* lock, imgst_file* imgstfile)
+{
+    M_REQUIRE_NON_NULL(lock);
+
+    return serve(imgst_filename, stop, NULL, lock, imgstfile);
+}
+
+/**
+ * Serves a follower imgStore on its socket, in step with its leader, until stop is set.
+ */
+int ipc_follow(const char* imgst_filename, const char* leader_filename,
+               volatile sig_atomic_t* stop, imgst_file* imgstfile)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(leader_filename);
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    ipc_follower follower;
+    memset(&follower, 0, sizeof(follower));
+    follower.leader_filename = leader_filename;
+    follower.last_error = ERR_NONE;
+
+    // What a seeded copy holds is all at its version
+    M_EXIT_IF_ERR(file_end(imgstfile->file, &follower.end));
+
+    return serve(imgst_filename, stop, &follower, NULL, imgstfile);
+}
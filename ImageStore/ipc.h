@@ -0,0 +1,162 @@
+#pragma once
+
+/**
+ * @file ipc.h
+ * @brief Local daemon holding an imgStore open, and its binary protocol.
+ *
+ * The daemon listens on the Unix socket "<imgstore_filename>.sock". Each
+ * request is a fixed ipc_request header followed by id_len bytes of image ID
+ * and payload_len bytes of payload (the image of an insert); each reply is a
+ * fixed ipc_reply header followed by payload_len bytes of payload. Integers
+ * are in host byte order: both ends run on the same machine.
+ *
+ * A connection may carry many requests, one after the other. The daemon
+ * serves the requests of its clients in turn, one at a time, and closes the
+ * connections left idle for a few seconds.
+ *
+ * A follower is a copy of an imgStore (a clone, or a restored backup) kept
+ * in step with its leader: it asks the leader's daemon for what changed
+ * since its version (IPC_SYNC), in the format of do_backup, and applies it
+ * while serving the read-only requests on its own socket.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+#include "error.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+#include <signal.h> // for sig_atomic_t
+#include <pthread.h> // for pthread_mutex_t
+
+/* version of the protocol, first byte of every request */
+#define IPC_VERSION 1
+
+/* appended to the imgStore filename to name the socket */
+#define IPC_SOCKET_SUFFIX ".sock"
+
+/* largest payload accepted by the daemon (an image to insert) */
+#define IPC_MAX_PAYLOAD (1u << 30)
+
+/* requests */
+#define IPC_LIST    1 // arg: cursor, limit; flags: IPC_LIST_JSON or not
+#define IPC_READ    2 // img_id, res
+#define IPC_INSERT  3 // img_id, payload: the image
+#define IPC_DELETE  4 // img_id
+#define IPC_CHANGES 5 // arg: since, limit
+#define IPC_SNAPSHOT 6 // payload: absolute path of the copy; flags: IPC_SNAPSHOT_WRITABLE or not
+#define IPC_SYNC    7 // arg: version of the follower; limit: its generation; payload: its file size (uint64_t)
+
+/* how often a follower asks its leader for changes */
+#define IPC_SYNC_INTERVAL_MS 100
+
+/* IPC_LIST flag: reply with the JSON listing rather than the raw records */
+#define IPC_LIST_JSON 1
+
+/* IPC_SNAPSHOT flag: make a writable clone rather than a read-only snapshot */
+#define IPC_SNAPSHOT_WRITABLE 1
+
+typedef struct ipc_request ipc_request;
+typedef struct ipc_reply ipc_reply;
+
+/**
+ * @brief Header of a request.
+ */
+struct ipc_request {
+    uint8_t version;      // IPC_VERSION
+    uint8_t op;           // IPC_LIST, IPC_READ...
+    uint8_t res;          // resolution code of IPC_READ
+    uint8_t flags;        // IPC_LIST_JSON, IPC_SNAPSHOT_WRITABLE
+    uint16_t id_len;      // length of the image ID that follows
+    uint16_t reserved;    // zero
+    uint32_t arg;         // cursor of IPC_LIST, since of IPC_CHANGES, version of IPC_SYNC
+    uint32_t limit;       // limit of IPC_LIST and IPC_CHANGES, 0 for none; generation of IPC_SYNC
+    uint32_t payload_len; // length of the payload that follows the image ID
+};
+
+/**
+ * @brief Header of a reply.
+ *
+ * The payload is the JSON document of IPC_LIST (with IPC_LIST_JSON) and
+ * IPC_CHANGES, the image of IPC_READ, and, for IPC_LIST without IPC_LIST_JSON,
+ * the imgst_header followed by the listed img_metadata records, and for
+ * IPC_SYNC, the backup since the follower version (empty if up to date).
+ */
+struct ipc_reply {
+    int32_t status;       // error code, ERR_NONE if none
+    uint32_t payload_len;
+};
+
+/**
+ * @brief Connects to the daemon serving an imgStore, if any.
+ *
+ * @param imgst_filename Path to the imgStore file.
+ * @param fd Location receiving the connected socket.
+ * @return ERR_IO if no daemon serves the imgStore. 0 if connected.
+ */
+int ipc_connect(const char* imgst_filename, int* fd);
+
+/**
+ * @brief Sends a request to the daemon and waits for its reply.
+ *
+ * @param fd The connected socket.
+ * @param request The request header (its version, id_len and payload_len are set here).
+ * @param img_id The image ID, NULL for none.
+ * @param payload The payload, NULL for none.
+ * @param payload_len The length of the payload.
+ * @param reply Location receiving the reply payload (to free), NULL if empty.
+ * @param reply_len Location receiving the length of the reply payload.
+ * @return The status of the reply, or ERR_IO if the exchange failed.
+ */
+int ipc_call(int fd, ipc_request* request, const char* img_id,
+             const void* payload, size_t payload_len,
+             char** reply, size_t* reply_len);
+
+/**
+ * @brief Serves an open imgStore on its socket until stop is set.
+ *
+ * Fails with ERR_BUSY if another daemon already serves the imgStore; a stale
+ * socket is replaced. The socket is removed on return.
+ *
+ * @param imgst_filename Path to the imgStore file, naming the socket.
+ * @param stop Flag stopping the daemon once set (by a signal handler).
+ * @param imgstfile The imgst_file in memory, open for writing.
+ * @return Some error code. 0 if no error.
+ */
+int ipc_serve(const char* imgst_filename, volatile sig_atomic_t* stop, imgst_file* imgstfile);
+
+/**
+ * @brief Serves an imgStore also in use by other threads on its socket until stop is set.
+ *
+ * As ipc_serve, but each request runs under lock, which the other threads
+ * take around their own accesses to the imgStore; they also keep its access
+ * statistics and hot set. The HTTP server thus serves the CLI meanwhile,
+ * snapshots and clones included.
+ *
+ * @param imgst_filename Path to the imgStore file, naming the socket.
+ * @param stop Flag stopping the daemon once set (by a signal handler).
+ * @param lock The lock of the imgStore.
+ * @param imgstfile The imgst_file in memory, open for writing.
+ * @return Some error code. 0 if no error.
+ */
+int ipc_serve_shared(const char* imgst_filename, volatile sig_atomic_t* stop,
+                     pthread_mutex_t* lock, imgst_file* imgstfile);
+
+/**
+ * @brief Serves a follower imgStore on its socket, in step with its leader, until stop is set.
+ *
+ * Every IPC_SYNC_INTERVAL_MS, what changed on the leader since the version of
+ * the follower is applied to it. Meanwhile, insert and delete are refused
+ * with ERR_READ_ONLY, and a missing derivative is resized for the reply only.
+ * If the leader's daemon is down, the follower keeps serving and retries: to
+ * fail over, stop the follower and serve it.
+ *
+ * @param imgst_filename Path to the follower imgStore file, naming its socket.
+ * @param leader_filename Path to the leader imgStore file, naming the socket to sync from.
+ * @param stop Flag stopping the daemon once set (by a signal handler).
+ * @param imgstfile The follower imgst_file in memory, open for writing.
+ * @return Some error code. 0 if no error.
+ */
+int ipc_follow(const char* imgst_filename, const char* leader_filename,
+               volatile sig_atomic_t* stop, imgst_file* imgstfile);
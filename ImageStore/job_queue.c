@@ -0,0 +1,253 @@
+/**
+ * @file job_queue.c
+ * @brief Bounded job queue served by a fixed pool of worker threads.
+ *
+ * @author ???
+ */
+
+#include "job_queue.h"
+
+#include <stdlib.h> // for calloc and free
+
+/**
+ * Worker thread: runs jobs until the queue is stopped and empty.
+ */
+static void* worker_main(void* arg)
+{
+    job_queue* queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (1) {
+        while (queue->count == 0 && !queue->stopping) {
+            pthread_cond_wait(&queue->nonempty, &queue->lock);
+        }
+
+        if (queue->count == 0) {
+            break; // stopping and nothing left
+        }
+
+        void* job = queue->ring[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        --queue->count;
+        ++queue->running;
+
+        pthread_mutex_unlock(&queue->lock);
+
+        queue->run(job);
+
+        if (queue->done != NULL) {
+            queue->done(job);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        --queue->running;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+ * Starts the worker threads of a queue.
+ */
+int job_queue_init(job_queue* queue, size_t capacity, size_t nb_workers, job_fn run, job_fn done)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(queue);
+    M_REQUIRE_NON_NULL(run);
+
+    M_EXIT_IF(capacity == 0 || nb_workers == 0, ERR_INVALID_ARGUMENT,
+              "a queue needs room and workers", );
+
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->running = 0;
+    queue->nb_workers = 0;
+    queue->stopping = 0;
+    queue->run = run;
+    queue->done = done;
+
+    M_EXIT_IF_NULL(queue->ring = calloc(capacity, sizeof(void*)), capacity * sizeof(void*));
+
+    queue->workers = calloc(nb_workers, sizeof(pthread_t));
+
+    if (queue->workers == NULL) {
+        free(queue->ring);
+        queue->ring = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->nonempty, NULL);
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        if (pthread_create(&queue->workers[i], NULL, worker_main, queue) != 0) {
+            job_queue_free(queue);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        ++queue->nb_workers;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Queues a job, or fails right away if the queue is full.
+ */
+int job_queue_submit(job_queue* queue, void* job)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(queue);
+    M_REQUIRE_NON_NULL(job);
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->count == queue->capacity || queue->stopping) {
+        pthread_mutex_unlock(&queue->lock);
+        return ERR_BUSY;
+    }
+
+    queue->ring[(queue->head + queue->count) % queue->capacity] = job;
+    ++queue->count;
+
+    pthread_cond_signal(&queue->nonempty);
+    pthread_mutex_unlock(&queue->lock);
+
+    return ERR_NONE;
+}
+
+/**
+ * Gives the number of queued and running jobs.
+ */
+void job_queue_stats(job_queue* queue, size_t* queued, size_t* running)
+{
+    if (queue == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queued != NULL) {
+        *queued = queue->count;
+    }
+
+    if (running != NULL) {
+        *running = queue->running;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Runs the jobs still queued, then stops the workers and frees the queue.
+ */
+void job_queue_free(job_queue* queue)
+{
+    if (queue == NULL || queue->ring == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->nonempty);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (size_t i = 0; i < queue->nb_workers; ++i) {
+        pthread_join(queue->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->nonempty);
+
+    free(queue->workers);
+    queue->workers = NULL;
+    free(queue->ring);
+    queue->ring = NULL;
+}
+
+/**
+ * Prepares an empty list.
+ */
+int job_list_init(job_list* list, size_t capacity)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(list);
+
+    M_EXIT_IF(capacity == 0, ERR_INVALID_ARGUMENT, "a list needs room", );
+
+    list->capacity = capacity;
+    list->head = 0;
+    list->count = 0;
+
+    M_EXIT_IF_NULL(list->ring = calloc(capacity, sizeof(void*)), capacity * sizeof(void*));
+
+    pthread_mutex_init(&list->lock, NULL);
+    pthread_cond_init(&list->nonempty, NULL);
+    pthread_cond_init(&list->nonfull, NULL);
+
+    return ERR_NONE;
+}
+
+/**
+ * Adds a job to a list, waiting if it is full.
+ */
+void job_list_push(job_list* list, void* job)
+{
+    pthread_mutex_lock(&list->lock);
+
+    while (list->count == list->capacity) {
+        pthread_cond_wait(&list->nonfull, &list->lock);
+    }
+
+    list->ring[(list->head + list->count) % list->capacity] = job;
+    ++list->count;
+
+    pthread_cond_signal(&list->nonempty);
+    pthread_mutex_unlock(&list->lock);
+}
+
+/**
+ * Takes jobs out of a list, waiting until there is at least one.
+ */
+size_t job_list_take(job_list* list, void** jobs, size_t max)
+{
+    size_t taken = 0;
+
+    pthread_mutex_lock(&list->lock);
+
+    while (list->count == 0) {
+        pthread_cond_wait(&list->nonempty, &list->lock);
+    }
+
+    while (taken < max && list->count > 0) {
+        jobs[taken++] = list->ring[list->head];
+        list->head = (list->head + 1) % list->capacity;
+        --list->count;
+    }
+
+    pthread_cond_broadcast(&list->nonfull);
+    pthread_mutex_unlock(&list->lock);
+
+    return taken;
+}
+
+/**
+ * Frees a list.
+ */
+void job_list_free(job_list* list)
+{
+    if (list == NULL || list->ring == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&list->lock);
+    pthread_cond_destroy(&list->nonempty);
+    pthread_cond_destroy(&list->nonfull);
+
+    free(list->ring);
+    list->ring = NULL;
+}
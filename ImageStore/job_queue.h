@@ -0,0 +1,125 @@
+#pragma once
+
+/**
+ * @file job_queue.h
+ * @brief Bounded job queue served by a fixed pool of worker threads.
+ *
+ * Submitting to a full queue fails right away with ERR_BUSY instead of
+ * waiting, so callers can shed load.
+ *
+ * @author ???
+ */
+
+#include "error.h"
+
+#include <stddef.h> // for size_t
+#include <pthread.h>
+
+/**
+ * @brief Function applied to a job, by a worker thread.
+ */
+typedef void (*job_fn)(void* job);
+
+typedef struct job_queue job_queue;
+
+struct job_queue {
+    void** ring;          // queued jobs, circular
+    size_t capacity;      // maximum number of queued jobs
+    size_t head;          // index of the oldest queued job
+    size_t count;         // number of queued jobs
+    size_t running;       // number of jobs being run
+    size_t nb_workers;    // maximum number of jobs run at once
+    pthread_t* workers;
+    int stopping;         // set by job_queue_free
+    job_fn run;           // runs a job
+    job_fn done;          // called once a job was run
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+};
+
+/**
+ * @brief Starts the worker threads of a queue.
+ *
+ * @param queue The queue to initialize.
+ * @param capacity The maximum number of jobs waiting for a worker.
+ * @param nb_workers The number of worker threads (maximum concurrency).
+ * @param run Function running a job.
+ * @param done Function called with each job once run (may be NULL).
+ * @return Some error code. 0 if no error.
+ */
+int job_queue_init(job_queue* queue, size_t capacity, size_t nb_workers, job_fn run, job_fn done);
+
+/**
+ * @brief Queues a job, or fails right away if the queue is full.
+ *
+ * @param queue The queue.
+ * @param job The job, handed to run and done.
+ * @return ERR_BUSY if the queue is full. 0 if no error.
+ */
+int job_queue_submit(job_queue* queue, void* job);
+
+/**
+ * @brief Gives the number of queued and running jobs.
+ *
+ * @param queue The queue.
+ * @param queued Location receiving the number of queued jobs (may be NULL).
+ * @param running Location receiving the number of running jobs (may be NULL).
+ */
+void job_queue_stats(job_queue* queue, size_t* queued, size_t* running);
+
+/**
+ * @brief Runs the jobs still queued, then stops the workers and frees the queue.
+ *
+ * @param queue The queue.
+ */
+void job_queue_free(job_queue* queue);
+
+typedef struct job_list job_list;
+
+/**
+ * @brief Bounded list of finished jobs, handed back by the workers (from
+ *        their done function) to the thread that submitted them.
+ */
+struct job_list {
+    void** ring;          // finished jobs, circular
+    size_t capacity;      // maximum number of finished jobs
+    size_t head;          // index of the oldest finished job
+    size_t count;         // number of finished jobs
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+};
+
+/**
+ * @brief Prepares an empty list.
+ *
+ * @param list The list to initialize.
+ * @param capacity The maximum number of jobs held (typically the number of jobs in flight).
+ * @return Some error code. 0 if no error.
+ */
+int job_list_init(job_list* list, size_t capacity);
+
+/**
+ * @brief Adds a job to a list, waiting if it is full.
+ *
+ * @param list The list.
+ * @param job The job.
+ */
+void job_list_push(job_list* list, void* job);
+
+/**
+ * @brief Takes jobs out of a list, waiting until there is at least one.
+ *
+ * @param list The list.
+ * @param jobs Array receiving the jobs, oldest first.
+ * @param max The capacity of jobs.
+ * @return The number of jobs taken.
+ */
+size_t job_list_take(job_list* list, void** jobs, size_t max);
+
+/**
+ * @brief Frees a list (the jobs still in it are not freed).
+ *
+ * @param list The list.
+ */
+void job_list_free(job_list* list);
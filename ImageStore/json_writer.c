@@ -0,0 +1,99 @@
+/**
+ * @file json_writer.c
+ * @brief Buffered JSON output through a list_writer sink.
+ *
+ * @author ???
+ */
+
+#include "json_writer.h"
+
+#include <stdio.h> // for vsnprintf
+#include <stdarg.h> // for va_list
+
+// Size of the scratch buffer used by json_appendf
+#define JSON_FMT_SIZE 256
+
+/**
+ * Hands the buffered bytes to the writer.
+ */
+int json_flush(json_buffer* out)
+{
+    M_REQUIRE_NON_NULL(out);
+
+    if (out->len > 0) {
+        M_EXIT_IF_ERR(out->writer(out->arg, out->data, out->len));
+        out->len = 0;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Appends raw bytes, flushing the buffer first if needed.
+ */
+int json_append(json_buffer* out, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(data);
+    M_EXIT_IF(len > JSON_BUF_SIZE, ERR_INVALID_ARGUMENT, "cannot append %zu bytes at once", len);
+
+    if (out->len + len > JSON_BUF_SIZE) {
+        M_EXIT_IF_ERR(json_flush(out));
+    }
+
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+
+    return ERR_NONE;
+}
+
+/**
+ * Appends printf-formatted output.
+ */
+int json_appendf(json_buffer* out, const char* fmt, ...)
+{
+    char formatted[JSON_FMT_SIZE];
+
+    va_list ap;
+    va_start(ap, fmt);
+    const int len = vsnprintf(formatted, sizeof(formatted), fmt, ap);
+    va_end(ap);
+
+    M_EXIT_IF(len < 0 || (size_t) len >= sizeof(formatted), ERR_INVALID_ARGUMENT,
+              "formatted output too long", );
+
+    return json_append(out, formatted, (size_t) len);
+}
+
+/**
+ * Appends an image ID as a JSON string literal (with its quotes).
+ */
+int json_append_id(json_buffer* out, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(img_id);
+
+    // Worst case: every character escaped as \u00XX, plus quotes
+    char escaped[6 * (MAX_IMG_ID + 1) + 2];
+    size_t len = 0;
+
+    escaped[len++] = '"';
+
+    for (size_t i = 0; i <= MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        const unsigned char c = (unsigned char) img_id[i];
+
+        if (c == '"' || c == '\\') {
+            escaped[len++] = '\\';
+            escaped[len++] = (char) c;
+
+        } else if (c < 0x20) {
+            len += (size_t) snprintf(&escaped[len], 7, "\\u%04x", c);
+
+        } else {
+            escaped[len++] = (char) c;
+        }
+    }
+
+    escaped[len++] = '"';
+
+    return json_append(out, escaped, len);
+}
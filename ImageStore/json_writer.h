@@ -0,0 +1,65 @@
+#pragma once
+
+/**
+ * @file json_writer.h
+ * @brief Buffered JSON output through a list_writer sink.
+ *
+ * Used by the listing and change feed code to stream JSON documents in
+ * bounded chunks.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+// Size of the local buffer gathering output before handing it to the writer.
+// It must hold at least one fully escaped image ID.
+#define JSON_BUF_SIZE 4096
+
+typedef struct json_buffer json_buffer;
+
+/**
+ * @brief Local output buffer, flushed to the writer when full.
+ */
+struct json_buffer {
+    char data[JSON_BUF_SIZE];
+    size_t len;
+    list_writer writer;
+    void* arg;
+};
+
+/**
+ * @brief Hands the buffered bytes to the writer.
+ *
+ * @param out The buffer to flush.
+ * @return Some error code. 0 if no error.
+ */
+int json_flush(json_buffer* out);
+
+/**
+ * @brief Appends raw bytes, flushing the buffer first if needed.
+ *
+ * @param out The buffer to append to.
+ * @param data The bytes to append.
+ * @param len The number of bytes to append (at most JSON_BUF_SIZE).
+ * @return Some error code. 0 if no error.
+ */
+int json_append(json_buffer* out, const char* data, size_t len);
+
+/**
+ * @brief Appends printf-formatted output (at most 255 characters).
+ *
+ * @param out The buffer to append to.
+ * @param fmt The printf format.
+ * @return Some error code. 0 if no error.
+ */
+int json_appendf(json_buffer* out, const char* fmt, ...);
+
+/**
+ * @brief Appends an image ID as a JSON string literal (with its quotes).
+ *
+ * @param out The buffer to append to.
+ * @param img_id The image ID, at most MAX_IMG_ID characters are used.
+ * @return Some error code. 0 if no error.
+ */
+int json_append_id(json_buffer* out, const char* img_id);
@@ -0,0 +1,230 @@
+/**
+ * @file meta_scan.c
+ * @brief Scans of the whole metadata table, several records at a time.
+ *
+ * The records stay as they are on disk, sizeof(img_metadata) bytes apart:
+ * a separate column of states would have to follow every writer of the
+ * metadata (insert, delete, restore, follow, gc). The gathers read 32 bits
+ * at is_valid, which unused_16 completes, and 64 bits at the SHA, that is
+ * its fingerprint (see sha_hash.h).
+ *
+ * @author ???
+ */
+
+#include "meta_scan.h"
+#include "sha_hash.h"
+
+#include <stddef.h> // for offsetof
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#endif
+
+/**
+ * Whether the AVX2 scans can be used.
+ */
+static int use_avx2(void)
+{
+#ifdef HAVE_AVX2_SCAN
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+#ifdef HAVE_AVX2_SCAN
+/**
+ * Slots of eight records from the first one, and mask of the 16 bits of is_valid.
+ */
+#define STRIDES8 _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+#define STATE_MASK 0xffff
+
+/**
+ * Finds the first slot in a given state among whole groups of eight, max if none.
+ */
+__attribute__((target("avx2")))
+static size_t next_state_avx2(const img_metadata* metadata, size_t* from, size_t max, uint16_t state)
+{
+    const __m256i offsets = _mm256_mullo_epi32(STRIDES8, _mm256_set1_epi32((int) sizeof(img_metadata)));
+    const __m256i mask = _mm256_set1_epi32(STATE_MASK);
+    const __m256i wanted = _mm256_set1_epi32(state);
+    const char* base = (const char*) metadata + offsetof(img_metadata, is_valid);
+
+    for (size_t i = *from; i + 8 <= max; i += 8) {
+        const __m256i words = _mm256_i32gather_epi32((const int*) (base + i * sizeof(img_metadata)), offsets, 1);
+        const __m256i equal = _mm256_cmpeq_epi32(_mm256_and_si256(words, mask), wanted);
+        const unsigned found = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+
+        if (found != 0) {
+            return i + (size_t) __builtin_ctz(found);
+        }
+
+        *from = i + 8;
+    }
+
+    return max;
+}
+
+/**
+ * Lists the valid slots among whole groups of eight, returning their number.
+ */
+__attribute__((target("avx2")))
+static size_t valid_slots_avx2(const img_metadata* metadata, size_t* from, size_t max, uint32_t* slots)
+{
+    const __m256i offsets = _mm256_mullo_epi32(STRIDES8, _mm256_set1_epi32((int) sizeof(img_metadata)));
+    const __m256i mask = _mm256_set1_epi32(STATE_MASK);
+    const __m256i wanted = _mm256_set1_epi32(NON_EMPTY);
+    const char* base = (const char*) metadata + offsetof(img_metadata, is_valid);
+    size_t nb = 0;
+    size_t i = *from;
+
+    for (; i + 8 <= max; i += 8) {
+        const __m256i words = _mm256_i32gather_epi32((const int*) (base + i * sizeof(img_metadata)), offsets, 1);
+        const __m256i equal = _mm256_cmpeq_epi32(_mm256_and_si256(words, mask), wanted);
+        unsigned found = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+
+        if (slots == NULL) {
+            nb += (size_t) __builtin_popcount(found);
+            continue;
+        }
+
+        while (found != 0) {
+            slots[nb++] = (uint32_t) (i + (size_t) __builtin_ctz(found));
+            found &= found - 1;
+        }
+    }
+
+    *from = i;
+
+    return nb;
+}
+
+/**
+ * Finds the first valid slot, other than exclude, with a given SHA among
+ * whole groups of four, max if none.
+ */
+__attribute__((target("avx2")))
+static size_t find_sha_avx2(const img_metadata* metadata, size_t* from, size_t max,
+                            const unsigned char* sha, size_t exclude)
+{
+    const __m128i offsets = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3),
+                                            _mm_set1_epi32((int) sizeof(img_metadata)));
+    const __m256i fp = _mm256_set1_epi64x((long long) sha_fingerprint(sha));
+    const char* base = (const char*) metadata + offsetof(img_metadata, SHA);
+    size_t i = *from;
+
+    for (; i + 4 <= max; i += 4) {
+        const __m256i fps = _mm256_i32gather_epi64((const long long*) (base + i * sizeof(img_metadata)), offsets, 1);
+        unsigned found = (unsigned) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fps, fp)));
+
+        // Almost surely the content: the whole SHA tells
+        while (found != 0) {
+            const size_t slot = i + (size_t) __builtin_ctz(found);
+            const img_metadata* meta = &metadata[slot];
+
+            if (slot != exclude && meta->is_valid == NON_EMPTY && shaCompare(meta->SHA, sha) == 0) {
+                return slot;
+            }
+
+            found &= found - 1;
+        }
+    }
+
+    *from = i;
+
+    return max;
+}
+#endif
+
+/**
+ * Finds the first slot in a given state.
+ */
+size_t meta_next_state(const img_metadata* metadata, size_t from, size_t max, uint16_t state)
+{
+    if (metadata == NULL) {
+        return max;
+    }
+
+    size_t i = from;
+
+#ifdef HAVE_AVX2_SCAN
+    if (use_avx2()) {
+        const size_t found = next_state_avx2(metadata, &i, max, state);
+
+        if (found < max) {
+            return found;
+        }
+    }
+#endif
+
+    while (i < max && metadata[i].is_valid != state) {
+        ++i;
+    }
+
+    return i;
+}
+
+/**
+ * Lists the valid slots, in increasing order.
+ */
+size_t meta_valid_slots(const img_metadata* metadata, size_t max, uint32_t* slots)
+{
+    if (metadata == NULL) {
+        return 0;
+    }
+
+    size_t nb = 0;
+    size_t i = 0;
+
+#ifdef HAVE_AVX2_SCAN
+    if (use_avx2()) {
+        nb = valid_slots_avx2(metadata, &i, max, slots);
+    }
+#endif
+
+    for (; i < max; ++i) {
+        if (metadata[i].is_valid == NON_EMPTY) {
+            if (slots != NULL) {
+                slots[nb] = (uint32_t) i;
+            }
+
+            ++nb;
+        }
+    }
+
+    return nb;
+}
+
+/**
+ * Finds the first valid slot, other than exclude, with a given SHA.
+ */
+size_t meta_find_sha(const img_metadata* metadata, size_t max,
+                     const unsigned char* sha, size_t exclude)
+{
+    if (metadata == NULL || sha == NULL) {
+        return max;
+    }
+
+    size_t i = 0;
+
+#ifdef HAVE_AVX2_SCAN
+    if (use_avx2()) {
+        const size_t found = find_sha_avx2(metadata, &i, max, sha, exclude);
+
+        if (found < max) {
+            return found;
+        }
+    }
+#endif
+
+    for (; i < max; ++i) {
+        const img_metadata* meta = &metadata[i];
+
+        if (i != exclude && meta->is_valid == NON_EMPTY && shaCompare(meta->SHA, sha) == 0) {
+            return i;
+        }
+    }
+
+    return max;
+}
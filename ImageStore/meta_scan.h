@@ -0,0 +1,48 @@
+#pragma once
+
+/**
+ * @file meta_scan.h
+ * @brief Scans of the whole metadata table, several records at a time.
+ *
+ * Looking for valid or free slots, or for a content, reads a few bytes of
+ * each record. Where the CPU has AVX2, these bytes are gathered from eight
+ * records (four for SHAs) and compared at once; elsewhere the scans test
+ * one record at a time.
+ *
+ * @author ???
+ */
+
+#include "imgStore.h"
+
+/**
+ * @brief Finds the first slot in a given state.
+ *
+ * @param metadata The metadata table.
+ * @param from The first slot looked at.
+ * @param max The number of slots of the table.
+ * @param state EMPTY or NON_EMPTY.
+ * @return The slot, or max if none.
+ */
+size_t meta_next_state(const img_metadata* metadata, size_t from, size_t max, uint16_t state);
+
+/**
+ * @brief Lists the valid slots, in increasing order.
+ *
+ * @param metadata The metadata table.
+ * @param max The number of slots of the table.
+ * @param slots Array of max slots receiving the valid ones, or NULL to only count them.
+ * @return The number of valid slots.
+ */
+size_t meta_valid_slots(const img_metadata* metadata, size_t max, uint32_t* slots);
+
+/**
+ * @brief Finds the first valid slot, other than exclude, with a given SHA.
+ *
+ * @param metadata The metadata table.
+ * @param max The number of slots of the table.
+ * @param sha The SHA of the content.
+ * @param exclude A slot to ignore (typically the one being inserted).
+ * @return The slot, or max if none.
+ */
+size_t meta_find_sha(const img_metadata* metadata, size_t max,
+                     const unsigned char* sha, size_t exclude);
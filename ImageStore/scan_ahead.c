@@ -0,0 +1,59 @@
+/**
+ * @file scan_ahead.c
+ * @brief Read-ahead hints for scans of many contents of an imgStore.
+ *
+ * @author ???
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno and posix_fadvise
+
+#include "scan_ahead.h"
+
+#include <fcntl.h> // for posix_fadvise
+
+/**
+ * Starts hints for a scan.
+ */
+void scan_ahead_init(scan_ahead* sa, FILE* file, const scan_extent* extents, size_t nb,
+                     uint64_t window)
+{
+    if (sa == NULL) {
+        return;
+    }
+
+    sa->fd = file == NULL || extents == NULL ? -1 : fileno(file);
+    sa->extents = extents;
+    sa->nb = nb;
+    sa->current = 0;
+    sa->next = 0;
+    sa->read = 0;
+    sa->advised = 0;
+    sa->window = window;
+}
+
+/**
+ * Tells that the scan reads its next extent.
+ */
+void scan_ahead_next(scan_ahead* sa)
+{
+    if (sa == NULL || sa->fd < 0 || sa->current >= sa->nb) {
+        return;
+    }
+
+    sa->read += sa->extents[sa->current++].size;
+
+    // Neighbours are advised at once: one call per run of the file
+    while (sa->next < sa->nb && sa->advised < sa->read + sa->window) {
+        const uint64_t start = sa->extents[sa->next].offset;
+        uint64_t end = start;
+
+        while (sa->next < sa->nb && sa->extents[sa->next].offset == end
+               && sa->advised < sa->read + sa->window) {
+            end += sa->extents[sa->next].size;
+            sa->advised += sa->extents[sa->next].size;
+            ++sa->next;
+        }
+
+        posix_fadvise(sa->fd, (off_t) start, (off_t) (end - start), POSIX_FADV_WILLNEED);
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/**
+ * @file scan_ahead.h
+ * @brief Read-ahead hints for scans of many contents of an imgStore.
+ *
+ * A scan that reads contents one by one with fread stalls on each of them,
+ * and the kernel only reads ahead what looks sequential. Given the extents
+ * a scan is about to read, in its own order, a scan_ahead advises the kernel
+ * (posix_fadvise WILLNEED) of those up to a window of bytes ahead of the one
+ * being read, so that the disk works while the scan copies.
+ *
+ * @author ???
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* default bytes advised ahead of the content being read */
+#define SCAN_AHEAD_WINDOW ((uint64_t) 8 << 20)
+
+typedef struct scan_extent scan_extent;
+typedef struct scan_ahead scan_ahead;
+
+/**
+ * @brief Bytes of the imgStore file that a scan reads at once.
+ */
+struct scan_extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct scan_ahead {
+    int fd;
+    const scan_extent* extents; // in the order of the scan
+    size_t nb;
+    size_t current;             // next extent read
+    size_t next;                // next extent to advise
+    uint64_t read;              // bytes of the extents read, current included
+    uint64_t advised;           // bytes of the extents advised
+    uint64_t window;
+};
+
+/**
+ * @brief Starts hints for a scan.
+ *
+ * @param sa The hints.
+ * @param file The file scanned.
+ * @param extents The extents the scan reads, in its order; kept until the scan ends.
+ * @param nb The number of extents.
+ * @param window The bytes advised ahead, SCAN_AHEAD_WINDOW if unsure.
+ */
+void scan_ahead_init(scan_ahead* sa, FILE* file, const scan_extent* extents, size_t nb,
+                     uint64_t window);
+
+/**
+ * @brief Tells that the scan reads its next extent: those within the window after it are advised.
+ *
+ * @param sa The hints.
+ */
+void scan_ahead_next(scan_ahead* sa);
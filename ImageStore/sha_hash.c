@@ -0,0 +1,75 @@
+/**
+ * @file sha_hash.c
+ * @brief SHA-256 of image contents, for deduplication.
+ *
+ * Should the fetch or a context fail, the one-shot SHA256() still gives
+ * the same digest.
+ *
+ * @author ???
+ */
+
+#include "sha_hash.h"
+
+#include <openssl/evp.h>
+#include <openssl/opensslv.h> // for OPENSSL_VERSION_NUMBER
+#include <pthread.h>
+
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static pthread_key_t s_key;
+static int s_key_ok = 0;
+static const EVP_MD* s_sha256 = NULL;
+
+/**
+ * Frees the context of an ending thread.
+ */
+static void thread_exit(void* arg)
+{
+    EVP_MD_CTX_free(arg);
+}
+
+static void fetch_sha256(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    s_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+#else
+    s_sha256 = EVP_sha256();
+#endif
+    s_key_ok = s_sha256 != NULL && pthread_key_create(&s_key, thread_exit) == 0;
+}
+
+/**
+ * Context of the calling thread, NULL if it cannot be had.
+ */
+static EVP_MD_CTX* thread_context(void)
+{
+    pthread_once(&s_once, fetch_sha256);
+
+    if (!s_key_ok) {
+        return NULL;
+    }
+
+    EVP_MD_CTX* ctx = pthread_getspecific(s_key);
+
+    if (ctx == NULL && (ctx = EVP_MD_CTX_new()) != NULL && pthread_setspecific(s_key, ctx) != 0) {
+        EVP_MD_CTX_free(ctx);
+        ctx = NULL;
+    }
+
+    return ctx;
+}
+
+/**
+ * Computes the SHA-256 of a buffer.
+ */
+void sha_digest(const void* data, size_t len, unsigned char sha[SHA256_DIGEST_LENGTH])
+{
+    EVP_MD_CTX* ctx = thread_context();
+    unsigned int sha_len = 0;
+
+    if (ctx == NULL
+        || EVP_DigestInit_ex(ctx, s_sha256, NULL) != 1
+        || EVP_DigestUpdate(ctx, data, len) != 1
+        || EVP_DigestFinal_ex(ctx, sha, &sha_len) != 1) {
+        SHA256(data, len, sha);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * @file sha_hash.h
+ * @brief SHA-256 of image contents, for deduplication.
+ *
+ * OpenSSL picks the fastest implementation the CPU has (SHA extensions,
+ * else AVX2 or SSSE3) once per process; what costs per call with its
+ * one-shot SHA256() is looking the algorithm up and making a context, for
+ * every image. Here the algorithm is fetched once and each thread keeps its
+ * context, so that hashing an image costs the hashing only.
+ *
+ * @author ???
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>      // for memcpy
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+
+/**
+ * @brief Computes the SHA-256 of a buffer.
+ *
+ * @param data The bytes hashed.
+ * @param len Their number.
+ * @param sha Location receiving the digest.
+ */
+void sha_digest(const void* data, size_t len, unsigned char sha[SHA256_DIGEST_LENGTH]);
+
+/**
+ * @brief The first 64 bits of a SHA-256, as a fingerprint of the content.
+ *
+ * The bits of a SHA-256 are uniformly distributed: the fingerprint hashes
+ * the content in tables, and scans compare it for several records at once
+ * (see meta_scan.h) before the whole digest.
+ *
+ * @param sha The digest.
+ * @return Its fingerprint.
+ */
+static inline uint64_t sha_fingerprint(const unsigned char* sha)
+{
+    uint64_t fp = 0;
+    memcpy(&fp, sha, sizeof(fp));
+    return fp;
+}
+
+/**
+ * @brief The first 32 bits of a SHA-256, tagging the records of the side
+ * tables kept per slot (.heat, .phash) with the image they were made for.
+ *
+ * @param sha The digest.
+ * @return Its tag.
+ */
+static inline uint32_t sha_tag(const unsigned char* sha)
+{
+    uint32_t tag = 0;
+    memcpy(&tag, sha, sizeof(tag));
+    return tag;
+}
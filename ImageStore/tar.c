@@ -0,0 +1,340 @@
+/**
+ * @file tar.c
+ * @brief Minimal reader and writer of POSIX (ustar) tar streams.
+ *
+ * @author ???
+ */
+
+#include "tar.h"
+
+#include <stdlib.h> // for strtoul (pax records)
+#include <string.h> // for memset, strlen
+#include <time.h>   // for time
+
+#define TAR_NAME_LEN 100
+
+/**
+ * The ustar header, exactly one block.
+ */
+typedef struct tar_header {
+    char name[TAR_NAME_LEN];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header;
+
+_Static_assert(sizeof(tar_header) == TAR_BLOCK, "tar header must be one block");
+
+/**
+ * Value of an octal header field, which may fill its len bytes without a terminator.
+ */
+static unsigned long parse_octal(const char* field, size_t len)
+{
+    size_t i = 0;
+    unsigned long value = 0;
+
+    while (i < len && field[i] == ' ') {
+        ++i;
+    }
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + (unsigned long) (field[i] - '0');
+    }
+
+    return value;
+}
+
+/**
+ * Sum of the bytes of a header, its checksum field counting as spaces.
+ */
+static unsigned long header_sum(const tar_header* h)
+{
+    unsigned long sum = 0;
+
+    for (size_t i = 0; i < sizeof(tar_header); ++i) {
+        const size_t in_chksum = i >= offsetof(tar_header, chksum)
+                                 && i < offsetof(tar_header, chksum) + sizeof(h->chksum);
+        sum += in_chksum ? (unsigned char) ' ' : ((const unsigned char*) h)[i];
+    }
+
+    return sum;
+}
+
+/**
+ * Number of padding bytes after size bytes of content.
+ */
+static size_t padding(size_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/**
+ * Pads the stream up to the next block boundary after size bytes.
+ */
+static int write_padding(FILE* out, size_t size)
+{
+    static const char zeros[TAR_BLOCK];
+    const size_t pad = padding(size);
+
+    return fwrite(zeros, 1, pad, out) == pad ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Skips size bytes of a stream. Streams (stdin) cannot seek: reads through.
+ */
+static int skip_bytes(FILE* in, size_t size)
+{
+    char skipped[TAR_BLOCK];
+
+    while (size > 0) {
+        const size_t len = size < sizeof(skipped) ? size : sizeof(skipped);
+
+        if (fread(skipped, len, 1, in) != 1) {
+            return ERR_IO;
+        }
+
+        size -= len;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Writes a header block, then the content and its padding.
+ */
+static int write_entry(FILE* out, char typeflag, const char* name, const void* data, size_t size)
+{
+    tar_header h;
+    memset(&h, 0, sizeof(h));
+
+    // Truncated names are only used along with a pax path record
+    strncpy(h.name, name, TAR_NAME_LEN);
+    snprintf(h.mode, sizeof(h.mode), "%07o", 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011lo", (unsigned long) size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011lo", (unsigned long) time(NULL));
+    h.typeflag = typeflag;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    snprintf(h.chksum, sizeof(h.chksum), "%06lo", header_sum(&h));
+    h.chksum[7] = ' ';
+
+    if (fwrite(&h, sizeof(h), 1, out) != 1
+        || (size > 0 && fwrite(data, size, 1, out) != 1)) {
+        return ERR_IO;
+    }
+
+    return write_padding(out, size);
+}
+
+/**
+ * Appends a pax record to a buffer.
+ */
+int tar_pax_add(char* pax, size_t max, size_t* len, const char* key, const char* value)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(pax);
+    M_REQUIRE_NON_NULL(len);
+    M_REQUIRE_NON_NULL(key);
+    M_REQUIRE_NON_NULL(value);
+
+    const size_t base = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t record = base + 1;
+
+    // The length of the length changes the length
+    while (record != base + (size_t) snprintf(NULL, 0, "%zu", record)) {
+        record = base + (size_t) snprintf(NULL, 0, "%zu", record);
+    }
+
+    M_EXIT_IF(*len + record >= max, ERR_INVALID_ARGUMENT, "pax records too long", );
+
+    snprintf(pax + *len, max - *len, "%zu %s=%s\n", record, key, value);
+    *len += record;
+
+    return ERR_NONE;
+}
+
+/**
+ * Finds the value of a pax record of an entry.
+ */
+int tar_pax_get(const tar_entry* entry, const char* key, char* value, size_t max)
+{
+    const size_t key_len = strlen(key);
+    size_t pos = 0;
+
+    while (pos < entry->pax_len) {
+        char* rest = NULL;
+        const size_t record = strtoul(entry->pax + pos, &rest, 10);
+
+        if (record == 0 || pos + record > entry->pax_len || *rest != ' ') {
+            return 0; // malformed
+        }
+
+        const char* k = rest + 1;
+        const char* v = k + key_len + 1;
+        const char* next = entry->pax + pos + record;
+
+        if (v < next && !strncmp(k, key, key_len) && k[key_len] == '=') {
+            const size_t v_len = (size_t) (next - 1 - v); // without '\n'
+
+            if (v_len >= max) {
+                return 0;
+            }
+
+            memcpy(value, v, v_len);
+            value[v_len] = '\0';
+            return 1;
+        }
+
+        pos += record;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends a regular file to a tar stream.
+ */
+int tar_write_file(FILE* out, const char* name, const char* pax, size_t pax_len,
+                   const void* data, size_t size)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(data);
+
+    char records[TAR_MAX_PAX];
+    size_t len = 0;
+
+    // Long names go in the pax extended header
+    if (strlen(name) >= TAR_NAME_LEN) {
+        M_EXIT_IF_ERR(tar_pax_add(records, sizeof(records), &len, "path", name));
+    }
+
+    if (pax != NULL && pax_len > 0) {
+        M_EXIT_IF(len + pax_len > sizeof(records), ERR_INVALID_ARGUMENT, "pax records too long", );
+        memcpy(records + len, pax, pax_len);
+        len += pax_len;
+    }
+
+    if (len > 0) {
+        M_EXIT_IF_ERR(write_entry(out, 'x', "PaxHeader", records, len));
+    }
+
+    return write_entry(out, '0', name, data, size);
+}
+
+/**
+ * Ends a tar stream.
+ */
+int tar_finish(FILE* out)
+{
+    M_REQUIRE_NON_NULL(out);
+
+    static const char zeros[2 * TAR_BLOCK];
+
+    if (fwrite(zeros, sizeof(zeros), 1, out) != 1 || fflush(out) != 0) {
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Reads the content of the current entry (and its padding).
+ */
+int tar_read_data(FILE* in, void* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(in);
+
+    if (size > 0 && fread(data, size, 1, in) != 1) {
+        return ERR_IO;
+    }
+
+    return skip_bytes(in, padding(size));
+}
+
+/**
+ * Skips the content of the current entry (and its padding).
+ */
+int tar_skip_data(FILE* in, size_t size)
+{
+    M_REQUIRE_NON_NULL(in);
+
+    return skip_bytes(in, size + padding(size));
+}
+
+/**
+ * Reads the header(s) of the next regular file of a tar stream.
+ */
+int tar_read_entry(FILE* in, tar_entry* entry, int* end)
+{
+    // Null-pointer checks
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(entry);
+    M_REQUIRE_NON_NULL(end);
+
+    memset(entry, 0, sizeof(tar_entry));
+    *end = 0;
+
+    tar_header h;
+
+    while (1) {
+        if (fread(&h, sizeof(h), 1, in) != 1) {
+            return ERR_IO;
+        }
+
+        // A zero block ends the archive
+        if (h.name[0] == '\0' && header_sum(&h) == 8 * (unsigned long) ' ') {
+            *end = 1;
+            return ERR_NONE;
+        }
+
+        M_EXIT_IF(parse_octal(h.chksum, sizeof(h.chksum)) != header_sum(&h), ERR_IO,
+                  "bad tar header checksum", );
+
+        const size_t size = parse_octal(h.size, sizeof(h.size));
+
+        if (h.typeflag == 'x') {
+            // Extended header of the next entry
+            M_EXIT_IF(size >= sizeof(entry->pax), ERR_IO, "pax header too long", );
+            M_EXIT_IF_ERR(tar_read_data(in, entry->pax, size));
+            entry->pax_len = size;
+
+        } else if (h.typeflag == '0' || h.typeflag == '\0') {
+            entry->size = size;
+
+            if (!tar_pax_get(entry, "path", entry->name, sizeof(entry->name))) {
+                // ustar names may be split into prefix and name
+                if (h.prefix[0] != '\0') {
+                    snprintf(entry->name, sizeof(entry->name), "%.*s/%.*s",
+                             (int) sizeof(h.prefix), h.prefix, TAR_NAME_LEN, h.name);
+                } else {
+                    snprintf(entry->name, sizeof(entry->name), "%.*s", TAR_NAME_LEN, h.name);
+                }
+            }
+
+            return ERR_NONE;
+
+        } else {
+            // Directories, links, global headers...: not for us
+            M_EXIT_IF_ERR(tar_skip_data(in, size));
+            entry->pax_len = 0;
+        }
+    }
+}
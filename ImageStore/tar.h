@@ -0,0 +1,114 @@
+#pragma once
+
+/**
+ * @file tar.h
+ * @brief Minimal reader and writer of POSIX (ustar) tar streams.
+ *
+ * Only regular files are written, and read (other entries are skipped).
+ * Names that do not fit in the ustar header, and any extra attributes,
+ * are carried by pax extended headers.
+ *
+ * @author ???
+ */
+
+#include "error.h"
+
+#include <stdio.h>  // for FILE
+#include <stddef.h> // for size_t
+
+/* size of a tar block */
+#define TAR_BLOCK 512
+
+/* maximum length of a name read from a tar stream */
+#define TAR_MAX_NAME 1024
+
+/* maximum size of the pax records of one entry */
+#define TAR_MAX_PAX 2048
+
+typedef struct tar_entry tar_entry;
+
+/**
+ * @brief A regular file read from a tar stream (without its content).
+ */
+struct tar_entry {
+    char name[TAR_MAX_NAME];  // path, from the pax header if any
+    size_t size;              // size of the content
+    char pax[TAR_MAX_PAX];    // pax records of the entry, "<len> <key>=<value>\n" each
+    size_t pax_len;
+};
+
+/**
+ * @brief Appends a pax record "<len> <key>=<value>\n" to a buffer.
+ *
+ * @param pax The buffer.
+ * @param max The capacity of the buffer.
+ * @param len Location of the length of the buffer content, updated.
+ * @param key The key.
+ * @param value The value.
+ * @return ERR_INVALID_ARGUMENT if the record does not fit. 0 if no error.
+ */
+int tar_pax_add(char* pax, size_t max, size_t* len, const char* key, const char* value);
+
+/**
+ * @brief Finds the value of a pax record of an entry.
+ *
+ * @param entry The entry.
+ * @param key The key.
+ * @param value Buffer receiving the value (null-terminated).
+ * @param max The capacity of value.
+ * @return 1 if found (and fitting in value), 0 otherwise.
+ */
+int tar_pax_get(const tar_entry* entry, const char* key, char* value, size_t max);
+
+/**
+ * @brief Appends a regular file to a tar stream.
+ *
+ * @param out The tar stream.
+ * @param name The path of the file in the archive.
+ * @param pax Extra pax records for the file (see tar_pax_add), may be NULL.
+ * @param pax_len The length of pax.
+ * @param data The content of the file.
+ * @param size The size of the content.
+ * @return Some error code. 0 if no error.
+ */
+int tar_write_file(FILE* out, const char* name, const char* pax, size_t pax_len,
+                   const void* data, size_t size);
+
+/**
+ * @brief Ends a tar stream (with two zero blocks).
+ *
+ * @param out The tar stream.
+ * @return Some error code. 0 if no error.
+ */
+int tar_finish(FILE* out);
+
+/**
+ * @brief Reads the header(s) of the next regular file of a tar stream.
+ *
+ * The content must then be consumed with tar_read_data or tar_skip_data.
+ *
+ * @param in The tar stream.
+ * @param entry Location receiving the entry.
+ * @param end Location set to 1 at the end of the archive, 0 otherwise.
+ * @return Some error code. 0 if no error.
+ */
+int tar_read_entry(FILE* in, tar_entry* entry, int* end);
+
+/**
+ * @brief Reads the content of the current entry (and its padding).
+ *
+ * @param in The tar stream.
+ * @param data Buffer receiving the content.
+ * @param size The size of the entry.
+ * @return Some error code. 0 if no error.
+ */
+int tar_read_data(FILE* in, void* data, size_t size);
+
+/**
+ * @brief Skips the content of the current entry (and its padding).
+ *
+ * @param in The tar stream.
+ * @param size The size of the entry.
+ * @return Some error code. 0 if no error.
+ */
+int tar_skip_data(FILE* in, size_t size);
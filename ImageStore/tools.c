@@ -5,13 +5,25 @@
  * @author Mia Primorac
  */
 
+#define _DEFAULT_SOURCE // for fileno and flock
+
 #include "imgStore.h"
+#include "imgst_index.h"
+#include "blob_cache.h"
+#include "imgst_heat.h"
+#include "arena.h"
+#include "huge_pages.h"
+#include "meta_scan.h"
 
 #include <stdlib.h> // for calloc
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <vips/vips.h> // for vips image manips
+#include <sys/file.h> // for flock
+#include <fcntl.h> // for open
+#include <unistd.h> // for close
+#include <errno.h>
 
 /**
  * Human-readable SHA
@@ -97,6 +109,10 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
     // Init values
     imgstfile->metadata = NULL;
     imgstfile->file = NULL;
+    imgstfile->changes = NULL;
+    imgstfile->index = NULL;
+    imgstfile->cache = NULL;
+    imgstfile->heat = NULL;
 
     // Open the file
     imgstfile->file = fopen(imgst_filename, open_mode);
@@ -117,8 +133,9 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
         return ERR_IO;
     }
 
-    // Dynamically allocate memory for every valid and invalid metadatum.
-    imgstfile->metadata = calloc(imgstfile->header.max_files, sizeof(img_metadata));
+    // Dynamically allocate memory for every valid and invalid metadatum,
+    // on huge pages if there are many: lookups probe them at random
+    imgstfile->metadata = huge_calloc(imgstfile->header.max_files, sizeof(img_metadata));
 
     // If allocating memory failed
     if (imgstfile->metadata == NULL) {
@@ -136,6 +153,10 @@ int do_open(const char* imgst_filename, const char* open_mode, imgst_file* imgst
         return ERR_IO;
     }
 
+    // Open the change log alongside
+    M_EXIT_IF_ERR_DO_SOMETHING(open_changes(imgst_filename, open_mode, imgstfile),
+                               do_close(imgstfile));
+
     return ERR_NONE;
 }
 /**
@@ -146,6 +167,9 @@ void do_close(imgst_file* imgstfile)
     /// Clean up the ->file and the ->metadata
 
     if (imgstfile != NULL) {
+        // The access statistics are written back on the way out
+        heat_close(imgstfile);
+
         if (imgstfile->file != NULL) {
             // Close and nullify the pointer
             fclose(imgstfile->file);
@@ -154,9 +178,55 @@ void do_close(imgst_file* imgstfile)
 
         if (imgstfile->metadata != NULL) {
             // Free and nullify the pointer
-            FREE_DEREF(imgstfile->metadata);
+            huge_free(imgstfile->metadata);
+            imgstfile->metadata = NULL;
         }
+
+        if (imgstfile->changes != NULL) {
+            // Close and nullify the pointer
+            fclose(imgstfile->changes);
+            imgstfile->changes = NULL;
+        }
+
+        index_free(imgstfile);
+        cache_free(imgstfile);
+    }
+}
+
+/**
+ * Takes an advisory lock on an open imgStore, released when it is closed.
+ */
+int do_lock(imgst_file* imgstfile, int exclusive)
+{
+    M_REQUIRE_NON_NULL(imgstfile);
+    M_REQUIRE_NON_NULL(imgstfile->file);
+
+    if (flock(fileno(imgstfile->file), (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0) {
+        return errno == EWOULDBLOCK ? ERR_BUSY : ERR_IO;
+    }
+
+    return ERR_NONE;
+}
+
+/**
+ * Checks that no process holds an imgStore locked.
+ */
+int check_unlocked(const char* imgst_filename)
+{
+    M_REQUIRE_NON_NULL(imgst_filename);
+
+    const int fd = open(imgst_filename, O_RDONLY);
+
+    // Nothing to hold yet
+    if (fd < 0) {
+        return ERR_NONE;
     }
+
+    // Even a reader's shared lock would wait for a writer
+    const int ret = flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK ? ERR_BUSY : ERR_NONE;
+    close(fd);
+
+    return ret;
 }
 
 /**
@@ -170,13 +240,24 @@ int findMetadataIndex(size_t* idx, const char* img_id, const imgst_file* imgstfi
     M_REQUIRE_NON_NULL(imgstfile);
     M_REQUIRE_NON_NULL(imgstfile->metadata);
 
-    size_t i = 0;
+    // Constant time when the index was built
+    if (imgstfile->index != NULL) {
+        const size_t found = index_find_id(img_id, imgstfile);
 
-    while((i < imgstfile->header.max_files)
-          && ((strcmp(imgstfile->metadata[i].img_id, img_id) != 0)
-              || (imgstfile->metadata[i].is_valid == EMPTY))) {
+        if (found == INDEX_NOT_FOUND) {
+            return ERR_FILE_NOT_FOUND;
+        }
 
-        ++i;
+        *idx = found;
+        return ERR_NONE;
+    }
+
+    // Only the IDs of the valid slots are compared
+    const size_t max = imgstfile->header.max_files;
+    size_t i = meta_next_state(imgstfile->metadata, 0, max, NON_EMPTY);
+
+    while (i < max && strcmp(imgstfile->metadata[i].img_id, img_id) != 0) {
+        i = meta_next_state(imgstfile->metadata, i + 1, max, NON_EMPTY);
     }
 
     // If invalid metadata, return error
@@ -215,25 +296,33 @@ int validMetadataIndex(const size_t idx, const imgst_file* imgstfile)
  * Updates the metadata of the given index in the imgStore file
  */
 int updateMetadata(const size_t idx, imgst_file* imgstfile)
+{
+    return updateMetadataRange(idx, 1, imgstfile);
+}
+
+/**
+ * Updates consecutive metadata in the imgStore file with a single write
+ */
+int updateMetadataRange(const size_t first, const size_t count, imgst_file* imgstfile)
 {
     // Null pointer checks
+    M_REQUIRE_NON_NULL(imgstfile);
     M_REQUIRE_NON_NULL(imgstfile->metadata);
     M_REQUIRE_NON_NULL(imgstfile->file);
-    M_REQUIRE_NON_NULL(imgstfile);
 
-    // Check if the index is of a metadata that exists (valid or not)
-    M_EXIT_IF(imgstfile->header.max_files <= idx, ERR_FILE_NOT_FOUND,
+    // Check if the indices are of metadata that exist (valid or not)
+    M_EXIT_IF(imgstfile->header.max_files < first + count || count == 0, ERR_FILE_NOT_FOUND,
               "the metadata of that index doesn't exist", );
 
     // Find the correct position in the file. Take header into account.
     rewind(imgstfile->file);
 
-    if (fseek(imgstfile->file, (long)(idx * sizeof(img_metadata) + sizeof(imgst_header)), SEEK_SET) != 0) {
+    if (fseek(imgstfile->file, (long)(first * sizeof(img_metadata) + sizeof(imgst_header)), SEEK_SET) != 0) {
         return ERR_IO;
     }
 
     // Attempt to overwrite the metadata.
-    if (fwrite(&(imgstfile->metadata[idx]), sizeof(img_metadata), 1, imgstfile->file) != 1) {
+    if (fwrite(&(imgstfile->metadata[first]), sizeof(img_metadata), count, imgstfile->file) != count) {
         return ERR_IO;
     }
 
@@ -306,10 +395,33 @@ int resolution_atoi(const char* resolution)
     }
 }
 
+/**
+ * Checks that an image ID names a file below a directory.
+ */
+int check_relative_id(const char* img_id)
+{
+    M_REQUIRE_NON_NULL(img_id);
+
+    M_EXIT_IF(img_id[0] == '/', ERR_INVALID_IMGID, "absolute image ID %s", img_id);
+
+    // Each component, between slashes
+    for (const char* part = img_id; *part != '\0'; ) {
+        const size_t len = strcspn(part, "/");
+
+        M_EXIT_IF(len == 2 && part[0] == '.' && part[1] == '.', ERR_INVALID_IMGID,
+                  "image ID %s leaves its directory", img_id);
+
+        part += len;
+        part += *part == '/';
+    }
+
+    return ERR_NONE;
+}
+
 /**
  * Creates a new name image_id + resolution_suffix + .jpg and stores it in newname
  */
-int create_name(const char* img_id, const int resolution, char** newname)
+int create_name(const char* img_id, const int resolution, arena* mem, char** newname)
 {
 
     // Null-pointer checks
@@ -343,7 +455,8 @@ int create_name(const char* img_id, const int resolution, char** newname)
 
     // Concatenation
     char* temp_name = NULL;
-    M_EXIT_IF_NULL(temp_name = malloc(new_len + 1), new_len);
+    temp_name = mem != NULL ? arena_alloc(mem, new_len + 1) : malloc(new_len + 1);
+    M_EXIT_IF_NULL(temp_name, new_len);
 
     temp_name[0] = '\0';
     strcat(temp_name, img_id);